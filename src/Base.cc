@@ -1,10 +1,16 @@
 #include "Base.hh"
 
+#include <netinet/in.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <list>
 #include <phosg/Network.hh>
+#include <phosg/Strings.hh>
 #include <phosg/Time.hh>
+#include <unordered_set>
 
+#include "DNSBase.hh"
 #include "Event.hh"
 #include "Future.hh"
 
@@ -96,12 +102,217 @@ Base::RecvFromAwaiter Base::recvfrom(evutil_socket_t fd, size_t max_size) {
 }
 
 Task<int> Base::connect(const std::string& addr, int port) {
-  // TODO: this does a blocking DNS query if addr isn't an IP address string
+  // This does a blocking DNS query if addr isn't an IP address string
   int fd = ::connect(addr, port, true);
   co_await EventAwaiter(*this, fd, EV_WRITE);
   co_return std::move(fd);
 }
 
+// Resolves addr for a TCP connection, and throws if it can't be resolved
+static Task<DNSBase::AddrInfoResult> resolve_for_connect(
+    DNSBase& dns_base, const string& addr, int port) {
+  struct evutil_addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+  string port_str = to_string(port);
+  auto res = co_await dns_base.getaddrinfo(addr.c_str(), port_str.c_str(), &hints);
+  if (res.result_code) {
+    throw runtime_error("cannot resolve " + addr + ": " +
+        evutil_gai_strerror(res.result_code));
+  }
+  co_return std::move(res);
+}
+
+// Creates a nonblocking socket and starts connecting it to addr. Returns the
+// fd, which may not be connected yet.
+static int start_connect(const struct sockaddr* addr, socklen_t addr_len) {
+  int fd = ::socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) {
+    throw runtime_error("cannot create socket: " + string_for_error(errno));
+  }
+  if (evutil_make_socket_nonblocking(fd) || evutil_make_socket_closeonexec(fd)) {
+    ::close(fd);
+    throw runtime_error("cannot configure socket");
+  }
+  if (::connect(fd, addr, addr_len) && (errno != EINPROGRESS)) {
+    int error = errno;
+    ::close(fd);
+    throw runtime_error("cannot connect: " + string_for_error(error));
+  }
+  return fd;
+}
+
+// Waits for a connection started by start_connect to succeed or fail. Unlike
+// start_connect, this doesn't close the fd if the connection fails.
+static Task<int> finish_connect(Base& base, int fd) {
+  // If the connection is still in progress, the fd becomes writable when it
+  // succeeds or fails
+  co_await EventAwaiter(base, fd, EV_WRITE);
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len)) {
+    error = errno;
+  }
+  if (error) {
+    throw runtime_error("cannot connect: " + string_for_error(error));
+  }
+  co_return std::move(fd);
+}
+
+Task<int> Base::connect(DNSBase& dns_base, const std::string& addr, int port) {
+  auto res = co_await resolve_for_connect(dns_base, addr, port);
+
+  string error_str;
+  for (auto* ai = res.results.get(); ai; ai = ai->ai_next) {
+    try {
+      co_return co_await this->connect(ai->ai_addr, ai->ai_addrlen);
+    } catch (const runtime_error& e) {
+      error_str = e.what();
+    }
+  }
+  throw runtime_error("cannot connect to " + addr + ": " + error_str);
+}
+
+Task<int> Base::connect(const struct sockaddr* addr, socklen_t addr_len) {
+  int fd = start_connect(addr, addr_len);
+  try {
+    co_await finish_connect(*this, fd);
+  } catch (const runtime_error&) {
+    ::close(fd);
+    throw;
+  }
+  co_return std::move(fd);
+}
+
+// Owns the fds of connection attempts that are still in progress. connect_any
+// keeps one of these in its coroutine frame, so the fds are closed even if the
+// frame is destroyed before connect_any returns (for example, because the task
+// awaiting it was destroyed).
+struct PendingConnectFds {
+  unordered_set<int> fds;
+
+  PendingConnectFds() = default;
+  PendingConnectFds(const PendingConnectFds&) = delete;
+  PendingConnectFds(PendingConnectFds&&) = delete;
+  PendingConnectFds& operator=(const PendingConnectFds&) = delete;
+  PendingConnectFds& operator=(PendingConnectFds&&) = delete;
+  ~PendingConnectFds() {
+    this->close_all();
+  }
+
+  void close_all() {
+    for (int fd : this->fds) {
+      ::close(fd);
+    }
+    this->fds.clear();
+  }
+};
+
+// Returns a task that completes after the given time, so it can be raced
+// against connection attempts with any()
+static Task<int> attempt_delay(Base& base, uint64_t usecs) {
+  co_await base.sleep(usecs);
+  co_return -1;
+}
+
+Task<int> Base::connect_any(
+    DNSBase& dns_base,
+    const std::string& host,
+    int port,
+    uint64_t attempt_delay_usecs) {
+  // getaddrinfo sends the A and AAAA queries in parallel
+  auto res = co_await resolve_for_connect(dns_base, host, port);
+
+  // Alternate between address families, starting with the family of the first
+  // address getaddrinfo returned (RFC 8305 section 4)
+  vector<const struct evutil_addrinfo*> addrs;
+  {
+    vector<const struct evutil_addrinfo*> preferred_addrs;
+    vector<const struct evutil_addrinfo*> other_addrs;
+    for (auto* ai = res.results.get(); ai; ai = ai->ai_next) {
+      if (ai->ai_family == res.results->ai_family) {
+        preferred_addrs.emplace_back(ai);
+      } else {
+        other_addrs.emplace_back(ai);
+      }
+    }
+    for (size_t x = 0; x < max(preferred_addrs.size(), other_addrs.size()); x++) {
+      if (x < preferred_addrs.size()) {
+        addrs.emplace_back(preferred_addrs[x]);
+      }
+      if (x < other_addrs.size()) {
+        addrs.emplace_back(other_addrs[x]);
+      }
+    }
+  }
+
+  // The fds of all attempts except the one that wins are closed at the end.
+  // Tasks are kept in a list so any() can hold pointers to them while others
+  // are added. Destroying the tasks unregisters their events, so pending_fds
+  // is declared first: if the frame is destroyed early, the fds must be closed
+  // after the tasks are destroyed, not before.
+  PendingConnectFds pending_fds;
+  list<Task<int>> tasks;
+  Task<int>* delay_task = nullptr;
+  int connected_fd = -1;
+  string error_str;
+  size_t next_addr_index = 0;
+  for (;;) {
+    // Start the next attempt, unless the previous one was started less than
+    // attempt_delay_usecs ago. Addresses that fail immediately are skipped.
+    while (!delay_task && (next_addr_index < addrs.size())) {
+      const auto* ai = addrs[next_addr_index++];
+      int fd;
+      try {
+        fd = start_connect(ai->ai_addr, ai->ai_addrlen);
+      } catch (const runtime_error& e) {
+        error_str = e.what();
+        continue;
+      }
+      pending_fds.fds.emplace(fd);
+      tasks.emplace_back(finish_connect(*this, fd));
+      if (next_addr_index < addrs.size()) {
+        delay_task = &tasks.emplace_back(attempt_delay(*this, attempt_delay_usecs));
+      }
+    }
+    if (tasks.empty()) {
+      break;
+    }
+
+    auto* task = co_await any(tasks.begin(), tasks.end());
+    if (task == delay_task) {
+      delay_task = nullptr;
+    } else {
+      try {
+        connected_fd = task->result();
+        pending_fds.fds.erase(connected_fd);
+        break;
+      } catch (const runtime_error& e) {
+        error_str = e.what();
+      }
+      // The attempt failed; the next one starts immediately instead of after
+      // the delay
+      if (delay_task) {
+        tasks.remove_if([&](const Task<int>& t) { return &t == delay_task; });
+        delay_task = nullptr;
+      }
+    }
+    tasks.remove_if([&](const Task<int>& t) { return &t == task; });
+  }
+
+  // Destroying the tasks unregisters their events, so this must happen before
+  // the fds are closed
+  tasks.clear();
+  pending_fds.close_all();
+  if (connected_fd < 0) {
+    throw runtime_error("cannot connect to " + host + ": " + error_str);
+  }
+  co_return std::move(connected_fd);
+}
+
 Base::RecvFromAwaiter::RecvFromAwaiter(
     Base& base, evutil_socket_t fd, size_t max_size)
     : base(base),
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <event2/event.h>
+#include <sys/socket.h>
 
 #include <coroutine>
 #include <functional>
@@ -14,6 +15,8 @@
 
 namespace EventAsync {
 
+class DNSBase;
+
 class Base {
 public:
   Base();
@@ -144,7 +147,24 @@ public:
 
   // Note: sendto() essentially never blocks so there is no async version of it
 
+  // Connects to a remote server and returns the connected fd. If addr is a
+  // hostname rather than an IP address, the first overload does a blocking DNS
+  // lookup; the second resolves it with dns_base instead, then tries each
+  // address it resolves to in order until one of them accepts the connection.
   Task<int> connect(const std::string& addr, int port);
+  Task<int> connect(DNSBase& dns_base, const std::string& addr, int port);
+  Task<int> connect(const struct sockaddr* addr, socklen_t addr_len);
+  // Connects to host using Happy Eyeballs (RFC 8305): resolves its IPv4 and
+  // IPv6 addresses in parallel, then starts connecting to them in order,
+  // alternating between address families. Each attempt starts
+  // attempt_delay_usecs after the previous one (or immediately, if the
+  // previous one fails), without canceling earlier attempts. Returns the fd of
+  // the first connection to succeed; the others are closed.
+  Task<int> connect_any(
+      DNSBase& dns_base,
+      const std::string& host,
+      int port,
+      uint64_t attempt_delay_usecs = 250000);
   AcceptAwaiter accept(int listen_fd, struct sockaddr_storage* addr = nullptr);
 
   void dump_events(FILE* stream);
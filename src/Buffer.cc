@@ -23,7 +23,8 @@ Buffer::Buffer(Base& base, struct evbuffer* buf)
 
 Buffer::Buffer(Buffer&& other)
     : base(other.base),
-      buf(other.buf) {
+      buf(other.buf),
+      owned(other.owned) {
   other.buf = nullptr;
   other.owned = false;
 }
@@ -348,6 +349,13 @@ void Buffer::add_file(int fd, off_t offset, size_t size) {
   }
 }
 
+void Buffer::add_file_segment(
+    struct evbuffer_file_segment* seg, off_t offset, size_t size) {
+  if (evbuffer_add_file_segment(this->buf, seg, offset, size)) {
+    throw runtime_error("evbuffer_add_file_segment");
+  }
+}
+
 void Buffer::add_buffer_reference(struct evbuffer* other_buf) {
   if (evbuffer_add_buffer_reference(this->buf, other_buf)) {
     throw runtime_error("evbuffer_add_buffer_reference");
@@ -152,6 +152,8 @@ struct Buffer {
   void add(std::string&& data);
 
   void add_file(int fd, off_t offset, size_t size);
+  void add_file_segment(
+      struct evbuffer_file_segment* seg, off_t offset, size_t size);
 
   void add_buffer_reference(struct evbuffer* other_buf);
   void add_buffer_reference(Buffer& other_buf);
@@ -0,0 +1,251 @@
+#include "BulkReverseResolver.hh"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+using namespace std;
+
+namespace EventAsync {
+
+BulkReverseResolver::Nameserver::Nameserver(
+    Base& base, const string& address, size_t in_flight_limit)
+    : address(address),
+      dns_base(base),
+      in_flight(0),
+      in_flight_limit(in_flight_limit),
+      window_completed(0),
+      window_failed(0),
+      window_skip(0),
+      queries(0),
+      timeouts(0),
+      server_failures(0) {
+  if (!this->address.empty()) {
+    this->dns_base.clear_nameservers_and_suspend();
+    this->dns_base.nameserver_ip_add(this->address.c_str());
+    this->dns_base.resume();
+  }
+}
+
+BulkReverseResolver::BulkReverseResolver(
+    Base& base,
+    Channel<Result>& results,
+    const BulkReverseResolverOptions& options)
+    : base(base),
+      results(results),
+      options(options),
+      running(false),
+      start_time(0),
+      rate_interval_start_time(0),
+      rate_interval_completed(0) {
+  if ((this->options.min_in_flight == 0) ||
+      (this->options.min_in_flight > this->options.max_in_flight)) {
+    throw invalid_argument("invalid in-flight query limits");
+  }
+  size_t initial_in_flight = clamp(
+      this->options.initial_in_flight,
+      this->options.min_in_flight,
+      this->options.max_in_flight);
+
+  if (this->options.nameservers.empty()) {
+    this->nameservers.emplace_back(
+        make_unique<Nameserver>(this->base, "", initial_in_flight));
+  } else {
+    for (const auto& address : this->options.nameservers) {
+      this->nameservers.emplace_back(
+          make_unique<Nameserver>(this->base, address, initial_in_flight));
+    }
+  }
+
+  // evdns queues requests beyond its own in-flight limit (64 by default)
+  // instead of sending them, which would hide the nameserver's actual latency
+  // from the limit adjustment here
+  string timeout_str = to_string(
+      static_cast<double>(this->options.query_timeout_usecs) / 1000000.0);
+  string attempts_str = to_string(this->options.query_attempts);
+  string max_inflight_str = to_string(this->options.max_in_flight);
+  for (auto& ns : this->nameservers) {
+    ns->dns_base.set_option("timeout:", timeout_str.c_str());
+    ns->dns_base.set_option("attempts:", attempts_str.c_str());
+    ns->dns_base.set_option("max-inflight:", max_inflight_str.c_str());
+  }
+}
+
+Task<void> BulkReverseResolver::resolve(const vector<struct in_addr>& addrs) {
+  return this->dispatch(addrs.size(), [&addrs](uint64_t index) -> struct in_addr {
+    return addrs[index];
+  });
+}
+
+Task<void> BulkReverseResolver::resolve_range(
+    const struct in_addr& first_addr, uint64_t count) {
+  uint32_t first_addr_host = ntohl(first_addr.s_addr);
+  if (count > 0x100000000ULL - first_addr_host) {
+    throw out_of_range("address range extends past 255.255.255.255");
+  }
+  return this->dispatch(count, [first_addr_host](uint64_t index) -> struct in_addr {
+    struct in_addr addr;
+    addr.s_addr = htonl(first_addr_host + index);
+    return addr;
+  });
+}
+
+Task<void> BulkReverseResolver::dispatch(
+    uint64_t count, function<struct in_addr(uint64_t index)> get_addr) {
+  if (this->running) {
+    throw logic_error("a bulk reverse resolution is already running");
+  }
+  this->running = true;
+  // The in-flight limits are kept from previous runs, but the stats aren't
+  this->stats = Stats();
+  for (auto& ns : this->nameservers) {
+    ns->queries = 0;
+    ns->timeouts = 0;
+    ns->server_failures = 0;
+  }
+  this->start_time = now();
+  this->rate_interval_start_time = this->start_time;
+  this->rate_interval_completed = 0;
+
+  uint64_t next_index = 0;
+  size_t total_in_flight = 0;
+  while ((next_index < count) || (total_in_flight > 0)) {
+    // Start as many queries as the limits allow, sending each one to the
+    // nameserver with the most unused capacity
+    while (next_index < count) {
+      size_t best_index = 0;
+      size_t best_available = 0;
+      for (size_t z = 0; z < this->nameservers.size(); z++) {
+        const auto& ns = this->nameservers[z];
+        size_t available = (ns->in_flight < ns->in_flight_limit)
+            ? (ns->in_flight_limit - ns->in_flight)
+            : 0;
+        if (available > best_available) {
+          best_index = z;
+          best_available = available;
+        }
+      }
+      if (best_available == 0) {
+        break;
+      }
+      auto& ns = this->nameservers[best_index];
+      ns->in_flight++;
+      ns->queries++;
+      this->stats.queries++;
+      total_in_flight++;
+      this->query(best_index, get_addr(next_index++));
+    }
+
+    auto c = co_await this->completions.read();
+    total_in_flight--;
+    this->on_query_complete(c);
+    this->results.write(std::move(c.result));
+  }
+
+  this->running = false;
+}
+
+DetachedTask BulkReverseResolver::query(
+    size_t nameserver_index, struct in_addr addr) {
+  Completion c;
+  c.nameserver_index = nameserver_index;
+  c.result.addr = addr;
+  c.result.result.ttl = 0;
+  try {
+    c.result.result = co_await this->nameservers[nameserver_index]->dns_base.resolve_reverse_ipv4(
+        &addr, DNS_QUERY_NO_SEARCH);
+  } catch (const exception&) {
+    c.result.result.result_code = DNS_ERR_UNKNOWN;
+  }
+  this->completions.write(std::move(c));
+}
+
+void BulkReverseResolver::on_query_complete(Completion& c) {
+  auto& ns = *this->nameservers[c.nameserver_index];
+  ns.in_flight--;
+
+  bool failed = false;
+  switch (c.result.result.result_code) {
+    case DNS_ERR_NONE:
+      if (c.result.result.results.empty()) {
+        this->stats.not_found++;
+      } else {
+        this->stats.resolved++;
+      }
+      break;
+    case DNS_ERR_NOTEXIST:
+    case DNS_ERR_NODATA:
+      this->stats.not_found++;
+      break;
+    case DNS_ERR_TIMEOUT:
+      this->stats.timeouts++;
+      ns.timeouts++;
+      failed = true;
+      break;
+    case DNS_ERR_SERVERFAILED:
+      this->stats.server_failures++;
+      ns.server_failures++;
+      failed = true;
+      break;
+    default:
+      this->stats.other_failures++;
+      break;
+  }
+
+  if (ns.window_skip > 0) {
+    ns.window_skip--;
+  } else {
+    ns.window_completed++;
+    ns.window_failed += failed;
+    if (ns.window_completed >= ns.in_flight_limit) {
+      double failure_rate = static_cast<double>(ns.window_failed) / ns.window_completed;
+      if (failure_rate > this->options.max_failure_rate) {
+        ns.in_flight_limit = max(ns.in_flight_limit / 2, this->options.min_in_flight);
+        ns.window_skip = ns.in_flight;
+      } else {
+        ns.in_flight_limit = min(ns.in_flight_limit + 1, this->options.max_in_flight);
+      }
+      ns.window_completed = 0;
+      ns.window_failed = 0;
+    }
+  }
+
+  uint64_t t = now();
+  size_t completed = this->stats.resolved + this->stats.not_found +
+      this->stats.timeouts + this->stats.server_failures +
+      this->stats.other_failures;
+  if (t > this->start_time) {
+    this->stats.average_queries_per_second =
+        static_cast<double>(completed * 1000000) / (t - this->start_time);
+  }
+  this->rate_interval_completed++;
+  if (this->rate_interval_start_time == this->start_time) {
+    // Less than a second has passed, so the recent rate is the average rate
+    this->stats.queries_per_second = this->stats.average_queries_per_second;
+  }
+  if (t - this->rate_interval_start_time >= 1000000) {
+    this->stats.queries_per_second =
+        static_cast<double>(this->rate_interval_completed * 1000000) /
+        (t - this->rate_interval_start_time);
+    this->rate_interval_start_time = t;
+    this->rate_interval_completed = 0;
+  }
+}
+
+BulkReverseResolver::Stats BulkReverseResolver::get_stats() const {
+  Stats ret = this->stats;
+  for (const auto& ns : this->nameservers) {
+    auto& ns_stats = ret.nameservers.emplace_back();
+    ns_stats.address = ns->address;
+    ns_stats.in_flight = ns->in_flight;
+    ns_stats.in_flight_limit = ns->in_flight_limit;
+    ns_stats.queries = ns->queries;
+    ns_stats.timeouts = ns->timeouts;
+    ns_stats.server_failures = ns->server_failures;
+  }
+  return ret;
+}
+
+} // namespace EventAsync
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Base.hh"
+#include "Channel.hh"
+#include "DNSBase.hh"
+#include "Task.hh"
+
+namespace EventAsync {
+
+struct BulkReverseResolverOptions {
+  // Nameservers to send queries to (IP addresses, optionally with ports, as
+  // for DNSBase::nameserver_ip_add). Each nameserver gets its own limit on
+  // queries in flight, so faster nameservers get more of the load. If this is
+  // empty, the system's configured nameservers are used, with a single limit.
+  std::vector<std::string> nameservers;
+  // The number of queries in flight to each nameserver is adjusted AIMD-style:
+  // each time a window's worth of queries completes, the limit is halved if
+  // more than max_failure_rate of them timed out or got SERVFAIL, and is
+  // increased by one otherwise.
+  size_t initial_in_flight = 8;
+  size_t min_in_flight = 1;
+  size_t max_in_flight = 256;
+  double max_failure_rate = 0.05;
+  // Timeout and retry count for each query (evdns's timeout: and attempts:
+  // options).
+  uint64_t query_timeout_usecs = 2000000;
+  size_t query_attempts = 2;
+};
+
+// Looks up PTR records for large numbers of IPv4 addresses (for example, all
+// the addresses in a /16) as fast as the nameservers allow, without
+// overloading them.
+class BulkReverseResolver {
+public:
+  struct Result {
+    struct in_addr addr;
+    DNSBase::LookupResult<std::string> result;
+  };
+
+  // Results are written to the given channel in the order they complete. The
+  // caller should read one result from it for each address passed to
+  // resolve() or resolve_range().
+  BulkReverseResolver(
+      Base& base,
+      Channel<Result>& results,
+      const BulkReverseResolverOptions& options = BulkReverseResolverOptions());
+  BulkReverseResolver(const BulkReverseResolver&) = delete;
+  BulkReverseResolver(BulkReverseResolver&&) = delete;
+  BulkReverseResolver& operator=(const BulkReverseResolver&) = delete;
+  BulkReverseResolver& operator=(BulkReverseResolver&&) = delete;
+  ~BulkReverseResolver() = default;
+
+  // Looks up all of the given addresses, and returns when all of the lookups
+  // are complete. Only one of these may run at a time, and the
+  // BulkReverseResolver must not be destroyed while one is running.
+  Task<void> resolve(const std::vector<struct in_addr>& addrs);
+  // Like resolve(), but looks up count consecutive addresses starting at
+  // first_addr.
+  Task<void> resolve_range(const struct in_addr& first_addr, uint64_t count);
+
+  struct NameserverStats {
+    std::string address; // empty if using the system's nameservers
+    size_t in_flight;
+    size_t in_flight_limit;
+    size_t queries;
+    size_t timeouts;
+    size_t server_failures;
+  };
+
+  // Stats describe the current (or most recent) call to resolve() or
+  // resolve_range().
+  struct Stats {
+    size_t queries = 0;
+    // Lookups that returned PTR records
+    size_t resolved = 0;
+    // Lookups for addresses that have no PTR records (NXDOMAIN or no data)
+    size_t not_found = 0;
+    size_t timeouts = 0;
+    size_t server_failures = 0;
+    // Other failures (refused, format errors, etc.)
+    size_t other_failures = 0;
+    // Completed queries per second, measured over about the last second, and
+    // since resolve() or resolve_range() started
+    double queries_per_second = 0.0;
+    double average_queries_per_second = 0.0;
+    std::vector<NameserverStats> nameservers;
+  };
+  Stats get_stats() const;
+
+private:
+  struct Nameserver {
+    std::string address;
+    DNSBase dns_base;
+    size_t in_flight;
+    size_t in_flight_limit;
+    // Queries completed (and how many of them failed) since the limit was last
+    // adjusted. After the limit is decreased, the queries that were already in
+    // flight aren't counted (window_skip), so a single burst of failures
+    // doesn't decrease it more than once.
+    size_t window_completed;
+    size_t window_failed;
+    size_t window_skip;
+    size_t queries;
+    size_t timeouts;
+    size_t server_failures;
+
+    Nameserver(Base& base, const std::string& address, size_t in_flight_limit);
+  };
+
+  struct Completion {
+    size_t nameserver_index;
+    Result result;
+  };
+
+  Base& base;
+  Channel<Result>& results;
+  BulkReverseResolverOptions options;
+  std::vector<std::unique_ptr<Nameserver>> nameservers;
+  // Queries send their results here, so the dispatcher can update the limits
+  // before passing them on
+  Channel<Completion> completions;
+  bool running;
+
+  Stats stats;
+  uint64_t start_time;
+  uint64_t rate_interval_start_time;
+  size_t rate_interval_completed;
+
+  Task<void> dispatch(
+      uint64_t count, std::function<struct in_addr(uint64_t index)> get_addr);
+  DetachedTask query(size_t nameserver_index, struct in_addr addr);
+  void on_query_complete(Completion& c);
+};
+
+} // namespace EventAsync
@@ -0,0 +1,271 @@
+#include "CachingResolver.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <list>
+#include <phosg/Time.hh>
+#include <type_traits>
+#include <unordered_map>
+
+#include "Future.hh"
+
+using namespace std;
+
+namespace EventAsync {
+
+template <typename ResultT>
+struct CacheTable {
+  using ResultFuture = Future<DNSBase::LookupResult<ResultT>>;
+
+  struct Entry {
+    // If has_result is false, the entry only exists because a query for it is
+    // in progress
+    bool has_result = false;
+    DNSBase::LookupResult<ResultT> result;
+    uint64_t expire_time = 0;
+    shared_ptr<ResultFuture> pending;
+    list<string>::iterator lru_it;
+  };
+
+  unordered_map<string, Entry> entries;
+  // Least recently used first
+  list<string> lru;
+
+  void touch(Entry& entry) {
+    this->lru.splice(this->lru.end(), this->lru, entry.lru_it);
+  }
+
+  void erase(typename unordered_map<string, Entry>::iterator it) {
+    this->lru.erase(it->second.lru_it);
+    this->entries.erase(it);
+  }
+
+  Entry& get_or_create(const string& key, size_t max_entries) {
+    auto it = this->entries.find(key);
+    if (it != this->entries.end()) {
+      this->touch(it->second);
+      return it->second;
+    }
+
+    // Make room before inserting, so the new entry can't be evicted itself.
+    // Entries with queries in progress can't be evicted, since other lookups
+    // are waiting on them; they're moved to the end of the list instead
+    for (size_t num_skipped = 0;
+         (this->entries.size() >= max_entries) && (num_skipped < this->lru.size());) {
+      auto evict_it = this->entries.find(this->lru.front());
+      if (evict_it->second.pending) {
+        this->touch(evict_it->second);
+        num_skipped++;
+      } else {
+        this->erase(evict_it);
+      }
+    }
+
+    Entry& entry = this->entries.try_emplace(key).first->second;
+    entry.lru_it = this->lru.emplace(this->lru.end(), key);
+    return entry;
+  }
+};
+
+struct CachingResolver::State {
+  DNSBase& dns_base;
+  CachingResolverOptions options;
+  Stats stats;
+  CacheTable<in_addr> ipv4;
+  CacheTable<in6_addr> ipv6;
+  // Keyed by the address's binary representation, so IPv4 keys are 4 bytes
+  // long and IPv6 keys are 16 bytes long
+  CacheTable<string> reverse;
+
+  State(DNSBase& dns_base, const CachingResolverOptions& options)
+      : dns_base(dns_base),
+        options(options) {}
+
+  template <typename ResultT>
+  static Task<DNSBase::LookupResult<ResultT>> resolve(
+      shared_ptr<State> state, CacheTable<ResultT>* table, string key);
+  template <typename ResultT>
+  static shared_ptr<typename CacheTable<ResultT>::ResultFuture> start_query(
+      shared_ptr<State> state, CacheTable<ResultT>* table, const string& key);
+  template <typename ResultT>
+  static DetachedTask run_query(
+      shared_ptr<State> state,
+      CacheTable<ResultT>* table,
+      string key,
+      shared_ptr<typename CacheTable<ResultT>::ResultFuture> future);
+};
+
+template <typename ResultT>
+Task<DNSBase::LookupResult<ResultT>> CachingResolver::State::resolve(
+    shared_ptr<State> state, CacheTable<ResultT>* table, string key) {
+  shared_ptr<typename CacheTable<ResultT>::ResultFuture> future;
+
+  auto it = table->entries.find(key);
+  if (it != table->entries.end()) {
+    auto& entry = it->second;
+    table->touch(entry);
+    if (entry.has_result) {
+      uint64_t t = now();
+      if (t < entry.expire_time) {
+        state->stats.hits++;
+        DNSBase::LookupResult<ResultT> ret = entry.result;
+        ret.ttl = (entry.expire_time - t) / 1000000;
+        co_return ret;
+      }
+      if (t < entry.expire_time + state->options.max_stale_usecs) {
+        state->stats.stale_hits++;
+        DNSBase::LookupResult<ResultT> ret = entry.result;
+        ret.ttl = 0;
+        if (!entry.pending) {
+          State::start_query(state, table, key);
+        }
+        co_return ret;
+      }
+    }
+    if (entry.pending) {
+      state->stats.coalesced++;
+      future = entry.pending;
+    }
+  }
+
+  if (!future) {
+    future = State::start_query(state, table, key);
+  }
+  // Other lookups may be waiting on the same future, so the result is copied
+  auto& f = *future;
+  DNSBase::LookupResult<ResultT> ret = co_await f;
+  co_return ret;
+}
+
+template <typename ResultT>
+shared_ptr<typename CacheTable<ResultT>::ResultFuture> CachingResolver::State::start_query(
+    shared_ptr<State> state, CacheTable<ResultT>* table, const string& key) {
+  auto& entry = table->get_or_create(key, state->options.max_entries);
+  auto future = make_shared<typename CacheTable<ResultT>::ResultFuture>();
+  entry.pending = future;
+  state->stats.queries++;
+  State::run_query(state, table, key, future);
+  return future;
+}
+
+template <typename ResultT>
+DetachedTask CachingResolver::State::run_query(
+    shared_ptr<State> state,
+    CacheTable<ResultT>* table,
+    string key,
+    shared_ptr<typename CacheTable<ResultT>::ResultFuture> future) {
+  DNSBase::LookupResult<ResultT> result;
+  result.result_code = DNS_ERR_UNKNOWN;
+  result.ttl = 0;
+  exception_ptr exc;
+  try {
+    if constexpr (is_same_v<ResultT, in_addr>) {
+      result = co_await state->dns_base.resolve_ipv4(key.c_str());
+    } else if constexpr (is_same_v<ResultT, in6_addr>) {
+      result = co_await state->dns_base.resolve_ipv6(key.c_str());
+    } else if (key.size() == sizeof(in_addr)) {
+      struct in_addr addr;
+      memcpy(&addr, key.data(), sizeof(addr));
+      result = co_await state->dns_base.resolve_reverse_ipv4(&addr);
+    } else {
+      struct in6_addr addr;
+      memcpy(&addr, key.data(), sizeof(addr));
+      result = co_await state->dns_base.resolve_reverse_ipv6(&addr);
+    }
+  } catch (const exception&) {
+    exc = current_exception();
+  }
+
+  bool has_answer = !exc && (result.result_code == DNS_ERR_NONE) && !result.results.empty();
+  bool is_negative = !exc &&
+      ((result.result_code == DNS_ERR_NOTEXIST) ||
+          (result.result_code == DNS_ERR_NODATA) ||
+          ((result.result_code == DNS_ERR_NONE) && result.results.empty()));
+  if (is_negative) {
+    // evdns doesn't provide a TTL for negative results
+    result.ttl = state->options.negative_ttl_usecs / 1000000;
+  } else if (!has_answer) {
+    state->stats.failed_queries++;
+  }
+
+  // The entry may have been evicted or cleared while the query was in
+  // progress, in which case the result isn't cached
+  auto it = table->entries.find(key);
+  if ((it != table->entries.end()) && (it->second.pending == future)) {
+    auto& entry = it->second;
+    entry.pending.reset();
+    uint64_t t = now();
+    if (has_answer) {
+      uint64_t ttl_usecs = static_cast<uint64_t>(max<int>(result.ttl, 0)) * 1000000;
+      ttl_usecs = clamp(ttl_usecs, state->options.min_ttl_usecs, state->options.max_ttl_usecs);
+      entry.has_result = true;
+      entry.result = result;
+      entry.expire_time = t + ttl_usecs;
+    } else if (is_negative) {
+      entry.has_result = true;
+      entry.result = result;
+      entry.expire_time = t + state->options.negative_ttl_usecs;
+    } else if (!entry.has_result) {
+      table->erase(it);
+    }
+    // Otherwise, the query failed and the entry keeps its stale result
+  }
+
+  if (exc) {
+    future->set_exception(exc);
+  } else {
+    future->set_result(std::move(result));
+  }
+}
+
+CachingResolver::CachingResolver(
+    DNSBase& dns_base, const CachingResolverOptions& options)
+    : state(make_shared<State>(dns_base, options)) {}
+
+Task<DNSBase::LookupResult<in_addr>> CachingResolver::resolve_ipv4(
+    const string& name) {
+  return State::resolve(this->state, &this->state->ipv4, name);
+}
+
+Task<DNSBase::LookupResult<in6_addr>> CachingResolver::resolve_ipv6(
+    const string& name) {
+  return State::resolve(this->state, &this->state->ipv6, name);
+}
+
+Task<DNSBase::LookupResult<string>> CachingResolver::resolve_reverse_ipv4(
+    const struct in_addr& addr) {
+  return State::resolve(this->state, &this->state->reverse,
+      string(reinterpret_cast<const char*>(&addr), sizeof(addr)));
+}
+
+Task<DNSBase::LookupResult<string>> CachingResolver::resolve_reverse_ipv6(
+    const struct in6_addr& addr) {
+  return State::resolve(this->state, &this->state->reverse,
+      string(reinterpret_cast<const char*>(&addr), sizeof(addr)));
+}
+
+template <typename ResultT>
+static void clear_table(CacheTable<ResultT>& table) {
+  for (auto it = table.entries.begin(); it != table.entries.end();) {
+    if (it->second.pending) {
+      it->second.has_result = false;
+      it++;
+    } else {
+      table.lru.erase(it->second.lru_it);
+      it = table.entries.erase(it);
+    }
+  }
+}
+
+void CachingResolver::clear() {
+  clear_table(this->state->ipv4);
+  clear_table(this->state->ipv6);
+  clear_table(this->state->reverse);
+}
+
+const CachingResolver::Stats& CachingResolver::get_stats() const {
+  return this->state->stats;
+}
+
+} // namespace EventAsync
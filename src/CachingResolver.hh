@@ -0,0 +1,85 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "DNSBase.hh"
+#include "Task.hh"
+
+namespace EventAsync {
+
+struct CachingResolverOptions {
+  // Results are cached for their TTL, limited to this range. (Without a
+  // minimum, answers with a zero TTL wouldn't be reused at all.)
+  uint64_t min_ttl_usecs = 1000000;
+  uint64_t max_ttl_usecs = 86400000000;
+  // Names that don't exist (NXDOMAIN), and names that have no records of the
+  // requested type, are cached for this long.
+  uint64_t negative_ttl_usecs = 30000000;
+  // After an entry expires, it's still returned for up to this long while it's
+  // refreshed in the background. If the refresh fails (for example, because
+  // the nameservers are unreachable), the stale entry continues to be returned
+  // until this time runs out.
+  uint64_t max_stale_usecs = 300000000;
+  // The maximum number of names cached for each lookup type (A, AAAA, and
+  // PTR). The least recently used entries are evicted beyond this.
+  size_t max_entries = 0x10000;
+};
+
+// Caches the results of DNSBase lookups by their TTLs. Concurrent lookups for
+// the same name share a single query. Lookups that fail for reasons other than
+// the name not existing (timeouts, SERVFAIL, etc.) aren't cached.
+//
+// dns_base must outlive the CachingResolver. Lookups that are in progress when
+// the CachingResolver is destroyed still complete (or fail, if dns_base is
+// destroyed too), but their results aren't cached.
+class CachingResolver {
+public:
+  explicit CachingResolver(
+      DNSBase& dns_base,
+      const CachingResolverOptions& options = CachingResolverOptions());
+  CachingResolver(const CachingResolver&) = delete;
+  CachingResolver(CachingResolver&&) = delete;
+  CachingResolver& operator=(const CachingResolver&) = delete;
+  CachingResolver& operator=(CachingResolver&&) = delete;
+  ~CachingResolver() = default;
+
+  // These work like the DNSBase functions with the same names. For cached
+  // results, ttl is the number of seconds remaining before the entry expires
+  // (zero for stale entries).
+  Task<DNSBase::LookupResult<in_addr>> resolve_ipv4(const std::string& name);
+  Task<DNSBase::LookupResult<in6_addr>> resolve_ipv6(const std::string& name);
+  Task<DNSBase::LookupResult<std::string>> resolve_reverse_ipv4(
+      const struct in_addr& addr);
+  Task<DNSBase::LookupResult<std::string>> resolve_reverse_ipv6(
+      const struct in6_addr& addr);
+
+  // Removes all cached results. Lookups that are in progress aren't affected.
+  void clear();
+
+  struct Stats {
+    // Lookups answered from the cache
+    size_t hits = 0;
+    // Lookups answered with expired entries while they were being refreshed
+    size_t stale_hits = 0;
+    // Lookups that waited for a query that was already in progress
+    size_t coalesced = 0;
+    // Queries sent to DNSBase (including background refreshes), and how many
+    // of them failed without an answer
+    size_t queries = 0;
+    size_t failed_queries = 0;
+  };
+  const Stats& get_stats() const;
+
+private:
+  // Lookups in progress keep the state alive, so they can finish after the
+  // CachingResolver is destroyed
+  struct State;
+  std::shared_ptr<State> state;
+};
+
+} // namespace EventAsync
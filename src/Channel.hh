@@ -75,6 +75,11 @@ protected:
     if (!this->awaiting_coros.empty()) {
       auto coro = this->awaiting_coros.front();
       this->awaiting_coros.pop_front();
+      // The insert iterator points to the last awaiter, so it's invalid if
+      // that was the one we just removed
+      if (this->awaiting_coros.empty()) {
+        this->awaiting_coros_insert_it = this->awaiting_coros.before_begin();
+      }
       coro.resume();
     }
   }
@@ -103,6 +103,59 @@ void DNSBase::getaddrinfo_cancel(struct evdns_getaddrinfo_request* req) {
   return evdns_getaddrinfo_cancel(req);
 }
 
+void DNSBase::AddrInfoDeleter::operator()(struct evutil_addrinfo* ai) const {
+  evutil_freeaddrinfo(ai);
+}
+
+DNSBase::GetAddrInfoAwaiter::GetAddrInfoAwaiter(
+    DNSBase& dns_base,
+    const char* nodename,
+    const char* servname,
+    const struct evutil_addrinfo* hints)
+    : dns_base(dns_base),
+      nodename(nodename),
+      servname(servname),
+      hints(hints),
+      complete(false),
+      coro(nullptr) {}
+
+bool DNSBase::GetAddrInfoAwaiter::await_ready() const noexcept {
+  return this->complete;
+}
+
+bool DNSBase::GetAddrInfoAwaiter::await_suspend(coroutine_handle<> coro) {
+  // evdns_getaddrinfo calls the callback before returning if the request can
+  // be answered without a query (or fails immediately), so the coroutine is
+  // only suspended if it didn't
+  evdns_getaddrinfo(
+      this->dns_base.dns_base,
+      this->nodename,
+      this->servname,
+      this->hints,
+      &GetAddrInfoAwaiter::on_request_complete,
+      this);
+  if (this->complete) {
+    return false;
+  }
+  this->coro = coro;
+  return true;
+}
+
+DNSBase::AddrInfoResult&& DNSBase::GetAddrInfoAwaiter::await_resume() {
+  return std::move(this->result);
+}
+
+void DNSBase::GetAddrInfoAwaiter::on_request_complete(
+    int result, struct evutil_addrinfo* res, void* arg) {
+  auto* aw = reinterpret_cast<GetAddrInfoAwaiter*>(arg);
+  aw->result.result_code = result;
+  aw->result.results.reset(res);
+  aw->complete = true;
+  if (aw->coro) {
+    aw->coro.resume();
+  }
+}
+
 DNSBase::LookupAwaiterBase::LookupAwaiterBase(
     DNSBase& dns_base, const void* target, int flags)
     : dns_base(dns_base),
@@ -232,6 +285,13 @@ void DNSBase::LookupReverseIPv6Awaiter::start_request() {
   }
 }
 
+DNSBase::GetAddrInfoAwaiter DNSBase::getaddrinfo(
+    const char* nodename,
+    const char* servname,
+    const struct evutil_addrinfo* hints) {
+  return GetAddrInfoAwaiter(*this, nodename, servname, hints);
+}
+
 DNSBase::LookupIPv4Awaiter DNSBase::resolve_ipv4(const char* name, int flags) {
   return LookupIPv4Awaiter(*this, name, flags);
 }
@@ -41,8 +41,6 @@ public:
   void set_option(const char* option, const char* val);
   int count_nameservers();
 
-  // TODO: write an awaiter for getaddrinfo
-
   struct evdns_getaddrinfo_request* getaddrinfo(
       const char* nodename, const char* servname,
       const struct evutil_addrinfo* hints_in,
@@ -50,6 +48,41 @@ public:
       void* cbarg);
   void getaddrinfo_cancel(struct evdns_getaddrinfo_request*);
 
+  struct AddrInfoDeleter {
+    void operator()(struct evutil_addrinfo* ai) const;
+  };
+
+  // If result_code is nonzero (one of the EVUTIL_EAI_* constants), an error
+  // occurred and results is null.
+  struct AddrInfoResult {
+    int result_code;
+    std::unique_ptr<struct evutil_addrinfo, AddrInfoDeleter> results;
+  };
+
+  class GetAddrInfoAwaiter {
+  public:
+    GetAddrInfoAwaiter(
+        DNSBase& dns_base,
+        const char* nodename,
+        const char* servname,
+        const struct evutil_addrinfo* hints);
+    bool await_ready() const noexcept;
+    bool await_suspend(std::coroutine_handle<> coro);
+    AddrInfoResult&& await_resume();
+
+  protected:
+    static void on_request_complete(
+        int result, struct evutil_addrinfo* res, void* arg);
+
+    DNSBase& dns_base;
+    const char* nodename;
+    const char* servname;
+    const struct evutil_addrinfo* hints;
+    bool complete;
+    AddrInfoResult result;
+    std::coroutine_handle<> coro;
+  };
+
   template <typename ResultT>
   struct LookupResult {
     int result_code;
@@ -128,6 +161,14 @@ public:
     virtual void start_request();
   };
 
+  // Resolves a hostname and/or service name like getaddrinfo(3), but without
+  // blocking the event loop. Numeric addresses and names in the hosts file are
+  // resolved immediately, without suspending the caller.
+  GetAddrInfoAwaiter getaddrinfo(
+      const char* nodename,
+      const char* servname,
+      const struct evutil_addrinfo* hints = nullptr);
+
   LookupIPv4Awaiter resolve_ipv4(const char* name, int flags = 0);
   LookupIPv6Awaiter resolve_ipv6(const char* name, int flags = 0);
   LookupReverseIPv4Awaiter resolve_reverse_ipv4(const struct in_addr* in,
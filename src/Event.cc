@@ -57,6 +57,10 @@ void Event::del() {
   }
 }
 
+void Event::activate(short what) {
+  event_active(this->ev, what, 0);
+}
+
 TimeoutEvent::TimeoutEvent(
     Base& base,
     uint64_t timeout,
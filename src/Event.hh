@@ -29,6 +29,9 @@ public:
 
   virtual void add();
   void del();
+  // Makes the event's callback run during the current (or next) event loop
+  // iteration, as if the event had been triggered with the given flags.
+  void activate(short what);
 
 protected:
   struct event* ev;
@@ -0,0 +1,294 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../Base.hh"
+#include "../CachingResolver.hh"
+#include "../DNSBase.hh"
+#include "../Task.hh"
+
+using namespace std;
+using namespace EventAsync;
+
+// Answers A queries over UDP on the loopback interface. Names that start with
+// "missing" don't exist; all others resolve to 10.0.0.N with a TTL of one hour,
+// where N is the number of queries received so far, so results from different
+// queries can be told apart.
+class FakeNameserver {
+public:
+  explicit FakeNameserver(Base& base)
+      : base(base),
+        fd(socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)),
+        stopped(false),
+        num_queries(0) {
+    if (this->fd < 0) {
+      throw runtime_error("cannot create socket");
+    }
+    memset(&this->addr, 0, sizeof(this->addr));
+    this->addr.sin_family = AF_INET;
+    this->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(this->addr);
+    if (::bind(this->fd, reinterpret_cast<const sockaddr*>(&this->addr), addr_len) ||
+        getsockname(this->fd, reinterpret_cast<sockaddr*>(&this->addr), &addr_len)) {
+      throw runtime_error("cannot bind socket");
+    }
+  }
+
+  // Makes dns_base send all queries to this nameserver
+  void configure(DNSBase& dns_base) {
+    dns_base.clear_nameservers_and_suspend();
+    dns_base.nameserver_sockaddr_add(
+        reinterpret_cast<const sockaddr*>(&this->addr), sizeof(this->addr), 0);
+    dns_base.resume();
+    dns_base.search_clear();
+  }
+
+  Task<void> serve() {
+    while (!this->stopped) {
+      auto res = co_await this->base.recvfrom(this->fd);
+      if (this->stopped || (res.data.size() < 12)) {
+        continue;
+      }
+      this->num_queries++;
+
+      // Parse the question name, which ends with an empty label and is
+      // followed by the type and class
+      string name;
+      size_t offset = 12;
+      while ((offset < res.data.size()) && res.data[offset]) {
+        uint8_t label_size = res.data[offset];
+        if (!name.empty()) {
+          name.push_back('.');
+        }
+        name.append(res.data, offset + 1, label_size);
+        offset += label_size + 1;
+      }
+      offset += 5;
+      if (offset > res.data.size()) {
+        continue;
+      }
+      for (auto& ch : name) {
+        ch = tolower(ch);
+      }
+      bool exists = !name.starts_with("missing");
+      bool is_a = (res.data[offset - 4] == 0) && (res.data[offset - 3] == 1);
+
+      // The response repeats the header and question, with only the flags and
+      // counts changed
+      string response = res.data.substr(0, offset);
+      response[2] = '\x81'; // QR, RD
+      response[3] = exists ? '\x80' : '\x83'; // RA, and NXDOMAIN if needed
+      memset(response.data() + 6, 0, 6);
+      if (exists && is_a) {
+        response[7] = 1;
+        static const char answer_header[10] = {
+            '\xC0', '\x0C', 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x0E, 0x10};
+        response.append(answer_header, sizeof(answer_header));
+        response.append({0x00, 0x04, 10, 0, 0, static_cast<char>(this->num_queries)});
+      }
+      sendto(this->fd, response.data(), response.size(), 0,
+          reinterpret_cast<const sockaddr*>(&res.addr), sizeof(sockaddr_in));
+    }
+  }
+
+  // Makes serve() return. The nameserver can't be destroyed until it does.
+  void stop() {
+    this->stopped = true;
+    sendto(this->fd, "", 1, 0,
+        reinterpret_cast<const sockaddr*>(&this->addr), sizeof(this->addr));
+  }
+
+  Base& base;
+  scoped_fd fd;
+  sockaddr_in addr;
+  bool stopped;
+  size_t num_queries;
+};
+
+// Returns the last byte of the first address name resolves to, or zero if the
+// name doesn't exist
+Task<uint8_t> resolve_ipv4(CachingResolver& resolver, string name) {
+  auto res = co_await resolver.resolve_ipv4(name);
+  if (res.result_code == DNS_ERR_NOTEXIST) {
+    co_return 0;
+  }
+  expect_eq(res.result_code, DNS_ERR_NONE);
+  expect_eq(res.results.size(), 1);
+  co_return ntohl(res.results[0].s_addr) & 0xFF;
+}
+
+DetachedTask test_ttl(Base& base) {
+  FakeNameserver ns(base);
+  DNSBase dns_base(base);
+  ns.configure(dns_base);
+  CachingResolverOptions options;
+  options.max_ttl_usecs = 200000;
+  options.max_stale_usecs = 400000;
+  options.negative_ttl_usecs = 200000;
+  CachingResolver resolver(dns_base, options);
+  Task<void> server = ns.serve();
+  server.start();
+  const auto& stats = resolver.get_stats();
+
+  // The first lookup queries the nameserver; the next one is a hit
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 1);
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 1);
+  expect_eq(ns.num_queries, 1);
+  expect_eq(stats.hits, 1);
+
+  // Nonexistent names are cached too
+  expect_eq(co_await resolve_ipv4(resolver, "missing.test"), 0);
+  expect_eq(co_await resolve_ipv4(resolver, "missing.test"), 0);
+  expect_eq(ns.num_queries, 2);
+  expect_eq(stats.hits, 2);
+
+  // After the TTL (clamped to max_ttl_usecs) runs out, the stale result is
+  // returned while it's refreshed in the background, and the refreshed result
+  // is returned after that
+  co_await base.sleep(300000);
+  auto stale_res = co_await resolver.resolve_ipv4("a.test");
+  expect_eq(stale_res.ttl, 0);
+  expect_eq(ntohl(stale_res.results.at(0).s_addr) & 0xFF, 1);
+  expect_eq(stats.stale_hits, 1);
+  co_await base.sleep(50000);
+  expect_eq(ns.num_queries, 3);
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 3);
+  expect_eq(stats.hits, 3);
+
+  // Once the stale time runs out too, lookups wait for a new query
+  co_await base.sleep(700000);
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 4);
+  expect_eq(co_await resolve_ipv4(resolver, "missing.test"), 0);
+  expect_eq(ns.num_queries, 5);
+  expect_eq(stats.stale_hits, 1);
+
+  // Cleared entries are queried again
+  resolver.clear();
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 6);
+  expect_eq(stats.queries, 6);
+  expect_eq(stats.failed_queries, 0);
+
+  ns.stop();
+  co_await server;
+}
+
+DetachedTask test_coalescing(Base& base) {
+  FakeNameserver ns(base);
+  DNSBase dns_base(base);
+  ns.configure(dns_base);
+  CachingResolver resolver(dns_base);
+  Task<void> server = ns.serve();
+  server.start();
+
+  // Concurrent lookups for the same name share one query
+  vector<Task<uint8_t>> tasks;
+  for (size_t z = 0; z < 4; z++) {
+    tasks.emplace_back(resolve_ipv4(resolver, "a.test"));
+  }
+  co_await all(tasks.begin(), tasks.end());
+  for (auto& task : tasks) {
+    expect_eq(co_await task, 1);
+  }
+  expect_eq(ns.num_queries, 1);
+  expect_eq(resolver.get_stats().coalesced, 3);
+
+  ns.stop();
+  co_await server;
+}
+
+DetachedTask test_eviction(Base& base) {
+  FakeNameserver ns(base);
+  DNSBase dns_base(base);
+  ns.configure(dns_base);
+  CachingResolverOptions options;
+  options.max_entries = 2;
+  CachingResolver resolver(dns_base, options);
+  Task<void> server = ns.serve();
+  server.start();
+
+  // Adding a third entry evicts the least recently used one, which is b.test
+  // since a.test was looked up again after it
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 1);
+  expect_eq(co_await resolve_ipv4(resolver, "b.test"), 2);
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 1);
+  expect_eq(co_await resolve_ipv4(resolver, "c.test"), 3);
+  expect_eq(ns.num_queries, 3);
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 1);
+  expect_eq(co_await resolve_ipv4(resolver, "c.test"), 3);
+  expect_eq(ns.num_queries, 3);
+  expect_eq(co_await resolve_ipv4(resolver, "b.test"), 4);
+  expect_eq(ns.num_queries, 4);
+
+  ns.stop();
+  co_await server;
+}
+
+DetachedTask test_eviction_with_pending_queries(Base& base) {
+  FakeNameserver ns(base);
+  DNSBase dns_base(base);
+  ns.configure(dns_base);
+  CachingResolverOptions options;
+  options.max_entries = 1;
+  CachingResolver resolver(dns_base, options);
+  Task<void> server = ns.serve();
+  server.start();
+
+  // The entry being added is never the one evicted, even when it's the only
+  // one that fits
+  expect_eq(co_await resolve_ipv4(resolver, "a.test"), 1);
+  expect_eq(co_await resolve_ipv4(resolver, "b.test"), 2);
+  expect_eq(co_await resolve_ipv4(resolver, "b.test"), 2);
+  expect_eq(ns.num_queries, 2);
+
+  // Entries with queries in progress can't be evicted, so the table grows past
+  // max_entries while both queries run, and both results are cached
+  vector<Task<uint8_t>> tasks;
+  tasks.emplace_back(resolve_ipv4(resolver, "c.test"));
+  tasks.emplace_back(resolve_ipv4(resolver, "d.test"));
+  co_await all(tasks.begin(), tasks.end());
+  expect_eq(ns.num_queries, 4);
+  uint8_t c_result = co_await tasks[0];
+  uint8_t d_result = co_await tasks[1];
+  expect_eq(c_result + d_result, 7);
+  expect_eq(co_await resolve_ipv4(resolver, "c.test"), c_result);
+  expect_eq(co_await resolve_ipv4(resolver, "d.test"), d_result);
+  expect_eq(ns.num_queries, 4);
+
+  // The next new entry evicts both of them
+  expect_eq(co_await resolve_ipv4(resolver, "e.test"), 5);
+  expect_eq(co_await resolve_ipv4(resolver, "c.test"), 6);
+  expect_eq(co_await resolve_ipv4(resolver, "d.test"), 7);
+
+  ns.stop();
+  co_await server;
+}
+
+int main(int, char**) {
+  struct Case {
+    const char* name;
+    DetachedTask (*fn)(Base&);
+  };
+  vector<Case> test_cases = {
+      {"test_ttl", test_ttl},
+      {"test_coalescing", test_coalescing},
+      {"test_eviction", test_eviction},
+      {"test_eviction_with_pending_queries", test_eviction_with_pending_queries},
+  };
+
+  Base base;
+  for (const auto& test_case : test_cases) {
+    fprintf(stderr, "-- %s\n", test_case.name);
+    test_case.fn(base);
+    base.run();
+  }
+  fprintf(stderr, "-- all tests passed\n");
+
+  return 0;
+}
@@ -1,46 +1,49 @@
-#include <coroutine>
-#include <phosg/Network.hh>
-#include <phosg/Strings.hh>
-#include <unordered_set>
+#include <string>
+#include <vector>
 
 #include "../DNSBase.hh"
-#include "../Protocols/HTTP/Connection.hh"
+#include "../Protocols/HTTP/ClientPool.hh"
 #include "../Protocols/HTTP/Request.hh"
 
 using namespace std;
 
-EventAsync::DetachedTask make_request(
-    EventAsync::Base& base,
-    const char* host,
-    uint16_t port,
-    const char* path) {
-
-  shared_ptr<SSL_CTX> ssl_ctx;
-  if (port == 443) {
-    ssl_ctx.reset(
-        EventAsync::HTTP::Connection::create_default_ssl_ctx(),
-        SSL_CTX_free);
+EventAsync::Task<void> fetch_url(
+    EventAsync::Base& base, EventAsync::HTTP::ClientPool& pool, string url) {
+  EventAsync::HTTP::Request req(base);
+  try {
+    co_await pool.request(req, EVHTTP_REQ_GET, url);
+    fprintf(stderr, "%s: response code %d, %zu bytes\n", url.c_str(),
+        req.get_response_code(), req.get_input_buffer().get_length());
+  } catch (const exception& e) {
+    fprintf(stderr, "%s: failed: %s\n", url.c_str(), e.what());
   }
+}
+
+EventAsync::DetachedTask fetch_urls(EventAsync::Base& base, vector<string> urls) {
+  // All the URLs are fetched concurrently; requests to the same host share up
+  // to 4 keep-alive connections
   EventAsync::DNSBase dns_base(base);
-  EventAsync::HTTP::Connection conn(base, dns_base, host, port, ssl_ctx.get());
-  EventAsync::HTTP::Request req(base);
-  req.add_output_header("Connection", "close");
+  EventAsync::HTTP::ClientPool pool(base, dns_base, 4);
 
-  string request_path = escape_url(path, false);
-  co_await conn.send_request(req, EVHTTP_REQ_GET, request_path.c_str());
+  vector<EventAsync::Task<void>> tasks;
+  for (const auto& url : urls) {
+    tasks.emplace_back(fetch_url(base, pool, url));
+  }
+  co_await EventAsync::all(tasks.begin(), tasks.end());
 
-  fprintf(stderr, "Response code: %d\n", req.get_response_code());
-  fprintf(stderr, "Data:\n");
-  req.get_input_buffer().debug_print_contents(stderr);
+  fprintf(stderr, "Opened %zu connection(s)\n", pool.get_num_connections());
+  // The idle connections would otherwise keep base.run() from returning until
+  // they time out
+  pool.close_idle_connections();
 }
 
 int main(int argc, char** argv) {
-  if (argc != 4) {
-    throw invalid_argument("Usage: HTTPClientExample hostname port request_path");
+  if (argc < 2) {
+    throw invalid_argument("Usage: HTTPClientExample url [url ...]");
   }
 
   EventAsync::Base base;
-  make_request(base, argv[1], atoi(argv[2]), argv[3]);
+  fetch_urls(base, vector<string>(argv + 1, argv + argc));
   base.run();
   return 0;
 }
@@ -0,0 +1,504 @@
+#include <string.h>
+
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../Base.hh"
+#include "../Buffer.hh"
+#include "../Protocols/HTTP/HPACK.hh"
+#include "../Protocols/HTTP/Request.hh"
+#include "../Protocols/HTTP/Websocket.hh"
+
+using namespace std;
+using namespace EventAsync;
+using namespace EventAsync::HTTP;
+
+using HeaderList = vector<pair<string, string>>;
+
+// Appends a frame as a client would send it (masked) or as a server would
+// (unmasked)
+static void add_frame(
+    Buffer& buf,
+    uint8_t opcode,
+    const string& payload,
+    bool mask,
+    bool fin = true,
+    bool compressed = false) {
+  static const uint8_t mask_key[4] = {0x12, 0x34, 0x56, 0x78};
+  add_websocket_frame_header(
+      buf, opcode, payload.size(), compressed, mask ? mask_key : nullptr, fin);
+  string data = payload;
+  if (mask) {
+    apply_websocket_mask(data.data(), data.size(), mask_key);
+  }
+  buf.add(data);
+}
+
+static void expect_protocol_error(
+    WebsocketDecoder& decoder, Buffer& buf, uint16_t close_code) {
+  WebsocketMessage msg;
+  try {
+    decoder.decode(buf, &msg);
+  } catch (const WebsocketProtocolError& e) {
+    expect_eq(e.close_code, close_code);
+    return;
+  }
+  throw logic_error("decode did not throw WebsocketProtocolError");
+}
+
+void test_websocket_decode_message(Base& base) {
+  Buffer buf(base);
+  WebsocketDecoder decoder(base, true);
+  WebsocketMessage msg;
+
+  // A frame that arrives in pieces isn't consumed until all of it is there
+  add_frame(buf, 0x01, "hello", true);
+  string frame = buf.remove(buf.get_length());
+  buf.add(frame.data(), 1);
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::NEED_MORE_DATA);
+  expect_eq(decoder.get_bytes_needed(), 2);
+  buf.add(frame.data() + 1, 3);
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::NEED_MORE_DATA);
+  expect_eq(decoder.get_bytes_needed(), 6); // Header and masking key
+  buf.add(frame.data() + 4, 4);
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::NEED_MORE_DATA);
+  expect_eq(decoder.get_bytes_needed(), frame.size());
+  expect_eq(buf.get_length(), 8);
+  buf.add(frame.data() + 8, frame.size() - 8);
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::MESSAGE);
+  expect_eq(msg.opcode, 0x01);
+  expect_eq(msg.data, "hello");
+  expect_eq(buf.get_length(), 0);
+
+  // Extended payload lengths
+  string large(70000, 'x');
+  add_frame(buf, 0x02, large.substr(0, 300), true);
+  add_frame(buf, 0x02, large, true);
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::MESSAGE);
+  expect_eq(msg.data, large.substr(0, 300));
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::MESSAGE);
+  expect_eq(msg.opcode, 0x02);
+  expect_eq(msg.data, large);
+}
+
+void test_websocket_decode_fragments(Base& base) {
+  Buffer buf(base);
+  WebsocketDecoder decoder(base, false);
+  WebsocketMessage msg;
+
+  // Control frames can arrive between the fragments of a message
+  add_frame(buf, 0x01, "frag", false, false);
+  add_frame(buf, 0x09, "ping", false);
+  add_frame(buf, 0x00, "mented", false, false);
+  add_frame(buf, 0x00, "", false, false);
+  add_frame(buf, 0x00, " message", false);
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::CONTROL_FRAME);
+  expect_eq(msg.opcode, 0x09);
+  expect_eq(msg.data, "ping");
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::MESSAGE);
+  expect_eq(msg.opcode, 0x01);
+  expect_eq(msg.data, "fragmented message");
+  expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::NEED_MORE_DATA);
+}
+
+void test_websocket_decode_errors(Base& base) {
+  // Frames from clients must be masked, and frames from servers must not be
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, true);
+    add_frame(buf, 0x01, "data", false);
+    expect_protocol_error(decoder, buf, 1002);
+  }
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false);
+    add_frame(buf, 0x01, "data", true);
+    expect_protocol_error(decoder, buf, 1002);
+  }
+  // A continuation frame must follow the start of a message, and a new
+  // message can't start before the previous one ends
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false);
+    add_frame(buf, 0x00, "data", false);
+    expect_protocol_error(decoder, buf, 1002);
+  }
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false);
+    add_frame(buf, 0x01, "data", false, false);
+    add_frame(buf, 0x01, "data", false);
+    expect_protocol_error(decoder, buf, 1002);
+  }
+  // RSV1 is only valid if permessage-deflate was negotiated
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false);
+    add_frame(buf, 0x01, "data", false, true, true);
+    expect_protocol_error(decoder, buf, 1002);
+  }
+  // Control frames can't be fragmented or have payloads over 125 bytes
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false);
+    add_frame(buf, 0x09, "ping", false, false);
+    expect_protocol_error(decoder, buf, 1002);
+  }
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false);
+    WebsocketMessage msg;
+    add_frame(buf, 0x09, string(125, 'x'), false);
+    expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::CONTROL_FRAME);
+    add_frame(buf, 0x09, string(126, 'x'), false);
+    expect_protocol_error(decoder, buf, 1002);
+  }
+}
+
+void test_websocket_decode_size_limit(Base& base) {
+  // An oversized message is rejected as soon as the header arrives, before
+  // its payload
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false, nullptr, 1000);
+    WebsocketMessage msg;
+    add_frame(buf, 0x01, string(1000, 'x'), false);
+    expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::MESSAGE);
+    add_websocket_frame_header(buf, 0x01, 1001);
+    expect_protocol_error(decoder, buf, 1009);
+  }
+  // The limit applies to the whole message, not to each frame
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false, nullptr, 1000);
+    add_frame(buf, 0x01, string(600, 'x'), false, false);
+    add_frame(buf, 0x00, string(401, 'x'), false);
+    expect_protocol_error(decoder, buf, 1009);
+  }
+}
+
+void test_websocket_deflate(Base& base) {
+  WebsocketDeflateParams params;
+  WebsocketDeflateOptions options;
+  options.enabled = true;
+  options.min_size = 0;
+  options.max_message_size = 0x10000;
+  WebsocketDeflateCodec server_codec(true, params, options);
+  WebsocketDeflateCodec client_codec(false, params, options);
+
+  // Messages round-trip through the compressor, including when they're split
+  // into multiple frames
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false, &client_codec);
+    WebsocketMessage msg;
+    for (size_t size : {100, 0x8000}) {
+      string data;
+      uint32_t seed = 1;
+      for (size_t z = 0; z < size; z++) {
+        seed = seed * 1103515245 + 12345;
+        data.push_back('a' + ((seed >> 16) % 26));
+      }
+      Buffer payload(base);
+      payload.add(data);
+      encode_websocket_message(buf, payload, 0x01, &server_codec, false, 0x1000);
+      expect(decoder.decode(buf, &msg) == WebsocketDecoder::Result::MESSAGE);
+      expect_eq(msg.opcode, 0x01);
+      expect_eq(msg.data, data);
+    }
+  }
+  // Invalid compressed data is rejected with 1007
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false, &client_codec);
+    add_frame(buf, 0x01, "\xFF\xFF\xFF\xFF not deflate data", false, true, true);
+    expect_protocol_error(decoder, buf, 1007);
+  }
+  // A message that decompresses to more than the limit is rejected with 1009,
+  // even though its compressed size is small
+  {
+    Buffer buf(base);
+    WebsocketDecoder decoder(base, false, &client_codec);
+    Buffer payload(base);
+    payload.add(string(0x20000, 'x'));
+    encode_websocket_message(buf, payload, 0x01, &server_codec, false);
+    expect_lt(buf.get_length(), 0x1000);
+    expect_protocol_error(decoder, buf, 1009);
+  }
+}
+
+static string from_hex(const char* hex) {
+  string ret;
+  for (const char* p = hex; *p; p++) {
+    if (*p == ' ') {
+      continue;
+    }
+    ret.push_back(static_cast<char>(stoul(string(p, 2), nullptr, 16)));
+    p++;
+  }
+  return ret;
+}
+
+static HeaderList decode_header_block(HPACKDecoder& decoder, const string& block) {
+  HeaderList headers;
+  expect(decoder.decode(headers, block.data(), block.size()));
+  return headers;
+}
+
+static void expect_decode_error(HPACKDecoder& decoder, const string& block) {
+  HeaderList headers;
+  try {
+    decoder.decode(headers, block.data(), block.size());
+  } catch (const runtime_error&) {
+    return;
+  }
+  throw logic_error("decode did not throw");
+}
+
+void test_hpack_huffman(Base&) {
+  // RFC 7541 appendix C.4: requests with Huffman-coded strings, which also
+  // refer to entries added to the dynamic table by earlier requests
+  HPACKDecoder decoder;
+  expect(decode_header_block(decoder, from_hex(
+      "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff")) == HeaderList({
+      {":method", "GET"},
+      {":scheme", "http"},
+      {":path", "/"},
+      {":authority", "www.example.com"},
+  }));
+  expect(decode_header_block(decoder, from_hex(
+      "8286 84be 5886 a8eb 1064 9cbf")) == HeaderList({
+      {":method", "GET"},
+      {":scheme", "http"},
+      {":path", "/"},
+      {":authority", "www.example.com"},
+      {"cache-control", "no-cache"},
+  }));
+  expect(decode_header_block(decoder, from_hex(
+      "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf")) == HeaderList({
+      {":method", "GET"},
+      {":scheme", "https"},
+      {":path", "/index.html"},
+      {":authority", "www.example.com"},
+      {"custom-key", "custom-value"},
+  }));
+
+  // Padding longer than 7 bits, and padding that contains the EOS symbol
+  HPACKDecoder decoder2;
+  expect_decode_error(decoder2, from_hex("40 81ff 0161"));
+  expect_decode_error(decoder2, from_hex("40 84ffffffff 0161"));
+  // Padding that isn't all 1 bits ("a" is 00011, padded with zeroes)
+  expect_decode_error(decoder2, from_hex("40 8118 0161"));
+}
+
+void test_hpack_integers(Base&) {
+  HPACKDecoder decoder;
+  // A multi-byte integer (a 200-byte value length)
+  string block = from_hex("82 00 0161 7f49") + string(200, 'x');
+  expect(decode_header_block(decoder, block) == HeaderList({
+      {":method", "GET"},
+      {"a", string(200, 'x')},
+  }));
+  // Integers that are too large, or that are truncated
+  expect_decode_error(decoder, from_hex("ff ffffffffffffffffff 01"));
+  expect_decode_error(decoder, from_hex("ff 80"));
+  // A string whose length runs past the end of the block
+  expect_decode_error(decoder, from_hex("40 05 6162"));
+  // Index 0, and an index past the end of the dynamic table
+  expect_decode_error(decoder, from_hex("80"));
+  expect_decode_error(decoder, from_hex("be"));
+}
+
+void test_hpack_dynamic_table_eviction(Base&) {
+  // RFC 7541 appendix C.5: responses with a 256-byte dynamic table, where
+  // adding entries evicts the oldest ones
+  HPACKDecoder decoder(256);
+  expect(decode_header_block(decoder, from_hex(
+      "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420"
+      "3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77"
+      "7777 2e65 7861 6d70 6c65 2e63 6f6d")) == HeaderList({
+      {":status", "302"},
+      {"cache-control", "private"},
+      {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+      {"location", "https://www.example.com"},
+  }));
+  // This evicts ":status: 302"
+  expect(decode_header_block(decoder, from_hex("4803 3330 37c1 c0bf")) == HeaderList({
+      {":status", "307"},
+      {"cache-control", "private"},
+      {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+      {"location", "https://www.example.com"},
+  }));
+  expect_decode_error(decoder, from_hex("c2"));
+  // This evicts all but the newest three entries
+  expect(decode_header_block(decoder, from_hex(
+      "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32"
+      "3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a"
+      "584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33"
+      "3630 303b 2076 6572 7369 6f6e 3d31")) == HeaderList({
+      {":status", "200"},
+      {"cache-control", "private"},
+      {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+      {"location", "https://www.example.com"},
+      {"content-encoding", "gzip"},
+      {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"},
+  }));
+  expect(decode_header_block(decoder, from_hex("bf")) == HeaderList({
+      {"content-encoding", "gzip"},
+  }));
+  expect_decode_error(decoder, from_hex("c1"));
+
+  // Shrinking the table evicts entries too; the table can't grow past the
+  // size we allow, and size updates must come before any fields
+  expect(decode_header_block(decoder, from_hex("20")) == HeaderList({}));
+  expect_decode_error(decoder, from_hex("be"));
+  expect_decode_error(decoder, from_hex("3fe201"));
+  expect_decode_error(decoder, from_hex("82 20"));
+}
+
+void test_hpack_encoder(Base&) {
+  HPACKEncoder encoder;
+  HPACKDecoder decoder;
+  HeaderList headers({
+      {":status", "200"},
+      {"content-type", "text/html; charset=utf-8"},
+      {"server", "event-async"},
+      {"set-cookie", "session=abcdef"},
+  });
+  string first_block;
+  for (size_t z = 0; z < 2; z++) {
+    string block;
+    for (const auto& it : headers) {
+      encoder.encode(block, it.first, it.second, it.first == "set-cookie");
+    }
+    expect(decode_header_block(decoder, block) == headers);
+    if (z == 0) {
+      first_block = block;
+    } else {
+      // Fields added to the dynamic table by the first block are indexed
+      expect_lt(block.size(), first_block.size());
+    }
+  }
+
+  // Table size changes are signaled at the start of the next block
+  encoder.set_max_table_size(0);
+  string block;
+  encoder.encode(block, "server", "event-async");
+  expect_eq(static_cast<uint8_t>(block[0]), 0x20);
+  expect(decode_header_block(decoder, block) == HeaderList({{"server", "event-async"}}));
+
+  // Fields beyond the list size limit aren't returned, but the block is still
+  // decoded
+  HeaderList limited;
+  expect(!decoder.decode(limited, block.data(), block.size(), 10));
+}
+
+static HeaderList query_param_list(string_view query) {
+  QueryParams params(query);
+  HeaderList ret;
+  for (const auto& it : params) {
+    ret.emplace_back(it.first, it.second);
+  }
+  return ret;
+}
+
+void test_query_params_decoding(Base&) {
+  expect(query_param_list("") == HeaderList({}));
+  expect(query_param_list("a=1&b=2") == HeaderList({{"a", "1"}, {"b", "2"}}));
+  expect(query_param_list("a+b=c+d+") == HeaderList({{"a b", "c d "}}));
+  expect(query_param_list("a%20b=%41%62%2B%26%3d") == HeaderList({{"a b", "Ab+&="}}));
+
+  // Escapes that aren't followed by two hex digits are left as-is, including
+  // those at the end of a component or of the query
+  expect(query_param_list("a=%") == HeaderList({{"a", "%"}}));
+  expect(query_param_list("a=%4") == HeaderList({{"a", "%4"}}));
+  expect(query_param_list("a=%4&b=%%41") == HeaderList({{"a", "%4"}, {"b", "%A"}}));
+  expect(query_param_list("a=%zz%4g") == HeaderList({{"a", "%zz%4g"}}));
+  expect(query_param_list("%=%") == HeaderList({{"%", "%"}}));
+
+  // Queries longer than 16 bytes are scanned in vector-sized chunks; escapes
+  // must be found in both the chunks and the tail
+  string long_query = "first=" + string(20, 'x') + "&second=" + string(20, 'y');
+  expect(query_param_list(long_query) == HeaderList({
+      {"first", string(20, 'x')},
+      {"second", string(20, 'y')},
+  }));
+  expect(query_param_list(long_query + "+%21") == HeaderList({
+      {"first", string(20, 'x')},
+      {"second", string(20, 'y') + " !"},
+  }));
+  expect(query_param_list("%21" + long_query) == HeaderList({
+      {"!first", string(20, 'x')},
+      {"second", string(20, 'y')},
+  }));
+}
+
+void test_query_params_empty_components(Base&) {
+  // Empty parameters are skipped, but empty names and values are not
+  expect(query_param_list("&") == HeaderList({}));
+  expect(query_param_list("&&a=1&&&b=2&") == HeaderList({{"a", "1"}, {"b", "2"}}));
+  expect(query_param_list("=v") == HeaderList({{"", "v"}}));
+  expect(query_param_list("k=") == HeaderList({{"k", ""}}));
+  expect(query_param_list("k") == HeaderList({{"k", ""}}));
+  expect(query_param_list("=") == HeaderList({{"", ""}}));
+  expect(query_param_list("a==b") == HeaderList({{"a", "=b"}}));
+
+  // has() and get() find the first parameter with the name, even if the name
+  // or value is empty
+  QueryParams params("a=1&=2&a=3&b&c=");
+  expect_eq(params.size(), 5);
+  expect(!params.empty());
+  expect(params.has("a"));
+  expect(params.has(""));
+  expect(params.has("b"));
+  expect(!params.has("d"));
+  expect_eq(params.get("a"), "1");
+  expect_eq(params.get(""), "2");
+  expect_eq(params.get("b"), "");
+  expect_eq(params.get("c", "default"), "");
+  expect_eq(params.get("d", "default"), "default");
+  try {
+    params.get("d");
+    throw logic_error("get did not throw for a missing parameter");
+  } catch (const out_of_range&) {
+  }
+  expect_eq(params[2].second, "3");
+
+  // Moving the parameters keeps the decoded values valid
+  string query = "x=%41+";
+  QueryParams moved_from(query);
+  QueryParams moved(std::move(moved_from));
+  expect_eq(moved.get("x"), "A ");
+  expect(QueryParams().empty());
+}
+
+int main(int, char**) {
+  struct Case {
+    const char* name;
+    void (*fn)(Base&);
+  };
+  vector<Case> test_cases = {
+      {"test_websocket_decode_message", test_websocket_decode_message},
+      {"test_websocket_decode_fragments", test_websocket_decode_fragments},
+      {"test_websocket_decode_errors", test_websocket_decode_errors},
+      {"test_websocket_decode_size_limit", test_websocket_decode_size_limit},
+      {"test_websocket_deflate", test_websocket_deflate},
+      {"test_hpack_huffman", test_hpack_huffman},
+      {"test_hpack_integers", test_hpack_integers},
+      {"test_hpack_dynamic_table_eviction", test_hpack_dynamic_table_eviction},
+      {"test_hpack_encoder", test_hpack_encoder},
+      {"test_query_params_decoding", test_query_params_decoding},
+      {"test_query_params_empty_components", test_query_params_empty_components},
+  };
+
+  Base base;
+  for (const auto& test_case : test_cases) {
+    fprintf(stderr, "-- %s\n", test_case.name);
+    test_case.fn(base);
+  }
+  fprintf(stderr, "-- all tests passed\n");
+
+  return 0;
+}
@@ -1,3 +1,6 @@
+#include <signal.h>
+#include <unistd.h>
+
 #include <coroutine>
 #include <phosg/Network.hh>
 #include <unordered_set>
@@ -8,7 +11,64 @@ using namespace std;
 
 class ExampleHTTPServer : public EventAsync::HTTP::Server {
 public:
-  ExampleHTTPServer(EventAsync::Base& base) : Server(base, nullptr) {}
+  ExampleHTTPServer(EventAsync::Base& base, size_t num_threads)
+      : Server(base, nullptr, num_threads) {
+    // Requests that match a route go to the route's handler; all others go to
+    // handle_request below
+    this->router.add(EVHTTP_REQ_GET, "/hello/:name",
+        [this](EventAsync::HTTP::Request& req, EventAsync::HTTP::RouteParams params)
+            -> EventAsync::DetachedTask {
+          string name(params.get("name"));
+          this->send_response(req, 200, "text/plain", "Hello, %s!\n", name.c_str());
+          co_return;
+        });
+
+    // This route streams its response, so it can be arbitrarily long without
+    // the server buffering all of it in memory
+    this->router.add(EVHTTP_REQ_GET, "/count/:n",
+        [this](EventAsync::HTTP::Request& req, EventAsync::HTTP::RouteParams params)
+            -> EventAsync::DetachedTask {
+          uint64_t n = strtoull(string(params.get("n")).c_str(), nullptr, 0);
+          auto stream = this->start_response_stream(req, 200, "text/plain");
+          try {
+            for (uint64_t z = 0; z < n; z++) {
+              co_await stream->write(to_string(z) + "\n");
+            }
+            co_await stream->end();
+          } catch (const runtime_error&) {
+            // The client disconnected before the response was complete
+          }
+        });
+
+    // This route reads its request body as it arrives, so clients can upload
+    // arbitrarily large bodies without the server buffering all of it in
+    // memory. The Request passed to the handler is only valid until the
+    // handler's first co_await, so it's moved into the coroutine frame.
+    this->router.add(EVHTTP_REQ_POST, "/upload",
+        [this](EventAsync::HTTP::Request& req_ref, EventAsync::HTTP::RouteParams)
+            -> EventAsync::DetachedTask {
+          EventAsync::HTTP::Request req(std::move(req_ref));
+          auto body = this->get_request_body_stream(req);
+          EventAsync::Buffer buf(req.base);
+          try {
+            while (co_await body->read(buf)) {
+              buf.drain_all();
+            }
+          } catch (const runtime_error& e) {
+            this->send_response(req, 400, "text/plain", "%s\n", e.what());
+            co_return;
+          }
+          this->send_response(req, 200, "text/plain",
+              "Received " + to_string(body->get_bytes_read()) + " bytes\n");
+        },
+        true);
+  }
+
+  // The worker threads call this object's handlers, so they have to be
+  // stopped before it's destroyed
+  virtual ~ExampleHTTPServer() {
+    this->stop();
+  }
 
 protected:
   virtual EventAsync::DetachedTask handle_request(
@@ -24,10 +84,23 @@ protected:
   }
 };
 
-int main(int, char**) {
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  // If a thread count is given, serve requests on that many worker threads,
+  // each with its own SO_REUSEPORT listening socket
+  size_t num_threads = (argc > 1) ? strtoull(argv[1], nullptr, 0) : 0;
+
   EventAsync::Base base;
-  ExampleHTTPServer server(base);
-  server.add_socket(listen("", 5050, SOMAXCONN));
-  base.run();
+  ExampleHTTPServer server(base, num_threads);
+  if (num_threads) {
+    server.listen("", 5050);
+    for (;;) {
+      pause();
+    }
+  } else {
+    server.add_socket(listen("", 5050, SOMAXCONN));
+    base.run();
+  }
   return 0;
 }
@@ -7,52 +7,45 @@
 #include <phosg/Strings.hh>
 #include <unordered_set>
 
+#include "../Protocols/HTTP/Broadcaster.hh"
 #include "../Protocols/HTTP/Server.hh"
 
 using namespace std;
 
 class ExampleHTTPWebsocketServer : public EventAsync::HTTP::Server {
 public:
-  ExampleHTTPWebsocketServer(EventAsync::Base& base) : Server(base, nullptr) {}
+  ExampleHTTPWebsocketServer(EventAsync::Base& base)
+      : Server(base, nullptr),
+        // TODO: make this not depend on the current directory (so e.g. running
+        // this executable as Examples/HTPWebsocketServer doesn't break)
+        static_files(base, "HTTPWebsocketServer-Static"),
+        broadcaster(base) {
+    this->set_compression(true);
+    EventAsync::HTTP::WebsocketDeflateOptions deflate_options;
+    deflate_options.enabled = true;
+    this->set_websocket_compression(deflate_options);
+    auto serve_static = [this](
+        EventAsync::HTTP::Request& req, EventAsync::HTTP::RouteParams params)
+        -> EventAsync::DetachedTask {
+      string filename(params[0]);
+      this->send_static_file(req, this->static_files, filename.c_str());
+      co_return;
+    };
+    this->router.add(EVHTTP_REQ_GET, "/static/*filename", serve_static);
+    this->router.add(EVHTTP_REQ_HEAD, "/static/*filename", serve_static);
+  }
 
 protected:
+  EventAsync::HTTP::StaticFileCache static_files;
+  EventAsync::HTTP::WebsocketBroadcaster broadcaster;
+
   virtual EventAsync::DetachedTask handle_request(
       EventAsync::HTTP::Request& req) {
     const char* path = req.get_uri();
 
-    // redirect / to /static/index.html
+    // serve /static/index.html at /
     if (!strcmp(path, "/")) {
-      path = "/static/index.html";
-    }
-
-    if (starts_with(path, "/static/")) {
-      // TODO: make this not depend on the current directory (so e.g. running
-      // this executable as Examples/HTPWebsocketServer doesn't break)
-      string filename = "HTTPWebsocketServer-Static/";
-      filename += &path[8];
-      if (filename.find("..") != string::npos) {
-        this->send_response(req, 400, "text/plain", "Invalid static file");
-
-      } else {
-        string data;
-        bool loaded = false;
-        try {
-          data = load_file(filename);
-          loaded = true;
-        } catch (const exception& e) {
-          this->send_response(
-              req, 500, "text/plain", "Could not read file: %s", e.what());
-        }
-        if (!loaded) {
-          co_return;
-        }
-
-        const char* content_type = "text/html";
-        if (ends_with(filename, ".js")) {
-          content_type = "text/javascript";
-        }
-        this->send_response(req, 200, content_type, std::move(data));
-      }
+      this->send_static_file(req, this->static_files, "index.html");
 
     } else if (starts_with(path, "/stream")) {
       auto c = co_await this->enable_websockets(req);
@@ -67,14 +60,28 @@ protected:
         // This websocket handler just replies with the rot13 encoding of
         // whatever the client sends, until they send "quit" - then it
         // disconnects them (by letting the WebsocketClient object get
-        // destroyed).
-        for (;;) {
-          auto msg = co_await c->read();
-          string response = rot13(msg.data.data(), msg.data.size());
-          co_await c->write(response.data(), response.size());
-          if (msg.data == "quit") {
-            break;
+        // destroyed). If the client sends "broadcast <text>", the text is sent
+        // to all connected clients instead.
+        this->broadcaster.subscribe("all", c);
+        try {
+          for (;;) {
+            auto msg = co_await c->read();
+            if (starts_with(msg.data, "broadcast ")) {
+              this->broadcaster.publish("all", msg.data.data() + 10, msg.data.size() - 10);
+              continue;
+            }
+            string response = rot13(msg.data.data(), msg.data.size());
+            co_await c->write(response.data(), response.size());
+            if (msg.data == "quit") {
+              // Anything still queued when the client is destroyed is
+              // discarded, so wait for the reply to be sent first
+              co_await c->flush();
+              break;
+            }
           }
+        } catch (const exception&) {
+          // The client disconnected (or was disconnected by the broadcaster
+          // for falling too far behind)
         }
       }
 
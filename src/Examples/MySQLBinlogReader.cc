@@ -60,11 +60,23 @@ EventAsync::DetachedTask read_binlogs(
     const auto* header = proc.get_event_header(data);
     switch (header->type) {
       // We don't print anything for these event types
-      case EventAsync::MySQL::BinlogEventType::PREVIOUS_GTIDS_EVENT:
       case EventAsync::MySQL::BinlogEventType::ANONYMOUS_GTID_EVENT:
         proc.parse_unknown_event(data);
         continue;
 
+      case EventAsync::MySQL::BinlogEventType::PREVIOUS_GTIDS_EVENT:
+        proc.parse_previous_gtids_event(data);
+        continue;
+
+      case EventAsync::MySQL::BinlogEventType::GTID_EVENT: {
+        auto ev = proc.parse_gtid_event(data);
+        string sid_str = GTIDSet::format_sid(ev.sid);
+        print_pos_comment_start(ev.header, filename);
+        fprintf(stdout, "*/ SET @@SESSION.GTID_NEXT = '%s:%" PRIu64 "';\n",
+            sid_str.c_str(), ev.gno);
+        break;
+      }
+
       case EventAsync::MySQL::BinlogEventType::TABLE_MAP_EVENT:
         proc.parse_table_map_event(data);
         break;
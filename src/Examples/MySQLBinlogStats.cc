@@ -159,6 +159,8 @@ EventAsync::DetachedTask generate_binlog_stats(
       current_filename.c_str(), current_position);
 
   BinlogProcessor proc;
+  // Reused for every rows event, so decoding them doesn't allocate memory
+  BinlogRowsEventView rows_ev;
   size_t transaction_event_bytes = 0;
   for (;;) {
     string data = co_await client.get_binlog_event();
@@ -197,7 +199,8 @@ EventAsync::DetachedTask generate_binlog_stats(
       case EventAsync::MySQL::BinlogEventType::WRITE_ROWS_EVENTv2:
       case EventAsync::MySQL::BinlogEventType::UPDATE_ROWS_EVENTv2:
       case EventAsync::MySQL::BinlogEventType::DELETE_ROWS_EVENTv2: {
-        auto ev = proc.parse_rows_event(data);
+        proc.parse_rows_event_view(std::move(data), rows_ev);
+        const auto& ev = rows_ev;
 
         tags.emplace("db_name", ev.ti->database_name);
         tags.emplace("table_name", ev.ti->table_name);
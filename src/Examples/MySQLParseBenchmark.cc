@@ -0,0 +1,86 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "../Base.hh"
+#include "../Protocols/MySQL/ProtocolBuffer.hh"
+#include "../Protocols/MySQL/Types.hh"
+
+using namespace std;
+using namespace EventAsync;
+using namespace EventAsync::MySQL;
+
+// Measures how long it takes to decode the rows of a text-protocol result set,
+// using a synthetic result with a mix of the common numeric, date/time, and
+// string column types. The rows are generated in memory in the same format the
+// server sends them (without packet headers), so this doesn't need a server.
+
+static const vector<ColumnType> column_types({
+    ColumnType::T_BIGINT,
+    ColumnType::T_INT,
+    ColumnType::T_TINYINT,
+    ColumnType::T_DOUBLE,
+    ColumnType::T_FLOAT,
+    ColumnType::T_DATETIME,
+    ColumnType::T_DATE,
+    ColumnType::T_TIME,
+    ColumnType::T_VARCHAR,
+});
+
+static void generate_rows(ProtocolBuffer& buf, size_t num_rows) {
+  for (size_t x = 0; x < num_rows; x++) {
+    buf.add_var_string(string_printf("%zu", x * 7919));
+    buf.add_var_string(string_printf("%" PRId64, static_cast<int64_t>(x) - 500000));
+    if (x % 10 == 0) {
+      buf.add_u8(0xFB); // NULL
+    } else {
+      buf.add_var_string(string_printf("%zu", x % 100));
+    }
+    buf.add_var_string(string_printf("%.6f", x * 0.001));
+    buf.add_var_string(string_printf("%g", x * 0.5));
+    buf.add_var_string(string_printf("2024-%02zu-%02zu %02zu:%02zu:%02zu.%03zu",
+        (x % 12) + 1, (x % 28) + 1, x % 24, x % 60, (x / 60) % 60, x % 1000));
+    buf.add_var_string(string_printf("2024-%02zu-%02zu", (x % 12) + 1, (x % 28) + 1));
+    buf.add_var_string(string_printf("-%zu:%02zu:%02zu", x % 800, x % 60, (x / 60) % 60));
+    buf.add_var_string(string_printf("row-%zu", x));
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t num_rows = (argc > 1) ? strtoull(argv[1], nullptr, 0) : 1000000;
+
+  Base base;
+  ProtocolBuffer buf(base);
+
+  fprintf(stderr, "generating %zu rows\n", num_rows);
+  generate_rows(buf, num_rows);
+  size_t total_bytes = buf.get_length();
+
+  // Decode the same way Client::query does with rows_as_dicts = false
+  vector<vector<Value>> rows;
+  rows.reserve(num_rows);
+  uint64_t start = now();
+  for (size_t x = 0; x < num_rows; x++) {
+    auto& row = rows.emplace_back();
+    row.reserve(column_types.size());
+    for (auto type : column_types) {
+      row.emplace_back(buf.remove_text_value(type));
+    }
+  }
+  uint64_t duration = now() - start;
+
+  if (buf.get_length() != 0) {
+    throw logic_error("not all row data was parsed");
+  }
+  if (get<uint64_t>(rows.back().at(0)) != (num_rows - 1) * 7919) {
+    throw logic_error("incorrect value parsed");
+  }
+
+  fprintf(stderr, "parsed %zu rows (%zu bytes) in %" PRIu64 " usecs (%g ns/row; %g MB/s)\n",
+      num_rows, total_bytes, duration,
+      static_cast<double>(duration * 1000) / num_rows,
+      static_cast<double>(total_bytes) / duration);
+  return 0;
+}
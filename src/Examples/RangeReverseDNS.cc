@@ -7,38 +7,65 @@
 #include <phosg/Network.hh>
 
 #include "../Base.hh"
-#include "../DNSBase.hh"
+#include "../BulkReverseResolver.hh"
+#include "../Channel.hh"
 #include "../Task.hh"
 
 using namespace std;
 using namespace EventAsync;
 
-Task<void> print_reverse_lookup_result(
-    Base& base, DNSBase& dns_base, uint32_t s_addr, uint64_t delay_usecs) {
-  co_await base.sleep(delay_usecs);
-
-  struct in_addr addr;
-  addr.s_addr = htonl(s_addr);
-  auto result = co_await dns_base.resolve_reverse_ipv4(&addr);
-  fprintf(stdout, "%u.%u.%u.%u => (%d)",
-      (s_addr >> 24) & 0xFF,
-      (s_addr >> 16) & 0xFF,
-      (s_addr >> 8) & 0xFF,
-      s_addr & 0xFF,
-      result.result_code);
-  if (result.result_code == 0) {
-    fprintf(stdout, " ttl=%d [", result.ttl);
-    bool is_first = true;
-    for (const string& name : result.results) {
-      if (!is_first) {
-        fputc(',', stdout);
+Task<void> print_reverse_lookup_results(
+    Channel<BulkReverseResolver::Result>& results, uint64_t count) {
+  for (uint64_t z = 0; z < count; z++) {
+    auto r = co_await results.read();
+    uint32_t s_addr = ntohl(r.addr.s_addr);
+    fprintf(stdout, "%u.%u.%u.%u => (%d)",
+        (s_addr >> 24) & 0xFF,
+        (s_addr >> 16) & 0xFF,
+        (s_addr >> 8) & 0xFF,
+        s_addr & 0xFF,
+        r.result.result_code);
+    if (r.result.result_code == 0) {
+      fprintf(stdout, " ttl=%d [", r.result.ttl);
+      bool is_first = true;
+      for (const string& name : r.result.results) {
+        if (!is_first) {
+          fputc(',', stdout);
+        }
+        is_first = false;
+        fwritex(stdout, name);
       }
-      is_first = false;
-      fwritex(stdout, name);
+      fputs("]\n", stdout);
+    } else {
+      fputc('\n', stdout);
+    }
+  }
+}
+
+Task<void> print_stats(
+    Base& base, const BulkReverseResolver& resolver, const bool* done) {
+  while (!*done) {
+    co_await base.sleep(1000000);
+    auto stats = resolver.get_stats();
+    fprintf(stderr,
+        "%zu queries (%zu resolved, %zu not found, %zu timeouts, %zu SERVFAIL, %zu other errors); %g/sec (%g/sec average)\n",
+        stats.queries,
+        stats.resolved,
+        stats.not_found,
+        stats.timeouts,
+        stats.server_failures,
+        stats.other_failures,
+        stats.queries_per_second,
+        stats.average_queries_per_second);
+    for (const auto& ns : stats.nameservers) {
+      fprintf(stderr, "  %s: %zu/%zu in flight; %zu queries, %zu timeouts, %zu SERVFAIL\n",
+          ns.address.empty() ? "(system nameservers)" : ns.address.c_str(),
+          ns.in_flight,
+          ns.in_flight_limit,
+          ns.queries,
+          ns.timeouts,
+          ns.server_failures);
     }
-    fputs("]\n", stdout);
-  } else {
-    fputc('\n', stdout);
   }
 }
 
@@ -46,20 +73,30 @@ DetachedTask print_reverse_range_lookup_results(
     Base& base,
     uint32_t s_addr_base,
     uint8_t scope_bits,
-    uint64_t delay_usecs,
-    size_t parallelism) {
-  s_addr_base &= ~((1 << (32 - scope_bits)) - 1);
-  DNSBase dns_base(base);
-  vector<Task<void>> tasks;
-  for (size_t x = 0; x < static_cast<size_t>(1 << (32 - scope_bits)); x++) {
-    tasks.emplace_back(print_reverse_lookup_result(base, dns_base, s_addr_base | x, delay_usecs));
-  }
-  co_await all_limit(tasks.begin(), tasks.end(), parallelism);
+    const BulkReverseResolverOptions& options) {
+  uint64_t count = 1ULL << (32 - scope_bits);
+  s_addr_base &= ~(count - 1);
+
+  Channel<BulkReverseResolver::Result> results;
+  BulkReverseResolver resolver(base, results, options);
+
+  bool done = false;
+  auto printer = print_reverse_lookup_results(results, count);
+  printer.start();
+  auto reporter = print_stats(base, resolver, &done);
+  reporter.start();
+
+  struct in_addr first_addr;
+  first_addr.s_addr = htonl(s_addr_base);
+  co_await resolver.resolve_range(first_addr, count);
+  done = true;
+  co_await printer;
+  co_await reporter;
 }
 
 int main(int argc, char** argv) {
-  if (argc < 2 || argc > 4) {
-    throw invalid_argument("Usage: RangeReverseDNS <ip-addr>/<scope-bits> [delay-usecs [parallelism]]\n");
+  if (argc < 2) {
+    throw invalid_argument("Usage: RangeReverseDNS <ip-addr>/<scope-bits> [nameserver-ip ...]\n");
   }
   string arg = argv[1];
   size_t slash_pos = arg.find('/');
@@ -72,12 +109,17 @@ int main(int argc, char** argv) {
   } else {
     s_addr_base = bswap32(inet_addr(arg.c_str()));
   }
+  if (scope_bits > 32) {
+    throw invalid_argument("scope bits must be 32 or fewer");
+  }
 
-  uint64_t delay_usecs = (argc >= 3) ? strtoull(argv[2], nullptr, 0) : 1000000;
-  size_t parallelism = (argc >= 4) ? strtoull(argv[3], nullptr, 0) : 1;
+  BulkReverseResolverOptions options;
+  for (int x = 2; x < argc; x++) {
+    options.nameservers.emplace_back(argv[x]);
+  }
 
   Base base;
-  print_reverse_range_lookup_results(base, s_addr_base, scope_bits, delay_usecs, parallelism);
+  print_reverse_range_lookup_results(base, s_addr_base, scope_bits, options);
   base.run();
   return 0;
 }
@@ -0,0 +1,47 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../DNSBase.hh"
+#include "../Protocols/HTTP/Connection.hh"
+#include "../Protocols/HTTP/WebsocketConnection.hh"
+
+using namespace std;
+
+EventAsync::DetachedTask send_messages(
+    EventAsync::Base& base, string url, vector<string> messages) {
+  EventAsync::DNSBase dns_base(base);
+  shared_ptr<SSL_CTX> ssl_ctx(
+      EventAsync::HTTP::Connection::create_default_ssl_ctx(), SSL_CTX_free);
+  EventAsync::HTTP::WebsocketDeflateOptions deflate_options;
+  deflate_options.enabled = true;
+
+  try {
+    auto ws = co_await EventAsync::HTTP::WebsocketConnection::connect(
+        base, dns_base, url, ssl_ctx.get(), deflate_options);
+    fprintf(stderr, "Connected to %s%s\n", url.c_str(),
+        ws->is_compressed() ? " (with compression)" : "");
+
+    // Send each message and print the server's reply to it
+    for (const auto& message : messages) {
+      co_await ws->write(message.data(), message.size());
+      auto reply = co_await ws->read();
+      fprintf(stderr, "> %s\n< %s\n", message.c_str(), reply.data.c_str());
+    }
+    co_await ws->close();
+
+  } catch (const exception& e) {
+    fprintf(stderr, "%s: failed: %s\n", url.c_str(), e.what());
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    throw invalid_argument("Usage: WebsocketClient url message [message ...]");
+  }
+
+  EventAsync::Base base;
+  send_messages(base, argv[1], vector<string>(argv + 2, argv + argc));
+  base.run();
+  return 0;
+}
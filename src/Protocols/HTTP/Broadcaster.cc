@@ -0,0 +1,111 @@
+#include "Broadcaster.hh"
+
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+WebsocketBroadcaster::WebsocketBroadcaster(
+    Base& base, size_t max_queued_bytes, SlowClientPolicy policy)
+    : base(base),
+      max_queued_bytes(max_queued_bytes),
+      policy(policy) {}
+
+void WebsocketBroadcaster::subscribe(
+    const string& topic, shared_ptr<WebsocketClient> client) {
+  if (!client) {
+    throw invalid_argument("client is missing");
+  }
+  const WebsocketClient* key = client.get();
+  this->topics[topic][key] = std::move(client);
+}
+
+void WebsocketBroadcaster::unsubscribe(
+    const string& topic, const WebsocketClient* client) {
+  auto topic_it = this->topics.find(topic);
+  if (topic_it == this->topics.end()) {
+    return;
+  }
+  topic_it->second.erase(client);
+  if (topic_it->second.empty()) {
+    this->topics.erase(topic_it);
+  }
+}
+
+void WebsocketBroadcaster::unsubscribe_all(const WebsocketClient* client) {
+  for (auto topic_it = this->topics.begin(); topic_it != this->topics.end();) {
+    topic_it->second.erase(client);
+    if (topic_it->second.empty()) {
+      topic_it = this->topics.erase(topic_it);
+    } else {
+      topic_it++;
+    }
+  }
+}
+
+size_t WebsocketBroadcaster::get_num_subscribers(const string& topic) const {
+  auto topic_it = this->topics.find(topic);
+  return (topic_it == this->topics.end()) ? 0 : topic_it->second.size();
+}
+
+size_t WebsocketBroadcaster::publish(
+    const string& topic, const void* data, size_t size, uint8_t opcode) {
+  if (!this->topics.count(topic)) {
+    return 0;
+  }
+  auto frame = make_shared<Buffer>(this->base);
+  add_websocket_frame_header(*frame, opcode, size);
+  frame->add(data, size);
+  return this->publish_frame(topic, frame);
+}
+
+size_t WebsocketBroadcaster::publish(
+    const string& topic, Buffer& buf, uint8_t opcode) {
+  if (!this->topics.count(topic)) {
+    buf.drain_all();
+    return 0;
+  }
+  auto frame = make_shared<Buffer>(this->base);
+  add_websocket_frame_header(*frame, opcode, buf.get_length());
+  frame->add_buffer(buf);
+  return this->publish_frame(topic, frame);
+}
+
+size_t WebsocketBroadcaster::publish_frame(
+    const string& topic, shared_ptr<Buffer> frame) {
+  // The frame is encoded only once; each client's output buffer references
+  // it, and its memory is freed after it has been sent to the last client
+  auto topic_it = this->topics.find(topic);
+  auto& subscribers = topic_it->second;
+
+  size_t num_queued = 0;
+  for (auto it = subscribers.begin(); it != subscribers.end();) {
+    auto client = it->second.lock();
+    if (!client || client->is_closed()) {
+      it = subscribers.erase(it);
+      continue;
+    }
+
+    if (client->get_queued_bytes() <= this->max_queued_bytes) {
+      client->send_frame(*frame);
+      num_queued++;
+    } else if (this->policy == SlowClientPolicy::CONFLATE) {
+      client->conflate_frame(topic, frame);
+      num_queued++;
+    } else if (this->policy == SlowClientPolicy::DISCONNECT) {
+      client->abort();
+      it = subscribers.erase(it);
+      continue;
+    } // Else, the policy is DROP; skip this client
+    it++;
+  }
+
+  if (subscribers.empty()) {
+    this->topics.erase(topic_it);
+  }
+  return num_queued;
+}
+
+} // namespace EventAsync::HTTP
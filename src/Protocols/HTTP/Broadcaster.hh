@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "../../Base.hh"
+#include "../../Buffer.hh"
+#include "Server.hh"
+
+namespace EventAsync::HTTP {
+
+// Sends Websocket messages to many clients at once. Clients subscribe to named
+// topics; when a message is published to a topic, its frame is encoded once
+// and the same buffer is queued (by reference, without copying it) on every
+// subscriber's connection.
+//
+// Each subscriber's queue is limited to max_queued_bytes. When a message is
+// published and a subscriber's queue is already over the limit, the policy
+// decides what happens for that subscriber:
+// - DISCONNECT: the client is aborted and unsubscribed from the topic.
+// - DROP: the message is not sent to that client.
+// - CONFLATE: the message is held back until the client's queue is empty,
+//   replacing any earlier held-back message on the same topic, so the client
+//   only receives the latest message once it catches up.
+//
+// Messages are always sent uncompressed, even to clients that negotiated the
+// permessage-deflate extension, since a compressed frame would depend on each
+// connection's compression state and couldn't be shared.
+//
+// The broadcaster only holds weak references to its subscribers, so a client
+// doesn't need to be unsubscribed before it's destroyed. The broadcaster and
+// all of its subscribers must belong to the same Base; if the server uses
+// multiple threads, use a separate broadcaster for each thread.
+class WebsocketBroadcaster {
+public:
+  using WebsocketClient = Server::WebsocketClient;
+
+  enum class SlowClientPolicy {
+    DISCONNECT = 0,
+    DROP,
+    CONFLATE,
+  };
+
+  explicit WebsocketBroadcaster(
+      Base& base,
+      size_t max_queued_bytes = 1024 * 1024,
+      SlowClientPolicy policy = SlowClientPolicy::DISCONNECT);
+  WebsocketBroadcaster(const WebsocketBroadcaster&) = delete;
+  WebsocketBroadcaster(WebsocketBroadcaster&&) = delete;
+  WebsocketBroadcaster& operator=(const WebsocketBroadcaster&) = delete;
+  WebsocketBroadcaster& operator=(WebsocketBroadcaster&&) = delete;
+  ~WebsocketBroadcaster() = default;
+
+  void subscribe(const std::string& topic, std::shared_ptr<WebsocketClient> client);
+  void unsubscribe(const std::string& topic, const WebsocketClient* client);
+  // Unsubscribes the client from all topics.
+  void unsubscribe_all(const WebsocketClient* client);
+  size_t get_num_subscribers(const std::string& topic) const;
+
+  // Sends a message to all subscribers of a topic. Returns the number of
+  // subscribers the message was queued (or held back) for. These don't wait
+  // for the message to be sent. The second form moves buf's contents into the
+  // frame without copying them, so if buf contains references to other
+  // memory, that memory must remain valid until all clients have been sent
+  // the message.
+  size_t publish(const std::string& topic, const void* data, size_t size,
+      uint8_t opcode = 0x01);
+  size_t publish(const std::string& topic, Buffer& buf, uint8_t opcode = 0x01);
+
+protected:
+  Base& base;
+  size_t max_queued_bytes;
+  SlowClientPolicy policy;
+  std::unordered_map<std::string,
+      std::unordered_map<const WebsocketClient*, std::weak_ptr<WebsocketClient>>>
+      topics;
+
+  size_t publish_frame(const std::string& topic, std::shared_ptr<Buffer> frame);
+};
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,232 @@
+#include "ClientPool.hh"
+
+#include <strings.h>
+
+#include <phosg/Time.hh>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+void ClientPool::IdleConnectionQueue::write_front(IdleConnection&& c) {
+  this->queue.emplace_front(std::move(c));
+  this->resume_awaiter();
+}
+
+bool ClientPool::IdleConnectionQueue::has_readers() const {
+  return !this->awaiting_coros.empty();
+}
+
+size_t ClientPool::IdleConnectionQueue::evict_idle_since(uint64_t time) {
+  size_t count = 0;
+  while (!this->queue.empty() && (this->queue.back().idle_since < time)) {
+    this->queue.pop_back();
+    count++;
+  }
+  return count;
+}
+
+void ClientPool::IdleConnectionQueue::clear() {
+  this->queue.clear();
+}
+
+ClientPool::ClientPool(
+    Base& base,
+    DNSBase& dns_base,
+    size_t max_connections_per_host,
+    uint64_t idle_timeout_usecs,
+    shared_ptr<SSL_CTX> ssl_ctx)
+    : base(base),
+      dns_base(dns_base),
+      max_connections_per_host(max_connections_per_host),
+      idle_timeout_usecs(idle_timeout_usecs),
+      ssl_ctx(ssl_ctx),
+      connection_timeout_secs(-1),
+      num_connections(0),
+      evict_event(base, idle_timeout_usecs / 2, &ClientPool::on_evict_event, this),
+      evict_event_scheduled(false) {
+  if (this->max_connections_per_host == 0) {
+    throw invalid_argument("max_connections_per_host must be at least 1");
+  }
+}
+
+void ClientPool::set_connection_timeout(int timeout_secs) {
+  this->connection_timeout_secs = timeout_secs;
+}
+
+size_t ClientPool::get_num_connections() const {
+  return this->num_connections;
+}
+
+Task<void> ClientPool::request(
+    Request& req, enum evhttp_cmd_type method, const string& url) {
+  unique_ptr<struct evhttp_uri, void (*)(struct evhttp_uri*)> uri(
+      evhttp_uri_parse(url.c_str()), evhttp_uri_free);
+  if (!uri) {
+    throw invalid_argument("invalid URL: " + url);
+  }
+
+  const char* scheme = evhttp_uri_get_scheme(uri.get());
+  bool use_ssl;
+  if (scheme && !strcasecmp(scheme, "http")) {
+    use_ssl = false;
+  } else if (scheme && !strcasecmp(scheme, "https")) {
+    use_ssl = true;
+  } else {
+    throw invalid_argument("URL scheme must be http or https: " + url);
+  }
+
+  const char* host = evhttp_uri_get_host(uri.get());
+  if (!host || !*host) {
+    throw invalid_argument("URL has no host: " + url);
+  }
+  int port = evhttp_uri_get_port(uri.get());
+  if (port < 0) {
+    port = use_ssl ? 443 : 80;
+  }
+
+  const char* path = evhttp_uri_get_path(uri.get());
+  const char* query = evhttp_uri_get_query(uri.get());
+  string path_and_query = (path && *path) ? path : "/";
+  if (query) {
+    path_and_query += '?';
+    path_and_query += query;
+  }
+
+  co_await this->request(req, method, use_ssl, host, port, path_and_query);
+}
+
+Task<void> ClientPool::request(
+    Request& req,
+    enum evhttp_cmd_type method,
+    bool use_ssl,
+    const string& host,
+    uint16_t port,
+    const string& path_and_query) {
+  HostPool& hp = this->get_host_pool(use_ssl, host, port);
+
+  // Prefer an idle connection; if there are none, open a new one unless the
+  // host is at its limit, in which case wait for another request to finish.
+  // The host pool can't be deleted while we wait, since it has connections.
+  unique_ptr<Connection> conn;
+  if (!hp.idle_connections.empty() ||
+      (hp.num_connections >= this->max_connections_per_host)) {
+    conn = std::move((co_await hp.idle_connections.read()).conn);
+  } else {
+    conn = this->create_connection(hp);
+  }
+
+  if (!evhttp_find_header(req.get_output_headers(), "Host")) {
+    if (port == (use_ssl ? 443 : 80)) {
+      req.add_output_header("Host", host.c_str());
+    } else {
+      string host_header = host + ":" + to_string(port);
+      req.add_output_header("Host", host_header.c_str());
+    }
+  }
+
+  // evhttp reconnects automatically if the server closed the connection
+  // after the last request, or if this request fails, so the connection can
+  // always go back into the pool
+  try {
+    co_await conn->send_request(req, method, path_and_query.c_str());
+  } catch (...) {
+    this->release_connection(hp, std::move(conn));
+    throw;
+  }
+  this->release_connection(hp, std::move(conn));
+}
+
+ClientPool::HostPool& ClientPool::get_host_pool(
+    bool use_ssl, const string& host, uint16_t port) {
+  string key = (use_ssl ? "https://" : "http://") + host + ":" + to_string(port);
+  auto emplace_ret = this->host_pools.try_emplace(key);
+  if (emplace_ret.second) {
+    auto hp = make_unique<HostPool>();
+    hp->use_ssl = use_ssl;
+    hp->host = host;
+    hp->port = port;
+    hp->num_connections = 0;
+    emplace_ret.first->second = std::move(hp);
+  }
+  return *emplace_ret.first->second;
+}
+
+unique_ptr<Connection> ClientPool::create_connection(HostPool& hp) {
+  if (hp.use_ssl && !this->ssl_ctx) {
+    this->ssl_ctx.reset(Connection::create_default_ssl_ctx(), SSL_CTX_free);
+  }
+  auto conn = make_unique<Connection>(
+      this->base,
+      this->dns_base,
+      hp.host,
+      hp.port,
+      hp.use_ssl ? this->ssl_ctx.get() : nullptr);
+  if (this->connection_timeout_secs >= 0) {
+    conn->set_timeout(this->connection_timeout_secs);
+  }
+  hp.num_connections++;
+  this->num_connections++;
+  return conn;
+}
+
+void ClientPool::release_connection(
+    HostPool& hp, unique_ptr<Connection>&& conn) {
+  // If a request is waiting for a connection, this resumes it immediately
+  bool has_readers = hp.idle_connections.has_readers();
+  hp.idle_connections.write_front(IdleConnection{std::move(conn), now()});
+  if (!has_readers) {
+    this->schedule_eviction();
+  }
+}
+
+void ClientPool::schedule_eviction() {
+  if (!this->evict_event_scheduled) {
+    this->evict_event_scheduled = true;
+    this->evict_event.add();
+  }
+}
+
+void ClientPool::close_idle_connections() {
+  for (auto it = this->host_pools.begin(); it != this->host_pools.end();) {
+    HostPool& hp = *it->second;
+    size_t num_idle = hp.idle_connections.size();
+    hp.idle_connections.clear();
+    hp.num_connections -= num_idle;
+    this->num_connections -= num_idle;
+    if (hp.num_connections == 0) {
+      it = this->host_pools.erase(it);
+    } else {
+      it++;
+    }
+  }
+  this->evict_event.del();
+  this->evict_event_scheduled = false;
+}
+
+void ClientPool::on_evict_event(evutil_socket_t, short, void* ctx) {
+  auto* p = reinterpret_cast<ClientPool*>(ctx);
+  p->evict_event_scheduled = false;
+
+  uint64_t t = now();
+  uint64_t cutoff = (t > p->idle_timeout_usecs) ? (t - p->idle_timeout_usecs) : 0;
+  bool any_idle = false;
+  for (auto it = p->host_pools.begin(); it != p->host_pools.end();) {
+    HostPool& hp = *it->second;
+    size_t num_evicted = hp.idle_connections.evict_idle_since(cutoff);
+    hp.num_connections -= num_evicted;
+    p->num_connections -= num_evicted;
+    if (hp.num_connections == 0) {
+      it = p->host_pools.erase(it);
+    } else {
+      any_idle |= !hp.idle_connections.empty();
+      it++;
+    }
+  }
+
+  if (any_idle) {
+    p->schedule_eviction();
+  }
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <event2/http.h>
+#include <openssl/ssl.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "../../Base.hh"
+#include "../../Channel.hh"
+#include "../../DNSBase.hh"
+#include "../../Event.hh"
+#include "../../Task.hh"
+#include "Connection.hh"
+#include "Request.hh"
+
+namespace EventAsync::HTTP {
+
+// Sends requests over pooled keep-alive connections. Connections are kept per
+// (scheme, host, port), so requests to the same server reuse connections that
+// are already open instead of paying for a new DNS lookup, TCP connect, and TLS
+// handshake each time. At most max_connections_per_host connections are open
+// to each server at once; requests beyond that wait for a connection to
+// become free. Connections that stay idle for longer than idle_timeout_usecs
+// are closed.
+//
+// The pool must outlive all requests sent through it. Idle connections keep a
+// timer pending on the Base, so if the program needs Base::run to return when
+// there's no more work, call close_idle_connections first.
+class ClientPool {
+public:
+  // If ssl_ctx is null, a default context (see
+  // Connection::create_default_ssl_ctx) is created for the first https
+  // request.
+  ClientPool(
+      Base& base,
+      DNSBase& dns_base,
+      size_t max_connections_per_host = 8,
+      uint64_t idle_timeout_usecs = 30000000,
+      std::shared_ptr<SSL_CTX> ssl_ctx = nullptr);
+  ClientPool(const ClientPool&) = delete;
+  ClientPool(ClientPool&&) = delete;
+  ClientPool& operator=(const ClientPool&) = delete;
+  ClientPool& operator=(ClientPool&&) = delete;
+  ~ClientPool() = default;
+
+  // Sends a request and waits for the response, which is then available in
+  // req as for Connection::send_request. url must be an absolute http or https
+  // URL; throws invalid_argument if it isn't, or runtime_error if the request
+  // fails. A Host header is added to the request if it doesn't already have
+  // one.
+  Task<void> request(
+      Request& req, enum evhttp_cmd_type method, const std::string& url);
+  Task<void> request(
+      Request& req,
+      enum evhttp_cmd_type method,
+      bool use_ssl,
+      const std::string& host,
+      uint16_t port,
+      const std::string& path_and_query);
+
+  // Sets the timeout for connections created after this call. See
+  // Connection::set_timeout.
+  void set_connection_timeout(int timeout_secs);
+
+  // Returns the number of open connections (both idle and in use) to all
+  // hosts.
+  size_t get_num_connections() const;
+  // Closes all idle connections. Connections that are in use are unaffected.
+  void close_idle_connections();
+
+private:
+  struct IdleConnection {
+    std::unique_ptr<Connection> conn;
+    uint64_t idle_since;
+  };
+
+  // The most recently used connection is at the front of the queue, so busy
+  // hosts reuse the same few connections and the rest time out.
+  class IdleConnectionQueue : public Channel<IdleConnection> {
+  public:
+    void write_front(IdleConnection&& c);
+    bool has_readers() const;
+    // Destroys connections that have been idle since before the given time,
+    // and returns how many were destroyed.
+    size_t evict_idle_since(uint64_t time);
+    void clear();
+  };
+
+  struct HostPool {
+    bool use_ssl;
+    std::string host;
+    uint16_t port;
+    // Idle connections wait here; requests that need a connection when none
+    // are idle and the host is at its limit wait to read from this channel
+    IdleConnectionQueue idle_connections;
+    size_t num_connections;
+  };
+
+  Base& base;
+  DNSBase& dns_base;
+  size_t max_connections_per_host;
+  uint64_t idle_timeout_usecs;
+  std::shared_ptr<SSL_CTX> ssl_ctx;
+  int connection_timeout_secs;
+  std::unordered_map<std::string, std::unique_ptr<HostPool>> host_pools;
+  size_t num_connections;
+
+  TimeoutEvent evict_event;
+  bool evict_event_scheduled;
+
+  HostPool& get_host_pool(
+      bool use_ssl, const std::string& host, uint16_t port);
+  std::unique_ptr<Connection> create_connection(HostPool& hp);
+  void release_connection(HostPool& hp, std::unique_ptr<Connection>&& conn);
+  void schedule_eviction();
+  static void on_evict_event(evutil_socket_t fd, short what, void* ctx);
+};
+
+} // namespace EventAsync::HTTP
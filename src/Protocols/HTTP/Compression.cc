@@ -0,0 +1,368 @@
+#include "Compression.hh"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include <phosg/Strings.hh>
+#include <string_view>
+
+#ifdef EVENT_ASYNC_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+// Output space is reserved in dest in chunks of this size
+static const size_t OUTPUT_CHUNK_SIZE = 0x4000;
+
+static const int DEFAULT_ZLIB_LEVEL = 6;
+static const int DEFAULT_BROTLI_QUALITY = 5;
+
+const char* name_for_content_encoding(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::IDENTITY:
+      return "identity";
+    case ContentEncoding::DEFLATE:
+      return "deflate";
+    case ContentEncoding::GZIP:
+      return "gzip";
+    case ContentEncoding::BROTLI:
+      return "br";
+    default:
+      return "<INVALID_CONTENT_ENCODING>";
+  }
+}
+
+bool content_encoding_available(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::IDENTITY:
+    case ContentEncoding::DEFLATE:
+    case ContentEncoding::GZIP:
+      return true;
+    case ContentEncoding::BROTLI:
+#ifdef EVENT_ASYNC_HAVE_BROTLI
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+uint32_t parse_accept_encoding(const char* header) {
+  uint32_t accepted = (1 << static_cast<size_t>(ContentEncoding::IDENTITY));
+  if (!header) {
+    return accepted;
+  }
+
+  // Codings that the client explicitly lists (with any q-value) aren't affected
+  // by a * entry
+  uint32_t listed = 0;
+  bool star_accepted = false;
+
+  string_view remaining(header);
+  while (!remaining.empty()) {
+    size_t comma_pos = remaining.find(',');
+    string_view item = remaining.substr(0, comma_pos);
+    remaining = (comma_pos == string_view::npos)
+        ? string_view() : remaining.substr(comma_pos + 1);
+
+    size_t semicolon_pos = item.find(';');
+    string_view coding = item.substr(0, semicolon_pos);
+    while (!coding.empty() && isspace(coding.front())) {
+      coding.remove_prefix(1);
+    }
+    while (!coding.empty() && isspace(coding.back())) {
+      coding.remove_suffix(1);
+    }
+
+    // The only parameter allowed here is q. A q-value of zero means the coding
+    // is not acceptable; we don't otherwise care about the relative values.
+    bool acceptable = true;
+    if (semicolon_pos != string_view::npos) {
+      string_view params = item.substr(semicolon_pos + 1);
+      size_t q_pos = params.find("q=");
+      if (q_pos != string_view::npos) {
+        string_view q = params.substr(q_pos + 2);
+        size_t end = 0;
+        while ((end < q.size()) && (isdigit(q[end]) || (q[end] == '.'))) {
+          end++;
+        }
+        acceptable = (strtod(string(q.substr(0, end)).c_str(), nullptr) > 0.0);
+      }
+    }
+
+    auto matches = [&](const char* name) -> bool {
+      return (coding.size() == strlen(name)) &&
+          !strncasecmp(coding.data(), name, coding.size());
+    };
+
+    if (matches("*")) {
+      star_accepted = acceptable;
+      continue;
+    }
+    ContentEncoding encoding;
+    if (matches("gzip") || matches("x-gzip")) {
+      encoding = ContentEncoding::GZIP;
+    } else if (matches("deflate")) {
+      encoding = ContentEncoding::DEFLATE;
+    } else if (matches("br")) {
+      encoding = ContentEncoding::BROTLI;
+    } else {
+      continue;
+    }
+    uint32_t bit = (1 << static_cast<size_t>(encoding));
+    listed |= bit;
+    if (acceptable && content_encoding_available(encoding)) {
+      accepted |= bit;
+    } else {
+      accepted &= ~bit;
+    }
+  }
+
+  if (star_accepted) {
+    for (size_t x = 0; x < NUM_CONTENT_ENCODINGS; x++) {
+      if (!(listed & (1 << x)) && content_encoding_available(static_cast<ContentEncoding>(x))) {
+        accepted |= (1 << x);
+      }
+    }
+  }
+  return accepted;
+}
+
+ContentEncoding preferred_content_encoding(uint32_t accepted_encodings) {
+  static const ContentEncoding preference_order[3] = {
+      ContentEncoding::BROTLI, ContentEncoding::GZIP, ContentEncoding::DEFLATE};
+  for (ContentEncoding encoding : preference_order) {
+    if (accepted_encodings & (1 << static_cast<size_t>(encoding))) {
+      return encoding;
+    }
+  }
+  return ContentEncoding::IDENTITY;
+}
+
+bool is_compressible_content_type(const char* content_type) {
+  if (!content_type) {
+    return false;
+  }
+  static const char* compressible_prefixes[] = {
+      "text/",
+      "application/json",
+      "application/javascript",
+      "application/xml",
+      "application/xhtml+xml",
+      "application/wasm",
+      "image/svg+xml",
+      "image/vnd.microsoft.icon",
+  };
+  for (const char* prefix : compressible_prefixes) {
+    if (!strncasecmp(content_type, prefix, strlen(prefix))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Compressor::Compressor()
+    : encoding(ContentEncoding::IDENTITY),
+      deflater_initialized(false),
+      deflater_encoding(ContentEncoding::IDENTITY),
+      deflater_level(0),
+      brotli(nullptr) {
+  memset(&this->deflater, 0, sizeof(this->deflater));
+}
+
+Compressor::~Compressor() {
+  if (this->deflater_initialized) {
+    deflateEnd(&this->deflater);
+  }
+#ifdef EVENT_ASYNC_HAVE_BROTLI
+  if (this->brotli) {
+    BrotliEncoderDestroyInstance(this->brotli);
+  }
+#endif
+}
+
+Compressor& Compressor::for_current_thread() {
+  static thread_local Compressor c;
+  return c;
+}
+
+void Compressor::begin(ContentEncoding encoding, int level) {
+  this->encoding = encoding;
+
+  switch (encoding) {
+    case ContentEncoding::DEFLATE:
+    case ContentEncoding::GZIP: {
+      if (level < 0) {
+        level = DEFAULT_ZLIB_LEVEL;
+      }
+      if (this->deflater_initialized &&
+          (this->deflater_encoding == encoding) &&
+          (this->deflater_level == level)) {
+        if (deflateReset(&this->deflater) != Z_OK) {
+          throw runtime_error("deflateReset failed");
+        }
+        break;
+      }
+      if (this->deflater_initialized) {
+        deflateEnd(&this->deflater);
+        this->deflater_initialized = false;
+      }
+      // Adding 16 to the window bits makes zlib write a gzip header and
+      // trailer instead of a zlib header and trailer. (HTTP's "deflate" coding
+      // is actually the zlib format, not raw deflate.)
+      int window_bits = (encoding == ContentEncoding::GZIP) ? (15 + 16) : 15;
+      if (deflateInit2(&this->deflater, level, Z_DEFLATED, window_bits, 8,
+              Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw runtime_error("deflateInit2 failed");
+      }
+      this->deflater_initialized = true;
+      this->deflater_encoding = encoding;
+      this->deflater_level = level;
+      break;
+    }
+
+    case ContentEncoding::BROTLI:
+#ifdef EVENT_ASYNC_HAVE_BROTLI
+      // There's no way to reset a brotli encoder, so we have to make a new one
+      if (this->brotli) {
+        BrotliEncoderDestroyInstance(this->brotli);
+      }
+      this->brotli = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+      if (!this->brotli) {
+        throw bad_alloc();
+      }
+      BrotliEncoderSetParameter(this->brotli, BROTLI_PARAM_QUALITY,
+          (level < 0) ? DEFAULT_BROTLI_QUALITY : level);
+      break;
+#else
+      throw logic_error("brotli compression is not available in this build");
+#endif
+
+    default:
+      throw logic_error("invalid content encoding for compression");
+  }
+}
+
+void Compressor::compress(Buffer& dest, Buffer& src, size_t size, bool finish) {
+  if (size > src.get_length()) {
+    throw logic_error("not enough data in source buffer");
+  }
+
+  if (size > 0) {
+    int num_vecs = src.peek(size, nullptr, nullptr, 0);
+    if (num_vecs < 0) {
+      throw runtime_error("evbuffer_peek");
+    }
+    this->iovecs.resize(num_vecs);
+    src.peek(size, nullptr, this->iovecs.data(), num_vecs);
+  } else {
+    this->iovecs.clear();
+  }
+
+  if ((this->encoding == ContentEncoding::DEFLATE) ||
+      (this->encoding == ContentEncoding::GZIP)) {
+    this->compress_zlib(dest, src, size, finish);
+  } else if (this->encoding == ContentEncoding::BROTLI) {
+    this->compress_brotli(dest, src, size, finish);
+  } else {
+    throw logic_error("compressor has not been started");
+  }
+  src.drain(size);
+}
+
+void Compressor::compress_zlib(
+    Buffer& dest, Buffer&, size_t size, bool finish) {
+  // Calls deflate until it doesn't produce any more output for the current
+  // input, reserving more output space in dest as needed
+  auto run = [&](int flush) -> int {
+    int ret;
+    do {
+      struct evbuffer_iovec out;
+      if (dest.reserve_space(OUTPUT_CHUNK_SIZE, &out, 1) != 1) {
+        throw runtime_error("cannot reserve space for compressed data");
+      }
+      this->deflater.next_out = reinterpret_cast<Bytef*>(out.iov_base);
+      this->deflater.avail_out = out.iov_len;
+      ret = deflate(&this->deflater, flush);
+      if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR)) {
+        throw runtime_error(string_printf("deflate failed (%d)", ret));
+      }
+      out.iov_len -= this->deflater.avail_out;
+      dest.commit_space(&out, 1);
+    } while ((this->deflater.avail_out == 0) ||
+        ((flush == Z_FINISH) && (ret != Z_STREAM_END)));
+    return ret;
+  };
+
+  size_t remaining = size;
+  for (size_t x = 0; (x < this->iovecs.size()) && (remaining > 0); x++) {
+    size_t chunk_size = min<size_t>(this->iovecs[x].iov_len, remaining);
+    this->deflater.next_in = reinterpret_cast<Bytef*>(this->iovecs[x].iov_base);
+    this->deflater.avail_in = chunk_size;
+    while (this->deflater.avail_in > 0) {
+      run(Z_NO_FLUSH);
+    }
+    remaining -= chunk_size;
+  }
+
+  // If the stream isn't finished, flush what we have so far so the client can
+  // start decompressing it; otherwise, write the trailer
+  this->deflater.next_in = nullptr;
+  this->deflater.avail_in = 0;
+  run(finish ? Z_FINISH : Z_SYNC_FLUSH);
+}
+
+void Compressor::compress_brotli(
+    Buffer& dest, Buffer&, size_t size, bool finish) {
+#ifdef EVENT_ASYNC_HAVE_BROTLI
+  auto run = [&](BrotliEncoderOperation op, const uint8_t** next_in, size_t* avail_in) {
+    do {
+      struct evbuffer_iovec out;
+      if (dest.reserve_space(OUTPUT_CHUNK_SIZE, &out, 1) != 1) {
+        throw runtime_error("cannot reserve space for compressed data");
+      }
+      size_t avail_out = out.iov_len;
+      uint8_t* next_out = reinterpret_cast<uint8_t*>(out.iov_base);
+      if (!BrotliEncoderCompressStream(
+              this->brotli, op, avail_in, next_in, &avail_out, &next_out, nullptr)) {
+        throw runtime_error("BrotliEncoderCompressStream failed");
+      }
+      out.iov_len -= avail_out;
+      dest.commit_space(&out, 1);
+    } while ((*avail_in > 0) || BrotliEncoderHasMoreOutput(this->brotli) ||
+        ((op == BROTLI_OPERATION_FINISH) && !BrotliEncoderIsFinished(this->brotli)));
+  };
+
+  size_t remaining = size;
+  for (size_t x = 0; (x < this->iovecs.size()) && (remaining > 0); x++) {
+    size_t chunk_size = min<size_t>(this->iovecs[x].iov_len, remaining);
+    const uint8_t* next_in = reinterpret_cast<const uint8_t*>(this->iovecs[x].iov_base);
+    size_t avail_in = chunk_size;
+    run(BROTLI_OPERATION_PROCESS, &next_in, &avail_in);
+    remaining -= chunk_size;
+  }
+
+  const uint8_t* next_in = nullptr;
+  size_t avail_in = 0;
+  run(finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH, &next_in, &avail_in);
+#else
+  (void)dest;
+  (void)size;
+  (void)finish;
+  throw logic_error("brotli compression is not available in this build");
+#endif
+}
+
+void Compressor::compress_all(
+    Buffer& dest, Buffer& src, ContentEncoding encoding, int level) {
+  this->begin(encoding, level);
+  this->compress(dest, src, src.get_length(), true);
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "../../Buffer.hh"
+
+struct BrotliEncoderStateStruct;
+
+namespace EventAsync::HTTP {
+
+enum class ContentEncoding {
+  IDENTITY = 0,
+  DEFLATE,
+  GZIP,
+  BROTLI,
+};
+
+static constexpr size_t NUM_CONTENT_ENCODINGS = 4;
+
+// Returns the name used for this encoding in the Accept-Encoding and
+// Content-Encoding headers (e.g. "gzip" or "br").
+const char* name_for_content_encoding(ContentEncoding encoding);
+
+// Returns true if this library was built with support for the given encoding.
+// IDENTITY, DEFLATE, and GZIP are always supported; BROTLI is supported only if
+// libbrotlienc was found at build time.
+bool content_encoding_available(ContentEncoding encoding);
+
+// Parses an Accept-Encoding header and returns a bitmask of the supported
+// encodings that the client accepts (bit N is set if ContentEncoding N is
+// acceptable). IDENTITY is always included. header may be null.
+uint32_t parse_accept_encoding(const char* header);
+
+// Returns the preferred encoding from a bitmask returned by
+// parse_accept_encoding. Brotli is preferred over gzip, and gzip over deflate.
+ContentEncoding preferred_content_encoding(uint32_t accepted_encodings);
+
+// Returns true if responses with this content type are generally worth
+// compressing (text, JSON, JavaScript, XML, SVG, etc.). Already-compressed
+// formats like images and video are not.
+bool is_compressible_content_type(const char* content_type);
+
+// Compresses HTTP response bodies. A compressor can be used for many streams,
+// one after another; the underlying zlib state is reset rather than recreated
+// between streams when possible. Data is compressed directly from and into
+// evbuffer chains, without being pulled up into contiguous memory.
+class Compressor {
+public:
+  Compressor();
+  Compressor(const Compressor&) = delete;
+  Compressor(Compressor&&) = delete;
+  Compressor& operator=(const Compressor&) = delete;
+  Compressor& operator=(Compressor&&) = delete;
+  ~Compressor();
+
+  // Starts a new stream. level is the zlib compression level for DEFLATE and
+  // GZIP, or the quality for BROTLI; -1 means to use a default that's
+  // appropriate for compressing responses on the fly.
+  void begin(ContentEncoding encoding, int level = -1);
+
+  // Compresses the first size bytes of src into dest, and drains them from src.
+  // If finish is true, also ends the stream; begin must be called again before
+  // compressing more data.
+  void compress(Buffer& dest, Buffer& src, size_t size, bool finish);
+
+  // Compresses all of src into dest as a single stream.
+  void compress_all(
+      Buffer& dest, Buffer& src, ContentEncoding encoding, int level = -1);
+
+  // Returns a compressor owned by the calling thread. This avoids recreating
+  // the compression state for each response; it must not be used for streams
+  // that span multiple event loop iterations, since another response on the
+  // same thread could use it in the meantime.
+  static Compressor& for_current_thread();
+
+private:
+  ContentEncoding encoding;
+
+  z_stream deflater;
+  bool deflater_initialized;
+  ContentEncoding deflater_encoding;
+  int deflater_level;
+
+  BrotliEncoderStateStruct* brotli;
+
+  std::vector<struct evbuffer_iovec> iovecs;
+
+  void compress_zlib(Buffer& dest, Buffer& src, size_t size, bool finish);
+  void compress_brotli(Buffer& dest, Buffer& src, size_t size, bool finish);
+};
+
+} // namespace EventAsync::HTTP
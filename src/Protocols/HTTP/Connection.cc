@@ -6,6 +6,8 @@
 #include <phosg/Strings.hh>
 #include <phosg/Time.hh>
 
+#include "TLSSessions.hh"
+
 using namespace std;
 
 namespace EventAsync::HTTP {
@@ -19,23 +21,7 @@ Connection::Connection(
     : base(base) {
 
   if (ssl_ctx) {
-    SSL* ssl = SSL_new(ssl_ctx);
-    if (!ssl) {
-      throw runtime_error("failed to create connection-specific ssl context");
-    }
-
-    X509_VERIFY_PARAM* param = SSL_get0_param(ssl);
-    X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
-    if (!X509_VERIFY_PARAM_set1_host(param, host.data(), host.size())) {
-      SSL_free(ssl);
-      throw runtime_error("failed to set expected hostname");
-    }
-
-    SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
-
-#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
-    SSL_set_tlsext_host_name(ssl, host.c_str());
-#endif
+    SSL* ssl = Connection::create_ssl(ssl_ctx, host, port);
 
     // bev takes ownership of ssl
     struct bufferevent* bev = bufferevent_openssl_socket_new(
@@ -93,9 +79,44 @@ SSL_CTX* Connection::create_default_ssl_ctx() {
   }
 
   SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, nullptr);
+  TLSClientSessionCache::attach(ssl_ctx);
   return ssl_ctx;
 }
 
+SSL* Connection::create_ssl(
+    SSL_CTX* ssl_ctx, const string& host, uint16_t port) {
+  SSL* ssl = SSL_new(ssl_ctx);
+  if (!ssl) {
+    throw runtime_error("failed to create connection-specific ssl context");
+  }
+
+  X509_VERIFY_PARAM* param = SSL_get0_param(ssl);
+  X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+  if (!X509_VERIFY_PARAM_set1_host(param, host.data(), host.size())) {
+    SSL_free(ssl);
+    throw runtime_error("failed to set expected hostname");
+  }
+
+  SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+  SSL_set_tlsext_host_name(ssl, host.c_str());
+#endif
+
+  // If the context has a session cache and we connected to this server
+  // recently, try to resume that session instead of doing a full handshake
+  auto* session_cache = TLSClientSessionCache::get(ssl_ctx);
+  if (session_cache) {
+    try {
+      session_cache->prepare(ssl, host, port);
+    } catch (...) {
+      SSL_free(ssl);
+      throw;
+    }
+  }
+  return ssl;
+}
+
 pair<string, uint16_t> Connection::get_peer() const {
   char* address = nullptr;
   uint16_t port;
@@ -144,12 +165,19 @@ void Connection::Awaiter::await_suspend(coroutine_handle<> coro) {
 }
 
 void Connection::Awaiter::await_resume() {
+  if (this->req.error) {
+    throw runtime_error(string("http request failed: ") + this->req.error);
+  }
 }
 
 void Connection::Awaiter::on_response() {
   this->coro.resume();
 }
 
+void Connection::Awaiter::dispatch_on_response(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<Awaiter*>(ctx)->on_response();
+}
+
 Connection::Awaiter Connection::send_request(
     Request& req,
     evhttp_cmd_type method,
@@ -157,6 +185,9 @@ Connection::Awaiter Connection::send_request(
   if (req.is_complete) {
     throw logic_error("attempted to re-send completed request");
   }
+  // The connection owns the request until the response arrives (even if this
+  // fails), at which point Request::on_response takes it back
+  req.owned = false;
   if (evhttp_make_request(conn, req.req, method, path_and_query)) {
     throw runtime_error("failed to send http request");
   }
@@ -30,6 +30,11 @@ struct Connection {
 
   static SSL_CTX* create_default_ssl_ctx();
 
+  // Creates an SSL object for an outbound connection to the given host, which
+  // verifies the server's certificate against the hostname, sends SNI, and
+  // resumes a cached session if the context has a TLSClientSessionCache.
+  static SSL* create_ssl(SSL_CTX* ssl_ctx, const std::string& host, uint16_t port);
+
   std::pair<std::string, uint16_t> get_peer() const;
   void set_local_address(const char* addr);
   void set_local_port(uint16_t port);
@@ -45,12 +50,16 @@ struct Connection {
     void await_suspend(std::coroutine_handle<> coro);
     void await_resume();
     void on_response();
+    static void dispatch_on_response(evutil_socket_t fd, short what, void* ctx);
 
   private:
     Request& req;
     std::coroutine_handle<> coro;
   };
 
+  // Sends a request. Awaiting the result waits for the response, which is
+  // then available in req; if the request fails (for example, because the
+  // connection can't be opened or times out), it throws runtime_error.
   Awaiter send_request(
       Request& req,
       evhttp_cmd_type method,
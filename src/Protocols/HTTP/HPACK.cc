@@ -0,0 +1,545 @@
+#include "HPACK.hh"
+
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+// RFC 7541 Appendix A. Index 1 is the first entry.
+static const pair<const char*, const char*> STATIC_TABLE[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+static const size_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// RFC 7541 Appendix B: the code and its length in bits for each byte value,
+// followed by EOS (256). The code is canonical (codes of the same length are
+// consecutive and ordered by symbol), so the decoder only needs the first code
+// of each length.
+static const struct {
+  uint32_t code;
+  uint8_t bits;
+} HUFFMAN_CODES[257] = {
+    {0x00001FF8, 13}, {0x007FFFD8, 23}, {0x0FFFFFE2, 28}, {0x0FFFFFE3, 28},
+    {0x0FFFFFE4, 28}, {0x0FFFFFE5, 28}, {0x0FFFFFE6, 28}, {0x0FFFFFE7, 28},
+    {0x0FFFFFE8, 28}, {0x00FFFFEA, 24}, {0x3FFFFFFC, 30}, {0x0FFFFFE9, 28},
+    {0x0FFFFFEA, 28}, {0x3FFFFFFD, 30}, {0x0FFFFFEB, 28}, {0x0FFFFFEC, 28},
+    {0x0FFFFFED, 28}, {0x0FFFFFEE, 28}, {0x0FFFFFEF, 28}, {0x0FFFFFF0, 28},
+    {0x0FFFFFF1, 28}, {0x0FFFFFF2, 28}, {0x3FFFFFFE, 30}, {0x0FFFFFF3, 28},
+    {0x0FFFFFF4, 28}, {0x0FFFFFF5, 28}, {0x0FFFFFF6, 28}, {0x0FFFFFF7, 28},
+    {0x0FFFFFF8, 28}, {0x0FFFFFF9, 28}, {0x0FFFFFFA, 28}, {0x0FFFFFFB, 28},
+    {0x00000014,  6}, {0x000003F8, 10}, {0x000003F9, 10}, {0x00000FFA, 12},
+    {0x00001FF9, 13}, {0x00000015,  6}, {0x000000F8,  8}, {0x000007FA, 11},
+    {0x000003FA, 10}, {0x000003FB, 10}, {0x000000F9,  8}, {0x000007FB, 11},
+    {0x000000FA,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001A,  6}, {0x0000001B,  6}, {0x0000001C,  6}, {0x0000001D,  6},
+    {0x0000001E,  6}, {0x0000001F,  6}, {0x0000005C,  7}, {0x000000FB,  8},
+    {0x00007FFC, 15}, {0x00000020,  6}, {0x00000FFB, 12}, {0x000003FC, 10},
+    {0x00001FFA, 13}, {0x00000021,  6}, {0x0000005D,  7}, {0x0000005E,  7},
+    {0x0000005F,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006A,  7},
+    {0x0000006B,  7}, {0x0000006C,  7}, {0x0000006D,  7}, {0x0000006E,  7},
+    {0x0000006F,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000FC,  8}, {0x00000073,  7}, {0x000000FD,  8}, {0x00001FFB, 13},
+    {0x0007FFF0, 19}, {0x00001FFC, 13}, {0x00003FFC, 14}, {0x00000022,  6},
+    {0x00007FFD, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002A,  6}, {0x00000007,  5},
+    {0x0000002B,  6}, {0x00000076,  7}, {0x0000002C,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002D,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007A,  7}, {0x0000007B,  7}, {0x00007FFE, 15},
+    {0x000007FC, 11}, {0x00003FFD, 14}, {0x00001FFD, 13}, {0x0FFFFFFC, 28},
+    {0x000FFFE6, 20}, {0x003FFFD2, 22}, {0x000FFFE7, 20}, {0x000FFFE8, 20},
+    {0x003FFFD3, 22}, {0x003FFFD4, 22}, {0x003FFFD5, 22}, {0x007FFFD9, 23},
+    {0x003FFFD6, 22}, {0x007FFFDA, 23}, {0x007FFFDB, 23}, {0x007FFFDC, 23},
+    {0x007FFFDD, 23}, {0x007FFFDE, 23}, {0x00FFFFEB, 24}, {0x007FFFDF, 23},
+    {0x00FFFFEC, 24}, {0x00FFFFED, 24}, {0x003FFFD7, 22}, {0x007FFFE0, 23},
+    {0x00FFFFEE, 24}, {0x007FFFE1, 23}, {0x007FFFE2, 23}, {0x007FFFE3, 23},
+    {0x007FFFE4, 23}, {0x001FFFDC, 21}, {0x003FFFD8, 22}, {0x007FFFE5, 23},
+    {0x003FFFD9, 22}, {0x007FFFE6, 23}, {0x007FFFE7, 23}, {0x00FFFFEF, 24},
+    {0x003FFFDA, 22}, {0x001FFFDD, 21}, {0x000FFFE9, 20}, {0x003FFFDB, 22},
+    {0x003FFFDC, 22}, {0x007FFFE8, 23}, {0x007FFFE9, 23}, {0x001FFFDE, 21},
+    {0x007FFFEA, 23}, {0x003FFFDD, 22}, {0x003FFFDE, 22}, {0x00FFFFF0, 24},
+    {0x001FFFDF, 21}, {0x003FFFDF, 22}, {0x007FFFEB, 23}, {0x007FFFEC, 23},
+    {0x001FFFE0, 21}, {0x001FFFE1, 21}, {0x003FFFE0, 22}, {0x001FFFE2, 21},
+    {0x007FFFED, 23}, {0x003FFFE1, 22}, {0x007FFFEE, 23}, {0x007FFFEF, 23},
+    {0x000FFFEA, 20}, {0x003FFFE2, 22}, {0x003FFFE3, 22}, {0x003FFFE4, 22},
+    {0x007FFFF0, 23}, {0x003FFFE5, 22}, {0x003FFFE6, 22}, {0x007FFFF1, 23},
+    {0x03FFFFE0, 26}, {0x03FFFFE1, 26}, {0x000FFFEB, 20}, {0x0007FFF1, 19},
+    {0x003FFFE7, 22}, {0x007FFFF2, 23}, {0x003FFFE8, 22}, {0x01FFFFEC, 25},
+    {0x03FFFFE2, 26}, {0x03FFFFE3, 26}, {0x03FFFFE4, 26}, {0x07FFFFDE, 27},
+    {0x07FFFFDF, 27}, {0x03FFFFE5, 26}, {0x00FFFFF1, 24}, {0x01FFFFED, 25},
+    {0x0007FFF2, 19}, {0x001FFFE3, 21}, {0x03FFFFE6, 26}, {0x07FFFFE0, 27},
+    {0x07FFFFE1, 27}, {0x03FFFFE7, 26}, {0x07FFFFE2, 27}, {0x00FFFFF2, 24},
+    {0x001FFFE4, 21}, {0x001FFFE5, 21}, {0x03FFFFE8, 26}, {0x03FFFFE9, 26},
+    {0x0FFFFFFD, 28}, {0x07FFFFE3, 27}, {0x07FFFFE4, 27}, {0x07FFFFE5, 27},
+    {0x000FFFEC, 20}, {0x00FFFFF3, 24}, {0x000FFFED, 20}, {0x001FFFE6, 21},
+    {0x003FFFE9, 22}, {0x001FFFE7, 21}, {0x001FFFE8, 21}, {0x007FFFF3, 23},
+    {0x003FFFEA, 22}, {0x003FFFEB, 22}, {0x01FFFFEE, 25}, {0x01FFFFEF, 25},
+    {0x00FFFFF4, 24}, {0x00FFFFF5, 24}, {0x03FFFFEA, 26}, {0x007FFFF4, 23},
+    {0x03FFFFEB, 26}, {0x07FFFFE6, 27}, {0x03FFFFEC, 26}, {0x03FFFFED, 26},
+    {0x07FFFFE7, 27}, {0x07FFFFE8, 27}, {0x07FFFFE9, 27}, {0x07FFFFEA, 27},
+    {0x07FFFFEB, 27}, {0x0FFFFFFE, 28}, {0x07FFFFEC, 27}, {0x07FFFFED, 27},
+    {0x07FFFFEE, 27}, {0x07FFFFEF, 27}, {0x07FFFFF0, 27}, {0x03FFFFEE, 26},
+    {0x3FFFFFFF, 30},
+};
+
+static const size_t HUFFMAN_MAX_BITS = 30;
+static const uint16_t HUFFMAN_EOS = 256;
+
+struct HuffmanDecodeTable {
+  // For each code length: the first code of that length, the number of codes
+  // of that length, and the index in symbols of the first code's symbol
+  uint32_t first_code[HUFFMAN_MAX_BITS + 1];
+  uint32_t count[HUFFMAN_MAX_BITS + 1];
+  uint16_t first_index[HUFFMAN_MAX_BITS + 1];
+  // All symbols, ordered by code
+  uint16_t symbols[257];
+
+  HuffmanDecodeTable() {
+    size_t num_symbols = 0;
+    for (size_t bits = 0; bits <= HUFFMAN_MAX_BITS; bits++) {
+      this->first_code[bits] = 0;
+      this->count[bits] = 0;
+      this->first_index[bits] = num_symbols;
+      for (uint16_t sym = 0; sym <= HUFFMAN_EOS; sym++) {
+        if (HUFFMAN_CODES[sym].bits != bits) {
+          continue;
+        }
+        if (this->count[bits] == 0) {
+          this->first_code[bits] = HUFFMAN_CODES[sym].code;
+        }
+        this->count[bits]++;
+        this->symbols[num_symbols++] = sym;
+      }
+    }
+  }
+};
+
+static void huffman_decode(string& dest, const uint8_t* data, size_t size) {
+  static const HuffmanDecodeTable table;
+
+  uint32_t code = 0;
+  size_t bits = 0;
+  for (size_t z = 0; z < size; z++) {
+    for (int8_t shift = 7; shift >= 0; shift--) {
+      code = (code << 1) | ((data[z] >> shift) & 1);
+      bits++;
+      if ((code - table.first_code[bits]) < table.count[bits]) {
+        uint16_t sym = table.symbols[table.first_index[bits] + (code - table.first_code[bits])];
+        if (sym == HUFFMAN_EOS) {
+          throw runtime_error("Huffman-encoded string contains EOS");
+        }
+        dest.push_back(static_cast<char>(sym));
+        code = 0;
+        bits = 0;
+      } else if (bits == HUFFMAN_MAX_BITS) {
+        throw runtime_error("invalid Huffman code");
+      }
+    }
+  }
+  // The last byte is padded with the most significant bits of EOS (all ones),
+  // and the padding must be shorter than a byte
+  if ((bits > 7) || (code != ((1u << bits) - 1))) {
+    throw runtime_error("invalid Huffman string padding");
+  }
+}
+
+static size_t huffman_encoded_size(const string& s) {
+  size_t bits = 0;
+  for (char ch : s) {
+    bits += HUFFMAN_CODES[static_cast<uint8_t>(ch)].bits;
+  }
+  return (bits + 7) >> 3;
+}
+
+static void huffman_encode(string& dest, const string& s) {
+  uint64_t pending = 0;
+  size_t pending_bits = 0;
+  for (char ch : s) {
+    const auto& code = HUFFMAN_CODES[static_cast<uint8_t>(ch)];
+    pending = (pending << code.bits) | code.code;
+    pending_bits += code.bits;
+    while (pending_bits >= 8) {
+      pending_bits -= 8;
+      dest.push_back(static_cast<char>(pending >> pending_bits));
+    }
+  }
+  if (pending_bits > 0) {
+    dest.push_back(static_cast<char>(
+        (pending << (8 - pending_bits)) | (0xFF >> pending_bits)));
+  }
+}
+
+// Integers are encoded in the low prefix_bits bits of the first byte (the high
+// bits of which are set by the caller as flags), continuing in 7-bit groups if
+// they don't fit (RFC 7541 section 5.1)
+static void encode_integer(string& dest, uint8_t flags, uint8_t prefix_bits, size_t value) {
+  size_t max_prefix = (1 << prefix_bits) - 1;
+  if (value < max_prefix) {
+    dest.push_back(static_cast<char>(flags | value));
+    return;
+  }
+  dest.push_back(static_cast<char>(flags | max_prefix));
+  value -= max_prefix;
+  while (value >= 0x80) {
+    dest.push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  dest.push_back(static_cast<char>(value));
+}
+
+static void encode_string(string& dest, const string& s) {
+  size_t huffman_size = huffman_encoded_size(s);
+  if (huffman_size < s.size()) {
+    encode_integer(dest, 0x80, 7, huffman_size);
+    huffman_encode(dest, s);
+  } else {
+    encode_integer(dest, 0x00, 7, s.size());
+    dest.append(s);
+  }
+}
+
+class HPACKReader {
+public:
+  HPACKReader(const void* data, size_t size)
+      : data(reinterpret_cast<const uint8_t*>(data)),
+        size(size),
+        offset(0) {}
+
+  bool eof() const {
+    return this->offset >= this->size;
+  }
+
+  uint8_t peek() const {
+    if (this->eof()) {
+      throw runtime_error("header block is truncated");
+    }
+    return this->data[this->offset];
+  }
+
+  size_t read_integer(uint8_t prefix_bits) {
+    size_t max_prefix = (1 << prefix_bits) - 1;
+    size_t value = this->peek() & max_prefix;
+    this->offset++;
+    if (value < max_prefix) {
+      return value;
+    }
+    // Values that need more than 28 bits are never valid here, since all
+    // lengths, indexes, and table sizes are far smaller than that
+    for (size_t shift = 0; shift <= 21; shift += 7) {
+      uint8_t b = this->peek();
+      this->offset++;
+      value += static_cast<size_t>(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        return value;
+      }
+    }
+    throw runtime_error("integer in header block is too large");
+  }
+
+  string read_string() {
+    bool huffman = this->peek() & 0x80;
+    size_t length = this->read_integer(7);
+    if (length > this->size - this->offset) {
+      throw runtime_error("string in header block is truncated");
+    }
+    string ret;
+    if (huffman) {
+      ret.reserve(length + (length >> 2));
+      huffman_decode(ret, this->data + this->offset, length);
+    } else {
+      ret.assign(reinterpret_cast<const char*>(this->data + this->offset), length);
+    }
+    this->offset += length;
+    return ret;
+  }
+
+private:
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+};
+
+// Each entry's size is its name and value lengths plus 32 bytes of overhead
+static size_t entry_size(const string& name, const string& value) {
+  return name.size() + value.size() + 32;
+}
+
+HPACKDynamicTable::HPACKDynamicTable(size_t max_size)
+    : size(0),
+      max_size(max_size) {}
+
+void HPACKDynamicTable::set_max_size(size_t new_max_size) {
+  this->max_size = new_max_size;
+  this->evict(this->max_size);
+}
+
+size_t HPACKDynamicTable::get_max_size() const {
+  return this->max_size;
+}
+
+void HPACKDynamicTable::add(const string& name, const string& value) {
+  // An entry larger than the whole table empties it and isn't added
+  size_t new_entry_size = entry_size(name, value);
+  if (new_entry_size > this->max_size) {
+    this->evict(0);
+    return;
+  }
+  this->evict(this->max_size - new_entry_size);
+  this->entries.emplace_front(name, value);
+  this->size += new_entry_size;
+}
+
+const pair<string, string>& HPACKDynamicTable::get(size_t index) const {
+  return this->entries.at(index);
+}
+
+size_t HPACKDynamicTable::num_entries() const {
+  return this->entries.size();
+}
+
+void HPACKDynamicTable::evict(size_t target_size) {
+  while (this->size > target_size) {
+    const auto& entry = this->entries.back();
+    this->size -= entry_size(entry.first, entry.second);
+    this->entries.pop_back();
+  }
+}
+
+HPACKDecoder::HPACKDecoder(size_t max_table_size)
+    : table(max_table_size),
+      max_table_size(max_table_size) {}
+
+bool HPACKDecoder::decode(
+    vector<pair<string, string>>& headers,
+    const void* data,
+    size_t size,
+    size_t max_list_size) {
+  auto get_entry = [&](size_t index) -> pair<string, string> {
+    if (index == 0) {
+      throw runtime_error("header block refers to index 0");
+    }
+    if (index <= STATIC_TABLE_SIZE) {
+      const auto& entry = STATIC_TABLE[index - 1];
+      return make_pair(entry.first, entry.second);
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= this->table.num_entries()) {
+      throw runtime_error("header block refers to a nonexistent table entry");
+    }
+    return this->table.get(index);
+  };
+
+  HPACKReader r(data, size);
+  size_t list_size = 0;
+  bool any_fields_decoded = false;
+  while (!r.eof()) {
+    uint8_t first = r.peek();
+    pair<string, string> field;
+
+    if (first & 0x80) { // Indexed field
+      field = get_entry(r.read_integer(7));
+
+    } else if ((first & 0xE0) == 0x20) { // Dynamic table size update
+      if (any_fields_decoded) {
+        throw runtime_error("table size update after header field");
+      }
+      size_t new_size = r.read_integer(5);
+      if (new_size > this->max_table_size) {
+        throw runtime_error("table size update exceeds the allowed maximum");
+      }
+      this->table.set_max_size(new_size);
+      continue;
+
+    } else { // Literal field, with or without indexing
+      bool add_to_table = (first & 0xC0) == 0x40;
+      size_t name_index = r.read_integer(add_to_table ? 6 : 4);
+      if (name_index) {
+        field.first = get_entry(name_index).first;
+      } else {
+        field.first = r.read_string();
+      }
+      field.second = r.read_string();
+      if (add_to_table) {
+        this->table.add(field.first, field.second);
+      }
+    }
+
+    any_fields_decoded = true;
+    list_size += entry_size(field.first, field.second);
+    if (list_size <= max_list_size) {
+      headers.emplace_back(std::move(field));
+    }
+  }
+  return (list_size <= max_list_size);
+}
+
+// Fields with these names almost always have a different value on each
+// response, so adding them to the dynamic table would only evict other entries
+static bool should_index_field(const string& name) {
+  static const unordered_set<string> unindexed_names({
+      "age",
+      "content-length",
+      "content-range",
+      "date",
+      "etag",
+      "expires",
+      "last-modified",
+      "location",
+      "set-cookie",
+  });
+  return !unindexed_names.count(name);
+}
+
+HPACKEncoder::HPACKEncoder()
+    : table(4096),
+      smallest_pending_table_size(4096),
+      pending_table_size(4096),
+      table_size_update_pending(false) {}
+
+void HPACKEncoder::set_max_table_size(size_t size) {
+  size = min<size_t>(size, 4096);
+  this->smallest_pending_table_size = this->table_size_update_pending
+      ? min(this->smallest_pending_table_size, size)
+      : min(this->table.get_max_size(), size);
+  this->pending_table_size = size;
+  this->table_size_update_pending = true;
+}
+
+void HPACKEncoder::encode(
+    string& block, const string& name, const string& value, bool sensitive) {
+  if (block.empty() && this->table_size_update_pending) {
+    if (this->smallest_pending_table_size < this->pending_table_size) {
+      encode_integer(block, 0x20, 5, this->smallest_pending_table_size);
+    }
+    encode_integer(block, 0x20, 5, this->pending_table_size);
+    this->table.set_max_size(this->pending_table_size);
+    this->table_size_update_pending = false;
+  }
+
+  // The static table maps each name to its first index, and each name-value
+  // pair (joined by a NUL byte) to its index
+  static const auto static_index = []() {
+    unordered_map<string, size_t> ret;
+    for (size_t z = STATIC_TABLE_SIZE; z > 0; z--) {
+      const auto& entry = STATIC_TABLE[z - 1];
+      ret[entry.first] = z;
+      ret[string(entry.first) + '\0' + entry.second] = z;
+    }
+    return ret;
+  }();
+
+  size_t name_index = 0;
+  if (!sensitive) {
+    string key = name + '\0' + value;
+    auto it = static_index.find(key);
+    if (it != static_index.end()) {
+      encode_integer(block, 0x80, 7, it->second);
+      return;
+    }
+  }
+  auto it = static_index.find(name);
+  if (it != static_index.end()) {
+    name_index = it->second;
+  }
+  for (size_t z = 0; z < this->table.num_entries(); z++) {
+    const auto& entry = this->table.get(z);
+    if (entry.first != name) {
+      continue;
+    }
+    if (!sensitive && (entry.second == value)) {
+      encode_integer(block, 0x80, 7, z + STATIC_TABLE_SIZE + 1);
+      return;
+    }
+    if (!name_index) {
+      name_index = z + STATIC_TABLE_SIZE + 1;
+    }
+  }
+
+  // Entries that would take up more than a quarter of the table aren't added,
+  // since they'd evict several smaller entries that are more likely to be
+  // reused
+  bool add_to_table = !sensitive &&
+      should_index_field(name) &&
+      (entry_size(name, value) <= (this->table.get_max_size() >> 2));
+  if (add_to_table) {
+    encode_integer(block, 0x40, 6, name_index);
+  } else {
+    encode_integer(block, sensitive ? 0x10 : 0x00, 4, name_index);
+  }
+  if (!name_index) {
+    encode_string(block, name);
+  }
+  encode_string(block, value);
+  if (add_to_table) {
+    this->table.add(name, value);
+  }
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace EventAsync::HTTP {
+
+// HPACK header compression for HTTP/2 (RFC 7541). Each HTTP/2 connection has
+// one decoder for the header blocks it receives and one encoder for the header
+// blocks it sends; both sides' dynamic tables must stay in sync, so header
+// blocks must be decoded (and encoded) in the order they appear on the
+// connection, even for streams that are then refused or reset.
+
+// The dynamic table shared by the encoder and decoder implementations. Entries
+// are stored newest first, so index 0 here is HPACK index 62.
+class HPACKDynamicTable {
+public:
+  explicit HPACKDynamicTable(size_t max_size = 4096);
+
+  void set_max_size(size_t max_size);
+  size_t get_max_size() const;
+
+  void add(const std::string& name, const std::string& value);
+  // Index is relative to the start of the dynamic table (zero is the newest
+  // entry). Throws out_of_range if there's no such entry.
+  const std::pair<std::string, std::string>& get(size_t index) const;
+  size_t num_entries() const;
+
+private:
+  std::deque<std::pair<std::string, std::string>> entries;
+  size_t size;
+  size_t max_size;
+
+  void evict(size_t target_size);
+};
+
+class HPACKDecoder {
+public:
+  // max_table_size is the largest dynamic table the peer's encoder is allowed
+  // to use (the SETTINGS_HEADER_TABLE_SIZE value we send, 4096 by default).
+  explicit HPACKDecoder(size_t max_table_size = 4096);
+  HPACKDecoder(const HPACKDecoder&) = delete;
+  HPACKDecoder(HPACKDecoder&&) = delete;
+  HPACKDecoder& operator=(const HPACKDecoder&) = delete;
+  HPACKDecoder& operator=(HPACKDecoder&&) = delete;
+  ~HPACKDecoder() = default;
+
+  // Decodes a complete header block, appending the fields to headers in the
+  // order they appear. Throws runtime_error if the block isn't valid, which is
+  // a connection error (COMPRESSION_ERROR) in HTTP/2. If the decoded fields'
+  // total size (as defined for SETTINGS_MAX_HEADER_LIST_SIZE) exceeds
+  // max_list_size, the rest of the block is still decoded (to keep the dynamic
+  // table in sync) but the fields aren't returned, and this returns false.
+  bool decode(
+      std::vector<std::pair<std::string, std::string>>& headers,
+      const void* data,
+      size_t size,
+      size_t max_list_size = 0x10000);
+
+private:
+  HPACKDynamicTable table;
+  size_t max_table_size;
+};
+
+class HPACKEncoder {
+public:
+  HPACKEncoder();
+  HPACKEncoder(const HPACKEncoder&) = delete;
+  HPACKEncoder(HPACKEncoder&&) = delete;
+  HPACKEncoder& operator=(const HPACKEncoder&) = delete;
+  HPACKEncoder& operator=(HPACKEncoder&&) = delete;
+  ~HPACKEncoder() = default;
+
+  // Called when the peer changes its SETTINGS_HEADER_TABLE_SIZE. The encoder
+  // uses a table no larger than our own limit (4096 bytes), and signals any
+  // change at the start of the next header block.
+  void set_max_table_size(size_t size);
+
+  // Appends an encoded header field to block. block should be empty when the
+  // first field of each header block is encoded. name must be lowercase. Fields
+  // that are likely to be repeated on later responses are added to the dynamic
+  // table; fields whose values change on every response (like Date or
+  // Content-Length) aren't, so they don't evict more useful entries. If
+  // sensitive is true, the field is marked as never indexed, so intermediaries
+  // won't compress it either.
+  void encode(
+      std::string& block,
+      const std::string& name,
+      const std::string& value,
+      bool sensitive = false);
+
+private:
+  HPACKDynamicTable table;
+  // If the peer shrinks the table and then grows it again before the next
+  // header block, both changes have to be signaled
+  size_t smallest_pending_table_size;
+  size_t pending_table_size;
+  bool table_size_update_pending;
+};
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,1436 @@
+#include "HTTP2.hh"
+
+#include <ctype.h>
+#include <event2/keyvalq_struct.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "ResponseHeaders.hh"
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+static const char CONNECTION_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t CONNECTION_PREFACE_SIZE = sizeof(CONNECTION_PREFACE) - 1;
+
+static const size_t FRAME_HEADER_SIZE = 9;
+// We never change SETTINGS_MAX_FRAME_SIZE from its default, so the client
+// can't send frames larger than this
+static const size_t MAX_RECEIVED_FRAME_SIZE = 0x4000;
+static const int64_t MAX_WINDOW_SIZE = 0x7FFFFFFF;
+static const uint32_t DEFAULT_WINDOW_SIZE = 0xFFFF;
+// A header block that's split across CONTINUATION frames can't be decoded until
+// all of it arrives, so its encoded size is limited too. CONTINUATION frames
+// may be empty, so their number is limited as well; otherwise, a client could
+// keep a header block open indefinitely without growing it.
+static const size_t MAX_HEADER_BLOCK_SIZE = 0x40000;
+static const size_t MAX_CONTINUATION_FRAMES = 0x100;
+
+// DATA frames are generated until the connection's output buffer holds this
+// many bytes, and generation resumes when it drains below the low watermark.
+// Keeping the buffer small means a newly-started response (or a higher-priority
+// one) doesn't wait behind much data from other streams.
+static const size_t OUTPUT_HIGH_WATERMARK = 0x10000;
+static const size_t OUTPUT_LOW_WATERMARK = 0x4000;
+
+enum FrameType : uint8_t {
+  DATA = 0x00,
+  HEADERS = 0x01,
+  PRIORITY = 0x02,
+  RST_STREAM = 0x03,
+  SETTINGS = 0x04,
+  PUSH_PROMISE = 0x05,
+  PING = 0x06,
+  GOAWAY = 0x07,
+  WINDOW_UPDATE = 0x08,
+  CONTINUATION = 0x09,
+};
+
+enum FrameFlag : uint8_t {
+  END_STREAM = 0x01,
+  ACK = 0x01,
+  END_HEADERS = 0x04,
+  PADDED = 0x08,
+  PRIORITY_INFO = 0x20,
+};
+
+enum ErrorCode : uint32_t {
+  NO_ERROR = 0x00,
+  PROTOCOL_ERROR = 0x01,
+  INTERNAL_ERROR = 0x02,
+  FLOW_CONTROL_ERROR = 0x03,
+  STREAM_CLOSED = 0x05,
+  FRAME_SIZE_ERROR = 0x06,
+  REFUSED_STREAM = 0x07,
+  CANCEL = 0x08,
+  COMPRESSION_ERROR = 0x09,
+  ENHANCE_YOUR_CALM = 0x0B,
+};
+
+enum SettingID : uint16_t {
+  HEADER_TABLE_SIZE = 0x01,
+  ENABLE_PUSH = 0x02,
+  MAX_CONCURRENT_STREAMS = 0x03,
+  INITIAL_WINDOW_SIZE = 0x04,
+  MAX_FRAME_SIZE = 0x05,
+  MAX_HEADER_LIST_SIZE = 0x06,
+};
+
+// Thrown while processing input when the client violates the protocol in a way
+// that affects the whole connection; the connection is then closed with a
+// GOAWAY frame carrying the error code. Errors that only affect one stream are
+// handled by resetting that stream instead.
+class HTTP2ConnectionError : public runtime_error {
+public:
+  HTTP2ConnectionError(uint32_t code, const char* what)
+      : runtime_error(what),
+        code(code) {}
+  uint32_t code;
+};
+
+static uint32_t get_u32b(const void* data) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  return (static_cast<uint32_t>(p[0]) << 24) |
+      (static_cast<uint32_t>(p[1]) << 16) |
+      (static_cast<uint32_t>(p[2]) << 8) |
+      static_cast<uint32_t>(p[3]);
+}
+
+static void put_u32b(void* data, uint32_t value) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(data);
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+// Headers that only apply to a single HTTP/1.1 connection. Requests containing
+// them are malformed in HTTP/2, and they're removed from responses.
+static bool is_connection_specific_header(const string& name) {
+  static const unordered_set<string> names({
+      "connection",
+      "keep-alive",
+      "proxy-connection",
+      "transfer-encoding",
+      "upgrade",
+  });
+  return names.count(name);
+}
+
+static bool method_for_name(const string& name, enum evhttp_cmd_type* type) {
+  static const unordered_map<string, enum evhttp_cmd_type> types({
+      {"GET", EVHTTP_REQ_GET},
+      {"POST", EVHTTP_REQ_POST},
+      {"HEAD", EVHTTP_REQ_HEAD},
+      {"PUT", EVHTTP_REQ_PUT},
+      {"DELETE", EVHTTP_REQ_DELETE},
+      {"OPTIONS", EVHTTP_REQ_OPTIONS},
+      {"TRACE", EVHTTP_REQ_TRACE},
+      {"PATCH", EVHTTP_REQ_PATCH},
+  });
+  auto it = types.find(name);
+  if (it == types.end()) {
+    return false;
+  }
+  *type = it->second;
+  return true;
+}
+
+// Requests on HTTP/2 connections aren't attached to an evhttp_connection, and
+// evhttp has no public way to set a request's method or URI, so those are kept
+// here along with the request's stream. A request whose stream was closed
+// before the handler finished has a null stream; the request is freed when the
+// handler ends its response, as evhttp does for requests whose connections
+// have closed.
+struct HTTP2Request {
+  HTTP2Stream* stream;
+  enum evhttp_cmd_type command;
+  string uri;
+  unique_ptr<struct evhttp_uri, void (*)(struct evhttp_uri*)> uri_elems;
+  int response_code;
+  // Set when the stream is closed while the handler is still running; see
+  // HTTP2Connection::running_orphaned_handlers
+  shared_ptr<size_t> orphaned_handler_count;
+};
+
+static thread_local unordered_map<struct evhttp_request*, HTTP2Request> http2_requests;
+
+static void free_http2_request(
+    unordered_map<struct evhttp_request*, HTTP2Request>::iterator it) {
+  struct evhttp_request* req = it->first;
+  if (it->second.orphaned_handler_count) {
+    (*it->second.orphaned_handler_count)--;
+  }
+  http2_requests.erase(it);
+  evhttp_request_free(req);
+}
+
+HTTP2Stream::HTTP2Stream(
+    HTTP2Connection* conn, uint32_t id, struct evhttp_request* req)
+    : conn(conn),
+      id(id),
+      req(req),
+      output_buf(conn->base),
+      remote_closed(false),
+      local_closed(false),
+      dispatched(false),
+      response_started(false),
+      response_ended(false),
+      response_has_body(false),
+      expected_body_size(-1),
+      send_window(DEFAULT_WINDOW_SIZE),
+      recv_window(DEFAULT_WINDOW_SIZE),
+      recv_unacknowledged(0),
+      depends_on(0),
+      weight(16),
+      virtual_time(0),
+      close_cb(nullptr),
+      close_cb_ctx(nullptr) {}
+
+HTTP2Stream* HTTP2Stream::for_request(struct evhttp_request* req) {
+  auto it = http2_requests.find(req);
+  return (it == http2_requests.end()) ? nullptr : it->second.stream;
+}
+
+struct evbuffer* HTTP2Stream::get_output_buffer() {
+  return this->output_buf.buf;
+}
+
+void HTTP2Stream::set_close_callback(void (*cb)(void* ctx), void* ctx) {
+  this->close_cb = cb;
+  this->close_cb_ctx = ctx;
+}
+
+void HTTP2Stream::send_response(int code, struct evbuffer* body, bool end) {
+  this->conn->send_response(this, code, body, end);
+}
+
+void HTTP2Stream::send_data(struct evbuffer* data) {
+  this->conn->send_data(this, data);
+}
+
+void HTTP2Stream::end_response() {
+  this->conn->end_response(this);
+}
+
+bool HTTP2Stream::is_sendable() const {
+  if (this->local_closed || !this->response_started) {
+    return false;
+  }
+  // The end of the response can always be sent, even if the windows are full,
+  // since an empty DATA frame doesn't count against them
+  if (this->output_buf.get_length() == 0) {
+    return this->response_ended;
+  }
+  return (this->send_window > 0) && (this->conn->send_window > 0);
+}
+
+// Tracks a new connection from the time evhttp sets it up until we know
+// whether it's an HTTP/2 connection. While this exists, its read callback
+// replaces evhttp's, and the other callbacks are passed through to evhttp.
+struct PrefaceWatcher {
+  Base& base;
+  struct bufferevent* bev;
+  struct evhttp_connection* evcon;
+  const HTTP2Options* options;
+  HTTP2Connection::RequestCallback cb;
+  void* cb_ctx;
+
+  bufferevent_data_cb evhttp_read_cb;
+  bufferevent_data_cb evhttp_write_cb;
+  bufferevent_event_cb evhttp_event_cb;
+  void* evhttp_cb_arg;
+
+  static void on_connection_set_up(evutil_socket_t, short, void* ctx);
+  static void on_read(struct bufferevent* bev, void* ctx);
+  static void on_write(struct bufferevent* bev, void* ctx);
+  static void on_event(struct bufferevent* bev, short what, void* ctx);
+  static void on_evhttp_close(struct evhttp_connection* evcon, void* ctx);
+
+  void restore_evhttp_callbacks();
+};
+
+void HTTP2Connection::watch(
+    Base& base,
+    struct bufferevent* bev,
+    const HTTP2Options* options,
+    RequestCallback cb,
+    void* cb_ctx) {
+  // evhttp sets the bufferevent's callbacks after the bevcb returns, so we
+  // can't replace them yet. This callback is activated immediately, so it runs
+  // before any events on the new connection.
+  auto* w = new PrefaceWatcher{
+      base, bev, nullptr, options, cb, cb_ctx, nullptr, nullptr, nullptr, nullptr};
+  base.once(-1, EV_TIMEOUT, &PrefaceWatcher::on_connection_set_up, w, 0);
+}
+
+void PrefaceWatcher::on_connection_set_up(evutil_socket_t, short, void* ctx) {
+  auto* w = reinterpret_cast<PrefaceWatcher*>(ctx);
+  bufferevent_getcb(w->bev, &w->evhttp_read_cb, &w->evhttp_write_cb,
+      &w->evhttp_event_cb, &w->evhttp_cb_arg);
+  // evhttp passes the connection as the argument to its callbacks. If the
+  // connection closes before sending anything, evhttp frees it, and the close
+  // callback frees the watcher.
+  w->evcon = reinterpret_cast<struct evhttp_connection*>(w->evhttp_cb_arg);
+  evhttp_connection_set_closecb(w->evcon, &PrefaceWatcher::on_evhttp_close, w);
+  bufferevent_setcb(w->bev, &PrefaceWatcher::on_read, &PrefaceWatcher::on_write,
+      &PrefaceWatcher::on_event, w);
+}
+
+void PrefaceWatcher::restore_evhttp_callbacks() {
+  evhttp_connection_set_closecb(this->evcon, nullptr, nullptr);
+  bufferevent_setcb(this->bev, this->evhttp_read_cb, this->evhttp_write_cb,
+      this->evhttp_event_cb, this->evhttp_cb_arg);
+}
+
+void PrefaceWatcher::on_read(struct bufferevent* bev, void* ctx) {
+  auto* w = reinterpret_cast<PrefaceWatcher*>(ctx);
+  struct evbuffer* input = bufferevent_get_input(bev);
+  char data[CONNECTION_PREFACE_SIZE];
+  size_t size = evbuffer_copyout(input, data, CONNECTION_PREFACE_SIZE);
+
+  if (memcmp(data, CONNECTION_PREFACE, size)) {
+    // Not HTTP/2; give the connection back to evhttp, which hasn't seen any
+    // of its data yet
+    w->restore_evhttp_callbacks();
+    auto read_cb = w->evhttp_read_cb;
+    void* cb_arg = w->evhttp_cb_arg;
+    delete w;
+    read_cb(bev, cb_arg);
+    return;
+  }
+  if (size < CONNECTION_PREFACE_SIZE) {
+    return; // Wait for the rest of the preface
+  }
+
+  auto* c = new HTTP2Connection(w->base, w->bev, w->evcon, w->options, w->cb, w->cb_ctx);
+  delete w;
+  HTTP2Connection::on_read(bev, c);
+}
+
+void PrefaceWatcher::on_write(struct bufferevent* bev, void* ctx) {
+  auto* w = reinterpret_cast<PrefaceWatcher*>(ctx);
+  if (w->evhttp_write_cb) {
+    w->evhttp_write_cb(bev, w->evhttp_cb_arg);
+  }
+}
+
+void PrefaceWatcher::on_event(struct bufferevent* bev, short what, void* ctx) {
+  // evhttp frees the connection if it failed, which calls on_evhttp_close, so
+  // the watcher must not be used after this
+  auto* w = reinterpret_cast<PrefaceWatcher*>(ctx);
+  if (w->evhttp_event_cb) {
+    w->evhttp_event_cb(bev, what, w->evhttp_cb_arg);
+  }
+}
+
+void PrefaceWatcher::on_evhttp_close(struct evhttp_connection*, void* ctx) {
+  delete reinterpret_cast<PrefaceWatcher*>(ctx);
+}
+
+static int select_alpn_protocol(
+    SSL*,
+    const unsigned char** out,
+    unsigned char* out_size,
+    const unsigned char* in,
+    unsigned int in_size,
+    void*) {
+  // Protocols we support, in order of preference
+  static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+  unsigned char* selected;
+  if (SSL_select_next_proto(&selected, out_size, protocols, sizeof(protocols) - 1,
+          in, in_size) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+void HTTP2Connection::enable_alpn(SSL_CTX* ctx) {
+  SSL_CTX_set_alpn_select_cb(ctx, &select_alpn_protocol, nullptr);
+}
+
+HTTP2Connection::HTTP2Connection(
+    Base& base,
+    struct bufferevent* bev,
+    struct evhttp_connection* evcon,
+    const HTTP2Options* options,
+    RequestCallback cb,
+    void* cb_ctx)
+    : base(base),
+      bev(bev),
+      evcon(evcon),
+      options(options),
+      cb(cb),
+      cb_ctx(cb_ctx),
+      preface_received(false),
+      settings_received(false),
+      going_away(false),
+      closing(false),
+      closed(false),
+      last_stream_id(0),
+      running_orphaned_handlers(make_shared<size_t>(0)),
+      virtual_time(0),
+      continuation_stream_id(0),
+      continuation_flags(0),
+      continuation_depends_on(0),
+      continuation_weight(0),
+      continuation_frame_count(0),
+      buffered_body_size(0),
+      peer_initial_window_size(DEFAULT_WINDOW_SIZE),
+      peer_max_frame_size(MAX_RECEIVED_FRAME_SIZE),
+      send_window(DEFAULT_WINDOW_SIZE),
+      recv_window(DEFAULT_WINDOW_SIZE),
+      recv_unacknowledged(0) {
+  // The evhttp_connection still owns the bufferevent, so we free it when the
+  // connection is done. evhttp_free also frees it, in which case the close
+  // callback tells us it's gone.
+  evhttp_connection_set_closecb(this->evcon, &HTTP2Connection::on_evhttp_close, this);
+  bufferevent_setcb(this->bev, &HTTP2Connection::on_read,
+      &HTTP2Connection::on_write, &HTTP2Connection::on_event, this);
+  bufferevent_setwatermark(this->bev, EV_WRITE, OUTPUT_LOW_WATERMARK, 0);
+  bufferevent_enable(this->bev, EV_READ | EV_WRITE);
+
+  uint8_t settings[18];
+  auto put_setting = [&](size_t index, uint16_t id, uint32_t value) {
+    settings[index * 6] = id >> 8;
+    settings[index * 6 + 1] = id;
+    put_u32b(&settings[index * 6 + 2], value);
+  };
+  put_setting(0, MAX_CONCURRENT_STREAMS, this->options->max_concurrent_streams);
+  put_setting(1, INITIAL_WINDOW_SIZE, this->options->initial_window_size);
+  put_setting(2, MAX_HEADER_LIST_SIZE, this->options->max_header_list_size);
+  this->write_frame(SETTINGS, 0, 0, settings, sizeof(settings));
+
+  // The connection's window can only be changed with WINDOW_UPDATE
+  if (this->options->initial_window_size > DEFAULT_WINDOW_SIZE) {
+    this->write_window_update(0, this->options->initial_window_size - DEFAULT_WINDOW_SIZE);
+    this->recv_window = this->options->initial_window_size;
+  }
+}
+
+HTTP2Connection::~HTTP2Connection() {
+  this->abort_streams();
+}
+
+void HTTP2Connection::on_read(struct bufferevent*, void* ctx) {
+  auto* c = reinterpret_cast<HTTP2Connection*>(ctx);
+  try {
+    c->process_input();
+  } catch (const HTTP2ConnectionError& e) {
+    c->go_away(e.code);
+  }
+}
+
+void HTTP2Connection::on_write(struct bufferevent*, void* ctx) {
+  auto* c = reinterpret_cast<HTTP2Connection*>(ctx);
+  if (c->closing) {
+    if (evbuffer_get_length(bufferevent_get_output(c->bev)) == 0) {
+      c->close();
+    }
+  } else {
+    c->write_data();
+  }
+}
+
+void HTTP2Connection::on_event(struct bufferevent*, short what, void* ctx) {
+  auto* c = reinterpret_cast<HTTP2Connection*>(ctx);
+  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    c->close();
+
+  } else if (what & BEV_EVENT_TIMEOUT) {
+    // The timeouts are the ones evhttp set on the connection. A read timeout
+    // while requests are still being handled is normal (the client is waiting
+    // for their responses), but otherwise the connection is idle and can be
+    // closed. A write timeout means the client isn't reading.
+    if (c->closing || (what & BEV_EVENT_WRITING)) {
+      c->close();
+    } else if (c->streams.empty()) {
+      c->go_away(NO_ERROR);
+    } else {
+      bufferevent_enable(c->bev, EV_READ);
+    }
+  }
+}
+
+void HTTP2Connection::on_evhttp_close(struct evhttp_connection*, void* ctx) {
+  // evhttp is freeing the connection (for example, because the server is being
+  // destroyed), so the bufferevent is about to be freed as well
+  auto* c = reinterpret_cast<HTTP2Connection*>(ctx);
+  c->evcon = nullptr;
+  c->bev = nullptr;
+  c->closed = true;
+  delete c;
+}
+
+void HTTP2Connection::process_input() {
+  struct evbuffer* input = bufferevent_get_input(this->bev);
+  if (!this->preface_received) {
+    // PrefaceWatcher already checked the preface's contents
+    if (evbuffer_get_length(input) < CONNECTION_PREFACE_SIZE) {
+      return;
+    }
+    evbuffer_drain(input, CONNECTION_PREFACE_SIZE);
+    this->preface_received = true;
+  }
+
+  while (!this->closing && !this->closed) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    if (evbuffer_copyout(input, header, FRAME_HEADER_SIZE) < static_cast<ssize_t>(FRAME_HEADER_SIZE)) {
+      break;
+    }
+    size_t size = (header[0] << 16) | (header[1] << 8) | header[2];
+    uint8_t type = header[3];
+    uint8_t flags = header[4];
+    uint32_t stream_id = get_u32b(&header[5]) & 0x7FFFFFFF;
+    if (size > MAX_RECEIVED_FRAME_SIZE) {
+      throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "frame is too large");
+    }
+    if (evbuffer_get_length(input) < FRAME_HEADER_SIZE + size) {
+      break;
+    }
+    evbuffer_drain(input, FRAME_HEADER_SIZE);
+
+    // The header block must be contiguous, and the client's first frame must
+    // be its SETTINGS frame
+    if (this->continuation_stream_id &&
+        ((type != CONTINUATION) || (stream_id != this->continuation_stream_id))) {
+      throw HTTP2ConnectionError(PROTOCOL_ERROR, "header block was interrupted");
+    }
+    if (!this->settings_received && (type != SETTINGS)) {
+      throw HTTP2ConnectionError(PROTOCOL_ERROR, "client did not send SETTINGS");
+    }
+
+    // DATA payloads are moved directly to the request's input buffer; all
+    // other frames are small enough to copy
+    if (type == DATA) {
+      this->process_data(stream_id, flags, input, size);
+    } else {
+      string payload(size, '\0');
+      evbuffer_remove(input, payload.data(), size);
+      this->process_frame(type, flags, stream_id, payload);
+    }
+  }
+}
+
+void HTTP2Connection::process_frame(
+    uint8_t type, uint8_t flags, uint32_t stream_id, const string& payload) {
+  switch (type) {
+    case HEADERS: {
+      if (stream_id == 0) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "HEADERS frame on stream 0");
+      }
+      size_t offset = 0;
+      size_t pad_size = 0;
+      if (flags & PADDED) {
+        if (payload.empty()) {
+          throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "HEADERS frame is too small");
+        }
+        pad_size = static_cast<uint8_t>(payload[0]);
+        offset = 1;
+      }
+      this->continuation_depends_on = 0;
+      this->continuation_weight = 0;
+      if (flags & PRIORITY_INFO) {
+        if (payload.size() < offset + 5) {
+          throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "HEADERS frame is too small");
+        }
+        this->continuation_depends_on = get_u32b(&payload[offset]) & 0x7FFFFFFF;
+        this->continuation_weight = static_cast<uint8_t>(payload[offset + 4]) + 1;
+        offset += 5;
+      }
+      if (offset + pad_size > payload.size()) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "HEADERS padding is too large");
+      }
+      this->header_block.assign(payload, offset, payload.size() - offset - pad_size);
+      this->continuation_flags = flags;
+      this->continuation_frame_count = 0;
+      if (flags & END_HEADERS) {
+        this->process_headers(stream_id, flags);
+      } else {
+        this->continuation_stream_id = stream_id;
+      }
+      break;
+    }
+
+    case CONTINUATION:
+      // A CONTINUATION frame is only valid while a header block is open
+      if (!this->continuation_stream_id || (stream_id != this->continuation_stream_id)) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "unexpected CONTINUATION frame");
+      }
+      if ((this->header_block.size() + payload.size() > MAX_HEADER_BLOCK_SIZE) ||
+          (++this->continuation_frame_count > MAX_CONTINUATION_FRAMES)) {
+        throw HTTP2ConnectionError(ENHANCE_YOUR_CALM, "header block is too large");
+      }
+      this->header_block += payload;
+      if (flags & END_HEADERS) {
+        this->continuation_stream_id = 0;
+        this->process_headers(stream_id, this->continuation_flags);
+      }
+      break;
+
+    case PRIORITY: {
+      if (stream_id == 0) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "PRIORITY frame on stream 0");
+      }
+      if (payload.size() != 5) {
+        this->reset_stream(stream_id, FRAME_SIZE_ERROR);
+        auto it = this->streams.find(stream_id);
+        if (it != this->streams.end()) {
+          this->close_stream(it->second.get());
+        }
+        break;
+      }
+      // Priorities of streams that aren't open are ignored
+      auto it = this->streams.find(stream_id);
+      if (it != this->streams.end()) {
+        this->set_priority(it->second.get(), get_u32b(payload.data()) & 0x7FFFFFFF,
+            static_cast<uint8_t>(payload[4]) + 1);
+      }
+      break;
+    }
+
+    case RST_STREAM: {
+      if (stream_id == 0) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "RST_STREAM frame on stream 0");
+      }
+      if (payload.size() != 4) {
+        throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "RST_STREAM frame has incorrect size");
+      }
+      if (stream_id > this->last_stream_id) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "RST_STREAM frame on idle stream");
+      }
+      auto it = this->streams.find(stream_id);
+      if (it != this->streams.end()) {
+        this->close_stream(it->second.get());
+      }
+      break;
+    }
+
+    case SETTINGS:
+      if (stream_id != 0) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "SETTINGS frame on nonzero stream");
+      }
+      if (flags & ACK) {
+        if (!payload.empty()) {
+          throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "SETTINGS ACK frame has a payload");
+        }
+      } else {
+        this->process_settings(payload);
+        this->settings_received = true;
+      }
+      break;
+
+    case PUSH_PROMISE:
+      throw HTTP2ConnectionError(PROTOCOL_ERROR, "client sent PUSH_PROMISE");
+
+    case PING:
+      if (stream_id != 0) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "PING frame on nonzero stream");
+      }
+      if (payload.size() != 8) {
+        throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "PING frame has incorrect size");
+      }
+      if (!(flags & ACK)) {
+        this->write_frame(PING, ACK, 0, payload.data(), payload.size());
+      }
+      break;
+
+    case GOAWAY:
+      if (stream_id != 0) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "GOAWAY frame on nonzero stream");
+      }
+      // The client won't open any more streams; finish the open ones and then
+      // close the connection
+      this->going_away = true;
+      if (this->streams.empty()) {
+        this->go_away(NO_ERROR);
+      }
+      break;
+
+    case WINDOW_UPDATE:
+      if (payload.size() != 4) {
+        throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "WINDOW_UPDATE frame has incorrect size");
+      }
+      this->process_window_update(stream_id, get_u32b(payload.data()) & 0x7FFFFFFF);
+      break;
+
+    default:
+      // Unknown frame types are ignored
+      break;
+  }
+}
+
+void HTTP2Connection::process_settings(const string& payload) {
+  if (payload.size() % 6) {
+    throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "SETTINGS frame has incorrect size");
+  }
+
+  for (size_t offset = 0; offset < payload.size(); offset += 6) {
+    uint16_t id = (static_cast<uint8_t>(payload[offset]) << 8) |
+        static_cast<uint8_t>(payload[offset + 1]);
+    uint32_t value = get_u32b(&payload[offset + 2]);
+    switch (id) {
+      case HEADER_TABLE_SIZE:
+        this->encoder.set_max_table_size(value);
+        break;
+      case ENABLE_PUSH:
+        if (value > 1) {
+          throw HTTP2ConnectionError(PROTOCOL_ERROR, "invalid SETTINGS_ENABLE_PUSH value");
+        }
+        break;
+      case INITIAL_WINDOW_SIZE: {
+        if (value > MAX_WINDOW_SIZE) {
+          throw HTTP2ConnectionError(FLOW_CONTROL_ERROR, "initial window size is too large");
+        }
+        // This changes the send windows of all open streams, but not the
+        // connection's window
+        int64_t delta = static_cast<int64_t>(value) - this->peer_initial_window_size;
+        for (auto& it : this->streams) {
+          it.second->send_window += delta;
+          if (it.second->send_window > MAX_WINDOW_SIZE) {
+            throw HTTP2ConnectionError(FLOW_CONTROL_ERROR, "stream window is too large");
+          }
+        }
+        this->peer_initial_window_size = value;
+        break;
+      }
+      case MAX_FRAME_SIZE:
+        if ((value < 0x4000) || (value > 0xFFFFFF)) {
+          throw HTTP2ConnectionError(PROTOCOL_ERROR, "invalid SETTINGS_MAX_FRAME_SIZE value");
+        }
+        this->peer_max_frame_size = value;
+        break;
+      default:
+        // We never push or open streams, so SETTINGS_MAX_CONCURRENT_STREAMS
+        // doesn't matter; SETTINGS_MAX_HEADER_LIST_SIZE is advisory, and
+        // unknown settings are ignored
+        break;
+    }
+  }
+
+  this->write_frame(SETTINGS, ACK, 0, nullptr, 0);
+  this->write_data();
+}
+
+void HTTP2Connection::process_window_update(uint32_t stream_id, uint32_t increment) {
+  if (stream_id == 0) {
+    if (increment == 0) {
+      throw HTTP2ConnectionError(PROTOCOL_ERROR, "WINDOW_UPDATE with zero increment");
+    }
+    this->send_window += increment;
+    if (this->send_window > MAX_WINDOW_SIZE) {
+      throw HTTP2ConnectionError(FLOW_CONTROL_ERROR, "connection window is too large");
+    }
+
+  } else {
+    auto it = this->streams.find(stream_id);
+    if (it == this->streams.end()) {
+      if (stream_id > this->last_stream_id) {
+        throw HTTP2ConnectionError(PROTOCOL_ERROR, "WINDOW_UPDATE frame on idle stream");
+      }
+      return; // The stream is already closed
+    }
+    HTTP2Stream* stream = it->second.get();
+    stream->send_window += increment;
+    if ((increment == 0) || (stream->send_window > MAX_WINDOW_SIZE)) {
+      this->reset_stream(stream_id, (increment == 0) ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+      this->close_stream(stream);
+      return;
+    }
+  }
+
+  this->write_data();
+}
+
+void HTTP2Connection::process_headers(uint32_t stream_id, uint8_t flags) {
+  // The block must be decoded even if the stream is then refused or ignored,
+  // since it may change the decoder's dynamic table
+  vector<pair<string, string>> headers;
+  bool within_limit;
+  try {
+    within_limit = this->decoder.decode(headers, this->header_block.data(),
+        this->header_block.size(), this->options->max_header_list_size);
+  } catch (const runtime_error& e) {
+    throw HTTP2ConnectionError(COMPRESSION_ERROR, e.what());
+  }
+  this->header_block.clear();
+  bool end_stream = flags & END_STREAM;
+
+  // A second header block on an open stream contains trailers, which are
+  // ignored; it must end the request
+  auto it = this->streams.find(stream_id);
+  if (it != this->streams.end()) {
+    HTTP2Stream* stream = it->second.get();
+    if (stream->remote_closed || !end_stream) {
+      this->reset_stream(stream_id, stream->remote_closed ? STREAM_CLOSED : PROTOCOL_ERROR);
+      this->close_stream(stream);
+      return;
+    }
+    stream->remote_closed = true;
+    this->dispatch(stream);
+    return;
+  }
+
+  if (!(stream_id & 1)) {
+    throw HTTP2ConnectionError(PROTOCOL_ERROR, "client used an even stream ID");
+  }
+  if (stream_id <= this->last_stream_id) {
+    // The stream was already closed; it can't be reopened (RFC 9113 section
+    // 5.1). This is only a stream error, since the client may have sent the
+    // frame before it received our RST_STREAM for the stream.
+    this->reset_stream(stream_id, STREAM_CLOSED);
+    return;
+  }
+  this->last_stream_id = stream_id;
+
+  // Handlers for streams the client reset keep running, so they count
+  // against the limit too; otherwise, a client could start unlimited handlers
+  // by opening and immediately resetting streams
+  size_t num_active = this->streams.size() + *this->running_orphaned_handlers;
+  if (this->going_away || (num_active >= this->options->max_concurrent_streams)) {
+    this->reset_stream(stream_id, REFUSED_STREAM);
+    return;
+  }
+  if (!within_limit) {
+    this->send_error_response(stream_id, 431, end_stream);
+    return;
+  }
+
+  HTTP2Stream* stream = this->open_stream(stream_id, end_stream, headers);
+  if (stream && this->continuation_weight) {
+    this->set_priority(stream, this->continuation_depends_on, this->continuation_weight);
+  }
+  if (stream && end_stream) {
+    stream->remote_closed = true;
+    this->dispatch(stream);
+  }
+}
+
+HTTP2Stream* HTTP2Connection::open_stream(
+    uint32_t stream_id,
+    bool end_stream,
+    vector<pair<string, string>>& headers) {
+  // Pseudo-header fields must come first, appear at most once each, and
+  // include :method, :scheme, and :path (CONNECT isn't supported). Field names
+  // must be lowercase, and connection-specific fields aren't allowed.
+  const string* method = nullptr;
+  const string* scheme = nullptr;
+  const string* path = nullptr;
+  const string* authority = nullptr;
+  bool malformed = false;
+  bool has_host = false;
+  bool regular_fields_started = false;
+  for (const auto& it : headers) {
+    const string& name = it.first;
+    if (name.empty()) {
+      malformed = true;
+    } else if (name[0] == ':') {
+      const string** target = nullptr;
+      if (name == ":method") {
+        target = &method;
+      } else if (name == ":scheme") {
+        target = &scheme;
+      } else if (name == ":path") {
+        target = &path;
+      } else if (name == ":authority") {
+        target = &authority;
+      }
+      if (regular_fields_started || !target || *target) {
+        malformed = true;
+      } else {
+        *target = &it.second;
+      }
+    } else {
+      regular_fields_started = true;
+      for (char ch : name) {
+        malformed |= ((ch >= 'A') && (ch <= 'Z'));
+      }
+      malformed |= is_connection_specific_header(name);
+      malformed |= ((name == "te") && (it.second != "trailers"));
+      has_host |= (name == "host");
+    }
+  }
+  if (malformed || !method || !scheme || !path || path->empty()) {
+    this->reset_stream(stream_id, PROTOCOL_ERROR);
+    return nullptr;
+  }
+
+  enum evhttp_cmd_type type;
+  if (!method_for_name(*method, &type)) {
+    this->send_error_response(stream_id, 501, end_stream);
+    return nullptr;
+  }
+
+  unique_ptr<struct evhttp_uri, void (*)(struct evhttp_uri*)> uri_elems(
+      evhttp_uri_parse_with_flags(path->c_str(), EVHTTP_URI_NONCONFORMANT),
+      evhttp_uri_free);
+  if (!uri_elems) {
+    this->send_error_response(stream_id, 400, end_stream);
+    return nullptr;
+  }
+
+  struct evhttp_request* req = evhttp_request_new(nullptr, nullptr);
+  if (!req) {
+    throw bad_alloc();
+  }
+  struct evkeyvalq* input_headers = evhttp_request_get_input_headers(req);
+
+  // Handlers expect a Host header, which is :authority in HTTP/2. Cookies may
+  // be split into multiple fields, which have to be joined for HTTP/1.x.
+  if (authority && !has_host) {
+    evhttp_add_header(input_headers, "Host", authority->c_str());
+  }
+  string cookie;
+  int64_t content_length = -1;
+  for (const auto& it : headers) {
+    const string& name = it.first;
+    if (name[0] == ':') {
+      continue;
+    }
+    if (name == "cookie") {
+      if (!cookie.empty()) {
+        cookie += "; ";
+      }
+      cookie += it.second;
+      continue;
+    }
+    if (name == "content-length") {
+      char* end;
+      content_length = strtoll(it.second.c_str(), &end, 10);
+      malformed |= (*end != '\0') || (content_length < 0) || it.second.empty();
+    }
+    // evhttp rejects values containing CR or LF, which are also malformed in
+    // HTTP/2
+    malformed |= evhttp_add_header(input_headers, name.c_str(), it.second.c_str()) != 0;
+  }
+  if (!cookie.empty()) {
+    malformed |= evhttp_add_header(input_headers, "cookie", cookie.c_str()) != 0;
+  }
+  if (malformed) {
+    evhttp_request_free(req);
+    this->reset_stream(stream_id, PROTOCOL_ERROR);
+    return nullptr;
+  }
+  if (content_length > static_cast<int64_t>(this->options->max_request_body_size)) {
+    evhttp_request_free(req);
+    this->send_error_response(stream_id, 413, end_stream);
+    return nullptr;
+  }
+
+  auto stream = make_unique<HTTP2Stream>(this, stream_id, req);
+  stream->expected_body_size = content_length;
+  stream->send_window = this->peer_initial_window_size;
+  stream->recv_window = this->options->initial_window_size;
+  stream->virtual_time = this->virtual_time;
+  HTTP2Stream* ret = stream.get();
+  this->streams.emplace(stream_id, std::move(stream));
+  http2_requests.emplace(req,
+      HTTP2Request{ret, type, *path, std::move(uri_elems), 0, nullptr});
+  return ret;
+}
+
+void HTTP2Connection::process_data(
+    uint32_t stream_id, uint8_t flags, struct evbuffer* input, size_t size) {
+  if (stream_id == 0) {
+    throw HTTP2ConnectionError(PROTOCOL_ERROR, "DATA frame on stream 0");
+  }
+
+  // The entire frame (including padding) counts against both windows, even if
+  // the stream is closed. Request bodies are only dispatched once they're
+  // complete, so withholding the connection's window until they're consumed
+  // would deadlock any request whose body is larger than the window. Instead,
+  // the window is replenished right away, and the memory used by buffered
+  // bodies is limited by max_buffered_body_size below.
+  if (static_cast<int64_t>(size) > this->recv_window) {
+    throw HTTP2ConnectionError(FLOW_CONTROL_ERROR, "client exceeded the connection window");
+  }
+  this->recv_window -= size;
+  this->recv_unacknowledged += size;
+  if (this->recv_unacknowledged >= (this->options->initial_window_size >> 1)) {
+    this->write_window_update(0, this->recv_unacknowledged);
+    this->recv_window += this->recv_unacknowledged;
+    this->recv_unacknowledged = 0;
+  }
+
+  size_t data_size = size;
+  size_t pad_size = 0;
+  if (flags & PADDED) {
+    uint8_t pad_size_byte;
+    if ((size == 0) || (evbuffer_remove(input, &pad_size_byte, 1) != 1)) {
+      throw HTTP2ConnectionError(FRAME_SIZE_ERROR, "DATA frame is too small");
+    }
+    pad_size = pad_size_byte;
+    data_size--;
+    if (pad_size > data_size) {
+      throw HTTP2ConnectionError(PROTOCOL_ERROR, "DATA padding is too large");
+    }
+    data_size -= pad_size;
+  }
+
+  auto it = this->streams.find(stream_id);
+  HTTP2Stream* stream = (it == this->streams.end()) ? nullptr : it->second.get();
+  if (!stream || stream->remote_closed) {
+    evbuffer_drain(input, data_size + pad_size);
+    if (stream_id > this->last_stream_id) {
+      throw HTTP2ConnectionError(PROTOCOL_ERROR, "DATA frame on idle stream");
+    }
+    if (stream) {
+      this->reset_stream(stream_id, STREAM_CLOSED);
+      this->close_stream(stream);
+    }
+    return;
+  }
+
+  if (static_cast<int64_t>(size) > stream->recv_window) {
+    evbuffer_drain(input, data_size + pad_size);
+    this->reset_stream(stream_id, FLOW_CONTROL_ERROR);
+    this->close_stream(stream);
+    return;
+  }
+  stream->recv_window -= size;
+  stream->recv_unacknowledged += size;
+
+  struct evbuffer* body = evhttp_request_get_input_buffer(stream->req);
+  size_t body_size = evbuffer_get_length(body) + data_size;
+  if ((stream->expected_body_size >= 0) &&
+      (body_size > static_cast<size_t>(stream->expected_body_size))) {
+    evbuffer_drain(input, data_size + pad_size);
+    this->reset_stream(stream_id, PROTOCOL_ERROR);
+    this->close_stream(stream);
+    return;
+  }
+  if (body_size > this->options->max_request_body_size) {
+    evbuffer_drain(input, data_size + pad_size);
+    this->close_stream(stream);
+    this->send_error_response(stream_id, 413, false);
+    return;
+  }
+  if (this->buffered_body_size + data_size > this->options->max_buffered_body_size) {
+    evbuffer_drain(input, data_size + pad_size);
+    this->reset_stream(stream_id, REFUSED_STREAM);
+    this->close_stream(stream);
+    return;
+  }
+  evbuffer_remove_buffer(input, body, data_size);
+  evbuffer_drain(input, pad_size);
+  this->buffered_body_size += data_size;
+
+  if (flags & END_STREAM) {
+    stream->remote_closed = true;
+    this->dispatch(stream);
+    return;
+  }
+  if (stream->recv_unacknowledged >= (this->options->initial_window_size >> 1)) {
+    this->write_window_update(stream_id, stream->recv_unacknowledged);
+    stream->recv_window += stream->recv_unacknowledged;
+    stream->recv_unacknowledged = 0;
+  }
+}
+
+void HTTP2Connection::set_priority(
+    HTTP2Stream* stream, uint32_t depends_on, uint16_t weight) {
+  // A stream can't depend on itself. Exclusive dependencies aren't supported;
+  // the stream just depends on the given stream without adopting its other
+  // dependents.
+  stream->depends_on = (depends_on == stream->id) ? 0 : depends_on;
+  stream->weight = weight;
+}
+
+void HTTP2Connection::dispatch(HTTP2Stream* stream) {
+  if ((stream->expected_body_size >= 0) &&
+      (evbuffer_get_length(evhttp_request_get_input_buffer(stream->req)) !=
+          static_cast<size_t>(stream->expected_body_size))) {
+    this->reset_stream(stream->id, PROTOCOL_ERROR);
+    this->close_stream(stream);
+    return;
+  }
+  // The handler may send its response (and the stream may be closed and
+  // destroyed) before this returns. The body belongs to the handler now, so it
+  // no longer counts as buffered.
+  this->buffered_body_size -= evbuffer_get_length(
+      evhttp_request_get_input_buffer(stream->req));
+  stream->dispatched = true;
+  this->cb(stream->req, this->cb_ctx);
+}
+
+void HTTP2Connection::send_error_response(
+    uint32_t stream_id, int code, bool request_complete) {
+  string block;
+  this->encoder.encode(block, ":status", to_string(code));
+  this->encoder.encode(block, "content-length", "0");
+  this->write_headers(stream_id, block, true);
+  // If the client is still sending the request, tell it to stop
+  if (!request_complete) {
+    this->reset_stream(stream_id, NO_ERROR);
+  }
+}
+
+void HTTP2Connection::send_response(
+    HTTP2Stream* stream, int code, struct evbuffer* body, bool end) {
+  if (stream->response_started) {
+    throw logic_error("response was already started");
+  }
+  auto& request = http2_requests.at(stream->req);
+  request.response_code = code;
+  stream->response_started = true;
+  stream->response_has_body = (request.command != EVHTTP_REQ_HEAD) &&
+      (code >= 200) && (code != 204) && (code != 304);
+  size_t body_size = body ? evbuffer_get_length(body) : 0;
+
+  string block;
+  this->encoder.encode(block, ":status", to_string(code));
+  bool has_date = false;
+  bool has_content_length = false;
+  string name;
+  struct evkeyvalq* output_headers = evhttp_request_get_output_headers(stream->req);
+  for (struct evkeyval* kv = output_headers->tqh_first; kv; kv = kv->next.tqe_next) {
+    name.assign(kv->key);
+    for (char& ch : name) {
+      ch = tolower(ch);
+    }
+    if (is_connection_specific_header(name)) {
+      continue;
+    }
+    has_date |= (name == "date");
+    has_content_length |= (name == "content-length");
+    this->encoder.encode(block, name, kv->value);
+  }
+  // evhttp adds a Date header to each response, so we do the same
+  if (!has_date) {
+    this->encoder.encode(block, "date", current_http_date());
+  }
+  if (end && stream->response_has_body && !has_content_length) {
+    this->encoder.encode(block, "content-length", to_string(body_size));
+  }
+
+  if (end) {
+    stream->response_ended = true;
+  }
+  if (!stream->response_has_body || (end && (body_size == 0))) {
+    if (body) {
+      evbuffer_drain(body, body_size);
+    }
+    this->write_headers(stream->id, block, true);
+    stream->local_closed = true;
+    if (stream->remote_closed && stream->response_ended) {
+      this->close_stream(stream);
+    }
+    return;
+  }
+
+  this->write_headers(stream->id, block, false);
+  if (body) {
+    this->send_data(stream, body);
+  } else {
+    this->write_data();
+  }
+}
+
+void HTTP2Connection::send_data(HTTP2Stream* stream, struct evbuffer* data) {
+  if (stream->local_closed) {
+    evbuffer_drain(data, evbuffer_get_length(data));
+    return;
+  }
+  // A stream that had nothing to send starts at the current virtual time, so
+  // it doesn't get extra turns for the time it was idle
+  stream->virtual_time = max(stream->virtual_time, this->virtual_time);
+  evbuffer_add_buffer(stream->output_buf.buf, data);
+  this->write_data();
+}
+
+void HTTP2Connection::end_response(HTTP2Stream* stream) {
+  stream->response_ended = true;
+  if (stream->local_closed) {
+    if (stream->remote_closed) {
+      this->close_stream(stream);
+    }
+  } else {
+    this->write_data();
+  }
+}
+
+void HTTP2Connection::write_frame_header(
+    struct evbuffer* buf,
+    size_t size,
+    uint8_t type,
+    uint8_t flags,
+    uint32_t stream_id) {
+  uint8_t header[FRAME_HEADER_SIZE] = {
+      static_cast<uint8_t>(size >> 16),
+      static_cast<uint8_t>(size >> 8),
+      static_cast<uint8_t>(size),
+      type,
+      flags,
+      0, 0, 0, 0};
+  put_u32b(&header[5], stream_id);
+  evbuffer_add(buf, header, FRAME_HEADER_SIZE);
+}
+
+void HTTP2Connection::write_frame(
+    uint8_t type, uint8_t flags, uint32_t stream_id, const void* data, size_t size) {
+  if (this->closed) {
+    return;
+  }
+  struct evbuffer* output = bufferevent_get_output(this->bev);
+  this->write_frame_header(output, size, type, flags, stream_id);
+  if (size) {
+    evbuffer_add(output, data, size);
+  }
+}
+
+void HTTP2Connection::write_headers(
+    uint32_t stream_id, const string& block, bool end_stream) {
+  // Blocks larger than the client's maximum frame size continue in
+  // CONTINUATION frames, which must immediately follow the HEADERS frame
+  size_t offset = 0;
+  do {
+    size_t size = min<size_t>(block.size() - offset, this->peer_max_frame_size);
+    bool last = (offset + size == block.size());
+    uint8_t type = (offset == 0) ? HEADERS : CONTINUATION;
+    uint8_t flags = (last ? END_HEADERS : 0) |
+        (((offset == 0) && end_stream) ? END_STREAM : 0);
+    this->write_frame(type, flags, stream_id, block.data() + offset, size);
+    offset += size;
+  } while (offset < block.size());
+}
+
+void HTTP2Connection::write_window_update(uint32_t stream_id, uint32_t increment) {
+  uint8_t payload[4];
+  put_u32b(payload, increment);
+  this->write_frame(WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+void HTTP2Connection::reset_stream(uint32_t stream_id, uint32_t error_code) {
+  uint8_t payload[4];
+  put_u32b(payload, error_code);
+  this->write_frame(RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+void HTTP2Connection::write_data() {
+  if (this->closing || this->closed) {
+    return;
+  }
+
+  // Each DATA frame goes to the sendable stream with the lowest virtual time,
+  // which then advances in inverse proportion to the stream's weight, so
+  // streams share the connection according to their weights. Streams whose
+  // parent stream has data to send wait for it, unless every sendable stream
+  // is waiting (which happens if the client's dependencies form a cycle).
+  struct evbuffer* output = bufferevent_get_output(this->bev);
+  while (evbuffer_get_length(output) < OUTPUT_HIGH_WATERMARK) {
+    HTTP2Stream* stream = nullptr;
+    HTTP2Stream* fallback_stream = nullptr;
+    for (const auto& it : this->streams) {
+      HTTP2Stream* s = it.second.get();
+      if (!s->is_sendable()) {
+        continue;
+      }
+      if (!fallback_stream || (s->virtual_time < fallback_stream->virtual_time)) {
+        fallback_stream = s;
+      }
+      if (s->depends_on) {
+        auto parent_it = this->streams.find(s->depends_on);
+        if ((parent_it != this->streams.end()) && parent_it->second->is_sendable()) {
+          continue;
+        }
+      }
+      if (!stream || (s->virtual_time < stream->virtual_time)) {
+        stream = s;
+      }
+    }
+    if (!stream) {
+      stream = fallback_stream;
+    }
+    if (!stream) {
+      break;
+    }
+
+    size_t available = stream->output_buf.get_length();
+    size_t size = 0;
+    if (available) {
+      size = min<size_t>({available, this->peer_max_frame_size,
+          static_cast<size_t>(stream->send_window),
+          static_cast<size_t>(this->send_window)});
+    }
+    bool end_stream = stream->response_ended && (size == available);
+    this->write_frame_header(output, size, DATA, end_stream ? END_STREAM : 0, stream->id);
+    evbuffer_remove_buffer(stream->output_buf.buf, output, size);
+    stream->send_window -= size;
+    this->send_window -= size;
+    this->virtual_time = stream->virtual_time;
+    stream->virtual_time += ((size + FRAME_HEADER_SIZE) << 8) / stream->weight;
+
+    if (end_stream) {
+      stream->local_closed = true;
+      if (stream->remote_closed) {
+        this->close_stream(stream);
+      }
+    }
+  }
+}
+
+void HTTP2Connection::close_stream(HTTP2Stream* stream) {
+  struct evhttp_request* req = stream->req;
+  auto it = http2_requests.find(req);
+  if (!stream->dispatched) {
+    this->buffered_body_size -= evbuffer_get_length(
+        evhttp_request_get_input_buffer(req));
+  }
+  if (stream->dispatched && !stream->response_ended) {
+    // The handler is still running; the request is freed when it ends its
+    // response. If it's streaming the response, tell it to stop.
+    it->second.stream = nullptr;
+    it->second.orphaned_handler_count = this->running_orphaned_handlers;
+    (*this->running_orphaned_handlers)++;
+    if (stream->close_cb) {
+      stream->close_cb(stream->close_cb_ctx);
+    }
+  } else if (!stream->dispatched) {
+    free_http2_request(it);
+  } else {
+    // The handler may still use the request until the function that ended the
+    // response returns, so it's freed on the next event loop iteration
+    it->second.stream = nullptr;
+    this->base.once(-1, EV_TIMEOUT, [req](evutil_socket_t, short) {
+      free_http2_request(http2_requests.find(req));
+    }, 0);
+  }
+  this->streams.erase(stream->id);
+
+  if (this->going_away && this->streams.empty()) {
+    this->go_away(NO_ERROR);
+  }
+}
+
+void HTTP2Connection::abort_streams() {
+  while (!this->streams.empty()) {
+    this->close_stream(this->streams.begin()->second.get());
+  }
+}
+
+void HTTP2Connection::go_away(uint32_t error_code) {
+  if (this->closing || this->closed) {
+    return;
+  }
+  this->closing = true;
+
+  uint8_t payload[8];
+  put_u32b(&payload[0], this->last_stream_id);
+  put_u32b(&payload[4], error_code);
+  this->write_frame(GOAWAY, 0, 0, payload, sizeof(payload));
+
+  // Responses that haven't been sent yet are abandoned; the connection closes
+  // as soon as the GOAWAY frame has been sent
+  this->abort_streams();
+  bufferevent_disable(this->bev, EV_READ);
+  if (evbuffer_get_length(bufferevent_get_output(this->bev)) == 0) {
+    this->close();
+  } else {
+    bufferevent_setwatermark(this->bev, EV_WRITE, 0, 0);
+  }
+}
+
+void HTTP2Connection::close() {
+  if (this->closed) {
+    return;
+  }
+  this->closed = true;
+  this->abort_streams();
+
+  evhttp_connection_set_closecb(this->evcon, nullptr, nullptr);
+  evhttp_connection_free(this->evcon);
+  this->evcon = nullptr;
+  this->bev = nullptr;
+
+  // This is called from the connection's callbacks, so the object can't be
+  // deleted until they return
+  this->base.once(-1, EV_TIMEOUT, [this](evutil_socket_t, short) {
+    delete this;
+  }, 0);
+}
+
+void send_http_reply(
+    struct evhttp_request* req, int code, const char* reason, struct evbuffer* body) {
+  auto it = http2_requests.find(req);
+  if (it == http2_requests.end()) {
+    evhttp_send_reply(req, code, reason, body);
+  } else if (!it->second.stream) {
+    free_http2_request(it);
+  } else {
+    it->second.stream->send_response(code, body, true);
+  }
+}
+
+void send_http_reply_start(
+    struct evhttp_request* req, int code, const char* reason) {
+  auto it = http2_requests.find(req);
+  if (it == http2_requests.end()) {
+    evhttp_send_reply_start(req, code, reason);
+  } else if (it->second.stream) {
+    it->second.stream->send_response(code, nullptr, false);
+  }
+}
+
+void send_http_reply_chunk(struct evhttp_request* req, struct evbuffer* data) {
+  auto it = http2_requests.find(req);
+  if (it == http2_requests.end()) {
+    evhttp_send_reply_chunk(req, data);
+  } else if (it->second.stream) {
+    it->second.stream->send_data(data);
+  }
+}
+
+void send_http_reply_end(struct evhttp_request* req) {
+  auto it = http2_requests.find(req);
+  if (it == http2_requests.end()) {
+    evhttp_send_reply_end(req);
+  } else if (!it->second.stream) {
+    free_http2_request(it);
+  } else {
+    it->second.stream->end_response();
+  }
+}
+
+bool is_http_request_connected(struct evhttp_request* req) {
+  auto it = http2_requests.find(req);
+  if (it == http2_requests.end()) {
+    return evhttp_request_get_connection(req) != nullptr;
+  }
+  return it->second.stream != nullptr;
+}
+
+enum evhttp_cmd_type get_http_request_command(struct evhttp_request* req) {
+  auto it = http2_requests.find(req);
+  return (it == http2_requests.end())
+      ? evhttp_request_get_command(req)
+      : it->second.command;
+}
+
+const char* get_http_request_uri(struct evhttp_request* req) {
+  auto it = http2_requests.find(req);
+  return (it == http2_requests.end())
+      ? evhttp_request_get_uri(req)
+      : it->second.uri.c_str();
+}
+
+const struct evhttp_uri* get_http_request_evhttp_uri(struct evhttp_request* req) {
+  auto it = http2_requests.find(req);
+  return (it == http2_requests.end())
+      ? evhttp_request_get_evhttp_uri(req)
+      : it->second.uri_elems.get();
+}
+
+int get_http_request_response_code(struct evhttp_request* req) {
+  auto it = http2_requests.find(req);
+  return (it == http2_requests.end())
+      ? evhttp_request_get_response_code(req)
+      : it->second.response_code;
+}
+
+} // namespace EventAsync::HTTP
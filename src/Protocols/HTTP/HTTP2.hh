@@ -0,0 +1,280 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../Base.hh"
+#include "../../Buffer.hh"
+#include "HPACK.hh"
+
+namespace EventAsync::HTTP {
+
+// Settings for HTTP/2 connections (RFC 9113) on a Server.
+struct HTTP2Options {
+  bool enabled = false;
+  // If true, HTTP/2 is also accepted on non-TLS sockets from clients that
+  // start the connection with the HTTP/2 preface ("prior knowledge"). On TLS
+  // sockets, HTTP/2 is negotiated with ALPN.
+  bool allow_cleartext = true;
+  // Streams opened beyond this limit are refused (the client can retry them
+  // once others complete). Streams the client has reset still count until
+  // their handlers finish.
+  uint32_t max_concurrent_streams = 100;
+  // The flow-control window for each request body and for the connection as a
+  // whole. Larger windows allow faster uploads on high-latency links.
+  uint32_t initial_window_size = 0x100000;
+  // Requests whose headers are larger than this (as defined for
+  // SETTINGS_MAX_HEADER_LIST_SIZE) get a 431 response.
+  size_t max_header_list_size = 0x10000;
+  // Requests whose bodies are larger than this get a 413 response.
+  size_t max_request_body_size = 64 * 1024 * 1024;
+  // Request bodies are buffered until they're complete, and the flow-control
+  // windows are replenished as data arrives, so this limits the total size of
+  // the incomplete bodies buffered for each connection. A stream whose body
+  // would exceed it is reset with REFUSED_STREAM (so the client can retry it
+  // once other requests have completed).
+  size_t max_buffered_body_size = 64 * 1024 * 1024;
+};
+
+class HTTP2Connection;
+
+// One request and its response on an HTTP/2 connection. Handlers don't use
+// this directly; requests that arrive over HTTP/2 are regular evhttp_request
+// objects, and responses to them are sent with the send_http_reply functions
+// below, which frame the response on the request's stream. Their methods and
+// URIs must be read through Request (or the get_http_request functions below)
+// rather than with evhttp's getters.
+class HTTP2Stream {
+public:
+  HTTP2Stream(HTTP2Connection* conn, uint32_t id, struct evhttp_request* req);
+  HTTP2Stream(const HTTP2Stream&) = delete;
+  HTTP2Stream(HTTP2Stream&&) = delete;
+  HTTP2Stream& operator=(const HTTP2Stream&) = delete;
+  HTTP2Stream& operator=(HTTP2Stream&&) = delete;
+  ~HTTP2Stream() = default;
+
+  // Returns the stream that req arrived on, or nullptr if req is an HTTP/1.x
+  // request or its stream has been closed.
+  static HTTP2Stream* for_request(struct evhttp_request* req);
+
+  // Returns the buffer holding response body data that hasn't been sent yet.
+  // Data is removed from it as it's sent in DATA frames, which may be delayed
+  // by flow control or by other streams on the same connection.
+  struct evbuffer* get_output_buffer();
+
+  // Sets a function to be called if the stream is closed before the response
+  // is complete (because the client reset the stream or the connection was
+  // closed). The stream must not be used after this is called.
+  void set_close_callback(void (*cb)(void* ctx), void* ctx);
+
+  // Sends the response headers (from the request's output headers). If end is
+  // true, body (which may be null) is the entire response body, and is drained;
+  // otherwise, the body is sent later with send_data and end_response. The
+  // stream may be closed and destroyed before any of these return.
+  void send_response(int code, struct evbuffer* body, bool end);
+  void send_data(struct evbuffer* data);
+  void end_response();
+
+protected:
+  friend class HTTP2Connection;
+
+  HTTP2Connection* conn;
+  uint32_t id;
+  struct evhttp_request* req;
+  Buffer output_buf;
+
+  // remote_closed means the request is complete (the client sent END_STREAM);
+  // local_closed means the response is complete and END_STREAM was sent
+  bool remote_closed;
+  bool local_closed;
+  bool dispatched;
+  bool response_started;
+  bool response_ended;
+  bool response_has_body;
+  int64_t expected_body_size;
+
+  int64_t send_window;
+  int64_t recv_window;
+  size_t recv_unacknowledged;
+
+  // Priority (RFC 7540 section 5.3). Streams with data to send are served in
+  // proportion to their weights; a stream waits while the stream it depends
+  // on has data to send.
+  uint32_t depends_on;
+  uint16_t weight;
+  uint64_t virtual_time;
+
+  void (*close_cb)(void* ctx);
+  void* close_cb_ctx;
+
+  bool is_sendable() const;
+};
+
+// An HTTP/2 connection taken over from evhttp. Server creates these through
+// watch(); they delete themselves when the connection closes.
+class HTTP2Connection {
+public:
+  // Called with each complete request (the same signature as evhttp's request
+  // callbacks).
+  using RequestCallback = void (*)(struct evhttp_request* req, void* ctx);
+
+  // Watches a new connection for the HTTP/2 connection preface. This must be
+  // called from evhttp's bufferevent callback (see evhttp_set_bevcb), with the
+  // bufferevent it returns. If the client starts the connection with the
+  // preface, the connection is taken over from evhttp and served as HTTP/2;
+  // otherwise, evhttp handles it as usual. options must remain valid as long
+  // as the connection is open.
+  static void watch(
+      Base& base,
+      struct bufferevent* bev,
+      const HTTP2Options* options,
+      RequestCallback cb,
+      void* cb_ctx);
+
+  // Sets up ALPN on ctx so that TLS clients can negotiate HTTP/2 ("h2") or
+  // HTTP/1.1. This affects all connections that use ctx.
+  static void enable_alpn(SSL_CTX* ctx);
+
+  HTTP2Connection(
+      Base& base,
+      struct bufferevent* bev,
+      struct evhttp_connection* evcon,
+      const HTTP2Options* options,
+      RequestCallback cb,
+      void* cb_ctx);
+  HTTP2Connection(const HTTP2Connection&) = delete;
+  HTTP2Connection(HTTP2Connection&&) = delete;
+  HTTP2Connection& operator=(const HTTP2Connection&) = delete;
+  HTTP2Connection& operator=(HTTP2Connection&&) = delete;
+  ~HTTP2Connection();
+
+  Base& base;
+
+protected:
+  struct bufferevent* bev;
+  struct evhttp_connection* evcon;
+  const HTTP2Options* options;
+  RequestCallback cb;
+  void* cb_ctx;
+
+  HPACKDecoder decoder;
+  HPACKEncoder encoder;
+
+  bool preface_received;
+  bool settings_received;
+  bool going_away;
+  bool closing;
+  bool closed;
+
+  std::map<uint32_t, std::unique_ptr<HTTP2Stream>> streams;
+  uint32_t last_stream_id;
+  // The number of handlers still running for streams that were closed before
+  // their responses were complete. This is shared with the requests, since
+  // the handlers may outlive the connection.
+  std::shared_ptr<size_t> running_orphaned_handlers;
+  uint64_t virtual_time;
+
+  // A header block that's continued in CONTINUATION frames is collected here,
+  // along with the HEADERS frame's flags and priority
+  uint32_t continuation_stream_id;
+  uint8_t continuation_flags;
+  uint32_t continuation_depends_on;
+  uint16_t continuation_weight;
+  size_t continuation_frame_count;
+  std::string header_block;
+
+  // The total size of the request bodies buffered for streams that haven't
+  // been dispatched yet
+  size_t buffered_body_size;
+
+  // Peer settings
+  uint32_t peer_initial_window_size;
+  uint32_t peer_max_frame_size;
+
+  int64_t send_window;
+  int64_t recv_window;
+  size_t recv_unacknowledged;
+
+  void process_input();
+  void process_frame(
+      uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload);
+  void process_headers(uint32_t stream_id, uint8_t flags);
+  void process_data(
+      uint32_t stream_id, uint8_t flags, struct evbuffer* input, size_t size);
+  void process_settings(const std::string& payload);
+  void process_window_update(uint32_t stream_id, uint32_t increment);
+  void set_priority(
+      HTTP2Stream* stream, uint32_t depends_on, uint16_t weight);
+
+  HTTP2Stream* open_stream(
+      uint32_t stream_id,
+      bool end_stream,
+      std::vector<std::pair<std::string, std::string>>& headers);
+  void dispatch(HTTP2Stream* stream);
+  void send_error_response(uint32_t stream_id, int code, bool request_complete);
+  void send_response(
+      HTTP2Stream* stream, int code, struct evbuffer* body, bool end);
+  void send_data(HTTP2Stream* stream, struct evbuffer* data);
+  void end_response(HTTP2Stream* stream);
+
+  void write_frame_header(
+      struct evbuffer* buf,
+      size_t size,
+      uint8_t type,
+      uint8_t flags,
+      uint32_t stream_id);
+  void write_frame(
+      uint8_t type, uint8_t flags, uint32_t stream_id, const void* data, size_t size);
+  void write_headers(
+      uint32_t stream_id, const std::string& block, bool end_stream);
+  void write_window_update(uint32_t stream_id, uint32_t increment);
+  void write_data();
+  void reset_stream(uint32_t stream_id, uint32_t error_code);
+
+  void close_stream(HTTP2Stream* stream);
+  void abort_streams();
+  void go_away(uint32_t error_code);
+  void close();
+
+  static void on_read(struct bufferevent* bev, void* ctx);
+  static void on_write(struct bufferevent* bev, void* ctx);
+  static void on_event(struct bufferevent* bev, short what, void* ctx);
+  static void on_evhttp_close(struct evhttp_connection* evcon, void* ctx);
+
+  friend class HTTP2Stream;
+  friend struct PrefaceWatcher;
+};
+
+// Server sends all responses through these functions. They work like the
+// evhttp functions with the same names (without the http_ part), but also
+// handle requests that arrived over HTTP/2.
+void send_http_reply(
+    struct evhttp_request* req, int code, const char* reason, struct evbuffer* body);
+void send_http_reply_start(
+    struct evhttp_request* req, int code, const char* reason);
+void send_http_reply_chunk(struct evhttp_request* req, struct evbuffer* data);
+void send_http_reply_end(struct evhttp_request* req);
+
+// Returns false if the client can no longer receive the response to req,
+// because it disconnected or (over HTTP/2) reset the request's stream.
+bool is_http_request_connected(struct evhttp_request* req);
+
+// These work like the evhttp_request_get_* functions with the same names, but
+// also handle requests that arrived over HTTP/2, whose method, URI, and
+// response code aren't stored in the evhttp_request.
+enum evhttp_cmd_type get_http_request_command(struct evhttp_request* req);
+const char* get_http_request_uri(struct evhttp_request* req);
+const struct evhttp_uri* get_http_request_evhttp_uri(struct evhttp_request* req);
+int get_http_request_response_code(struct evhttp_request* req);
+
+} // namespace EventAsync::HTTP
@@ -1,9 +1,16 @@
 #include "Request.hh"
 
-#include <phosg/Strings.hh>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <phosg/Time.hh>
+#include <stdexcept>
 
 #include "Connection.hh"
+#include "HTTP2.hh"
 
 using namespace std;
 
@@ -12,12 +19,14 @@ namespace EventAsync::HTTP {
 Request::Request(Base& base)
     : base(base),
       req(evhttp_request_new(&Request::on_response, this)),
-      owned(false),
+      owned(true),
       is_complete(false),
-      awaiter(nullptr) {
+      awaiter(nullptr),
+      error(nullptr) {
   if (!this->req) {
     throw bad_alloc();
   }
+  evhttp_request_set_error_cb(this->req, &Request::on_error);
 }
 
 Request::Request(Base& base, struct evhttp_request* req)
@@ -38,65 +47,218 @@ Request::~Request() {
   }
 }
 
-unordered_multimap<string, string> Request::parse_url_params() {
-  const struct evhttp_uri* uri = evhttp_request_get_evhttp_uri(this->req);
-  const char* query = evhttp_uri_get_query(uri);
-  return this->parse_url_params(query);
+// Counts the '&' separators in a query, and checks whether it contains any
+// characters that have to be decoded ('%' or '+')
+static size_t scan_query(const char* data, size_t size, bool* needs_decoding) {
+  size_t num_separators = 0;
+  bool decode = false;
+  size_t x = 0;
+#if defined(__SSE2__)
+  const __m128i amp_v = _mm_set1_epi8('&');
+  const __m128i percent_v = _mm_set1_epi8('%');
+  const __m128i plus_v = _mm_set1_epi8('+');
+  __m128i decode_v = _mm_setzero_si128();
+  for (; x + 16 <= size; x += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + x));
+    num_separators += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, amp_v)));
+    decode_v = _mm_or_si128(decode_v,
+        _mm_or_si128(_mm_cmpeq_epi8(v, percent_v), _mm_cmpeq_epi8(v, plus_v)));
+  }
+  decode = (_mm_movemask_epi8(decode_v) != 0);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t amp_v = vdupq_n_u8('&');
+  const uint8x16_t percent_v = vdupq_n_u8('%');
+  const uint8x16_t plus_v = vdupq_n_u8('+');
+  const uint8x16_t one_v = vdupq_n_u8(1);
+  uint8x16_t decode_v = vdupq_n_u8(0);
+  for (; x + 16 <= size; x += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + x));
+    num_separators += vaddvq_u8(vandq_u8(vceqq_u8(v, amp_v), one_v));
+    decode_v = vorrq_u8(decode_v,
+        vorrq_u8(vceqq_u8(v, percent_v), vceqq_u8(v, plus_v)));
+  }
+  decode = (vmaxvq_u8(decode_v) != 0);
+#endif
+  for (; x < size; x++) {
+    num_separators += (data[x] == '&');
+    decode |= (data[x] == '%') || (data[x] == '+');
+  }
+  *needs_decoding = decode;
+  return num_separators;
 }
 
-unordered_multimap<string, string> Request::parse_url_params(const char* query) {
-  unordered_multimap<string, string> params;
-  if (*query == '\0') {
-    return params;
-  }
-  for (auto it : split(query, '&')) {
-    size_t first_equals = it.find('=');
-    if (first_equals != string::npos) {
-      string value(it, first_equals + 1);
-
-      size_t write_offset = 0, read_offset = 0;
-      for (; read_offset < value.size(); write_offset++) {
-        if ((value[read_offset] == '%') && (read_offset < value.size() - 2)) {
-          value[write_offset] =
-              static_cast<char>(value_for_hex_char(value[read_offset + 1]) << 4) |
-              static_cast<char>(value_for_hex_char(value[read_offset + 2]));
-          read_offset += 3;
-        } else if (value[write_offset] == '+') {
-          value[write_offset] = ' ';
-          read_offset++;
-        } else {
-          value[write_offset] = value[read_offset];
-          read_offset++;
-        }
+static int hex_digit_value(char ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  } else if (ch >= 'A' && ch <= 'F') {
+    return ch - 'A' + 10;
+  } else if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  return -1;
+}
+
+// Decodes a query parameter's name or value into dest, which must have room
+// for at least src.size() bytes. Returns the number of bytes written. '%' signs
+// that aren't followed by two hex digits are left as-is.
+static size_t decode_query_component(char* dest, string_view src) {
+  size_t write_offset = 0;
+  for (size_t read_offset = 0; read_offset < src.size(); read_offset++) {
+    char ch = src[read_offset];
+    if (ch == '+') {
+      ch = ' ';
+    } else if ((ch == '%') && (read_offset + 2 < src.size())) {
+      int high = hex_digit_value(src[read_offset + 1]);
+      int low = hex_digit_value(src[read_offset + 2]);
+      if ((high >= 0) && (low >= 0)) {
+        ch = static_cast<char>((high << 4) | low);
+        read_offset += 2;
       }
-      value.resize(write_offset);
+    }
+    dest[write_offset++] = ch;
+  }
+  return write_offset;
+}
+
+QueryParams::QueryParams(string_view query) {
+  if (query.empty()) {
+    return;
+  }
+
+  bool needs_decoding;
+  size_t num_separators = scan_query(query.data(), query.size(), &needs_decoding);
+  this->params.reserve(num_separators + 1);
 
-      params.emplace(piecewise_construct, forward_as_tuple(it, 0, first_equals),
-          forward_as_tuple(value));
+  // Decoding never makes a component longer, so all decoded components fit in
+  // a buffer the size of the query
+  char* decoded_end = nullptr;
+  if (needs_decoding) {
+    this->decoded.reset(new char[query.size()]);
+    decoded_end = this->decoded.get();
+  }
+  auto decode_component = [&](string_view component) -> string_view {
+    if (!decoded_end || (component.find_first_of("%+") == string_view::npos)) {
+      return component;
+    }
+    char* start = decoded_end;
+    decoded_end += decode_query_component(start, component);
+    return string_view(start, decoded_end - start);
+  };
+
+  size_t offset = 0;
+  while (offset < query.size()) {
+    size_t end_offset = query.find('&', offset);
+    if (end_offset == string_view::npos) {
+      end_offset = query.size();
+    }
+    string_view param = query.substr(offset, end_offset - offset);
+    offset = end_offset + 1;
+    if (param.empty()) {
+      continue;
+    }
+
+    size_t equals_offset = param.find('=');
+    if (equals_offset == string_view::npos) {
+      this->params.emplace_back(decode_component(param), string_view());
     } else {
-      params.emplace(it, "");
+      this->params.emplace_back(
+          decode_component(param.substr(0, equals_offset)),
+          decode_component(param.substr(equals_offset + 1)));
+    }
+  }
+}
+
+size_t QueryParams::size() const {
+  return this->params.size();
+}
+
+bool QueryParams::empty() const {
+  return this->params.empty();
+}
+
+const QueryParams::Param& QueryParams::operator[](size_t index) const {
+  return this->params.at(index);
+}
+
+vector<QueryParams::Param>::const_iterator QueryParams::begin() const {
+  return this->params.begin();
+}
+
+vector<QueryParams::Param>::const_iterator QueryParams::end() const {
+  return this->params.end();
+}
+
+bool QueryParams::has(string_view name) const {
+  for (const auto& it : this->params) {
+    if (it.first == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+string_view QueryParams::get(string_view name) const {
+  for (const auto& it : this->params) {
+    if (it.first == name) {
+      return it.second;
     }
   }
-  return params;
+  throw out_of_range("query does not have parameter " + string(name));
+}
+
+string_view QueryParams::get(string_view name, string_view default_value) const {
+  for (const auto& it : this->params) {
+    if (it.first == name) {
+      return it.second;
+    }
+  }
+  return default_value;
+}
+
+QueryParams Request::get_query_params() const {
+  const char* query = evhttp_uri_get_query(this->get_evhttp_uri());
+  return query ? QueryParams(query) : QueryParams();
+}
+
+unordered_multimap<string, string> Request::parse_url_params() {
+  const char* query = evhttp_uri_get_query(this->get_evhttp_uri());
+  return this->parse_url_params(query);
+}
+
+unordered_multimap<string, string> Request::parse_url_params(const char* query) {
+  unordered_multimap<string, string> ret;
+  if (!query) {
+    return ret;
+  }
+  QueryParams params(query);
+  ret.reserve(params.size());
+  for (const auto& it : params) {
+    ret.emplace(it.first, it.second);
+  }
+  return ret;
 }
 
 unordered_map<string, string> Request::parse_url_params_unique() {
-  const struct evhttp_uri* uri = evhttp_request_get_evhttp_uri(this->req);
-  const char* query = evhttp_uri_get_query(uri);
+  const char* query = evhttp_uri_get_query(this->get_evhttp_uri());
   return this->parse_url_params_unique(query);
 }
 
 unordered_map<string, string> Request::parse_url_params_unique(
     const char* query) {
   unordered_map<string, string> ret;
-  for (const auto& it : Request::parse_url_params(query)) {
-    ret.emplace(it.first, std::move(it.second));
+  if (!query) {
+    return ret;
+  }
+  QueryParams params(query);
+  ret.reserve(params.size());
+  for (const auto& it : params) {
+    ret.emplace(it.first, it.second);
   }
   return ret;
 }
 
 enum evhttp_cmd_type Request::get_command() const {
-  return evhttp_request_get_command(this->req);
+  return get_http_request_command(this->req);
 }
 
 struct evhttp_connection* Request::get_connection() {
@@ -104,7 +266,7 @@ struct evhttp_connection* Request::get_connection() {
 }
 
 const struct evhttp_uri* Request::get_evhttp_uri() const {
-  return evhttp_request_get_evhttp_uri(this->req);
+  return get_http_request_evhttp_uri(this->req);
 }
 
 const char* Request::get_host() const {
@@ -138,26 +300,72 @@ void Request::add_output_header(const char* header_name, const char* value) {
 }
 
 int Request::get_response_code() {
-  return evhttp_request_get_response_code(this->req);
+  return get_http_request_response_code(this->req);
 }
 
 const char* Request::get_uri() {
-  return evhttp_request_get_uri(this->req);
+  return get_http_request_uri(this->req);
 }
 
-void Request::on_response(struct evhttp_request*, void* ctx) {
+void Request::on_response(struct evhttp_request* evreq, void* ctx) {
   auto* req = reinterpret_cast<Request*>(ctx);
 
-  // By default, calling evhttp_make_request causes the request to become owned
-  // by the connection object. We don't want that here - the caller is a
-  // coroutine, and will need to examine the result after this callback returns.
-  // Fortunately, libevent allows us to override the default ownership behavior.
-  evhttp_request_own(req->req);
+  if (!evreq) {
+    // The request failed, and evhttp has already freed it (on_error is called
+    // just before this, but not for every kind of failure)
+    req->req = nullptr;
+    req->owned = false;
+    if (!req->error) {
+      req->error = "request failed";
+    }
+  } else {
+    // By default, calling evhttp_make_request causes the request to become
+    // owned by the connection object. We don't want that here - the caller is
+    // a coroutine, and will need to examine the result after this callback
+    // returns. Fortunately, libevent allows us to override the default
+    // ownership behavior.
+    evhttp_request_own(evreq);
+    req->owned = true;
+    // If the connection couldn't be opened, evhttp calls this with the
+    // request but no response
+    if (!req->error && (evhttp_request_get_response_code(evreq) == 0)) {
+      req->error = "cannot connect to server";
+    }
+  }
 
   req->is_complete = true;
   if (req->awaiter) {
-    auto* aw = reinterpret_cast<Connection::Awaiter*>(req->awaiter);
-    aw->on_response();
+    // evhttp still uses the request and connection after this callback
+    // returns, but the coroutine may destroy both as soon as it's resumed, so
+    // it has to be resumed from the event loop instead of from here
+    req->base.once(-1, EV_TIMEOUT, &Connection::Awaiter::dispatch_on_response,
+        req->awaiter, 0);
+  }
+}
+
+void Request::on_error(enum evhttp_request_error error, void* ctx) {
+  auto* req = reinterpret_cast<Request*>(ctx);
+  switch (error) {
+    case EVREQ_HTTP_TIMEOUT:
+      req->error = "request timed out";
+      break;
+    case EVREQ_HTTP_EOF:
+      req->error = "connection closed before the response was complete";
+      break;
+    case EVREQ_HTTP_INVALID_HEADER:
+      req->error = "response has invalid headers";
+      break;
+    case EVREQ_HTTP_BUFFER_ERROR:
+      req->error = "cannot read or write connection";
+      break;
+    case EVREQ_HTTP_REQUEST_CANCEL:
+      req->error = "request was canceled";
+      break;
+    case EVREQ_HTTP_DATA_TOO_LONG:
+      req->error = "response is too large";
+      break;
+    default:
+      req->error = "request failed";
   }
 }
 
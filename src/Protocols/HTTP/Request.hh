@@ -3,13 +3,55 @@
 #include <event2/event.h>
 #include <event2/http.h>
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "../../Buffer.hh"
 
 namespace EventAsync::HTTP {
 
+// Parameters from a URL query string (application/x-www-form-urlencoded), in
+// the order they appear. Names and values are views into the query string,
+// except for those containing percent-escapes or '+', which are decoded into a
+// single buffer owned by this object; parsing a query allocates memory at most
+// twice, regardless of how many parameters it has. The views are valid as long
+// as both this object and the query string exist (for a request's query, until
+// the response is sent). Empty parameters (as in "a=1&&b=2") are skipped.
+class QueryParams {
+public:
+  using Param = std::pair<std::string_view, std::string_view>;
+
+  QueryParams() = default;
+  explicit QueryParams(std::string_view query);
+  QueryParams(const QueryParams&) = delete;
+  QueryParams(QueryParams&&) = default;
+  QueryParams& operator=(const QueryParams&) = delete;
+  QueryParams& operator=(QueryParams&&) = default;
+  ~QueryParams() = default;
+
+  size_t size() const;
+  bool empty() const;
+  const Param& operator[](size_t index) const;
+  std::vector<Param>::const_iterator begin() const;
+  std::vector<Param>::const_iterator end() const;
+
+  // Returns true if any parameter has this name.
+  bool has(std::string_view name) const;
+  // Returns the value of the first parameter with this name. The first
+  // version throws out_of_range if there's no such parameter; the second
+  // returns default_value instead.
+  std::string_view get(std::string_view name) const;
+  std::string_view get(std::string_view name, std::string_view default_value) const;
+
+private:
+  std::vector<Param> params;
+  std::unique_ptr<char[]> decoded;
+};
+
 struct Request {
   Request(Base& base);
   Request(Base& base, struct evhttp_request* req);
@@ -19,6 +61,12 @@ struct Request {
   Request& operator=(Request&& req) = delete;
   ~Request();
 
+  // These parse the request's query (or the given query, which may be null)
+  // into QueryParams. The versions that return maps copy every name and value,
+  // so prefer get_query_params for requests with many parameters.
+  // parse_url_params_unique keeps the first value of each parameter.
+  QueryParams get_query_params() const;
+
   static std::unordered_multimap<std::string, std::string> parse_url_params(
       const char* query);
   static std::unordered_map<std::string, std::string> parse_url_params_unique(
@@ -54,8 +102,12 @@ struct Request {
   // created.
   bool is_complete; // only relevant for outbound requests
   void* awaiter;
+  // If an outbound request failed (evhttp frees the request in that case, so
+  // req is null afterward), this describes why
+  const char* error;
 
   static void on_response(struct evhttp_request* req, void* ctx);
+  static void on_error(enum evhttp_request_error error, void* ctx);
 };
 
 } // namespace EventAsync::HTTP
@@ -0,0 +1,829 @@
+#include "RequestBodyStream.hh"
+
+#include <string.h>
+#include <strings.h>
+
+#include <string_view>
+#include <unordered_map>
+
+#include "Router.hh"
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+// Requests whose headers are longer than this (or chunk size lines longer
+// than MAX_LINE_SIZE) aren't parsed; they're passed through to evhttp, which
+// applies its own limits
+static const size_t MAX_HEADERS_SIZE = 0x10000;
+static const size_t MAX_LINE_SIZE = 0x1000;
+
+// Each connection's filter is registered here so that handlers can find it
+// from the request. Connections are only ever used on one thread, so this
+// doesn't need to be locked.
+static thread_local unordered_map<struct bufferevent*, RequestBodyFilter*> filter_for_bufferevent;
+
+static bool method_for_name(string_view name, enum evhttp_cmd_type* method) {
+  // These are case-sensitive, as in evhttp
+  static const unordered_map<string_view, enum evhttp_cmd_type> methods({
+      {"GET", EVHTTP_REQ_GET},
+      {"POST", EVHTTP_REQ_POST},
+      {"HEAD", EVHTTP_REQ_HEAD},
+      {"PUT", EVHTTP_REQ_PUT},
+      {"DELETE", EVHTTP_REQ_DELETE},
+      {"OPTIONS", EVHTTP_REQ_OPTIONS},
+      {"TRACE", EVHTTP_REQ_TRACE},
+      {"CONNECT", EVHTTP_REQ_CONNECT},
+      {"PATCH", EVHTTP_REQ_PATCH},
+  });
+  auto it = methods.find(name);
+  if (it == methods.end()) {
+    return false;
+  }
+  *method = it->second;
+  return true;
+}
+
+static string_view trim_whitespace(string_view s) {
+  size_t start = s.find_first_not_of(" \t");
+  if (start == string_view::npos) {
+    return string_view();
+  }
+  return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+static bool header_name_equals(string_view name, const char* expected) {
+  size_t expected_size = strlen(expected);
+  return (name.size() == expected_size) &&
+      !strncasecmp(name.data(), expected, expected_size);
+}
+
+// Parses a chunk size line. Chunk extensions (after a ; or whitespace) are
+// ignored.
+static bool parse_chunk_size(string_view line, uint64_t* size) {
+  size_t end = line.find_first_of("; \t");
+  string_view digits = line.substr(0, end);
+  if (digits.empty() || (digits.size() > 15)) {
+    return false;
+  }
+  uint64_t ret = 0;
+  for (char ch : digits) {
+    ret <<= 4;
+    if ((ch >= '0') && (ch <= '9')) {
+      ret |= (ch - '0');
+    } else if ((ch >= 'a') && (ch <= 'f')) {
+      ret |= (ch - 'a' + 10);
+    } else if ((ch >= 'A') && (ch <= 'F')) {
+      ret |= (ch - 'A' + 10);
+    } else {
+      return false;
+    }
+  }
+  *size = ret;
+  return true;
+}
+
+RequestBodyFilter::RequestBodyFilter(Base& base, const Router& router)
+    : base(base),
+      router(router),
+      bev(nullptr),
+      underlying(nullptr),
+      output_cb_entry(nullptr),
+      underlying_output_cb_entry(nullptr),
+      flush_event(base, 0, &RequestBodyFilter::on_flush_event, this),
+      flush_scheduled(false),
+      write_callback_pending(false),
+      state(State::HEADERS),
+      streaming_body(false),
+      body_bytes_remaining(0),
+      stream_active(false),
+      stream_method(EVHTTP_REQ_GET),
+      stream_req(nullptr),
+      stream_content_length(-1),
+      stream_body_complete(false),
+      stream_body_error(false),
+      stream_body_discarded(false),
+      stream_continue_pending(false),
+      read_enabled_for_body(false),
+      paused_for_queue(false),
+      queue(base),
+      reader(nullptr),
+      waiting_coro(nullptr) {}
+
+RequestBodyFilter::~RequestBodyFilter() {
+  filter_for_bufferevent.erase(this->bev);
+  // The underlying bufferevent is freed after this, so it could still call
+  // our callback if it writes any more data
+  if (this->underlying_output_cb_entry) {
+    evbuffer_remove_cb_entry(
+        bufferevent_get_output(this->underlying), this->underlying_output_cb_entry);
+  }
+  if (this->output_cb_entry) {
+    evbuffer_remove_cb_entry(bufferevent_get_output(this->bev), this->output_cb_entry);
+  }
+
+  // Give any data that hasn't been read yet to the reader, so it can still
+  // read the body if the client sent all of it before disconnecting
+  if (this->reader) {
+    this->reader->buffered_body.add_buffer(this->queue);
+    this->reader->body_received = this->stream_body_complete &&
+        !this->stream_body_discarded;
+    this->reader->filter = nullptr;
+    this->resume_reader();
+  }
+}
+
+struct bufferevent* RequestBodyFilter::create(
+    Base& base, struct bufferevent* underlying, const Router& router) {
+  auto* f = new RequestBodyFilter(base, router);
+  f->underlying = underlying;
+  f->bev = bufferevent_filter_new(
+      underlying,
+      &RequestBodyFilter::process_input,
+      &RequestBodyFilter::process_output,
+      BEV_OPT_CLOSE_ON_FREE,
+      &RequestBodyFilter::free_filter,
+      f);
+  if (!f->bev) {
+    delete f;
+    return underlying;
+  }
+  filter_for_bufferevent.emplace(f->bev, f);
+  f->output_cb_entry = evbuffer_add_cb(
+      bufferevent_get_output(f->bev), &RequestBodyFilter::on_output_changed, f);
+  f->underlying_output_cb_entry = evbuffer_add_cb(
+      bufferevent_get_output(underlying),
+      &RequestBodyFilter::on_underlying_output_changed,
+      f);
+  if (!f->output_cb_entry || !f->underlying_output_cb_entry) {
+    // This frees the underlying bufferevent and the filter object too
+    bufferevent_free(f->bev);
+    return nullptr;
+  }
+
+  // When the filter consumes body data without passing anything to evhttp, it
+  // still reports progress (so libevent resets the connection's read timeout
+  // while a body is being streamed). With a low watermark of 1, evhttp's read
+  // callback isn't called when there's nothing for it to read, which matters
+  // because evhttp aborts if it's called while waiting for a response. The
+  // high watermark on the underlying bufferevent makes it stop reading from
+  // the socket when the filter stops consuming data.
+  bufferevent_setwatermark(f->bev, EV_READ, 1, 0);
+  bufferevent_setwatermark(underlying, EV_READ, 0, LOW_WATERMARK);
+  return f->bev;
+}
+
+RequestBodyFilter* RequestBodyFilter::for_request(struct evhttp_request* req) {
+  struct evhttp_connection* conn = evhttp_request_get_connection(req);
+  if (!conn) {
+    return nullptr;
+  }
+  auto it = filter_for_bufferevent.find(evhttp_connection_get_bufferevent(conn));
+  return (it == filter_for_bufferevent.end()) ? nullptr : it->second;
+}
+
+void RequestBodyFilter::free_filter(void* ctx) {
+  delete reinterpret_cast<RequestBodyFilter*>(ctx);
+}
+
+void RequestBodyFilter::on_request_dispatched(struct evhttp_request* req) {
+  // evhttp dispatches requests in the order they were received, and the
+  // filter doesn't pass any requests to evhttp after a streamed request until
+  // that request's response is complete, so the streamed request is the only
+  // one that can have the same method and URI
+  if (!this->stream_active || this->stream_req ||
+      (evhttp_request_get_command(req) != this->stream_method) ||
+      (this->stream_uri != evhttp_request_get_uri(req))) {
+    return;
+  }
+
+  this->stream_req = req;
+  evhttp_request_set_on_complete_cb(
+      req, &RequestBodyFilter::on_request_complete, this);
+  if (this->stream_body_error) {
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Connection", "close");
+  } else if (!this->stream_body_complete) {
+    // evhttp stops reading from the connection while it waits for the
+    // response, so we have to turn reading back on to get the rest of the body
+    bufferevent_enable(this->bev, EV_READ);
+    this->read_enabled_for_body = true;
+    this->resume_processing();
+  }
+}
+
+bool RequestBodyFilter::is_streaming(struct evhttp_request* req) const {
+  return req && (this->stream_req == req);
+}
+
+void RequestBodyFilter::on_request_complete(struct evhttp_request*, void* ctx) {
+  auto* f = reinterpret_cast<RequestBodyFilter*>(ctx);
+  f->stream_active = false;
+  f->stream_req = nullptr;
+  // evhttp turns reading back on by itself after the response (if the
+  // connection is kept alive)
+  f->read_enabled_for_body = false;
+  f->stream_continue_pending = false;
+  if (!f->stream_body_complete) {
+    f->stream_body_discarded = true;
+    f->queue.drain_all();
+    f->resume_reader();
+  }
+  // There may be more requests waiting to be parsed; evhttp turns reading back
+  // on after this callback returns, so this has to be deferred
+  f->resume_processing();
+}
+
+void RequestBodyFilter::resume_processing() {
+  if (evbuffer_get_length(bufferevent_get_input(this->underlying))) {
+    bufferevent_trigger(this->underlying, EV_READ,
+        BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+  }
+}
+
+void RequestBodyFilter::resume_reader() {
+  // This is called from within libevent's callbacks, so the reader is resumed
+  // on the next event loop iteration instead of immediately
+  if (this->waiting_coro) {
+    auto coro = this->waiting_coro;
+    this->waiting_coro = nullptr;
+    this->base.once(-1, EV_TIMEOUT, [coro](evutil_socket_t, short) {
+      coro.resume();
+    }, 0);
+  }
+}
+
+void RequestBodyFilter::send_continue_if_needed() {
+  if (this->stream_continue_pending) {
+    this->stream_continue_pending = false;
+    static const char* continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+    bufferevent_write(this->underlying, continue_response, strlen(continue_response));
+  }
+}
+
+enum bufferevent_filter_result RequestBodyFilter::process_input(
+    struct evbuffer* src,
+    struct evbuffer* dst,
+    ev_ssize_t,
+    enum bufferevent_flush_mode,
+    void* ctx) {
+  return reinterpret_cast<RequestBodyFilter*>(ctx)->process_input(src, dst);
+}
+
+enum bufferevent_filter_result RequestBodyFilter::process_input(
+    struct evbuffer* src, struct evbuffer* dst) {
+  bool consumed_any = false;
+  for (;;) {
+    bool consumed = false;
+    switch (this->state) {
+      case State::HEADERS:
+        // evhttp can't accept any data while it's waiting for the response to
+        // a streamed request, so the next request has to wait until then
+        if (!this->stream_active && evbuffer_get_length(src)) {
+          consumed = this->process_headers(src, dst);
+        }
+        break;
+      case State::BODY:
+      case State::CHUNK_DATA:
+        consumed = this->process_body_data(src, dst);
+        break;
+      case State::CHUNK_SIZE:
+      case State::CHUNK_TRAILERS:
+        consumed = this->process_chunk_line(src, dst);
+        break;
+      case State::PASSTHROUGH:
+        if (evbuffer_get_length(src)) {
+          evbuffer_add_buffer(dst, src);
+          consumed = true;
+        }
+        break;
+      case State::DISCARD:
+        if (evbuffer_get_length(src)) {
+          evbuffer_drain(src, evbuffer_get_length(src));
+          consumed = true;
+        }
+        break;
+    }
+    if (!consumed) {
+      break;
+    }
+    consumed_any = true;
+  }
+  return consumed_any ? BEV_OK : BEV_NEED_MORE;
+}
+
+enum bufferevent_filter_result RequestBodyFilter::process_output(
+    struct evbuffer* src,
+    struct evbuffer* dst,
+    ev_ssize_t,
+    enum bufferevent_flush_mode,
+    void* ctx) {
+  auto* f = reinterpret_cast<RequestBodyFilter*>(ctx);
+  // Leave the data in the filter's output buffer until the underlying
+  // bufferevent has sent everything it already has, so that anything watching
+  // the connection's output buffer (e.g. ResponseStream) sees how much data
+  // hasn't been sent yet
+  if (!evbuffer_get_length(src) || evbuffer_get_length(dst)) {
+    return BEV_NEED_MORE;
+  }
+  evbuffer_add_buffer(dst, src);
+  // SSL bufferevents send data as soon as it's added to their output buffer,
+  // but socket bufferevents wait for the socket to be writable. If the data
+  // wasn't sent immediately, returning BEV_NEED_MORE prevents the filter from
+  // calling the write callback; on_flush_event calls it instead after the
+  // underlying bufferevent has sent the data.
+  if (evbuffer_get_length(dst)) {
+    f->write_callback_pending = true;
+    return BEV_NEED_MORE;
+  }
+  return BEV_OK;
+}
+
+void RequestBodyFilter::on_output_changed(
+    struct evbuffer*, const struct evbuffer_cb_info* info, void* ctx) {
+  if (info->n_added) {
+    reinterpret_cast<RequestBodyFilter*>(ctx)->schedule_flush();
+  }
+}
+
+void RequestBodyFilter::on_underlying_output_changed(
+    struct evbuffer* buf, const struct evbuffer_cb_info* info, void* ctx) {
+  auto* f = reinterpret_cast<RequestBodyFilter*>(ctx);
+  if (f->write_callback_pending && info->n_deleted && !evbuffer_get_length(buf)) {
+    f->schedule_flush();
+  }
+}
+
+void RequestBodyFilter::schedule_flush() {
+  // evhttp may free the bufferevent before the event runs, so we hold a
+  // reference to it until then
+  if (!this->flush_scheduled) {
+    this->flush_scheduled = true;
+    bufferevent_incref(this->bev);
+    this->flush_event.add();
+  }
+}
+
+void RequestBodyFilter::on_flush_event(evutil_socket_t, short, void* ctx) {
+  auto* f = reinterpret_cast<RequestBodyFilter*>(ctx);
+  struct bufferevent* bev = f->bev;
+  f->flush_scheduled = false;
+
+  // If evhttp has already freed the bufferevent (which clears its callbacks),
+  // there's nothing to do
+  bufferevent_event_cb eventcb;
+  bufferevent_getcb(bev, nullptr, nullptr, &eventcb, nullptr);
+  if (eventcb) {
+    bufferevent_flush(bev, EV_WRITE, BEV_NORMAL);
+    if (f->write_callback_pending &&
+        !evbuffer_get_length(bufferevent_get_output(f->underlying)) &&
+        !evbuffer_get_length(bufferevent_get_output(bev))) {
+      f->write_callback_pending = false;
+      bufferevent_trigger(bev, EV_WRITE, 0);
+    }
+  }
+
+  // If evhttp has freed the bufferevent, this frees the filter too
+  bufferevent_decref(bev);
+}
+
+bool RequestBodyFilter::process_headers(
+    struct evbuffer* src, struct evbuffer* dst) {
+  // Empty lines before the request line are ignored (RFC 9112 section 2.2);
+  // some clients send an extra line ending after a request's body. These have
+  // to be removed before looking for the end of the headers, since otherwise
+  // the first of them would be taken as the request line.
+  bool skipped_empty_lines = false;
+  for (;;) {
+    char prefix[2];
+    ev_ssize_t prefix_size = evbuffer_copyout(src, prefix, sizeof(prefix));
+    if ((prefix_size >= 1) && (prefix[0] == '\n')) {
+      evbuffer_drain(src, 1);
+    } else if ((prefix_size == 2) && (prefix[0] == '\r') && (prefix[1] == '\n')) {
+      evbuffer_drain(src, 2);
+    } else {
+      break;
+    }
+    skipped_empty_lines = true;
+  }
+  if (!evbuffer_get_length(src) ||
+      ((evbuffer_get_length(src) == 1) && (*evbuffer_pullup(src, 1) == '\r'))) {
+    return skipped_empty_lines;
+  }
+
+  // Find the end of the headers (an empty line)
+  struct evbuffer_ptr pos;
+  evbuffer_ptr_set(src, &pos, 0, EVBUFFER_PTR_SET);
+  size_t headers_size = 0;
+  for (;;) {
+    size_t eol_size;
+    struct evbuffer_ptr eol = evbuffer_search_eol(src, &pos, &eol_size, EVBUFFER_EOL_CRLF);
+    if (eol.pos < 0) {
+      if (evbuffer_get_length(src) > MAX_HEADERS_SIZE) {
+        this->state = State::PASSTHROUGH;
+        return true;
+      }
+      return false;
+    }
+    if ((eol.pos == pos.pos) && (pos.pos > 0)) {
+      headers_size = eol.pos + eol_size;
+      break;
+    }
+    evbuffer_ptr_set(src, &pos, eol.pos + eol_size, EVBUFFER_PTR_SET);
+  }
+
+  string_view headers(
+      reinterpret_cast<const char*>(evbuffer_pullup(src, headers_size)),
+      headers_size);
+  auto next_line = [&headers]() -> string_view {
+    size_t line_end = headers.find('\n');
+    string_view line = headers.substr(0, line_end);
+    headers = headers.substr(line_end + 1);
+    if (!line.empty() && (line.back() == '\r')) {
+      line.remove_suffix(1);
+    }
+    return line;
+  };
+
+  // Parse the request line. If it's malformed, or anything else about the
+  // request is invalid, evhttp will reject it and close the connection, so we
+  // don't need to parse the rest of the connection's data
+  string_view request_line = next_line();
+  size_t method_end = request_line.find(' ');
+  size_t uri_end = (method_end == string_view::npos)
+      ? string_view::npos : request_line.find(' ', method_end + 1);
+  enum evhttp_cmd_type method;
+  if ((uri_end == string_view::npos) ||
+      !method_for_name(request_line.substr(0, method_end), &method)) {
+    this->state = State::PASSTHROUGH;
+    return true;
+  }
+  string uri(request_line.substr(method_end + 1, uri_end - method_end - 1));
+  bool is_http_1_0 = (request_line.substr(uri_end + 1) == "HTTP/1.0");
+
+  string_view content_length_str;
+  bool has_content_length = false;
+  bool chunked = false;
+  bool has_transfer_encoding = false;
+  bool expect_continue = false;
+  bool upgrade = false;
+  // Requests whose framing another HTTP implementation (such as a proxy in
+  // front of this server) could interpret differently from evhttp are
+  // rejected, since the difference could be used to smuggle requests. This
+  // includes folded header lines (obs-fold), which evhttp appends to the
+  // previous header, and repeated or conflicting Content-Length and
+  // Transfer-Encoding headers, of which evhttp uses only the first.
+  bool reject = false;
+  for (string_view line = next_line(); !line.empty() && !reject; line = next_line()) {
+    if ((line[0] == ' ') || (line[0] == '\t')) {
+      reject = true;
+      break;
+    }
+    size_t colon_pos = line.find(':');
+    if (colon_pos == string_view::npos) {
+      this->state = State::PASSTHROUGH;
+      return true;
+    }
+    string_view name = line.substr(0, colon_pos);
+    string_view value = trim_whitespace(line.substr(colon_pos + 1));
+    if (header_name_equals(name, "Content-Length")) {
+      reject = has_content_length;
+      content_length_str = value;
+      has_content_length = true;
+    } else if (header_name_equals(name, "Transfer-Encoding")) {
+      reject = has_transfer_encoding;
+      chunked = (value.size() == 7) && !strncasecmp(value.data(), "chunked", 7);
+      has_transfer_encoding = true;
+    } else if (header_name_equals(name, "Expect")) {
+      expect_continue = (value.size() == 12) &&
+          !strncasecmp(value.data(), "100-continue", 12);
+    } else if (header_name_equals(name, "Upgrade")) {
+      upgrade = true;
+    }
+  }
+
+  reject |= has_transfer_encoding && (has_content_length || !chunked);
+  if (reject) {
+    // evhttp responds to requests with malformed headers with 400 Bad Request
+    // and closes the connection, so it gets the request line followed by a
+    // line it can't parse as a header. The rest of the connection's data is
+    // discarded.
+    string rejected_headers(request_line);
+    rejected_headers.append("\r\n-\r\n\r\n");
+    evbuffer_drain(src, headers_size);
+    evbuffer_add(dst, rejected_headers.data(), rejected_headers.size());
+    this->state = State::DISCARD;
+    return true;
+  }
+
+  // Determine the body's length the same way evhttp does
+  uint64_t content_length = 0;
+  if ((method == EVHTTP_REQ_HEAD) || (method == EVHTTP_REQ_TRACE)) {
+    chunked = false;
+  } else if (!chunked && has_content_length) {
+    if (content_length_str.empty() || (content_length_str.size() > 18) ||
+        (content_length_str.find_first_not_of("0123456789") != string_view::npos)) {
+      this->state = State::PASSTHROUGH;
+      return true;
+    }
+    for (char ch : content_length_str) {
+      content_length = content_length * 10 + (ch - '0');
+    }
+  }
+
+  // Decide whether to stream this request's body
+  bool stream = false;
+  if (!upgrade && (chunked || content_length > 0)) {
+    struct evhttp_uri* parsed_uri = evhttp_uri_parse_with_flags(
+        uri.c_str(), EVHTTP_URI_NONCONFORMANT);
+    if (!parsed_uri) {
+      this->state = State::PASSTHROUGH;
+      return true;
+    }
+    const char* path = evhttp_uri_get_path(parsed_uri);
+    auto match = this->router.match(method, path ? path : "");
+    stream = match.handler && match.stream_request_body;
+    evhttp_uri_free(parsed_uri);
+  }
+
+  if (!stream) {
+    evbuffer_remove_buffer(src, dst, headers_size);
+    this->streaming_body = false;
+
+  } else {
+    // Pass the headers to evhttp without the ones that describe the body, so
+    // it will dispatch the request without waiting for the body
+    headers = string_view(
+        reinterpret_cast<const char*>(evbuffer_pullup(src, headers_size)),
+        headers_size);
+    string new_headers;
+    new_headers.reserve(headers_size);
+    for (string_view line = next_line(); ; line = next_line()) {
+      if (!line.empty()) {
+        string_view name = line.substr(0, line.find(':'));
+        if (header_name_equals(name, "Content-Length") ||
+            header_name_equals(name, "Transfer-Encoding") ||
+            header_name_equals(name, "Expect")) {
+          continue;
+        }
+      }
+      new_headers.append(line);
+      new_headers.append("\r\n");
+      if (line.empty()) {
+        break;
+      }
+    }
+    evbuffer_drain(src, headers_size);
+    evbuffer_add(dst, new_headers.data(), new_headers.size());
+
+    this->streaming_body = true;
+    this->stream_active = true;
+    this->stream_method = method;
+    this->stream_uri = std::move(uri);
+    this->stream_req = nullptr;
+    this->stream_content_length = chunked ? -1 : content_length;
+    this->stream_body_complete = false;
+    this->stream_body_error = false;
+    this->stream_body_discarded = false;
+    this->stream_continue_pending = expect_continue && !is_http_1_0;
+    this->paused_for_queue = false;
+  }
+
+  if (upgrade) {
+    // After a protocol upgrade, the connection doesn't carry HTTP anymore
+    this->state = State::PASSTHROUGH;
+  } else if (chunked) {
+    this->state = State::CHUNK_SIZE;
+  } else if (content_length > 0) {
+    this->state = State::BODY;
+    this->body_bytes_remaining = content_length;
+  } else {
+    this->state = State::HEADERS;
+  }
+  return true;
+}
+
+bool RequestBodyFilter::process_body_data(
+    struct evbuffer* src, struct evbuffer* dst) {
+  size_t size = min<uint64_t>(evbuffer_get_length(src), this->body_bytes_remaining);
+  if (size == 0) {
+    return false;
+  }
+
+  if (!this->streaming_body) {
+    evbuffer_remove_buffer(src, dst, size);
+  } else if (this->stream_body_discarded) {
+    evbuffer_drain(src, size);
+  } else {
+    // Stop consuming data when the reader is too far behind; the data stays in
+    // the underlying bufferevent, which stops reading from the socket when it
+    // has too much
+    if (this->queue.get_length() >= HIGH_WATERMARK) {
+      this->paused_for_queue = true;
+      return false;
+    }
+    evbuffer_remove_buffer(src, this->queue.buf, size);
+    this->resume_reader();
+  }
+
+  this->body_bytes_remaining -= size;
+  if (this->body_bytes_remaining == 0) {
+    if (this->state == State::BODY) {
+      this->on_body_complete();
+    } else {
+      this->state = State::CHUNK_SIZE;
+    }
+  }
+  return true;
+}
+
+bool RequestBodyFilter::process_chunk_line(
+    struct evbuffer* src, struct evbuffer* dst) {
+  size_t eol_size;
+  struct evbuffer_ptr eol = evbuffer_search_eol(src, nullptr, &eol_size, EVBUFFER_EOL_CRLF);
+  if (eol.pos < 0) {
+    if (evbuffer_get_length(src) > MAX_LINE_SIZE) {
+      this->on_body_error();
+      return true;
+    }
+    return false;
+  }
+
+  string line(eol.pos, '\0');
+  evbuffer_copyout(src, line.data(), line.size());
+  if (this->streaming_body) {
+    evbuffer_drain(src, eol.pos + eol_size);
+  } else {
+    evbuffer_remove_buffer(src, dst, eol.pos + eol_size);
+  }
+
+  if (this->state == State::CHUNK_TRAILERS) {
+    if (line.empty()) {
+      this->on_body_complete();
+    }
+  } else if (!line.empty()) {
+    // Empty lines before chunk sizes are skipped (this includes the line
+    // ending after each chunk's data), as evhttp does
+    uint64_t chunk_size;
+    if (!parse_chunk_size(line, &chunk_size)) {
+      this->on_body_error();
+    } else if (chunk_size == 0) {
+      this->state = State::CHUNK_TRAILERS;
+    } else {
+      this->state = State::CHUNK_DATA;
+      this->body_bytes_remaining = chunk_size;
+    }
+  }
+  return true;
+}
+
+void RequestBodyFilter::on_body_complete() {
+  this->state = State::HEADERS;
+  if (!this->streaming_body) {
+    return;
+  }
+  this->streaming_body = false;
+  this->stream_body_complete = true;
+  this->resume_reader();
+
+  // If the response isn't done yet, evhttp expects reading to be disabled
+  // until it is
+  if (this->read_enabled_for_body) {
+    this->read_enabled_for_body = false;
+    bufferevent_disable(this->bev, EV_READ);
+  }
+}
+
+void RequestBodyFilter::on_body_error() {
+  // If this isn't a streamed body, evhttp will find the same error and close
+  // the connection
+  if (!this->streaming_body) {
+    this->state = State::PASSTHROUGH;
+    return;
+  }
+
+  // We can't find the end of the body, so the connection can't be used for
+  // any more requests
+  this->state = State::DISCARD;
+  this->streaming_body = false;
+  this->stream_body_error = true;
+  this->stream_body_discarded = true;
+  this->queue.drain_all();
+  if (this->stream_req) {
+    evhttp_add_header(
+        evhttp_request_get_output_headers(this->stream_req), "Connection", "close");
+  }
+  this->resume_reader();
+  if (this->read_enabled_for_body) {
+    this->read_enabled_for_body = false;
+    bufferevent_disable(this->bev, EV_READ);
+  }
+}
+
+RequestBodyStream::RequestBodyStream(Request& req)
+    : filter(RequestBodyFilter::for_request(req.req)),
+      buffered_body(req.base),
+      streamed(false),
+      body_received(true),
+      content_length(-1),
+      bytes_read(0),
+      complete(false) {
+  if (this->filter && this->filter->is_streaming(req.req)) {
+    if (this->filter->reader) {
+      throw logic_error("request already has a body stream");
+    }
+    this->filter->reader = this;
+    this->streamed = true;
+    this->body_received = false;
+    this->content_length = this->filter->stream_content_length;
+  } else {
+    this->filter = nullptr;
+    this->buffered_body.add_buffer(evhttp_request_get_input_buffer(req.req));
+    this->content_length = this->buffered_body.get_length();
+  }
+}
+
+RequestBodyStream::~RequestBodyStream() {
+  if (this->filter) {
+    this->filter->reader = nullptr;
+    this->filter->waiting_coro = nullptr;
+  }
+}
+
+RequestBodyStream::ReadAwaiter RequestBodyStream::read(
+    Buffer& dest, size_t max_size) {
+  if (this->filter) {
+    this->filter->send_continue_if_needed();
+  }
+  return ReadAwaiter(*this, dest, max_size);
+}
+
+int64_t RequestBodyStream::get_content_length() const {
+  return this->content_length;
+}
+
+uint64_t RequestBodyStream::get_bytes_read() const {
+  return this->bytes_read;
+}
+
+bool RequestBodyStream::is_complete() const {
+  return this->complete;
+}
+
+RequestBodyStream::ReadAwaiter::ReadAwaiter(
+    RequestBodyStream& stream, Buffer& dest, size_t max_size)
+    : stream(stream),
+      dest(dest),
+      max_size(max_size) {}
+
+bool RequestBodyStream::ReadAwaiter::await_ready() const {
+  const auto* f = this->stream.filter;
+  return !f || this->stream.complete || f->queue.get_length() ||
+      f->stream_body_complete || f->stream_body_discarded;
+}
+
+void RequestBodyStream::ReadAwaiter::await_suspend(std::coroutine_handle<> coro) {
+  this->stream.filter->waiting_coro = coro;
+}
+
+size_t RequestBodyStream::ReadAwaiter::await_resume() {
+  auto& s = this->stream;
+  auto* f = s.filter;
+  if (s.complete) {
+    return 0;
+  }
+
+  if (f && f->stream_body_error) {
+    throw runtime_error("request body is malformed");
+  }
+  if (f && f->stream_body_discarded) {
+    throw runtime_error("request body was discarded after the response was sent");
+  }
+
+  Buffer& source = f ? f->queue : s.buffered_body;
+  size_t size = min<size_t>(source.get_length(), this->max_size);
+  if (size > 0) {
+    source.remove_buffer(this->dest, size);
+    s.bytes_read += size;
+  }
+
+  bool body_received = f ? f->stream_body_complete : s.body_received;
+  if (source.get_length() == 0) {
+    if (body_received) {
+      s.complete = true;
+      if (s.content_length < 0) {
+        s.content_length = s.bytes_read;
+      }
+    } else if (!f && (size == 0)) {
+      throw runtime_error("client has disconnected");
+    }
+  }
+
+  // If the filter stopped reading because the queue was full, start it again
+  if (f && f->paused_for_queue && (f->queue.get_length() < RequestBodyFilter::LOW_WATERMARK)) {
+    f->paused_for_queue = false;
+    f->resume_processing();
+  }
+  return size;
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <stdint.h>
+
+#include <coroutine>
+#include <string>
+
+#include "../../Base.hh"
+#include "../../Buffer.hh"
+#include "../../Event.hh"
+#include "Request.hh"
+
+namespace EventAsync::HTTP {
+
+class Router;
+class RequestBodyStream;
+
+// evhttp reads a request's entire body into memory before dispatching the
+// request, and has no way to change this for incoming requests. To stream
+// request bodies, Server puts one of these filters between each connection's
+// socket (or SSL) bufferevent and evhttp when any of its routes stream their
+// request bodies (see Router::add). The filter tracks the framing of each
+// request on the connection; for requests to streaming routes, it passes only
+// the request's headers to evhttp (without Content-Length, Transfer-Encoding,
+// or Expect, so evhttp dispatches the request immediately) and queues the
+// body for the handler to read with a RequestBodyStream. Requests to other
+// routes are passed through unmodified. Requests whose framing is ambiguous
+// (folded header lines, or repeated or conflicting Content-Length and
+// Transfer-Encoding headers) get a 400 response, and the connection is closed.
+//
+// The filter also works around two problems with using filtering bufferevents
+// under evhttp in libevent 2.1. First, evhttp writes responses while writing
+// is disabled and enables it afterward, but filters only pass output to the
+// underlying bufferevent when data is added while writing is enabled, so the
+// filter flushes its output on the next event loop iteration instead. Second,
+// filters call the write callback as soon as their output is moved to the
+// underlying bufferevent, but evhttp expects the data to have been sent at
+// that point (it shuts down the socket right away if the connection isn't
+// kept alive), so the filter holds the write callback until the underlying
+// bufferevent's output is empty.
+//
+// Handlers don't use this class directly; Server creates these and calls
+// on_request_dispatched.
+class RequestBodyFilter {
+public:
+  // Maximum number of queued (received but not yet read) body bytes. When the
+  // queue is larger than this, the filter stops reading from the connection
+  // until the handler reads enough to bring it below LOW_WATERMARK.
+  static constexpr size_t HIGH_WATERMARK = 0x100000;
+  static constexpr size_t LOW_WATERMARK = 0x40000;
+
+  // Creates a filtering bufferevent on top of underlying, which it takes
+  // ownership of. The router must outlive the returned bufferevent.
+  static struct bufferevent* create(
+      Base& base, struct bufferevent* underlying, const Router& router);
+
+  // Returns the filter for the request's connection, or nullptr if the
+  // request's connection doesn't have one (or is closed). This must be called
+  // on the thread that serves the connection.
+  static RequestBodyFilter* for_request(struct evhttp_request* req);
+
+  RequestBodyFilter(const RequestBodyFilter&) = delete;
+  RequestBodyFilter(RequestBodyFilter&&) = delete;
+  RequestBodyFilter& operator=(const RequestBodyFilter&) = delete;
+  RequestBodyFilter& operator=(RequestBodyFilter&&) = delete;
+  ~RequestBodyFilter();
+
+  // Called by Server for each request that evhttp dispatches on this filter's
+  // connection, before the request's handler is called.
+  void on_request_dispatched(struct evhttp_request* req);
+
+  // Returns true if req's body is being streamed by this filter.
+  bool is_streaming(struct evhttp_request* req) const;
+
+private:
+  friend class RequestBodyStream;
+
+  enum class State {
+    HEADERS = 0,
+    BODY,
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_TRAILERS,
+    // The connection is no longer being parsed (e.g. after a protocol upgrade
+    // or a request that evhttp will reject); everything is passed to evhttp
+    PASSTHROUGH,
+    // A streamed body was malformed, so the rest of the connection's data
+    // can't be parsed; everything is discarded
+    DISCARD,
+  };
+
+  RequestBodyFilter(Base& base, const Router& router);
+
+  Base& base;
+  const Router& router;
+  struct bufferevent* bev;
+  struct bufferevent* underlying;
+  struct evbuffer_cb_entry* output_cb_entry;
+  struct evbuffer_cb_entry* underlying_output_cb_entry;
+  TimeoutEvent flush_event;
+  bool flush_scheduled;
+  // True if output was moved to the underlying bufferevent but the write
+  // callback hasn't been called for it yet
+  bool write_callback_pending;
+
+  State state;
+  // True if the body currently being parsed belongs to a streamed request (so
+  // it goes into queue instead of to evhttp)
+  bool streaming_body;
+  uint64_t body_bytes_remaining;
+
+  // The streamed request whose headers were most recently passed to evhttp.
+  // The filter doesn't parse any further requests until the response to this
+  // one is complete, since evhttp can't accept data while it's waiting for a
+  // response. req is set when evhttp dispatches the request.
+  bool stream_active;
+  enum evhttp_cmd_type stream_method;
+  std::string stream_uri;
+  struct evhttp_request* stream_req;
+  int64_t stream_content_length;
+  bool stream_body_complete;
+  bool stream_body_error;
+  bool stream_body_discarded;
+  bool stream_continue_pending;
+  // True if the filter enabled reading on the connection so that it can read
+  // the body while evhttp waits for the handler's response
+  bool read_enabled_for_body;
+  bool paused_for_queue;
+  Buffer queue;
+
+  RequestBodyStream* reader;
+  std::coroutine_handle<> waiting_coro;
+
+  bool process_headers(struct evbuffer* src, struct evbuffer* dst);
+  bool process_body_data(struct evbuffer* src, struct evbuffer* dst);
+  bool process_chunk_line(struct evbuffer* src, struct evbuffer* dst);
+  void on_body_complete();
+  void on_body_error();
+  void send_continue_if_needed();
+  void resume_processing();
+  void schedule_flush();
+  void resume_reader();
+
+  static enum bufferevent_filter_result process_input(
+      struct evbuffer* src,
+      struct evbuffer* dst,
+      ev_ssize_t limit,
+      enum bufferevent_flush_mode mode,
+      void* ctx);
+  enum bufferevent_filter_result process_input(
+      struct evbuffer* src, struct evbuffer* dst);
+  static enum bufferevent_filter_result process_output(
+      struct evbuffer* src,
+      struct evbuffer* dst,
+      ev_ssize_t limit,
+      enum bufferevent_flush_mode mode,
+      void* ctx);
+  static void on_output_changed(
+      struct evbuffer* buf, const struct evbuffer_cb_info* info, void* ctx);
+  static void on_underlying_output_changed(
+      struct evbuffer* buf, const struct evbuffer_cb_info* info, void* ctx);
+  static void on_flush_event(evutil_socket_t fd, short what, void* ctx);
+  static void on_request_complete(struct evhttp_request* req, void* ctx);
+  static void free_filter(void* ctx);
+};
+
+// Reads a request's body incrementally. Use Server::get_request_body_stream to
+// create one of these. For requests to routes that stream their request bodies
+// (see Router::add), data is returned as it arrives from the client, and the
+// server stops reading from the connection while the handler has more than
+// RequestBodyFilter::HIGH_WATERMARK bytes of unread data, so memory usage is
+// bounded regardless of the body's size. For all other requests, evhttp has
+// already read the whole body, and the stream just returns it.
+//
+// If the client sent Expect: 100-continue, the 100 Continue response is sent
+// when the handler first calls read(), so handlers that respond without
+// reading the body don't cause the client to send it. If the handler sends its
+// response before reading the entire body, the rest of the body is discarded.
+class RequestBodyStream {
+public:
+  explicit RequestBodyStream(Request& req);
+  RequestBodyStream(const RequestBodyStream&) = delete;
+  RequestBodyStream(RequestBodyStream&&) = delete;
+  RequestBodyStream& operator=(const RequestBodyStream&) = delete;
+  RequestBodyStream& operator=(RequestBodyStream&&) = delete;
+  ~RequestBodyStream();
+
+  class ReadAwaiter {
+  public:
+    ReadAwaiter(RequestBodyStream& stream, Buffer& dest, size_t max_size);
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> coro);
+    size_t await_resume();
+
+  private:
+    RequestBodyStream& stream;
+    Buffer& dest;
+    size_t max_size;
+  };
+
+  // Moves up to max_size bytes of the body into dest, waiting for data to
+  // arrive if none is available yet. Returns the number of bytes moved, which
+  // is zero only at the end of the body. Throws runtime_error if the client
+  // disconnects or sends a malformed body before the body is complete.
+  [[nodiscard]] ReadAwaiter read(Buffer& dest, size_t max_size = SIZE_MAX);
+
+  // Returns the body's total length, or -1 if it isn't known yet (because the
+  // client is sending it with chunked encoding).
+  int64_t get_content_length() const;
+  // Returns the number of body bytes read so far.
+  uint64_t get_bytes_read() const;
+  // Returns true if the entire body has been read.
+  bool is_complete() const;
+
+private:
+  friend class RequestBodyFilter;
+
+  // This is null if the request isn't streamed, or if its connection has been
+  // closed
+  RequestBodyFilter* filter;
+  // For requests that aren't streamed, this holds the body that evhttp read.
+  // For streamed requests whose connections have been closed, this holds any
+  // data that was received but not yet read.
+  Buffer buffered_body;
+  bool streamed;
+  bool body_received;
+  int64_t content_length;
+  uint64_t bytes_read;
+  bool complete;
+};
+
+} // namespace EventAsync::HTTP
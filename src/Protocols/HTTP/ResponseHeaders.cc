@@ -0,0 +1,112 @@
+#include "ResponseHeaders.hh"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <array>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+static constexpr int MAX_STATUS_CODE = 599;
+
+static constexpr auto reason_phrases = []() {
+  array<const char*, MAX_STATUS_CODE + 1> ret{};
+  ret[100] = "Continue";
+  ret[101] = "Switching Protocols";
+  ret[102] = "Processing";
+  ret[200] = "OK";
+  ret[201] = "Created";
+  ret[202] = "Accepted";
+  ret[203] = "Non-Authoritative Information";
+  ret[204] = "No Content";
+  ret[205] = "Reset Content";
+  ret[206] = "Partial Content";
+  ret[207] = "Multi-Status";
+  ret[208] = "Already Reported";
+  ret[226] = "IM Used";
+  ret[300] = "Multiple Choices";
+  ret[301] = "Moved Permanently";
+  ret[302] = "Found";
+  ret[303] = "See Other";
+  ret[304] = "Not Modified";
+  ret[305] = "Use Proxy";
+  ret[307] = "Temporary Redirect";
+  ret[308] = "Permanent Redirect";
+  ret[400] = "Bad Request";
+  ret[401] = "Unauthorized";
+  ret[402] = "Payment Required";
+  ret[403] = "Forbidden";
+  ret[404] = "Not Found";
+  ret[405] = "Method Not Allowed";
+  ret[406] = "Not Acceptable";
+  ret[407] = "Proxy Authentication Required";
+  ret[408] = "Request Timeout";
+  ret[409] = "Conflict";
+  ret[410] = "Gone";
+  ret[411] = "Length Required";
+  ret[412] = "Precondition Failed";
+  ret[413] = "Request Entity Too Large";
+  ret[414] = "Request-URI Too Long";
+  ret[415] = "Unsupported Media Type";
+  ret[416] = "Requested Range Not Satisfiable";
+  ret[417] = "Expectation Failed";
+  ret[418] = "I\'m a Teapot";
+  ret[420] = "Enhance Your Calm";
+  ret[422] = "Unprocessable Entity";
+  ret[423] = "Locked";
+  ret[424] = "Failed Dependency";
+  ret[426] = "Upgrade Required";
+  ret[428] = "Precondition Required";
+  ret[429] = "Too Many Requests";
+  ret[431] = "Request Header Fields Too Large";
+  ret[444] = "No Response";
+  ret[449] = "Retry With";
+  ret[451] = "Unavailable For Legal Reasons";
+  ret[500] = "Internal Server Error";
+  ret[501] = "Not Implemented";
+  ret[502] = "Bad Gateway";
+  ret[503] = "Service Unavailable";
+  ret[504] = "Gateway Timeout";
+  ret[505] = "HTTP Version Not Supported";
+  ret[506] = "Variant Also Negotiates";
+  ret[507] = "Insufficient Storage";
+  ret[508] = "Loop Detected";
+  ret[509] = "Bandwidth Limit Exceeded";
+  ret[510] = "Not Extended";
+  ret[511] = "Network Authentication Required";
+  ret[598] = "Network Read Timeout Error";
+  ret[599] = "Network Connect Timeout Error";
+  return ret;
+}();
+
+const char* reason_phrase_for_status(int code) {
+  return ((code >= 0) && (code <= MAX_STATUS_CODE)) ? reason_phrases[code] : nullptr;
+}
+
+const char* current_http_date() {
+  // The names are written out instead of using strftime, whose output depends
+  // on the locale
+  static const char* const day_names[7] = {
+      "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  static const char* const month_names[12] = {
+      "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+  static thread_local time_t formatted_time = -1;
+  static thread_local char formatted[32];
+
+  time_t now = time(nullptr);
+  if (now != formatted_time) {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    snprintf(formatted, sizeof(formatted), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+        day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon],
+        tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    formatted_time = now;
+  }
+  return formatted;
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,17 @@
+#pragma once
+
+namespace EventAsync::HTTP {
+
+// Returns the reason phrase for an HTTP status code (e.g. "Not Found" for
+// 404), or nullptr if the code isn't a known one, in which case evhttp uses a
+// generic phrase for the code's class. This is a lookup in a table that's
+// built at compile time.
+const char* reason_phrase_for_status(int code);
+
+// Returns the current time formatted for the Date header (e.g. "Sun, 06 Nov
+// 1994 08:49:37 GMT"). The string is formatted at most once per second on each
+// thread, and is overwritten by later calls on the same thread, so callers
+// should copy it.
+const char* current_http_date();
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,238 @@
+#include "ResponseStream.hh"
+
+#include <event2/bufferevent.h>
+
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+using ConnectionCloseCallback = void (*)(struct evhttp_connection*, void*);
+
+// Close callbacks set with set_http_connection_close_callback. evhttp calls
+// dispatch_connection_close instead, which removes the entry before calling
+// the callback, since evhttp frees the connection right after that. As with
+// the other per-connection state, connections are only ever used on one
+// thread, so this doesn't need to be locked.
+static thread_local unordered_map<
+    struct evhttp_connection*, pair<ConnectionCloseCallback, void*>>
+    close_callback_for_connection;
+
+static void dispatch_connection_close(struct evhttp_connection* conn, void*) {
+  auto it = close_callback_for_connection.find(conn);
+  if (it == close_callback_for_connection.end()) {
+    return;
+  }
+  auto [cb, ctx] = it->second;
+  close_callback_for_connection.erase(it);
+  cb(conn, ctx);
+}
+
+void set_http_connection_close_callback(
+    struct evhttp_connection* conn, ConnectionCloseCallback cb, void* ctx) {
+  if (cb) {
+    close_callback_for_connection[conn] = make_pair(cb, ctx);
+    evhttp_connection_set_closecb(conn, &dispatch_connection_close, nullptr);
+  } else {
+    close_callback_for_connection.erase(conn);
+    evhttp_connection_set_closecb(conn, nullptr, nullptr);
+  }
+}
+
+ResponseStream::ResponseStream(
+    Request& req,
+    int code,
+    const char* reason,
+    size_t high_watermark,
+    size_t low_watermark)
+    : base(req.base),
+      req(req.req),
+      conn(evhttp_request_get_connection(this->req)),
+      http2_stream(HTTP2Stream::for_request(this->req)),
+      output_buf(nullptr),
+      high_watermark(high_watermark),
+      low_watermark(low_watermark),
+      ended(false),
+      prev_close_cb(nullptr),
+      prev_close_cb_ctx(nullptr),
+      drain_cb_entry(nullptr),
+      waiting_coro(nullptr) {
+  if (this->low_watermark > this->high_watermark) {
+    throw invalid_argument("low watermark must not be above high watermark");
+  }
+
+  send_http_reply_start(this->req, code, reason);
+
+  // If the client has already disconnected, evhttp has detached the request
+  // from its connection (or the request's HTTP/2 stream is gone); in that
+  // case, the stream starts out closed
+  if (this->http2_stream) {
+    this->output_buf = this->http2_stream->get_output_buffer();
+    this->http2_stream->set_close_callback(&ResponseStream::on_stream_close, this);
+  } else if (this->conn) {
+    this->output_buf = bufferevent_get_output(
+        evhttp_connection_get_bufferevent(this->conn));
+    auto it = close_callback_for_connection.find(this->conn);
+    if (it != close_callback_for_connection.end()) {
+      this->prev_close_cb = it->second.first;
+      this->prev_close_cb_ctx = it->second.second;
+    }
+    set_http_connection_close_callback(
+        this->conn, &ResponseStream::on_connection_close, this);
+  }
+}
+
+ResponseStream::~ResponseStream() {
+  this->remove_drain_cb();
+  this->finish();
+}
+
+bool ResponseStream::is_closed() const {
+  return this->output_buf == nullptr;
+}
+
+size_t ResponseStream::get_pending_bytes() const {
+  return this->output_buf ? evbuffer_get_length(this->output_buf) : 0;
+}
+
+void ResponseStream::check_writable() const {
+  if (this->ended) {
+    throw logic_error("response stream has already ended");
+  }
+  if (!this->output_buf) {
+    throw runtime_error("client has disconnected");
+  }
+}
+
+ResponseStream::DrainAwaiter ResponseStream::write(Buffer& buf) {
+  this->check_writable();
+  // An empty chunk would end the response, so don't send one
+  if (buf.get_length() > 0) {
+    send_http_reply_chunk(this->req, buf.buf);
+  }
+  return DrainAwaiter(*this, this->high_watermark, false);
+}
+
+ResponseStream::DrainAwaiter ResponseStream::write(
+    const void* data, size_t size) {
+  Buffer buf(this->base);
+  buf.add(data, size);
+  return this->write(buf);
+}
+
+ResponseStream::DrainAwaiter ResponseStream::write(const string& data) {
+  return this->write(data.data(), data.size());
+}
+
+ResponseStream::DrainAwaiter ResponseStream::end() {
+  this->check_writable();
+  return DrainAwaiter(*this, this->low_watermark, true);
+}
+
+void ResponseStream::finish() {
+  if (this->ended) {
+    return;
+  }
+  this->ended = true;
+  // The connection may outlive the response (if it's kept alive), so we have
+  // to stop listening for it to close, and give the close callback back to
+  // whoever had it before. If the client already disconnected,
+  // send_http_reply_end just frees the request.
+  if (this->http2_stream) {
+    this->http2_stream->set_close_callback(nullptr, nullptr);
+    this->http2_stream = nullptr;
+  } else if (this->conn) {
+    set_http_connection_close_callback(
+        this->conn, this->prev_close_cb, this->prev_close_cb_ctx);
+    this->conn = nullptr;
+  }
+  this->output_buf = nullptr;
+  send_http_reply_end(this->req);
+  this->req = nullptr;
+}
+
+void ResponseStream::remove_drain_cb() {
+  if (this->drain_cb_entry) {
+    evbuffer_remove_cb_entry(this->output_buf, this->drain_cb_entry);
+    this->drain_cb_entry = nullptr;
+  }
+}
+
+void ResponseStream::resume_waiting_coro() {
+  // This is called from within libevent's callbacks (and, when the connection
+  // closes, while evhttp is in the middle of freeing it), so the coroutine is
+  // resumed on the next event loop iteration instead of immediately
+  if (this->waiting_coro) {
+    auto coro = this->waiting_coro;
+    this->waiting_coro = nullptr;
+    this->base.once(-1, EV_TIMEOUT, [coro](evutil_socket_t, short) {
+      coro.resume();
+    }, 0);
+  }
+}
+
+void ResponseStream::on_output_changed(
+    struct evbuffer*, const struct evbuffer_cb_info* info, void* ctx) {
+  auto* s = reinterpret_cast<ResponseStream*>(ctx);
+  size_t length = info->orig_size + info->n_added - info->n_deleted;
+  if (length <= s->low_watermark) {
+    s->remove_drain_cb();
+    s->resume_waiting_coro();
+  }
+}
+
+void ResponseStream::on_connection_close(
+    struct evhttp_connection* conn, void* ctx) {
+  auto* s = reinterpret_cast<ResponseStream*>(ctx);
+  s->remove_drain_cb();
+  s->conn = nullptr;
+  s->output_buf = nullptr;
+  s->resume_waiting_coro();
+  if (s->prev_close_cb) {
+    s->prev_close_cb(conn, s->prev_close_cb_ctx);
+  }
+}
+
+void ResponseStream::on_stream_close(void* ctx) {
+  // The stream's output buffer is freed after this returns
+  auto* s = reinterpret_cast<ResponseStream*>(ctx);
+  s->remove_drain_cb();
+  s->http2_stream = nullptr;
+  s->output_buf = nullptr;
+  s->resume_waiting_coro();
+}
+
+ResponseStream::DrainAwaiter::DrainAwaiter(
+    ResponseStream& stream, size_t wait_threshold, bool end_response)
+    : stream(stream),
+      wait_threshold(wait_threshold),
+      end_response(end_response) {}
+
+bool ResponseStream::DrainAwaiter::await_ready() const {
+  return !this->stream.output_buf ||
+      (evbuffer_get_length(this->stream.output_buf) <= this->wait_threshold);
+}
+
+void ResponseStream::DrainAwaiter::await_suspend(std::coroutine_handle<> coro) {
+  this->stream.waiting_coro = coro;
+  this->stream.drain_cb_entry = evbuffer_add_cb(
+      this->stream.output_buf, &ResponseStream::on_output_changed, &this->stream);
+  if (!this->stream.drain_cb_entry) {
+    throw bad_alloc();
+  }
+}
+
+void ResponseStream::DrainAwaiter::await_resume() {
+  bool closed = (this->stream.output_buf == nullptr);
+  // If the client disconnected, this just frees the request
+  if (this->end_response) {
+    this->stream.finish();
+  }
+  if (closed) {
+    throw runtime_error("client has disconnected");
+  }
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include <coroutine>
+#include <string>
+
+#include "../../Base.hh"
+#include "../../Buffer.hh"
+#include "HTTP2.hh"
+#include "Request.hh"
+
+namespace EventAsync::HTTP {
+
+// Sends a response body incrementally, using chunked transfer encoding (or, for
+// HTTP 1.0 clients, by closing the connection at the end of the response; for
+// HTTP/2 clients, in DATA frames on the request's stream). Use
+// Server::start_response_stream to create one of these.
+//
+// Writes don't wait for data to be sent unless the connection's output buffer
+// holds more than high_watermark bytes, in which case they wait until it
+// drains to low_watermark bytes. This keeps memory usage bounded regardless of
+// how large the response is or how slowly the client reads it. For HTTP/2
+// requests, the watermarks apply to the stream's own queue, which drains as
+// flow control and the other streams on the connection allow.
+//
+// If the client disconnects, awaiting write or end throws runtime_error. The
+// stream must not outlive the Server that created it.
+//
+// For HTTP/1.x requests, the stream watches for the connection to close with
+// the connection's close callback. evhttp only allows one close callback per
+// connection and has no way to get the current one, so handlers that need
+// their own close callback should set it with
+// set_http_connection_close_callback instead of evhttp_connection_set_closecb;
+// the stream then calls it when the connection closes, and restores it when
+// the response ends.
+class ResponseStream {
+public:
+  ResponseStream(
+      Request& req,
+      int code,
+      const char* reason,
+      size_t high_watermark = 0x40000,
+      size_t low_watermark = 0x10000);
+  ResponseStream(const ResponseStream&) = delete;
+  ResponseStream(ResponseStream&&) = delete;
+  ResponseStream& operator=(const ResponseStream&) = delete;
+  ResponseStream& operator=(ResponseStream&&) = delete;
+  // If end() wasn't called, ends the response without waiting.
+  ~ResponseStream();
+
+private:
+  class DrainAwaiter;
+
+public:
+  // Sends a chunk of the response body. The Buffer version drains buf. The
+  // data is queued for sending immediately; awaiting the result waits only if
+  // the output buffer is above the high watermark. These functions return an
+  // awaiter rather than a Task so that writes that don't need to wait don't
+  // allocate a coroutine frame.
+  [[nodiscard]] DrainAwaiter write(Buffer& buf);
+  [[nodiscard]] DrainAwaiter write(const void* data, size_t size);
+  [[nodiscard]] DrainAwaiter write(const std::string& data);
+
+  // Waits until the output buffer drains to low_watermark, then ends the
+  // response. No more data may be written after this.
+  [[nodiscard]] DrainAwaiter end();
+
+  // Returns true if the client has disconnected (or reset the request's
+  // stream).
+  bool is_closed() const;
+  // Returns the number of bytes waiting to be sent on the connection.
+  size_t get_pending_bytes() const;
+
+private:
+  class DrainAwaiter {
+  public:
+    DrainAwaiter(ResponseStream& stream, size_t wait_threshold, bool end_response);
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> coro);
+    void await_resume();
+
+  private:
+    ResponseStream& stream;
+    size_t wait_threshold;
+    bool end_response;
+  };
+
+  Base& base;
+  struct evhttp_request* req;
+  struct evhttp_connection* conn;
+  HTTP2Stream* http2_stream;
+  struct evbuffer* output_buf;
+  size_t high_watermark;
+  size_t low_watermark;
+  bool ended;
+
+  // The connection's close callback from before the stream was created
+  void (*prev_close_cb)(struct evhttp_connection* conn, void* ctx);
+  void* prev_close_cb_ctx;
+
+  struct evbuffer_cb_entry* drain_cb_entry;
+  std::coroutine_handle<> waiting_coro;
+
+  void check_writable() const;
+  void remove_drain_cb();
+  void resume_waiting_coro();
+  void finish();
+
+  static void on_output_changed(
+      struct evbuffer* buf, const struct evbuffer_cb_info* info, void* ctx);
+  static void on_connection_close(struct evhttp_connection* conn, void* ctx);
+  static void on_stream_close(void* ctx);
+};
+
+// Works like evhttp_connection_set_closecb, but also records the callback so
+// that a ResponseStream on the connection can call it. cb may be null to remove
+// the callback.
+void set_http_connection_close_callback(
+    struct evhttp_connection* conn,
+    void (*cb)(struct evhttp_connection* conn, void* ctx),
+    void* ctx);
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,229 @@
+#include "Router.hh"
+
+#include <string.h>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+RouteParams::RouteParams()
+    : count(0),
+      names(nullptr) {}
+
+size_t RouteParams::size() const {
+  return this->count;
+}
+
+string_view RouteParams::operator[](size_t index) const {
+  if (index >= this->count) {
+    throw out_of_range("route parameter index out of range");
+  }
+  return this->values[index];
+}
+
+string_view RouteParams::get(string_view name) const {
+  if (this->names) {
+    for (size_t x = 0; x < this->count; x++) {
+      if ((*this->names)[x] == name) {
+        return this->values[x];
+      }
+    }
+  }
+  throw out_of_range("route does not have parameter " + string(name));
+}
+
+Router::Router()
+    : root(new Node()),
+      num_routes(0),
+      num_streaming_routes(0) {}
+
+bool Router::empty() const {
+  return this->num_routes == 0;
+}
+
+bool Router::has_streaming_routes() const {
+  return this->num_streaming_routes > 0;
+}
+
+Router::Node* Router::add_static(Node* node, string_view text) {
+  while (!text.empty()) {
+    size_t child_index = node->static_child_first_chars.find(text[0]);
+    if (child_index == string::npos) {
+      auto& child = node->static_children.emplace_back(new Node());
+      child->prefix = text;
+      node->static_child_first_chars.push_back(text[0]);
+      return child.get();
+    }
+
+    auto& child = node->static_children[child_index];
+    size_t common_length = 0;
+    while ((common_length < child->prefix.size()) &&
+        (common_length < text.size()) &&
+        (child->prefix[common_length] == text[common_length])) {
+      common_length++;
+    }
+
+    // If the new text diverges from the child's prefix partway through, split
+    // the child into two nodes at the point of divergence
+    if (common_length < child->prefix.size()) {
+      unique_ptr<Node> split_node(new Node());
+      split_node->prefix = child->prefix.substr(0, common_length);
+      child->prefix = child->prefix.substr(common_length);
+      split_node->static_child_first_chars.push_back(child->prefix[0]);
+      split_node->static_children.emplace_back(std::move(child));
+      child = std::move(split_node);
+    }
+
+    node = child.get();
+    text = text.substr(common_length);
+  }
+  return node;
+}
+
+void Router::add(
+    enum evhttp_cmd_type method,
+    const string& pattern,
+    Handler handler,
+    bool stream_request_body) {
+  if (pattern.empty() || (pattern[0] != '/')) {
+    throw invalid_argument("route pattern must begin with /");
+  }
+
+  vector<string> param_names;
+  Node* node = this->root.get();
+  string_view remaining = pattern;
+  while (!remaining.empty()) {
+    if ((remaining[0] == ':') || (remaining[0] == '*')) {
+      bool is_wildcard = (remaining[0] == '*');
+      size_t name_end = remaining.find('/');
+      if (name_end == string::npos) {
+        name_end = remaining.size();
+      } else if (is_wildcard) {
+        throw invalid_argument("wildcard must be at end of route pattern");
+      }
+      if (name_end == 1) {
+        throw invalid_argument("route parameter must have a name");
+      }
+      if (remaining.find_first_of(":*", 1) < name_end) {
+        throw invalid_argument("route parameter must be followed by /");
+      }
+      if (param_names.size() >= RouteParams::MAX_PARAMS) {
+        throw invalid_argument("route pattern has too many parameters");
+      }
+      param_names.emplace_back(remaining.substr(1, name_end - 1));
+
+      auto& child = is_wildcard ? node->wildcard_child : node->param_child;
+      if (!child) {
+        child.reset(new Node());
+      }
+      node = child.get();
+      remaining = remaining.substr(name_end);
+
+    } else {
+      size_t static_end = remaining.find_first_of(":*");
+      if (static_end == string::npos) {
+        static_end = remaining.size();
+      } else if (remaining[static_end - 1] != '/') {
+        throw invalid_argument("route parameter must follow /");
+      }
+      node = this->add_static(node, remaining.substr(0, static_end));
+      remaining = remaining.substr(static_end);
+    }
+  }
+
+  for (const auto& route : node->routes) {
+    if (route.method == method) {
+      throw logic_error("duplicate route: " + pattern);
+    }
+  }
+  node->routes.emplace_back(Route{
+      method, std::move(param_names), std::move(handler), stream_request_body});
+  this->num_routes++;
+  if (stream_request_body) {
+    this->num_streaming_routes++;
+  }
+}
+
+const Router::Node* Router::match_node(
+    const Node* node, string_view path, RouteParams& params) {
+  if (path.empty()) {
+    if (!node->routes.empty()) {
+      return node;
+    }
+    // A wildcard may match an empty string (e.g. /static/ for /static/*path)
+    if (node->wildcard_child && !node->wildcard_child->routes.empty()) {
+      params.values[params.count++] = path;
+      return node->wildcard_child.get();
+    }
+    return nullptr;
+  }
+
+  // Static children take precedence. There is at most one static child that
+  // can match, since their first characters are all different.
+  const char* child_ch = reinterpret_cast<const char*>(memchr(
+      node->static_child_first_chars.data(),
+      path[0],
+      node->static_child_first_chars.size()));
+  if (child_ch) {
+    const Node* child = node->static_children[
+        child_ch - node->static_child_first_chars.data()].get();
+    if (path.starts_with(child->prefix)) {
+      const Node* ret = match_node(child, path.substr(child->prefix.size()), params);
+      if (ret) {
+        return ret;
+      }
+    }
+  }
+
+  if (node->param_child) {
+    size_t segment_size = path.find('/');
+    if (segment_size == string::npos) {
+      segment_size = path.size();
+    }
+    if (segment_size > 0) {
+      size_t prev_count = params.count;
+      params.values[params.count++] = path.substr(0, segment_size);
+      const Node* ret = match_node(
+          node->param_child.get(), path.substr(segment_size), params);
+      if (ret) {
+        return ret;
+      }
+      params.count = prev_count;
+    }
+  }
+
+  if (node->wildcard_child && !node->wildcard_child->routes.empty()) {
+    params.values[params.count++] = path;
+    return node->wildcard_child.get();
+  }
+
+  return nullptr;
+}
+
+Router::Match Router::match(
+    enum evhttp_cmd_type method, string_view path) const {
+  Match ret;
+  ret.handler = nullptr;
+  ret.path_matched = false;
+  ret.allowed_methods = 0;
+  ret.stream_request_body = false;
+
+  const Node* node = this->match_node(this->root.get(), path, ret.params);
+  if (!node) {
+    ret.params.count = 0;
+    return ret;
+  }
+
+  ret.path_matched = true;
+  for (const auto& route : node->routes) {
+    ret.allowed_methods |= route.method;
+    if (route.method == method) {
+      ret.handler = &route.handler;
+      ret.stream_request_body = route.stream_request_body;
+      ret.params.names = &route.param_names;
+    }
+  }
+  return ret;
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <event2/http.h>
+#include <stdint.h>
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../Task.hh"
+#include "Request.hh"
+
+namespace EventAsync::HTTP {
+
+// Path parameters captured by a route. The values are views into the request's
+// URI (they are not percent-decoded), so they're valid until the response is
+// sent. This object is small and doesn't own any memory, so it's cheap to copy
+// into a handler's coroutine frame.
+class RouteParams {
+public:
+  static constexpr size_t MAX_PARAMS = 16;
+
+  RouteParams();
+  ~RouteParams() = default;
+
+  size_t size() const;
+  // Returns parameters by position, in the order they appear in the route.
+  std::string_view operator[](size_t index) const;
+  // Returns parameters by name. Throws out_of_range if the route doesn't have
+  // a parameter with this name.
+  std::string_view get(std::string_view name) const;
+
+private:
+  friend class Router;
+
+  std::array<std::string_view, MAX_PARAMS> values;
+  size_t count;
+  const std::vector<std::string>* names;
+};
+
+// Maps request methods and paths to handlers, using a compressed radix trie.
+// Routes are added at startup; after that, the router is read-only, so it can
+// be used from multiple threads, and lookups take time proportional to the
+// path length and don't allocate memory.
+//
+// Route patterns consist of static text, parameters, and wildcards:
+// - A parameter is written as :name and matches one path segment (it must be
+//   followed by / or the end of the pattern), for example /users/:id/posts.
+// - A wildcard is written as *name and matches the rest of the path, including
+//   any slashes (it must be at the end of the pattern), for example
+//   /static/*filename.
+// When multiple routes could match a path, static text takes precedence over
+// parameters, which take precedence over wildcards.
+class Router {
+public:
+  using Handler = std::function<DetachedTask(Request& req, RouteParams params)>;
+
+  Router();
+  Router(const Router&) = delete;
+  Router(Router&&) = default;
+  Router& operator=(const Router&) = delete;
+  Router& operator=(Router&&) = default;
+  ~Router() = default;
+
+  // Adds a route. Throws invalid_argument if the pattern is malformed, or
+  // logic_error if there's already a route for the same method and pattern.
+  // If stream_request_body is true, the server dispatches requests for this
+  // route as soon as their headers are received, and the handler reads the
+  // body as it arrives with Server::get_request_body_stream (otherwise, the
+  // entire body is read into memory before the handler is called). Streaming
+  // routes make all of the server's HTTP/1.x connections slower; see
+  // Server::router.
+  void add(
+      enum evhttp_cmd_type method,
+      const std::string& pattern,
+      Handler handler,
+      bool stream_request_body = false);
+
+  bool empty() const;
+  // Returns true if any route streams its request bodies.
+  bool has_streaming_routes() const;
+
+  struct Match {
+    // The matched route's handler, or nullptr if there isn't one for this
+    // method and path
+    const Handler* handler;
+    // True if any route matches the path, even if it's for a different method.
+    // If handler is null and this is true, the server should return 405 Method
+    // Not Allowed.
+    bool path_matched;
+    // The methods of the routes that match the path, as a bitmask of
+    // evhttp_cmd_type values (for the Allow header in 405 responses)
+    uint32_t allowed_methods;
+    // True if the matched route streams its request bodies
+    bool stream_request_body;
+    RouteParams params;
+  };
+  Match match(enum evhttp_cmd_type method, std::string_view path) const;
+
+private:
+  struct Route {
+    enum evhttp_cmd_type method;
+    std::vector<std::string> param_names;
+    Handler handler;
+    bool stream_request_body;
+  };
+
+  struct Node {
+    // Static text matched by this node. For parameter and wildcard nodes, this
+    // is empty.
+    std::string prefix;
+
+    // Children are checked in this order: static (by first character), then
+    // parameter, then wildcard
+    std::string static_child_first_chars;
+    std::vector<std::unique_ptr<Node>> static_children;
+    std::unique_ptr<Node> param_child;
+    std::unique_ptr<Node> wildcard_child;
+
+    std::vector<Route> routes;
+  };
+
+  std::unique_ptr<Node> root;
+  size_t num_routes;
+  size_t num_streaming_routes;
+
+  static Node* add_static(Node* node, std::string_view text);
+  static const Node* match_node(
+      const Node* node, std::string_view path, RouteParams& params);
+};
+
+} // namespace EventAsync::HTTP
@@ -1,21 +1,31 @@
 #include "Server.hh"
 
+#include <errno.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent_ssl.h>
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/thread.h>
 #include <inttypes.h>
+#include <netinet/in.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <future>
+#include <mutex>
 #include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
 #include <phosg/Hash.hh>
+#include <phosg/Network.hh>
 #include <phosg/Strings.hh>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -23,81 +33,30 @@ using namespace std;
 
 namespace EventAsync::HTTP {
 
-const unordered_map<int, const char*> Server::explanation_for_response_code({
-    {100, "Continue"},
-    {101, "Switching Protocols"},
-    {102, "Processing"},
-    {200, "OK"},
-    {201, "Created"},
-    {202, "Accepted"},
-    {203, "Non-Authoritative Information"},
-    {204, "No Content"},
-    {205, "Reset Content"},
-    {206, "Partial Content"},
-    {207, "Multi-Status"},
-    {208, "Already Reported"},
-    {226, "IM Used"},
-    {300, "Multiple Choices"},
-    {301, "Moved Permanently"},
-    {302, "Found"},
-    {303, "See Other"},
-    {304, "Not Modified"},
-    {305, "Use Proxy"},
-    {307, "Temporary Redirect"},
-    {308, "Permanent Redirect"},
-    {400, "Bad Request"},
-    {401, "Unathorized"},
-    {402, "Payment Required"},
-    {403, "Forbidden"},
-    {404, "Not Found"},
-    {405, "Method Not Allowed"},
-    {406, "Not Acceptable"},
-    {407, "Proxy Authentication Required"},
-    {408, "Request Timeout"},
-    {409, "Conflict"},
-    {410, "Gone"},
-    {411, "Length Required"},
-    {412, "Precondition Failed"},
-    {413, "Request Entity Too Large"},
-    {414, "Request-URI Too Long"},
-    {415, "Unsupported Media Type"},
-    {416, "Requested Range Not Satisfiable"},
-    {417, "Expectation Failed"},
-    {418, "I\'m a Teapot"},
-    {420, "Enhance Your Calm"},
-    {422, "Unprocessable Entity"},
-    {423, "Locked"},
-    {424, "Failed Dependency"},
-    {426, "Upgrade Required"},
-    {428, "Precondition Required"},
-    {429, "Too Many Requests"},
-    {431, "Request Header Fields Too Large"},
-    {444, "No Response"},
-    {449, "Retry With"},
-    {451, "Unavailable For Legal Reasons"},
-    {500, "Internal Server Error"},
-    {501, "Not Implemented"},
-    {502, "Bad Gateway"},
-    {503, "Service Unavailable"},
-    {504, "Gateway Timeout"},
-    {505, "HTTP Version Not Supported"},
-    {506, "Variant Also Negotiates"},
-    {507, "Insufficient Storage"},
-    {508, "Loop Detected"},
-    {509, "Bandwidth Limit Exceeded"},
-    {510, "Not Extended"},
-    {511, "Network Authentication Required"},
-    {598, "Network Read Timeout Error"},
-    {599, "Network Connect Timeout Error"},
-});
-
-Server::Server(Base& base, shared_ptr<SSL_CTX> ssl_ctx)
-    : base(base),
+const unordered_map<int, const char*> Server::explanation_for_response_code = []() {
+  unordered_map<int, const char*> ret;
+  for (int code = 100; code < 600; code++) {
+    const char* phrase = reason_phrase_for_status(code);
+    if (phrase) {
+      ret.emplace(code, phrase);
+    }
+  }
+  return ret;
+}();
+
+Server::Worker::Worker(Server* server, size_t index, Base* base)
+    : server(server),
+      index(index),
+      base(base),
       http(nullptr),
-      ssl_http(nullptr),
-      ssl_ctx(ssl_ctx) {}
+      ssl_http(nullptr) {
+  if (!this->base) {
+    this->owned_base.reset(new Base());
+    this->base = this->owned_base.get();
+  }
+}
 
-Server::~Server() {
+Server::Worker::~Worker() {
   if (this->http) {
     evhttp_free(this->http);
   }
@@ -106,78 +65,461 @@ Server::~Server() {
   }
 }
 
-void Server::add_socket(int fd, bool ssl) {
+struct evhttp* Server::Worker::get_http(bool ssl) {
   if (ssl) {
     if (!this->ssl_http) {
-      if (!this->ssl_ctx.get()) {
+      if (!this->server->ssl_ctx.get()) {
         throw logic_error("cannot add SSL listening socket without SSL_CTX set");
       }
-      this->ssl_http = evhttp_new(this->base.base);
+      this->ssl_http = evhttp_new(this->base->base);
       if (!this->ssl_http) {
         throw bad_alloc();
       }
       evhttp_set_bevcb(
-          this->ssl_http,
-          this->dispatch_on_ssl_connection,
-          this->ssl_ctx.get());
-      evhttp_set_gencb(this->ssl_http, this->dispatch_handle_request, this);
+          this->ssl_http, &Server::dispatch_on_ssl_connection, this);
+      evhttp_set_gencb(this->ssl_http, this->server->dispatch_handle_request, this);
     }
-    evhttp_accept_socket(this->ssl_http, fd);
+    return this->ssl_http;
 
   } else {
     if (!this->http) {
-      this->http = evhttp_new(this->base.base);
+      this->http = evhttp_new(this->base->base);
       if (!this->http) {
         throw bad_alloc();
       }
-      evhttp_set_gencb(this->http, this->dispatch_handle_request, this);
+      // dispatch_on_connection decides for each connection whether it needs a
+      // RequestBodyFilter or HTTP/2 detection, so routes added after this
+      // still take effect
+      evhttp_set_bevcb(this->http, &Server::dispatch_on_connection, this);
+      evhttp_set_gencb(this->http, this->server->dispatch_handle_request, this);
     }
-    evhttp_accept_socket(this->http, fd);
+    return this->http;
+  }
+}
+
+Server::Server(
+    Base& base, shared_ptr<SSL_CTX> ssl_ctx, size_t num_worker_threads)
+    : base(base),
+      ssl_ctx(ssl_ctx),
+      compression_enabled(false),
+      compression_min_size(1024),
+      compression_level(-1),
+      websocket_max_frame_size(0x10000),
+      websocket_high_watermark(0x40000),
+      websocket_low_watermark(0x10000),
+      websocket_max_message_size(64 * 1024 * 1024),
+      num_worker_threads(num_worker_threads),
+      workers_started(false) {
+  if (this->num_worker_threads == 0) {
+    this->workers.emplace_back(new Worker(this, 0, &this->base));
+    return;
+  }
+
+  // The worker Bases are configured from this thread and stopped from it in
+  // the destructor, so libevent's locking must be enabled before creating them.
+  // Servers may be constructed on multiple threads, but this must only be done
+  // once per process.
+  static once_flag evthread_initialized;
+  call_once(evthread_initialized, []() {
+    if (evthread_use_pthreads()) {
+      throw runtime_error("cannot enable libevent thread support");
+    }
+  });
+
+  for (size_t x = 0; x < this->num_worker_threads; x++) {
+    this->workers.emplace_back(new Worker(this, x, nullptr));
+  }
+  for (auto& w : this->workers) {
+    w->thread = thread(&Server::worker_thread_fn, this, w.get());
   }
 }
 
+Server::~Server() {
+  this->stop();
+}
+
+void Server::check_not_worker_thread() const {
+  auto this_thread_id = this_thread::get_id();
+  for (const auto& w : this->workers) {
+    if (w->thread.get_id() == this_thread_id) {
+      throw logic_error("cannot configure or stop a server from its worker threads");
+    }
+  }
+}
+
+void Server::stop() {
+  this->check_not_worker_thread();
+  // Calling event_base_loopbreak directly could race with the thread starting
+  // its event loop (which resets the break flag), so we do it from within the
+  // loop instead
+  for (auto& w : this->workers) {
+    if (w->thread.joinable()) {
+      struct event_base* b = w->base->base;
+      w->base->once(-1, EV_TIMEOUT, [b](evutil_socket_t, short) {
+        event_base_loopbreak(b);
+      }, 0);
+    }
+  }
+  for (auto& w : this->workers) {
+    if (w->thread.joinable()) {
+      w->thread.join();
+    }
+  }
+}
+
+void Server::worker_thread_fn(Worker* w) {
+  // The worker may not have any listening sockets yet, so don't exit if there
+  // are no events
+  event_base_loop(w->base->base, EVLOOP_NO_EXIT_ON_EMPTY);
+}
+
+void Server::start_workers() {
+  // on_worker_thread_start is virtual, so it can't be called until the
+  // subclass' constructor has finished. Adding the first socket is the
+  // earliest point at which we know this is the case.
+  if (this->workers_started) {
+    return;
+  }
+  this->workers_started = true;
+  if (this->num_worker_threads > 0) {
+    this->run_on_workers([this](Worker& w) {
+      this->on_worker_thread_start(w.index, *w.base);
+    });
+  }
+}
+
+void Server::on_worker_thread_start(size_t, Base&) {}
+
+void Server::run_on_workers(function<void(Worker&)> fn) {
+  if (this->num_worker_threads == 0) {
+    fn(*this->workers[0]);
+    return;
+  }
+  this->check_not_worker_thread();
+
+  vector<future<void>> futures;
+  for (auto& w : this->workers) {
+    auto p = make_shared<promise<void>>();
+    futures.emplace_back(p->get_future());
+    Worker* w_ptr = w.get();
+    w->base->once(-1, EV_TIMEOUT, [w_ptr, fn, p](evutil_socket_t, short) {
+      try {
+        fn(*w_ptr);
+        p->set_value();
+      } catch (...) {
+        p->set_exception(current_exception());
+      }
+    }, 0);
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+}
+
+void Server::add_socket(int fd, bool ssl) {
+  this->start_workers();
+  this->run_on_workers([fd, ssl](Worker& w) {
+    if (evhttp_accept_socket(w.get_http(ssl), fd)) {
+      throw runtime_error("cannot accept connections on socket");
+    }
+  });
+}
+
+void Server::listen(const string& addr, uint16_t port, bool ssl) {
+  this->start_workers();
+  auto s = make_sockaddr_storage(addr, port);
+
+  // With worker threads, each thread gets its own socket; otherwise, there's
+  // only one socket and SO_REUSEPORT is unnecessary
+  vector<int> fds;
+  try {
+    for (size_t x = 0; x < this->workers.size(); x++) {
+      int fd = socket(s.first.ss_family, SOCK_STREAM, IPPROTO_TCP);
+      if (fd < 0) {
+        throw runtime_error("cannot create socket: " + string_for_error(errno));
+      }
+      fds.emplace_back(fd);
+
+      int optval = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+      if ((this->num_worker_threads > 0) &&
+          setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval))) {
+        throw runtime_error("cannot enable SO_REUSEPORT: " + string_for_error(errno));
+      }
+      if (::bind(fd, reinterpret_cast<const struct sockaddr*>(&s.first), s.second)) {
+        throw runtime_error("cannot bind socket: " + string_for_error(errno));
+      }
+      if (::listen(fd, SOMAXCONN)) {
+        throw runtime_error("cannot listen on socket: " + string_for_error(errno));
+      }
+      make_fd_nonblocking(fd);
+    }
+  } catch (const exception&) {
+    for (int fd : fds) {
+      close(fd);
+    }
+    throw;
+  }
+
+  this->run_on_workers([&fds, ssl](Worker& w) {
+    if (evhttp_accept_socket(w.get_http(ssl), fds[w.index])) {
+      throw runtime_error("cannot accept connections on socket");
+    }
+  });
+}
+
 void Server::set_server_name(const char* new_server_name) {
   this->server_name = new_server_name;
 }
 
-struct bufferevent* Server::dispatch_on_ssl_connection(
+void Server::set_compression(bool enabled, size_t min_size, int level) {
+  this->compression_enabled = enabled;
+  this->compression_min_size = min_size;
+  this->compression_level = level;
+}
+
+void Server::set_websocket_compression(const WebsocketDeflateOptions& options) {
+  this->websocket_deflate_options = options;
+}
+
+void Server::set_websocket_output_limits(
+    size_t max_frame_size, size_t high_watermark, size_t low_watermark) {
+  if (low_watermark > high_watermark) {
+    throw invalid_argument("low watermark must not be above high watermark");
+  }
+  this->websocket_max_frame_size = max_frame_size;
+  this->websocket_high_watermark = high_watermark;
+  this->websocket_low_watermark = low_watermark;
+}
+
+void Server::set_websocket_max_message_size(size_t max_message_size) {
+  this->websocket_max_message_size = max_message_size;
+}
+
+void Server::set_http2(const HTTP2Options& options) {
+  this->http2_options = options;
+  if (this->http2_options.enabled && this->ssl_ctx) {
+    HTTP2Connection::enable_alpn(this->ssl_ctx.get());
+  }
+}
+
+size_t Server::get_num_worker_threads() const {
+  return this->num_worker_threads;
+}
+
+struct bufferevent* Server::dispatch_on_connection(
     struct event_base* base,
     void* ctx) {
+  auto* w = reinterpret_cast<Worker*>(ctx);
+  // evhttp sets the fd after this returns
+  struct bufferevent* bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (bev && w->server->router.has_streaming_routes()) {
+    bev = RequestBodyFilter::create(*w->base, bev, w->server->router);
+  }
+  const auto& http2_options = w->server->http2_options;
+  if (bev && http2_options.enabled && http2_options.allow_cleartext) {
+    HTTP2Connection::watch(
+        *w->base, bev, &http2_options, &Server::dispatch_handle_request, w);
+  }
+  return bev;
+}
 
-  SSL_CTX* ssl_ctx = reinterpret_cast<SSL_CTX*>(ctx);
-  SSL* ssl = SSL_new(ssl_ctx);
-  return bufferevent_openssl_socket_new(
+struct bufferevent* Server::dispatch_on_ssl_connection(
+    struct event_base* base,
+    void* ctx) {
+  auto* w = reinterpret_cast<Worker*>(ctx);
+  SSL* ssl = SSL_new(w->server->ssl_ctx.get());
+  struct bufferevent* bev = bufferevent_openssl_socket_new(
       base,
       -1,
       ssl,
       BUFFEREVENT_SSL_ACCEPTING,
       BEV_OPT_CLOSE_ON_FREE);
+  if (bev && w->server->router.has_streaming_routes()) {
+    bev = RequestBodyFilter::create(*w->base, bev, w->server->router);
+  }
+  // Clients that negotiated HTTP/2 with ALPN send the preface as soon as the
+  // handshake is done
+  if (bev && w->server->http2_options.enabled) {
+    HTTP2Connection::watch(*w->base, bev, &w->server->http2_options,
+        &Server::dispatch_handle_request, w);
+  }
+  return bev;
+}
+
+static string allow_header_for_methods(uint32_t methods) {
+  static const vector<pair<enum evhttp_cmd_type, const char*>> names({
+      {EVHTTP_REQ_GET, "GET"},
+      {EVHTTP_REQ_HEAD, "HEAD"},
+      {EVHTTP_REQ_POST, "POST"},
+      {EVHTTP_REQ_PUT, "PUT"},
+      {EVHTTP_REQ_DELETE, "DELETE"},
+      {EVHTTP_REQ_OPTIONS, "OPTIONS"},
+      {EVHTTP_REQ_TRACE, "TRACE"},
+      {EVHTTP_REQ_CONNECT, "CONNECT"},
+      {EVHTTP_REQ_PATCH, "PATCH"},
+  });
+  string ret;
+  for (const auto& [method, name] : names) {
+    if (methods & method) {
+      if (!ret.empty()) {
+        ret += ", ";
+      }
+      ret += name;
+    }
+  }
+  return ret;
 }
 
 void Server::dispatch_handle_request(
     struct evhttp_request* req,
     void* ctx) {
-  auto* s = reinterpret_cast<Server*>(ctx);
-  Request req_obj(s->base, req);
+  auto* w = reinterpret_cast<Worker*>(ctx);
+  Request req_obj(*w->base, req);
+
+  Server* s = w->server;
+  if (s->router.has_streaming_routes()) {
+    auto* filter = RequestBodyFilter::for_request(req);
+    if (filter) {
+      filter->on_request_dispatched(req);
+    }
+  }
+  if (!s->router.empty()) {
+    const char* path = evhttp_uri_get_path(req_obj.get_evhttp_uri());
+    auto match = s->router.match(req_obj.get_command(), path ? path : "");
+    if (match.handler) {
+      (*match.handler)(req_obj, match.params);
+      return;
+    } else if (match.path_matched) {
+      req_obj.add_output_header(
+          "Allow", allow_header_for_methods(match.allowed_methods).c_str());
+      s->send_response(req_obj, 405, "text/plain", "Method not allowed");
+      return;
+    }
+  }
+
   s->handle_request(req_obj);
 }
 
+DetachedTask Server::handle_request(Request& req) {
+  this->send_response(req, 404, "text/plain", "Not found");
+  co_return;
+}
+
+// Bodies larger than this are compressed and sent in chunks of this size
+static const size_t STREAMING_COMPRESSION_CHUNK_SIZE = 0x10000;
+
+void Server::add_standard_headers(Request& req, const char* content_type) {
+  struct evkeyvalq* headers = req.get_output_headers();
+  if (content_type) {
+    evhttp_add_header(headers, "Content-Type", content_type);
+  }
+  if (!this->server_name.empty()) {
+    evhttp_add_header(headers, "Server", this->server_name.c_str());
+  }
+  // evhttp adds a Date header to HTTP/1.1 responses if there isn't one, but
+  // formats it again for every response
+  if (!evhttp_find_header(headers, "Date")) {
+    evhttp_add_header(headers, "Date", current_http_date());
+  }
+}
+
 void Server::send_response(
     Request& req,
     int code,
     const char* content_type,
     Buffer& buf) {
+  this->send_response_body(req, code, content_type, buf, true);
+}
 
-  req.add_output_header("Content-Type", content_type);
-  if (!this->server_name.empty()) {
-    req.add_output_header("Server", this->server_name.c_str());
+void Server::send_response_body(
+    Request& req,
+    int code,
+    const char* content_type,
+    Buffer& buf,
+    bool allow_compression) {
+
+  this->add_standard_headers(req, content_type);
+
+  // Don't compress responses that have no body, partial responses (the range
+  // would refer to the uncompressed data), or responses that the handler has
+  // already encoded
+  ContentEncoding encoding = ContentEncoding::IDENTITY;
+  if (allow_compression &&
+      this->compression_enabled &&
+      (code >= 200) && (code != 204) && (code != 206) && (code != 304) &&
+      (req.get_command() != EVHTTP_REQ_HEAD) &&
+      is_compressible_content_type(content_type) &&
+      !evhttp_find_header(req.get_output_headers(), "Content-Encoding")) {
+    req.add_output_header("Vary", "Accept-Encoding");
+    if (buf.get_length() >= this->compression_min_size) {
+      encoding = preferred_content_encoding(
+          parse_accept_encoding(req.get_input_header("Accept-Encoding")));
+    }
   }
 
-  evhttp_send_reply(
-      req.req,
-      code,
-      Server::explanation_for_response_code.at(code),
-      buf.buf);
+  if (encoding == ContentEncoding::IDENTITY) {
+    send_http_reply(
+        req.req,
+        code,
+        reason_phrase_for_status(code),
+        buf.buf);
+    return;
+  }
+
+  req.add_output_header("Content-Encoding", name_for_content_encoding(encoding));
+  if (buf.get_length() <= STREAMING_COMPRESSION_CHUNK_SIZE) {
+    Buffer compressed_buf(req.base);
+    Compressor::for_current_thread().compress_all(
+        compressed_buf, buf, encoding, this->compression_level);
+    send_http_reply(
+        req.req,
+        code,
+        reason_phrase_for_status(code),
+        compressed_buf.buf);
+  } else {
+    Buffer body_buf(req.base);
+    body_buf.add_buffer(buf);
+    this->send_compressed_response_stream(
+        req.base, req.req, code, encoding, std::move(body_buf));
+  }
+}
+
+DetachedTask Server::send_compressed_response_stream(
+    Base& base,
+    struct evhttp_request* req,
+    int code,
+    ContentEncoding encoding,
+    Buffer buf) {
+  // This can't use the thread's shared compressor, since other responses may
+  // use it while this one is waiting for its next turn
+  Compressor compressor;
+  compressor.begin(encoding, this->compression_level);
+
+  // evhttp uses chunked encoding here (or closes the connection after the
+  // response, for HTTP 1.0 clients), since the final size isn't known yet
+  send_http_reply_start(req, code, reason_phrase_for_status(code));
+  Buffer chunk_buf(base);
+  for (;;) {
+    size_t chunk_size = min<size_t>(buf.get_length(), STREAMING_COMPRESSION_CHUNK_SIZE);
+    bool finish = (chunk_size == buf.get_length());
+    compressor.compress(chunk_buf, buf, chunk_size, finish);
+    if (chunk_buf.get_length() > 0) {
+      send_http_reply_chunk(req, chunk_buf.buf);
+    }
+    if (finish) {
+      break;
+    }
+
+    // Let other events run before compressing the next chunk. If the client
+    // disconnected in the meantime, send_http_reply_end just frees the
+    // request.
+    co_await base.sleep(0);
+    if (!is_http_request_connected(req)) {
+      break;
+    }
+  }
+  send_http_reply_end(req);
 }
 
 void Server::send_response(
@@ -186,7 +528,7 @@ void Server::send_response(
     const char* content_type,
     const void* data,
     size_t size) {
-  Buffer buf(this->base);
+  Buffer buf(req.base);
   buf.add(data, size);
   this->send_response(req, code, content_type, buf);
 }
@@ -196,14 +538,14 @@ void Server::send_response(
     int code,
     const char* content_type,
     string&& data) {
-  Buffer buf(this->base);
+  Buffer buf(req.base);
   buf.add(std::move(data));
   this->send_response(req, code, content_type, buf);
 }
 
 void Server::send_response(Request& req, int code,
     const char* content_type, const char* fmt, ...) {
-  Buffer out_buffer(this->base);
+  Buffer out_buffer(req.base);
 
   va_list va;
   va_start(va, fmt);
@@ -215,50 +557,354 @@ void Server::send_response(Request& req, int code,
 
 void Server::send_response(Request& req, int code,
     const char* content_type) {
-  if (!this->server_name.empty()) {
-    req.add_output_header("Server", this->server_name.c_str());
-  }
-  if (content_type) {
-    req.add_output_header("Content-Type", content_type);
-  }
-  evhttp_send_reply(
+  this->add_standard_headers(req, content_type);
+  send_http_reply(
       req.req,
       code,
-      Server::explanation_for_response_code.at(code),
+      reason_phrase_for_status(code),
       nullptr);
 }
 
+unique_ptr<ResponseStream> Server::start_response_stream(
+    Request& req,
+    int code,
+    const char* content_type) {
+  this->add_standard_headers(req, content_type);
+  return make_unique<ResponseStream>(
+      req, code, reason_phrase_for_status(code));
+}
+
+unique_ptr<RequestBodyStream> Server::get_request_body_stream(Request& req) {
+  return make_unique<RequestBodyStream>(req);
+}
+
+// Returns true if any of the entity tags in an If-None-Match header matches
+// etag. This uses the weak comparison function (RFC 9110 section 8.8.3.2), so
+// W/ prefixes are ignored.
+static bool etag_list_matches(const char* header, const string& etag) {
+  string_view remaining(header);
+  while (!remaining.empty()) {
+    size_t comma_pos = remaining.find(',');
+    string_view item = remaining.substr(0, comma_pos);
+    remaining = (comma_pos == string_view::npos)
+        ? string_view() : remaining.substr(comma_pos + 1);
+
+    while (!item.empty() && ((item.front() == ' ') || (item.front() == '\t'))) {
+      item.remove_prefix(1);
+    }
+    while (!item.empty() && ((item.back() == ' ') || (item.back() == '\t'))) {
+      item.remove_suffix(1);
+    }
+    if (item == "*") {
+      return true;
+    }
+    if (item.starts_with("W/")) {
+      item.remove_prefix(2);
+    }
+    if (item == etag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+enum class RangeParseResult {
+  IGNORED = 0,
+  SATISFIABLE,
+  UNSATISFIABLE,
+};
+
+// Parses a Range header. On success, start and end are set to the requested
+// [start, end) interval of the file. Multiple ranges and units other than bytes
+// aren't supported; in these cases, the header is ignored and the entire file
+// is sent, as RFC 9110 allows.
+static RangeParseResult parse_byte_range(
+    const char* header, uint64_t file_size, uint64_t* start, uint64_t* end) {
+  string_view spec(header);
+  if (!spec.starts_with("bytes=") || (spec.find(',') != string_view::npos)) {
+    return RangeParseResult::IGNORED;
+  }
+  spec.remove_prefix(6);
+
+  size_t dash_pos = spec.find('-');
+  if (dash_pos == string_view::npos) {
+    return RangeParseResult::IGNORED;
+  }
+  string_view first_str = spec.substr(0, dash_pos);
+  string_view last_str = spec.substr(dash_pos + 1);
+
+  auto parse_u64 = [](string_view s, uint64_t* value) -> bool {
+    if (s.empty() || (s.size() > 19)) {
+      return false;
+    }
+    *value = 0;
+    for (char ch : s) {
+      if ((ch < '0') || (ch > '9')) {
+        return false;
+      }
+      *value = (*value * 10) + (ch - '0');
+    }
+    return true;
+  };
+
+  uint64_t first, last;
+  if (first_str.empty()) {
+    // Suffix range (bytes=-N): the last N bytes of the file
+    if (!parse_u64(last_str, &last)) {
+      return RangeParseResult::IGNORED;
+    }
+    if ((last == 0) || (file_size == 0)) {
+      return RangeParseResult::UNSATISFIABLE;
+    }
+    *start = (last > file_size) ? 0 : (file_size - last);
+    *end = file_size;
+    return RangeParseResult::SATISFIABLE;
+  }
+
+  if (!parse_u64(first_str, &first)) {
+    return RangeParseResult::IGNORED;
+  }
+  if (last_str.empty()) {
+    last = file_size - 1;
+  } else if (!parse_u64(last_str, &last) || (last < first)) {
+    return RangeParseResult::IGNORED;
+  }
+  if (first >= file_size) {
+    return RangeParseResult::UNSATISFIABLE;
+  }
+  *start = first;
+  *end = (last >= file_size) ? file_size : (last + 1);
+  return RangeParseResult::SATISFIABLE;
+}
+
+void Server::send_static_file(
+    Request& req, StaticFileCache& cache, const char* path) {
+  auto command = req.get_command();
+  if ((command != EVHTTP_REQ_GET) && (command != EVHTTP_REQ_HEAD)) {
+    req.add_output_header("Allow", "GET, HEAD");
+    this->send_response(req, 405, "text/plain", "Method not allowed");
+    return;
+  }
+
+  size_t decoded_path_size;
+  char* decoded_path = evhttp_uridecode(path, 0, &decoded_path_size);
+  if (!decoded_path) {
+    throw bad_alloc();
+  }
+  // Precompressed variants are only served if compression is enabled, like
+  // responses compressed on the fly
+  uint32_t accepted_encodings = this->compression_enabled
+      ? parse_accept_encoding(req.get_input_header("Accept-Encoding"))
+      : (1 << static_cast<size_t>(ContentEncoding::IDENTITY));
+  auto file = cache.get(string(decoded_path, decoded_path_size), accepted_encodings);
+  free(decoded_path);
+  if (!file) {
+    this->send_response(req, 404, "text/plain", "Not found");
+    return;
+  }
+
+  if (file->encoding != ContentEncoding::IDENTITY) {
+    req.add_output_header("Content-Encoding", name_for_content_encoding(file->encoding));
+  }
+  if (this->compression_enabled && ((file->encoding != ContentEncoding::IDENTITY) ||
+      is_compressible_content_type(file->content_type))) {
+    req.add_output_header("Vary", "Accept-Encoding");
+  }
+  req.add_output_header("ETag", file->etag.c_str());
+  req.add_output_header("Last-Modified", file->last_modified.c_str());
+  req.add_output_header("Accept-Ranges", "bytes");
+
+  // If-None-Match takes precedence over If-Modified-Since. Clients send back
+  // the Last-Modified value verbatim, so an exact comparison is sufficient.
+  const char* if_none_match = req.get_input_header("If-None-Match");
+  const char* if_modified_since = req.get_input_header("If-Modified-Since");
+  if (if_none_match
+          ? etag_list_matches(if_none_match, file->etag)
+          : (if_modified_since && (file->last_modified == if_modified_since))) {
+    this->send_response(req, 304);
+    return;
+  }
+
+  int code = 200;
+  uint64_t start = 0;
+  uint64_t end = file->size;
+  const char* range = req.get_input_header("Range");
+  const char* if_range = req.get_input_header("If-Range");
+  if (range && (!if_range ||
+      (file->etag == if_range) ||
+      (file->last_modified == if_range))) {
+    switch (parse_byte_range(range, file->size, &start, &end)) {
+      case RangeParseResult::IGNORED:
+        start = 0;
+        end = file->size;
+        break;
+      case RangeParseResult::SATISFIABLE: {
+        code = 206;
+        string content_range = string_printf(
+            "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64, start, end - 1, file->size);
+        req.add_output_header("Content-Range", content_range.c_str());
+        break;
+      }
+      case RangeParseResult::UNSATISFIABLE: {
+        string content_range = string_printf("bytes */%" PRIu64, file->size);
+        req.add_output_header("Content-Range", content_range.c_str());
+        this->send_response(req, 416, "text/plain", "Range not satisfiable");
+        return;
+      }
+    }
+  }
+
+  // evhttp doesn't send a body or compute Content-Length for HEAD requests,
+  // so we have to add the header manually
+  if (command == EVHTTP_REQ_HEAD) {
+    req.add_output_header("Content-Length", to_string(end - start).c_str());
+    this->send_response(req, code, file->content_type);
+    return;
+  }
+
+  // The segment is added by reference, so this doesn't read the file. libevent
+  // only uses sendfile() for segments added to a buffer that's marked as
+  // draining to an fd; otherwise, it maps the file into memory. SSL
+  // connections need the data in memory to encrypt it, so we only set the flag
+  // for plaintext connections. Filtered connections (see RequestBodyFilter)
+  // copy the data into the underlying bufferevent's buffer, so the flag can't
+  // be used for those either. Neither can HTTP/2 requests (which have no
+  // evhttp connection), since the data is split into DATA frames.
+  Buffer buf(req.base);
+  struct evhttp_connection* conn = req.get_connection();
+  struct bufferevent* bev = conn ? evhttp_connection_get_bufferevent(conn) : nullptr;
+  if (bev && !bufferevent_get_underlying(bev) && !bufferevent_openssl_get_ssl(bev)) {
+    evbuffer_set_flags(buf.buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+  }
+  if (end > start) {
+    if (file->segment) {
+      buf.add_file_segment(file->segment, start, end - start);
+    } else {
+      // Variants compressed in memory are sent by reference as well; the
+      // buffer keeps the file object alive until the data has been sent
+      buf.add_reference(file->data.data() + start, end - start,
+          [file](const void*, size_t) {});
+    }
+  }
+  this->send_response_body(req, code, file->content_type, buf, false);
+}
+
+// Pending websocket frames are moved to the output buffer until it holds at
+// least this many bytes. Smaller batches make pings and pongs wait less behind
+// data frames, but larger batches need fewer system calls to send.
+static const size_t WEBSOCKET_OUTPUT_BATCH_SIZE = 0x10000;
+// When a websocket client needs more data, this many bytes are read from the
+// socket if they're available, even if the current frame needs fewer.
+static const size_t WEBSOCKET_READ_SIZE = 0x10000;
+// A websocket client returns at most this many messages from read() before it
+// has to wait for the event loop.
+static const size_t WEBSOCKET_MAX_MESSAGES_WITHOUT_YIELD = 64;
+
 Server::WebsocketClient::WebsocketClient(
-    Server* server, struct evhttp_connection* conn)
+    Server* server,
+    Base& base,
+    struct evhttp_connection* conn,
+    unique_ptr<WebsocketDeflateCodec> deflate)
     : server(server),
       conn(conn),
       bev(evhttp_connection_get_bufferevent(this->conn)),
       fd(bufferevent_getfd(this->bev)),
-      input_buf(server->base) {}
+      input_buf(base),
+      deflate(std::move(deflate)),
+      max_frame_size(this->server->websocket_max_frame_size),
+      high_watermark(this->server->websocket_high_watermark),
+      low_watermark(this->server->websocket_low_watermark),
+      max_message_size(this->server->websocket_max_message_size),
+      pending_buf(base),
+      output_buf(base),
+      write_event(base, this->fd, EV_WRITE, &WebsocketClient::on_write_ready, this),
+      write_event_pending(false),
+      write_failed(false),
+      bytes_queued(0),
+      bytes_committed(0),
+      bytes_written(0),
+      messages_without_yield(0) {}
 
 Server::WebsocketClient::WebsocketClient(WebsocketClient&& other)
     : server(other.server),
       conn(other.conn),
       bev(other.bev),
       fd(other.fd),
-      input_buf(other.input_buf.base) {
+      input_buf(other.input_buf.base),
+      deflate(std::move(other.deflate)),
+      max_frame_size(other.max_frame_size),
+      high_watermark(other.high_watermark),
+      low_watermark(other.low_watermark),
+      max_message_size(other.max_message_size),
+      pending_buf(other.pending_buf.base),
+      pending_frame_sizes(std::move(other.pending_frame_sizes)),
+      output_buf(other.output_buf.base),
+      // The event's callback context is this object, so it can't be moved
+      write_event(other.output_buf.base, this->fd, EV_WRITE, &WebsocketClient::on_write_ready, this),
+      write_event_pending(false),
+      write_failed(other.write_failed),
+      bytes_queued(other.bytes_queued),
+      bytes_committed(other.bytes_committed),
+      bytes_written(other.bytes_written),
+      messages_without_yield(0),
+      write_waiters(std::move(other.write_waiters)),
+      conflated_frames(std::move(other.conflated_frames)) {
+  other.write_event.del();
+  other.write_event_pending = false;
   other.conn = nullptr;
   other.bev = nullptr;
   other.fd = -1;
+  other.pending_frame_sizes.clear();
+  other.write_waiters.clear();
+  other.conflated_frames.clear();
   this->input_buf.add_buffer(other.input_buf);
+  this->pending_buf.add_buffer(other.pending_buf);
+  this->output_buf.add_buffer(other.output_buf);
+  if (!this->write_failed && (this->bytes_queued > this->bytes_written)) {
+    this->schedule_flush();
+  }
 }
 
 Server::WebsocketClient& Server::WebsocketClient::operator=(
     WebsocketClient&& other) {
+  this->close();
+  other.write_event.del();
+  other.write_event_pending = false;
   this->server = other.server;
   this->conn = other.conn;
   this->bev = other.bev;
   this->fd = other.fd;
   this->input_buf.drain_all();
   this->input_buf.add_buffer(other.input_buf);
+  this->deflate = std::move(other.deflate);
+  this->max_frame_size = other.max_frame_size;
+  this->high_watermark = other.high_watermark;
+  this->low_watermark = other.low_watermark;
+  this->max_message_size = other.max_message_size;
+  this->pending_buf.drain_all();
+  this->pending_buf.add_buffer(other.pending_buf);
+  this->pending_frame_sizes = std::move(other.pending_frame_sizes);
+  this->output_buf.drain_all();
+  this->output_buf.add_buffer(other.output_buf);
+  this->write_event = Event(this->output_buf.base, this->fd, EV_WRITE,
+      &WebsocketClient::on_write_ready, this);
+  this->write_event_pending = false;
+  this->write_failed = other.write_failed;
+  this->bytes_queued = other.bytes_queued;
+  this->bytes_committed = other.bytes_committed;
+  this->bytes_written = other.bytes_written;
+  this->messages_without_yield = 0;
+  this->write_waiters = std::move(other.write_waiters);
+  this->conflated_frames = std::move(other.conflated_frames);
   other.conn = nullptr;
   other.bev = nullptr;
   other.fd = -1;
+  other.pending_frame_sizes.clear();
+  other.write_waiters.clear();
+  other.conflated_frames.clear();
+  if (!this->write_failed && (this->bytes_queued > this->bytes_written)) {
+    this->schedule_flush();
+  }
   return *this;
 }
 
@@ -267,6 +913,12 @@ Server::WebsocketClient::~WebsocketClient() {
 }
 
 void Server::WebsocketClient::close() {
+  // Any data that hasn't been sent yet is discarded, and coroutines waiting
+  // for it to be sent are resumed with an exception
+  this->write_event.del();
+  this->write_event_pending = false;
+  this->fail_writes();
+
   // Assume the evhttp_connection (if present) owns the fd, so we only need to
   // free the conn or close the fd here (but not both).
   if (this->conn) {
@@ -304,136 +956,360 @@ Task<shared_ptr<Server::WebsocketClient>> Server::enable_websockets(
     co_return nullptr;
   }
 
+  WebsocketDeflateParams deflate_params;
+  string extensions_header;
+  unique_ptr<WebsocketDeflateCodec> deflate;
+  if (negotiate_websocket_deflate(
+          evhttp_find_header(in_headers, "Sec-WebSocket-Extensions"),
+          this->websocket_deflate_options,
+          &deflate_params,
+          &extensions_header)) {
+    deflate = make_unique<WebsocketDeflateCodec>(
+        true, deflate_params, this->websocket_deflate_options);
+    extensions_header = "Sec-WebSocket-Extensions: " + extensions_header + "\r\n";
+  }
+
   string sec_websocket_accept_data = sec_websocket_key;
   sec_websocket_accept_data += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
   string sec_websocket_accept = base64_encode(sha1(sec_websocket_accept_data));
 
+  // The handler's Request object may be destroyed once the handler is
+  // suspended, so req must not be used after the co_await below
+  Base& base = req.base;
   struct evhttp_connection* conn = req.get_connection();
   struct bufferevent* bev = evhttp_connection_get_bufferevent(conn);
   int fd = bufferevent_getfd(bev);
 
   // Send the HTTP reply, which enables websockets on the client side. All
   // communication after this will use the websocket protocol.
-  Buffer buf(this->base);
+  Buffer buf(base);
   buf.add_printf("HTTP/1.1 101 Switching Protocols\r\n\
 Upgrade: websocket\r\n\
 Connection: upgrade\r\n\
 Sec-WebSocket-Accept: %s\r\n\
-\r\n",
-      sec_websocket_accept.c_str());
+%s\r\n",
+      sec_websocket_accept.c_str(),
+      extensions_header.c_str());
   co_await buf.write(fd);
 
-  co_return shared_ptr<WebsocketClient>(new WebsocketClient(this, conn));
+  co_return shared_ptr<WebsocketClient>(new WebsocketClient(this, base, conn, std::move(deflate)));
 }
 
-Server::WebsocketClient::WebsocketMessage::WebsocketMessage() : opcode(0) {}
-
 Task<Server::WebsocketClient::WebsocketMessage>
 Server::WebsocketClient::read() {
-  WebsocketMessage msg;
-
-  // A message may be fragmented into multiple frames, so we may need to receive
-  // more than one frame. We also automatically respond to control messages
-  // appropriately without returning to the calling coroutine.
+  // We automatically respond to control messages appropriately without
+  // returning to the calling coroutine.
+  WebsocketDecoder decoder(this->input_buf.base, true, this->deflate.get(),
+      this->max_message_size);
   for (;;) {
-    // We need at most 10 bytes to determine if there's a valid frame, or as
-    // little as 2.
-    co_await this->input_buf.read_to(this->fd, 2);
-    uint8_t frame_opcode = this->input_buf.remove_u8();
-    uint8_t frame_size = this->input_buf.remove_u8();
-
-    // Figure out the payload size
-    size_t payload_size = frame_size & 0x7F;
-    if (payload_size == 0x7F) {
-      co_await this->input_buf.read_to(this->fd, 8);
-      payload_size = this->input_buf.remove_u64b();
-    } else if (payload_size == 0x7E) {
-      co_await this->input_buf.read_to(this->fd, 2);
-      payload_size = this->input_buf.remove_u16b();
-    }
-
-    // Read the masking key if needed
-    bool has_mask = frame_size & 0x80;
-    uint8_t mask_key[4];
-    if (has_mask) {
-      co_await this->input_buf.read_to(this->fd, 4);
-      this->input_buf.remove(mask_key, 4);
-    }
-
-    // Read the message data and unmask it
-    co_await this->input_buf.read_to(this->fd, payload_size);
-    string frame_payload = this->input_buf.remove(payload_size);
-    if (has_mask) {
-      for (size_t x = 0; x < payload_size; x++) {
-        frame_payload[x] ^= mask_key[x & 3];
-      }
+    WebsocketMessage msg;
+    WebsocketDecoder::Result result = WebsocketDecoder::Result::NEED_MORE_DATA;
+    uint16_t close_code = 0;
+    string error;
+    try {
+      result = decoder.decode(this->input_buf, &msg);
+    } catch (const WebsocketProtocolError& e) {
+      close_code = e.close_code;
+      error = e.what();
+    }
+    if (close_code) {
+      co_await this->send_close_frame(close_code);
+      throw WebsocketProtocolError(error, close_code);
     }
 
-    // If the current message is a control message, respond appropriately. Note
-    // that control messages can be sent in the middle of fragmented messages;
-    // we should not fail if that happens.
-    uint8_t opcode = frame_opcode & 0x0F;
-    if (opcode & 0x08) {
-      if (opcode == 0x0A) { // Ping response
-        // (Ignore these)
-      } else if (opcode == 0x08) { // Quit
-        co_await this->write(frame_payload.data(), frame_payload.size(), 0x08);
-        throw runtime_error("client has disconnected");
-      } else if (opcode == 0x09) { // Ping
-        co_await this->write(frame_payload.data(), frame_payload.size(), 0x0A);
-      } else {
-        throw runtime_error("unrecognized control message");
-      }
-
-    } else { // Not a control message
-      // If this is the first frame in a message, the frame's opcode must not be
-      // zero; if it's a continuation frame, the frame's opcode must be zero.
-      if ((msg.opcode == 0) == (opcode == 0)) {
-        throw runtime_error("invalid opcode");
-      }
-
-      // Save the message opcode, if present, and append the frame data
-      if (opcode) {
-        msg.opcode = opcode;
+    switch (result) {
+      case WebsocketDecoder::Result::NEED_MORE_DATA: {
+        // Take whatever has already arrived without waiting first, so messages
+        // that arrive together are all handled (and their replies written
+        // together) during the same event loop iteration. If this fails, the
+        // error is reported by read_to instead.
+        size_t bytes_needed = decoder.get_bytes_needed();
+        size_t length = this->input_buf.get_length();
+        if (length < bytes_needed) {
+          evbuffer_read(this->input_buf.buf, this->fd,
+              max<size_t>(bytes_needed - length, WEBSOCKET_READ_SIZE));
+        }
+        if (this->input_buf.get_length() < bytes_needed) {
+          this->messages_without_yield = 0;
+          co_await this->input_buf.read_to(this->fd, bytes_needed);
+        }
+        break;
       }
-      msg.data += frame_payload;
-
-      // If the FIN bit is set, then the message is complete; otherwise, we need
-      // to receive at least one more frame to complete the message.
-      if (frame_opcode & 0x80) {
+      case WebsocketDecoder::Result::CONTROL_FRAME:
+        if (msg.opcode == 0x0A) { // Ping response
+          // (Ignore these)
+        } else if (msg.opcode == 0x08) { // Quit
+          // The caller will probably close the connection after this, so make
+          // sure the reply is sent first
+          co_await this->write(msg.data.data(), msg.data.size(), 0x08);
+          co_await this->flush();
+          throw runtime_error("client has disconnected");
+        } else if (msg.opcode == 0x09) { // Ping
+          co_await this->write(msg.data.data(), msg.data.size(), 0x0A);
+        } else {
+          throw runtime_error("unrecognized control message");
+        }
+        break;
+      case WebsocketDecoder::Result::MESSAGE:
+        // If many messages have arrived at once, return to the event loop
+        // occasionally so other connections aren't delayed. This also limits
+        // the stack depth when the caller's reads and writes all complete
+        // without suspending.
+        if (++this->messages_without_yield >= WEBSOCKET_MAX_MESSAGES_WITHOUT_YIELD) {
+          this->messages_without_yield = 0;
+          co_await this->input_buf.base.sleep(0);
+        }
         co_return std::move(msg);
-      }
     }
   }
 }
 
+Task<void> Server::WebsocketClient::send_close_frame(uint16_t status_code) {
+  // The connection is being failed anyway, so if the frame can't be sent,
+  // there's nothing else to do
+  if (this->write_failed) {
+    co_return;
+  }
+  uint8_t payload[2] = {
+      static_cast<uint8_t>(status_code >> 8),
+      static_cast<uint8_t>(status_code)};
+  try {
+    co_await this->write(payload, sizeof(payload), 0x08);
+    co_await this->flush();
+  } catch (const runtime_error&) { }
+}
+
 Task<void> Server::WebsocketClient::write(Buffer& buf, uint8_t opcode) {
-  size_t data_size = buf.get_length();
-
-  Buffer send_buf(this->server->base);
-  // We don't fragment outgoing frames, so the FIN bit is always set here.
-  send_buf.add_u8(0x80 | (opcode & 0x0F));
-  if (data_size > 0xFFFF) {
-    send_buf.add_u8(0x7F);
-    send_buf.add_u64b(data_size);
-  } else if (data_size > 0x7D) {
-    send_buf.add_u8(0x7E);
-    send_buf.add_u16b(data_size);
+  // Once the connection has failed, anything added to the queue is discarded
+  // instead of sent, and this usually returns without waiting for the queue,
+  // so the failure has to be reported here
+  if (this->write_failed) {
+    buf.drain_all();
+    throw runtime_error("websocket connection has failed");
+  }
+
+  if ((opcode == 0x09) || (opcode == 0x0A)) {
+    Buffer frame(this->output_buf.base);
+    encode_websocket_message(frame, buf, opcode, nullptr, false);
+    this->enqueue_control_frame(frame);
   } else {
-    send_buf.add_u8(data_size);
+    size_t prev_length = this->pending_buf.get_length();
+    encode_websocket_message(this->pending_buf, buf, opcode,
+        this->deflate.get(), false, this->max_frame_size,
+        &this->pending_frame_sizes);
+    this->bytes_queued += this->pending_buf.get_length() - prev_length;
+    this->schedule_flush();
   }
-  send_buf.add_buffer(buf);
 
-  co_await send_buf.write(this->fd);
+  if (this->bytes_queued - this->bytes_written > this->high_watermark) {
+    co_await WriteAwaiter{this, this->bytes_queued - this->low_watermark, false};
+  }
 }
 
 Task<void> Server::WebsocketClient::write(
     const void* data, size_t size, uint8_t opcode) {
-  Buffer buf(this->server->base);
-  buf.add_reference(data, size);
+  // The message may still be queued after this returns, so the data must be
+  // copied
+  Buffer buf(this->input_buf.base);
+  buf.add(data, size);
   co_await this->write(buf, opcode);
 }
 
+Task<void> Server::WebsocketClient::flush() {
+  co_await WriteAwaiter{this, this->bytes_queued, false};
+}
+
+void Server::WebsocketClient::send_frame(Buffer& frame) {
+  this->enqueue_frame(frame, true);
+}
+
+void Server::WebsocketClient::conflate_frame(
+    const string& key, shared_ptr<Buffer> frame) {
+  if (this->write_failed) {
+    return;
+  }
+  if (this->bytes_queued == this->bytes_written) {
+    this->enqueue_frame(*frame, true);
+    return;
+  }
+  for (auto& it : this->conflated_frames) {
+    if (it.first == key) {
+      it.second = std::move(frame);
+      return;
+    }
+  }
+  this->conflated_frames.emplace_back(key, std::move(frame));
+}
+
+size_t Server::WebsocketClient::get_queued_bytes() const {
+  size_t ret = this->bytes_queued - this->bytes_written;
+  for (const auto& it : this->conflated_frames) {
+    ret += it.second->get_length();
+  }
+  return ret;
+}
+
+void Server::WebsocketClient::abort() {
+  if (this->fd >= 0) {
+    ::shutdown(this->fd, SHUT_RDWR);
+  }
+  this->write_event.del();
+  this->write_event_pending = false;
+  this->fail_writes();
+}
+
+void Server::WebsocketClient::enqueue_frame(Buffer& frame, bool by_reference) {
+  if (this->write_failed) {
+    if (!by_reference) {
+      frame.drain_all();
+    }
+    return;
+  }
+  // The counters are only updated once the frame has actually been added,
+  // since adding it can throw
+  size_t size = frame.get_length();
+  if (by_reference) {
+    this->pending_buf.add_buffer_reference(frame);
+  } else {
+    this->pending_buf.add_buffer(frame);
+  }
+  this->pending_frame_sizes.emplace_back(size);
+  this->bytes_queued += size;
+  this->schedule_flush();
+}
+
+void Server::WebsocketClient::enqueue_control_frame(Buffer& frame) {
+  // The frame goes ahead of all pending data frames, so coroutines waiting for
+  // those frames to be sent now have to wait for this one too
+  size_t size = frame.get_length();
+  this->output_buf.add_buffer(frame);
+  for (auto& waiter : this->write_waiters) {
+    if (waiter.end_offset > this->bytes_committed) {
+      waiter.end_offset += size;
+    }
+  }
+  this->bytes_queued += size;
+  this->bytes_committed += size;
+  this->schedule_flush();
+}
+
+void Server::WebsocketClient::schedule_flush() {
+  // Frames aren't written immediately; instead, the write event's callback
+  // writes everything that was queued during the current event loop iteration
+  // at once
+  if (!this->write_event_pending) {
+    this->write_event_pending = true;
+    this->write_event.activate(EV_WRITE);
+  }
+}
+
+void Server::WebsocketClient::flush_output() {
+  // Write as much as possible now; if the socket's send buffer fills up, wait
+  // for it to become writable again. This is only called from the write
+  // event's callback, so it never blocks.
+  for (;;) {
+    // Move pending frames to output_buf in batches, but always move at least
+    // one frame if output_buf is empty
+    while (!this->pending_frame_sizes.empty() &&
+        (this->output_buf.get_length() < WEBSOCKET_OUTPUT_BATCH_SIZE)) {
+      size_t size = this->pending_frame_sizes.front();
+      this->pending_frame_sizes.pop_front();
+      this->pending_buf.remove_buffer(this->output_buf, size);
+      this->bytes_committed += size;
+    }
+
+    while (this->output_buf.get_length() > 0) {
+      int bytes = evbuffer_write(this->output_buf.buf, this->fd);
+      if (bytes < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+          this->fail_writes();
+          return;
+        }
+        break;
+      } else if (bytes == 0) {
+        break;
+      }
+      this->bytes_written += bytes;
+    }
+    if (this->output_buf.get_length() > 0) {
+      break;
+    }
+    if (!this->pending_frame_sizes.empty()) {
+      continue;
+    }
+    if (this->conflated_frames.empty()) {
+      break;
+    }
+    // The queue is empty, so send the held-back frames
+    for (auto& it : this->conflated_frames) {
+      size_t size = it.second->get_length();
+      this->pending_buf.add_buffer_reference(*it.second);
+      this->pending_frame_sizes.emplace_back(size);
+      this->bytes_queued += size;
+    }
+    this->conflated_frames.clear();
+  }
+
+  this->resume_write_waiters();
+  if (this->output_buf.get_length() > 0) {
+    this->write_event_pending = true;
+    this->write_event.add();
+  }
+}
+
+void Server::WebsocketClient::fail_writes() {
+  this->write_failed = true;
+  this->pending_buf.drain_all();
+  this->pending_frame_sizes.clear();
+  this->output_buf.drain_all();
+  this->conflated_frames.clear();
+  this->resume_write_waiters();
+}
+
+void Server::WebsocketClient::resume_write_waiters() {
+  // Waiting coroutines are resumed from the event loop rather than from here,
+  // since this can be called from another coroutine's write (and a resumed
+  // coroutine may destroy this object)
+  static auto resume_coro = +[](evutil_socket_t, short, void* addr) {
+    coroutine_handle<>::from_address(addr).resume();
+  };
+  while (!this->write_waiters.empty()) {
+    auto& waiter = this->write_waiters.front();
+    if (!this->write_failed && (waiter.end_offset > this->bytes_written)) {
+      break;
+    }
+    waiter.awaiter->failed = (waiter.end_offset > this->bytes_written);
+    this->output_buf.base.once(-1, EV_TIMEOUT, resume_coro, waiter.coro.address(), 0);
+    this->write_waiters.pop_front();
+  }
+}
+
+void Server::WebsocketClient::on_write_ready(
+    evutil_socket_t, short, void* ctx) {
+  auto* c = reinterpret_cast<WebsocketClient*>(ctx);
+  c->write_event_pending = false;
+  c->flush_output();
+}
+
+bool Server::WebsocketClient::WriteAwaiter::await_ready() {
+  this->failed = (this->client->bytes_written < this->end_offset) &&
+      this->client->write_failed;
+  return this->failed || (this->client->bytes_written >= this->end_offset);
+}
+
+void Server::WebsocketClient::WriteAwaiter::await_suspend(
+    coroutine_handle<> coro) {
+  this->client->write_waiters.emplace_back(
+      WriteWaiter{this->end_offset, this, coro});
+}
+
+void Server::WebsocketClient::WriteAwaiter::await_resume() {
+  // The client may have been destroyed by now, so it must not be used here
+  if (this->failed) {
+    throw runtime_error("websocket connection failed before data was sent");
+  }
+}
+
 SSL_CTX* Server::create_server_ssl_ctx(
     const string& key_filename,
     const string& cert_filename,
@@ -452,6 +1328,7 @@ SSL_CTX* Server::create_server_ssl_ctx(
   if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key_filename.c_str(), SSL_FILETYPE_PEM) <= 0) {
     throw runtime_error("cannot load SSL private key " + key_filename);
   }
+  TLSServerSessionTickets::attach(ssl_ctx);
   return ssl_ctx;
 }
 
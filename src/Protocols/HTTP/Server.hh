@@ -9,57 +9,233 @@
 #include <openssl/ssl.h>
 #include <stdlib.h>
 
+#include <deque>
+#include <functional>
+#include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "../../Base.hh"
 #include "../../Buffer.hh"
+#include "../../Event.hh"
 #include "../../Task.hh"
+#include "Compression.hh"
+#include "HTTP2.hh"
 #include "Request.hh"
+#include "RequestBodyStream.hh"
+#include "ResponseHeaders.hh"
+#include "ResponseStream.hh"
+#include "Router.hh"
+#include "StaticFiles.hh"
+#include "TLSSessions.hh"
+#include "Websocket.hh"
 
 namespace EventAsync::HTTP {
 
+class WebsocketBroadcaster;
+
 class Server {
 public:
-  Server(Base& base, std::shared_ptr<SSL_CTX> ssl_ctx);
+  // If num_worker_threads is zero, the server handles all requests on base, in
+  // the calling thread. Otherwise, the server starts that many threads, each
+  // with its own Base and evhttp instances, and requests are parsed and
+  // handled (including TLS) on those threads; base is not used for serving in
+  // that case. When using worker threads, handle_request is called
+  // concurrently on multiple threads, so it must be thread-safe. Within a
+  // handler, use req.base (which is the worker thread's Base) for any
+  // asynchronous work.
+  Server(
+      Base& base,
+      std::shared_ptr<SSL_CTX> ssl_ctx,
+      size_t num_worker_threads = 0);
   Server(const Server&) = delete;
   Server(Server&&) = delete;
   Server& operator=(const Server&) = delete;
   Server& operator=(Server&&) = delete;
+  // Stops the worker threads, if they're still running (see stop).
   virtual ~Server();
 
+  // Stops the worker threads and waits for them to exit. Handlers that are
+  // waiting for something when this is called are never resumed. The worker
+  // threads call handle_request and other virtual methods, so a subclass that
+  // uses worker threads must call this in its destructor (or before then), not
+  // leave it to ~Server, which runs after the subclass has been destroyed.
+  // This can be called more than once, but not from a worker thread.
+  void stop();
+
   // Add a listening socket to this server. You should have already called
   // listen() on fd and made it nonblocking. If ssl is true, the server will
   // handle all connections on this fd over SSL. The same Server object can
-  // serve SSL and non-SSL traffic by adding sockets multiple sockets here.
+  // serve SSL and non-SSL traffic by adding sockets multiple sockets here. If
+  // the server has worker threads, all of them accept connections from this
+  // socket.
   void add_socket(int fd, bool ssl = false);
 
+  // Creates a listening socket on the given address and port and adds it to
+  // this server. If the server has worker threads, this creates a separate
+  // SO_REUSEPORT socket for each thread, so the kernel distributes incoming
+  // connections evenly between them and there's no contention on a shared
+  // accept queue. If addr is empty, listens on all interfaces.
+  void listen(const std::string& addr, uint16_t port, bool ssl = false);
+
   // Sets the server name. If this is called, the server will automatically add
-  // the Server response header to all subsequent responses.
+  // the Server response header to all subsequent responses. When using worker
+  // threads, this should be called before any sockets are added.
   void set_server_name(const char* server_name);
 
+  // Enables or disables compression of response bodies sent with
+  // send_response. When enabled, a response is compressed with the best
+  // encoding the client accepts (per its Accept-Encoding header) if its body is
+  // at least min_size bytes and its content type is compressible (see
+  // is_compressible_content_type). level is passed to Compressor::begin.
+  // Bodies up to 64KB are compressed all at once with a per-thread compressor;
+  // larger bodies are compressed and sent in 64KB chunks, returning to the
+  // event loop between chunks, so compressing them doesn't delay other
+  // connections. Compression is disabled by default. When using worker
+  // threads, this should be called before any sockets are added.
+  void set_compression(bool enabled, size_t min_size = 1024, int level = -1);
+
+  // Sets the options for the permessage-deflate websocket extension (see
+  // WebsocketDeflateOptions in Websocket.hh). If enabled, enable_websockets
+  // accepts the extension when the client offers it, and messages larger than
+  // options.min_size are then compressed in both directions. The extension is
+  // disabled by default. When using worker threads, this should be called
+  // before any sockets are added.
+  void set_websocket_compression(const WebsocketDeflateOptions& options);
+
+  // Sets how outgoing websocket messages are queued. Messages whose payload is
+  // larger than max_frame_size bytes are split into multiple frames (zero
+  // disables this), so pings and pongs can be sent between the frames of a
+  // large message instead of waiting for all of it. When a client's queue
+  // holds more than high_watermark bytes, WebsocketClient::write waits until
+  // it drains to low_watermark bytes. When using worker threads, this should
+  // be called before any sockets are added.
+  void set_websocket_output_limits(
+      size_t max_frame_size = 0x10000,
+      size_t high_watermark = 0x40000,
+      size_t low_watermark = 0x10000);
+
+  // Sets the largest websocket message that WebsocketClient::read will accept
+  // (64MB by default). If a client sends a larger one, read closes the
+  // connection with status 1009 and throws WebsocketProtocolError. For
+  // compressed messages, this limits the size before decompression; the size
+  // after decompression is limited by WebsocketDeflateOptions. When using
+  // worker threads, this should be called before any sockets are added.
+  void set_websocket_max_message_size(size_t max_message_size);
+
+  // Enables or disables HTTP/2 (see HTTP2Options in HTTP2.hh). When enabled,
+  // TLS clients can negotiate HTTP/2 with ALPN (this sets the ALPN callback on
+  // the server's SSL_CTX), and if options.allow_cleartext is true, clients can
+  // also use HTTP/2 on non-TLS sockets by sending the HTTP/2 connection preface
+  // instead of an HTTP/1.1 request. Requests on HTTP/2 connections are
+  // dispatched to routes and handle_request like any others, with up to
+  // options.max_concurrent_streams handled concurrently on each connection.
+  // Their bodies are always fully received before they're dispatched, even for
+  // streaming routes, and they can't be converted into websockets. HTTP/2 is
+  // disabled by default. This should be called before any sockets are added.
+  void set_http2(const HTTP2Options& options);
+
+  // Returns the number of worker threads (zero if the server runs on the base
+  // passed to the constructor).
+  size_t get_num_worker_threads() const;
+
   static SSL_CTX* create_server_ssl_ctx(
       const std::string& key_filename,
       const std::string& cert_filename,
       const std::string& ca_cert_filename);
 
 protected:
+  // Each worker has its own Base and evhttp instances. If the server has no
+  // worker threads, there's a single worker that uses the server's base and
+  // has no thread.
+  struct Worker {
+    Server* server;
+    size_t index;
+    std::unique_ptr<Base> owned_base;
+    Base* base;
+    struct evhttp* http;
+    struct evhttp* ssl_http;
+    std::thread thread;
+
+    Worker(Server* server, size_t index, Base* base);
+    Worker(const Worker&) = delete;
+    Worker(Worker&&) = delete;
+    Worker& operator=(const Worker&) = delete;
+    Worker& operator=(Worker&&) = delete;
+    ~Worker();
+
+    struct evhttp* get_http(bool ssl);
+  };
+
   Base& base;
-  struct evhttp* http;
-  struct evhttp* ssl_http;
   std::shared_ptr<SSL_CTX> ssl_ctx;
   std::string server_name;
+  bool compression_enabled;
+  size_t compression_min_size;
+  int compression_level;
+  WebsocketDeflateOptions websocket_deflate_options;
+  size_t websocket_max_frame_size;
+  size_t websocket_high_watermark;
+  size_t websocket_low_watermark;
+  size_t websocket_max_message_size;
+  HTTP2Options http2_options;
+  size_t num_worker_threads;
+  std::vector<std::unique_ptr<Worker>> workers;
+  bool workers_started;
+
+  // Runs fn on each worker's thread (or on the calling thread, if there are no
+  // worker threads) and waits for all calls to complete. evhttp objects aren't
+  // thread-safe, so all configuration changes must be done this way. Throws
+  // logic_error if called from a worker thread, since that thread can't run
+  // fn while it's waiting (and two workers waiting for each other would
+  // deadlock).
+  void run_on_workers(std::function<void(Worker&)> fn);
+  void check_not_worker_thread() const;
+  void worker_thread_fn(Worker* w);
+  void start_workers();
+
+  // Called on each worker thread before it handles any requests (when the
+  // first socket is added to the server). Subclasses can override this to set
+  // up per-thread state (for example, a client for a backend service on the
+  // worker's Base). If there are no worker threads, this is never called.
+  virtual void on_worker_thread_start(size_t worker_index, Base& base);
 
+  // These create the bufferevent for each new connection. ctx is the Worker.
+  // If any routes stream their request bodies, the bufferevent is wrapped in
+  // a RequestBodyFilter. If HTTP/2 is enabled, the connection is watched for
+  // the HTTP/2 preface (see HTTP2Connection::watch).
+  static struct bufferevent* dispatch_on_connection(
+      struct event_base* base,
+      void* ctx);
   static struct bufferevent* dispatch_on_ssl_connection(
       struct event_base* base,
       void* ctx);
   static void dispatch_handle_request(struct evhttp_request* req, void* ctx);
 
-  // When subclassing Server, you must implement this function to respond to
-  // requests. Your implementation must either call one of the send_response
-  // functions below or convert the request into a Websocket stream. Failure to
-  // do either of these will result in a memory leak.
-  virtual DetachedTask handle_request(Request& req) = 0;
+  // Routes for this server. Subclasses should add routes here in their
+  // constructors (before adding any sockets). Requests that match a route are
+  // sent to that route's handler; requests whose path matches a route but whose
+  // method doesn't get a 405 response; all other requests are sent to
+  // handle_request.
+  //
+  // Adding a route that streams its request bodies has a cost for every
+  // HTTP/1.x connection, not only for requests to that route: the route isn't
+  // known until a request's headers arrive, so all connections go through a
+  // RequestBodyFilter. This parses each request's headers a second time,
+  // copies all data to and from the socket an extra time, and makes
+  // send_static_file copy file contents into memory instead of using
+  // sendfile(). Servers that need the highest throughput or serve large static
+  // files should avoid streaming routes, or put them on a separate Server.
+  Router router;
+
+  // When subclassing Server, you must either add routes to the router above or
+  // implement this function to respond to requests (or both). Handlers must
+  // either call one of the send_response functions below or convert the
+  // request into a Websocket stream. Failure to do either of these will result
+  // in a memory leak. The default implementation sends a 404 response.
+  virtual DetachedTask handle_request(Request& req);
 
   // The send_response function sends a standard HTTP response to the client.
   // The code is an HTTP code (e.g. 200, 404, etc.). Most forms of this function
@@ -93,9 +269,61 @@ protected:
       int code,
       const char* content_type = nullptr);
 
+  // Adds the headers that every response gets: Content-Type (if content_type
+  // isn't null), Server (if set_server_name was called), and Date.
+  void add_standard_headers(Request& req, const char* content_type);
+  void send_response_body(
+      Request& req,
+      int code,
+      const char* content_type,
+      Buffer& buf,
+      bool allow_compression);
+  DetachedTask send_compressed_response_stream(
+      Base& base,
+      struct evhttp_request* req,
+      int code,
+      ContentEncoding encoding,
+      Buffer buf);
+
+  // Starts a response whose body is sent incrementally, and returns a stream
+  // that the handler writes the body to. This is useful for responses that are
+  // too large to build in memory or that are generated over time; see
+  // ResponseStream for details. The stream's body is never compressed. The
+  // handler must call end() on the returned stream (or destroy it) when the
+  // response is complete.
+  std::unique_ptr<ResponseStream> start_response_stream(
+      Request& req,
+      int code,
+      const char* content_type);
+
+  // Returns a stream that reads the request's body. For requests to routes
+  // that stream their request bodies (see Router::add), the body is read from
+  // the client as the handler reads from the stream; for other requests, the
+  // stream returns the body that was already received. This should be called
+  // before the handler's first co_await, and at most once per request.
+  std::unique_ptr<RequestBodyStream> get_request_body_stream(Request& req);
+
+  // Sends a file from a static file cache. path is relative to the cache's
+  // root directory and is URL-decoded by this function, so it can come directly
+  // from the request URI (for example, from a route's wildcard parameter).
+  // This handles GET and HEAD requests, conditional requests (If-None-Match and
+  // If-Modified-Since), and single byte ranges; other methods get a 405
+  // response, and nonexistent files get a 404 response. The file's contents are
+  // sent from the cached fd without being copied into memory. If compression
+  // is enabled (see set_compression), the client accepts a compressed encoding,
+  // and the cache has a variant of the file in that encoding, the variant is
+  // sent instead.
+  void send_static_file(Request& req, StaticFileCache& cache, const char* path);
+
   class WebsocketClient {
   public:
-    WebsocketClient(Server* server, struct evhttp_connection* conn);
+    // If deflate is not null, the permessage-deflate extension was negotiated
+    // and the client uses it to compress and decompress messages.
+    WebsocketClient(
+        Server* server,
+        Base& base,
+        struct evhttp_connection* conn,
+        std::unique_ptr<WebsocketDeflateCodec> deflate = nullptr);
     WebsocketClient(const WebsocketClient&) = delete;
     WebsocketClient(WebsocketClient&&);
     WebsocketClient& operator=(const WebsocketClient&) = delete;
@@ -105,28 +333,113 @@ protected:
     void close();
     bool is_closed() const;
 
-    struct WebsocketMessage {
-      uint8_t opcode;
-      std::string data;
-      WebsocketMessage();
-    };
+    using WebsocketMessage = HTTP::WebsocketMessage;
 
-    // Waits for a returns a complete Websocket message from the client.
+    // Waits for a returns a complete Websocket message from the client. If the
+    // client violates the protocol, this sends a close frame with the
+    // appropriate status code and throws WebsocketProtocolError.
     Task<WebsocketMessage> read();
 
-    // Sends a Websocket message to the client.
+    // Sends a Websocket message to the client. Outgoing messages are queued in
+    // order, so these may be called from multiple coroutines at once; pings
+    // and pongs skip ahead of queued data frames. The returned task completes
+    // as soon as the message is queued, unless the queue is above the server's
+    // high watermark (see set_websocket_output_limits), in which case it first
+    // waits for the queue to drain to the low watermark. Messages queued
+    // during the same event loop iteration are written to the socket with a
+    // single system call. These throw if the connection has failed. The first
+    // form moves buf's contents into the queue without copying them, so if buf
+    // contains references to other memory, that memory must remain valid until
+    // the message has been sent (see flush).
     Task<void> write(Buffer& buf, uint8_t opcode = 0x01);
     Task<void> write(const void* data, size_t size, uint8_t opcode = 0x01);
 
+    // Waits until everything that has been queued so far has been written to
+    // the socket. Throws if the connection fails before then. Data that's
+    // still queued when the client is closed or destroyed is discarded, so
+    // call this first if the client should receive all of it.
+    Task<void> flush();
+
+    // Queues an already-encoded frame (including its header) to be sent,
+    // without waiting for it to be written or applying backpressure. The frame
+    // is added by reference, so the same frame buffer can be sent to many
+    // clients without copying it; frame must not be modified after this. If the
+    // connection has failed, the frame is discarded.
+    void send_frame(Buffer& frame);
+    // Like send_frame, but if the client's output queue isn't empty, the frame
+    // is held back until it is, and replaces any other held-back frame with the
+    // same key. This is used to send only the latest state to slow clients.
+    void conflate_frame(const std::string& key, std::shared_ptr<Buffer> frame);
+
+    // Returns the number of bytes queued to be sent to the client that haven't
+    // yet been written to the socket, including held-back frames.
+    size_t get_queued_bytes() const;
+
+    // Shuts down the connection without waiting for queued data to be sent.
+    // Pending and future writes fail, and read() throws once it has consumed
+    // any data that was already received. The client object still must be
+    // destroyed (or closed) as usual.
+    void abort();
+
   protected:
+    struct WriteAwaiter {
+      WebsocketClient* client;
+      uint64_t end_offset;
+      bool failed;
+
+      bool await_ready();
+      void await_suspend(std::coroutine_handle<> coro);
+      void await_resume();
+    };
+    struct WriteWaiter {
+      uint64_t end_offset;
+      WriteAwaiter* awaiter;
+      std::coroutine_handle<> coro;
+    };
+
     Server* server;
     struct evhttp_connection* conn;
     struct bufferevent* bev;
     int fd;
     Buffer input_buf;
+    std::unique_ptr<WebsocketDeflateCodec> deflate;
+
+    size_t max_frame_size;
+    size_t high_watermark;
+    size_t low_watermark;
+    size_t max_message_size;
 
-    static std::string encode_websocket_message_header(size_t data_size,
-        uint8_t opcode);
+    // Data frames wait in pending_buf (whose frame boundaries are recorded in
+    // pending_frame_sizes) and are moved to output_buf shortly before they're
+    // written, so that pings and pongs, which are added directly to
+    // output_buf, don't wait behind a large amount of queued data.
+    Buffer pending_buf;
+    std::deque<size_t> pending_frame_sizes;
+    Buffer output_buf;
+    Event write_event;
+    bool write_event_pending;
+    bool write_failed;
+    // These count all bytes ever queued, moved to output_buf, and written to
+    // the socket, so they can be used to tell when a particular frame has been
+    // sent
+    uint64_t bytes_queued;
+    uint64_t bytes_committed;
+    uint64_t bytes_written;
+    // The number of messages read() has returned since it last waited for
+    // the event loop
+    size_t messages_without_yield;
+    std::deque<WriteWaiter> write_waiters;
+    std::vector<std::pair<std::string, std::shared_ptr<Buffer>>> conflated_frames;
+
+    // Sends a close frame and waits for it to be written. Errors are ignored.
+    Task<void> send_close_frame(uint16_t status_code);
+    void enqueue_frame(Buffer& frame, bool by_reference);
+    void enqueue_control_frame(Buffer& frame);
+    void schedule_flush();
+    void flush_output();
+    void fail_writes();
+    void resume_write_waiters();
+    static void on_write_ready(evutil_socket_t fd, short what, void* ctx);
   };
 
   // Converts the current request into a Websocket stream. Returns a
@@ -136,7 +449,12 @@ protected:
   // reason, and you should still call send_response as for a normal request.
   Task<std::shared_ptr<WebsocketClient>> enable_websockets(Request& req);
 
+  // Reason phrases by status code. This is built from the same table as
+  // reason_phrase_for_status, which should be used instead (it doesn't need a
+  // hash lookup, and returns nullptr for unknown codes instead of throwing).
   static const std::unordered_map<int, const char*> explanation_for_response_code;
+
+  friend class WebsocketBroadcaster;
 };
 
 } // namespace EventAsync::HTTP
@@ -0,0 +1,577 @@
+#include "StaticFiles.hh"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <vector>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+static const unordered_map<string, const char*> content_type_for_extension({
+    {"css", "text/css"},
+    {"csv", "text/csv"},
+    {"gif", "image/gif"},
+    {"htm", "text/html"},
+    {"html", "text/html"},
+    {"ico", "image/vnd.microsoft.icon"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "text/javascript"},
+    {"json", "application/json"},
+    {"mjs", "text/javascript"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"svg", "image/svg+xml"},
+    {"txt", "text/plain"},
+    {"wasm", "application/wasm"},
+    {"webm", "video/webm"},
+    {"webp", "image/webp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xml", "application/xml"},
+    {"zip", "application/zip"},
+});
+
+// Formats a time as an HTTP-date (RFC 9110 section 5.6.7). This doesn't use
+// strftime because the day and month names must not depend on the locale.
+static string format_http_date(time_t t) {
+  static const char* day_names[7] = {
+      "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  static const char* month_names[12] = {
+      "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  return string_printf("%s, %02d %s %04d %02d:%02d:%02d GMT",
+      day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon],
+      tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+StaticFileCache::File::File()
+    : encoding(ContentEncoding::IDENTITY),
+      segment(nullptr),
+      fd(-1),
+      size(0),
+      content_type(nullptr),
+      device(0),
+      inode(0),
+      mtime(0) {}
+
+StaticFileCache::File::~File() {
+  // Responses that are still being sent hold their own references to the
+  // segment, so this doesn't close the fd until they're done
+  if (this->segment) {
+    evbuffer_file_segment_free(this->segment);
+  }
+}
+
+StaticFileCache::StaticFileCache(
+    Base& base,
+    const string& root_directory,
+    size_t max_entries,
+    size_t max_precompress_size)
+    : base(base),
+      root_directory(root_directory),
+      max_entries(max_entries),
+      max_precompress_size(max_precompress_size),
+      inotify_fd(-1),
+      inotify_thread_exit_fds{-1, -1},
+      precompress_thread_should_exit(false) {
+  if (this->max_entries == 0) {
+    throw invalid_argument("static file cache must have at least one entry");
+  }
+  if (this->root_directory.empty()) {
+    this->root_directory = ".";
+  }
+  while ((this->root_directory.size() > 1) && (this->root_directory.back() == '/')) {
+    this->root_directory.pop_back();
+  }
+
+#ifdef __linux__
+  this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (this->inotify_fd < 0) {
+    throw runtime_error("cannot create inotify instance: " + string_for_error(errno));
+  }
+  if (pipe2(this->inotify_thread_exit_fds, O_CLOEXEC)) {
+    ::close(this->inotify_fd);
+    throw runtime_error("cannot create pipe: " + string_for_error(errno));
+  }
+  this->inotify_thread = thread(&StaticFileCache::inotify_thread_fn, this);
+#endif
+
+  if (this->max_precompress_size > 0) {
+    this->precompress_thread = thread(&StaticFileCache::precompress_thread_fn, this);
+  }
+}
+
+StaticFileCache::~StaticFileCache() {
+  if (this->precompress_thread.joinable()) {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->precompress_thread_should_exit = true;
+    }
+    this->precompress_cv.notify_all();
+    this->precompress_thread.join();
+  }
+  if (this->inotify_thread.joinable()) {
+    char ch = 0;
+    while ((::write(this->inotify_thread_exit_fds[1], &ch, 1) < 0) &&
+           (errno == EINTR)) {
+    }
+    this->inotify_thread.join();
+  }
+  for (int fd : this->inotify_thread_exit_fds) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+  if (this->inotify_fd >= 0) {
+    ::close(this->inotify_fd);
+  }
+}
+
+const char* StaticFileCache::content_type_for_filename(const string& filename) {
+  size_t dot_pos = filename.rfind('.');
+  size_t slash_pos = filename.rfind('/');
+  if ((dot_pos != string::npos) &&
+      ((slash_pos == string::npos) || (dot_pos > slash_pos))) {
+    string extension = filename.substr(dot_pos + 1);
+    for (char& ch : extension) {
+      ch = ::tolower(ch);
+    }
+    try {
+      return content_type_for_extension.at(extension);
+    } catch (const out_of_range&) {
+    }
+  }
+  return "application/octet-stream";
+}
+
+bool StaticFileCache::is_valid_relative_path(const string& relative_path) {
+  if (relative_path.find('\0') != string::npos) {
+    return false;
+  }
+  // Don't allow any path component to be .. (this also rejects absolute paths,
+  // since the caller prepends the root directory)
+  size_t offset = 0;
+  while (offset <= relative_path.size()) {
+    size_t end = relative_path.find('/', offset);
+    if (end == string::npos) {
+      end = relative_path.size();
+    }
+    if ((end - offset == 2) && !relative_path.compare(offset, 2, "..")) {
+      return false;
+    }
+    offset = end + 1;
+  }
+  return true;
+}
+
+shared_ptr<StaticFileCache::File> StaticFileCache::create_file(
+    int fd, const struct stat& st) {
+  auto file = make_shared<File>();
+  file->size = st.st_size;
+  file->device = st.st_dev;
+  file->inode = st.st_ino;
+  file->mtime = st.st_mtime;
+  if (file->size > 0) {
+    // The segment takes ownership of the fd
+    file->segment = evbuffer_file_segment_new(
+        fd, 0, file->size, EVBUF_FS_CLOSE_ON_FREE);
+    if (!file->segment) {
+      ::close(fd);
+      throw runtime_error("cannot create file segment");
+    }
+    file->fd = fd;
+  } else {
+    ::close(fd);
+  }
+  return file;
+}
+
+shared_ptr<const StaticFileCache::File> StaticFileCache::preferred_file(
+    const Entry& entry, uint32_t accepted_encodings) {
+  uint32_t available_encodings = 0;
+  for (size_t x = 0; x < NUM_CONTENT_ENCODINGS; x++) {
+    if (entry.files[x]) {
+      available_encodings |= (1 << x);
+    }
+  }
+  return entry.files[static_cast<size_t>(preferred_content_encoding(
+      accepted_encodings & available_encodings))];
+}
+
+int StaticFileCache::add_watch_locked(const string& full_path) {
+#ifdef __linux__
+  return inotify_add_watch(this->inotify_fd, full_path.c_str(),
+      IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#else
+  (void)full_path;
+  return -1;
+#endif
+}
+
+shared_ptr<const StaticFileCache::File> StaticFileCache::open_sidecar_locked(
+    const string& full_path,
+    const File& original,
+    ContentEncoding encoding,
+    int* watch_descriptor) {
+  *watch_descriptor = -1;
+  if (!content_encoding_available(encoding)) {
+    return nullptr;
+  }
+
+  string sidecar_path = full_path + ((encoding == ContentEncoding::BROTLI) ? ".br" : ".gz");
+  int fd = ::open(sidecar_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  *watch_descriptor = this->add_watch_locked(sidecar_path);
+
+  // Ignore sidecar files that are older than the original file, since they
+  // probably weren't regenerated after it was changed
+  struct stat st;
+  if (::fstat(fd, &st) || !S_ISREG(st.st_mode) || (st.st_mtime < original.mtime)) {
+    ::close(fd);
+    this->release_unused_watch_locked(*watch_descriptor);
+    *watch_descriptor = -1;
+    return nullptr;
+  }
+
+  auto file = create_file(fd, st);
+  file->encoding = encoding;
+  file->content_type = original.content_type;
+  file->last_modified = original.last_modified;
+  file->etag = original.etag.substr(0, original.etag.size() - 1) + "-" +
+      name_for_content_encoding(encoding) + "\"";
+  return file;
+}
+
+shared_ptr<const StaticFileCache::File> StaticFileCache::get(
+    const string& relative_path, uint32_t accepted_encodings) {
+  if (!is_valid_relative_path(relative_path)) {
+    return nullptr;
+  }
+  string full_path = this->root_directory + "/" + relative_path;
+
+  {
+    lock_guard<mutex> g(this->lock);
+    auto it = this->entries.find(relative_path);
+    if (it != this->entries.end()) {
+#ifdef __linux__
+      this->lru.splice(this->lru.begin(), this->lru, it->second.lru_it);
+      return preferred_file(it->second, accepted_encodings);
+#else
+      // Without inotify, we can't tell if the file has changed without calling
+      // stat(), but this still saves an open() and an fstat()
+      const auto& file = it->second.files[static_cast<size_t>(ContentEncoding::IDENTITY)];
+      struct stat st;
+      if ((::stat(full_path.c_str(), &st) == 0) &&
+          (st.st_dev == file->device) &&
+          (st.st_ino == file->inode) &&
+          (st.st_mtime == file->mtime) &&
+          (static_cast<uint64_t>(st.st_size) == file->size)) {
+        this->lru.splice(this->lru.begin(), this->lru, it->second.lru_it);
+        return preferred_file(it->second, accepted_encodings);
+      }
+      this->erase_locked(it);
+#endif
+    }
+  }
+
+  // The file isn't cached, so open it. This is done without holding the lock
+  // so misses don't block other threads' hits.
+  int fd = ::open(full_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  lock_guard<mutex> g(this->lock);
+
+  // Start watching the file before getting its metadata, so if it changes
+  // after this point, we'll get an inotify event and drop the entry
+  int watch_descriptor = this->add_watch_locked(full_path);
+
+  struct stat st;
+  if (::fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    this->release_unused_watch_locked(watch_descriptor);
+    return nullptr;
+  }
+
+  shared_ptr<File> file;
+  try {
+    file = create_file(fd, st);
+  } catch (const exception&) {
+    this->release_unused_watch_locked(watch_descriptor);
+    throw;
+  }
+  file->content_type = content_type_for_filename(relative_path);
+  file->etag = string_printf("\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "\"",
+      static_cast<uint64_t>(st.st_ino),
+      static_cast<uint64_t>(st.st_mtime),
+      static_cast<uint64_t>(st.st_size));
+  file->last_modified = format_http_date(st.st_mtime);
+
+#ifdef __linux__
+  // If the file was replaced between the open() and inotify_add_watch() calls,
+  // the watch is on a different file, so we can't cache this one
+  struct stat path_st;
+  if ((watch_descriptor < 0) ||
+      ::stat(full_path.c_str(), &path_st) ||
+      (path_st.st_dev != st.st_dev) ||
+      (path_st.st_ino != st.st_ino)) {
+    this->release_unused_watch_locked(watch_descriptor);
+    return file;
+  }
+#endif
+
+  auto it = this->entries.find(relative_path);
+  if (it != this->entries.end()) {
+    this->erase_locked(it);
+  }
+  this->lru.emplace_front(relative_path);
+  Entry& entry = this->entries.emplace(relative_path, Entry()).first->second;
+  entry.lru_it = this->lru.begin();
+  entry.files[static_cast<size_t>(ContentEncoding::IDENTITY)] = file;
+  if (watch_descriptor >= 0) {
+    entry.watch_descriptors.emplace_back(watch_descriptor);
+  }
+
+  bool needs_precompression = false;
+  for (auto encoding : {ContentEncoding::GZIP, ContentEncoding::BROTLI}) {
+    int sidecar_watch_descriptor;
+    auto sidecar = this->open_sidecar_locked(
+        full_path, *file, encoding, &sidecar_watch_descriptor);
+    if (sidecar) {
+      entry.files[static_cast<size_t>(encoding)] = sidecar;
+      if (sidecar_watch_descriptor >= 0) {
+        entry.watch_descriptors.emplace_back(sidecar_watch_descriptor);
+      }
+    } else if (content_encoding_available(encoding)) {
+      needs_precompression = true;
+    }
+  }
+  for (int wd : entry.watch_descriptors) {
+    this->watch_descriptor_to_path.emplace(wd, relative_path);
+  }
+
+  // Very small files aren't worth compressing, since the headers dominate
+  if (needs_precompression &&
+      (file->size >= 0x100) &&
+      (file->size <= this->max_precompress_size) &&
+      is_compressible_content_type(file->content_type)) {
+    this->precompress_queue.emplace_back(PrecompressJob{relative_path, file});
+    this->precompress_cv.notify_one();
+  }
+
+  auto ret = preferred_file(entry, accepted_encodings);
+  while (this->entries.size() > this->max_entries) {
+    this->erase_locked(this->entries.find(this->lru.back()));
+  }
+  return ret;
+}
+
+void StaticFileCache::erase_locked(unordered_map<string, Entry>::iterator it) {
+  // Multiple paths may refer to the same file (and therefore the same watch),
+  // so only remove each watch when the last of its paths is removed
+  for (int watch_descriptor : it->second.watch_descriptors) {
+    auto range = this->watch_descriptor_to_path.equal_range(watch_descriptor);
+    for (auto wd_it = range.first; wd_it != range.second;) {
+      if (wd_it->second == it->first) {
+        wd_it = this->watch_descriptor_to_path.erase(wd_it);
+      } else {
+        wd_it++;
+      }
+    }
+    this->release_unused_watch_locked(watch_descriptor);
+  }
+  this->lru.erase(it->second.lru_it);
+  this->entries.erase(it);
+}
+
+void StaticFileCache::release_unused_watch_locked(int watch_descriptor) {
+#ifdef __linux__
+  if ((watch_descriptor >= 0) &&
+      !this->watch_descriptor_to_path.count(watch_descriptor)) {
+    inotify_rm_watch(this->inotify_fd, watch_descriptor);
+  }
+#else
+  (void)watch_descriptor;
+#endif
+}
+
+void StaticFileCache::clear() {
+  lock_guard<mutex> g(this->lock);
+  while (!this->entries.empty()) {
+    this->erase_locked(this->entries.begin());
+  }
+}
+
+size_t StaticFileCache::size() {
+  lock_guard<mutex> g(this->lock);
+  return this->entries.size();
+}
+
+void StaticFileCache::inotify_thread_fn() {
+#ifdef __linux__
+  struct pollfd fds[2] = {
+      {this->inotify_fd, POLLIN, 0},
+      {this->inotify_thread_exit_fds[0], POLLIN, 0},
+  };
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error("cannot poll inotify instance: " + string_for_error(errno));
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    if (fds[0].revents) {
+      this->on_inotify_readable();
+    }
+  }
+#endif
+}
+
+void StaticFileCache::on_inotify_readable() {
+#ifdef __linux__
+  // Events are variable-size, but the kernel never splits one across reads
+  alignas(struct inotify_event) char buf[0x1000];
+  for (;;) {
+    ssize_t bytes_read = ::read(this->inotify_fd, buf, sizeof(buf));
+    if (bytes_read <= 0) {
+      break;
+    }
+
+    lock_guard<mutex> g(this->lock);
+    for (ssize_t offset = 0; offset < bytes_read;) {
+      const auto* ev = reinterpret_cast<const struct inotify_event*>(&buf[offset]);
+      offset += sizeof(struct inotify_event) + ev->len;
+
+      // Any event on a watched file means it's been modified, replaced, or
+      // deleted, so drop all cache entries that refer to it. If the watch was
+      // removed (IN_IGNORED), this also cleans up the entries.
+      auto range = this->watch_descriptor_to_path.equal_range(ev->wd);
+      vector<string> paths;
+      for (auto it = range.first; it != range.second; it++) {
+        paths.emplace_back(it->second);
+      }
+      for (const auto& path : paths) {
+        auto entry_it = this->entries.find(path);
+        if (entry_it != this->entries.end()) {
+          this->erase_locked(entry_it);
+        }
+      }
+    }
+  }
+#endif
+}
+
+void StaticFileCache::precompress_thread_fn() {
+  // Since these variants are compressed once and served many times, use the
+  // highest compression levels
+  static const int GZIP_LEVEL = 9;
+  static const int BROTLI_QUALITY = 11;
+
+  Compressor compressor;
+  unique_lock<mutex> g(this->lock);
+  for (;;) {
+    this->precompress_cv.wait(g, [this]() {
+      return this->precompress_thread_should_exit || !this->precompress_queue.empty();
+    });
+    if (this->precompress_thread_should_exit) {
+      return;
+    }
+    PrecompressJob job = std::move(this->precompress_queue.front());
+    this->precompress_queue.pop_front();
+
+    // Skip the job if the file was changed or evicted while it was queued
+    vector<ContentEncoding> encodings;
+    auto it = this->entries.find(job.relative_path);
+    if (it != this->entries.end() &&
+        (it->second.files[static_cast<size_t>(ContentEncoding::IDENTITY)] == job.file)) {
+      for (auto encoding : {ContentEncoding::GZIP, ContentEncoding::BROTLI}) {
+        if (content_encoding_available(encoding) &&
+            !it->second.files[static_cast<size_t>(encoding)]) {
+          encodings.emplace_back(encoding);
+        }
+      }
+    }
+    if (encodings.empty()) {
+      continue;
+    }
+
+    g.unlock();
+    // The fd is owned by the file's segment, which the job keeps alive. pread
+    // doesn't use the fd's offset, so this doesn't interfere with sendfile.
+    string data(job.file->size, '\0');
+    bool read_ok = true;
+    for (size_t offset = 0; offset < data.size();) {
+      ssize_t bytes_read = pread(
+          job.file->fd, data.data() + offset, data.size() - offset, offset);
+      if (bytes_read <= 0) {
+        read_ok = false;
+        break;
+      }
+      offset += bytes_read;
+    }
+    vector<shared_ptr<File>> variants;
+    if (read_ok) {
+      for (auto encoding : encodings) {
+        Buffer src(this->base);
+        Buffer dest(this->base);
+        src.add_reference(data.data(), data.size());
+        compressor.compress_all(dest, src, encoding,
+            (encoding == ContentEncoding::BROTLI) ? BROTLI_QUALITY : GZIP_LEVEL);
+        if (dest.get_length() >= job.file->size) {
+          continue; // Compression didn't help
+        }
+        auto variant = make_shared<File>();
+        variant->encoding = encoding;
+        variant->size = dest.get_length();
+        variant->data = dest.remove(dest.get_length());
+        variant->content_type = job.file->content_type;
+        variant->last_modified = job.file->last_modified;
+        variant->etag = job.file->etag.substr(0, job.file->etag.size() - 1) +
+            "-" + name_for_content_encoding(encoding) + "\"";
+        variant->device = job.file->device;
+        variant->inode = job.file->inode;
+        variant->mtime = job.file->mtime;
+        variants.emplace_back(std::move(variant));
+      }
+    }
+    g.lock();
+
+    it = this->entries.find(job.relative_path);
+    if (it != this->entries.end() &&
+        (it->second.files[static_cast<size_t>(ContentEncoding::IDENTITY)] == job.file)) {
+      for (auto& variant : variants) {
+        auto& slot = it->second.files[static_cast<size_t>(variant->encoding)];
+        if (!slot) {
+          slot = std::move(variant);
+        }
+      }
+    }
+  }
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../../Base.hh"
+#include "Compression.hh"
+
+namespace EventAsync::HTTP {
+
+// Keeps open file descriptors and metadata for recently-served static files, so
+// serving a cached file requires no open() or stat() calls. File contents are
+// never copied into memory; they're sent with sendfile() (or mmap(), for SSL
+// connections) via libevent's file segments.
+//
+// The cache also keeps compressed variants of each file. If there's a sidecar
+// file with the same name plus .br or .gz next to the original file (and it's
+// at least as new as the original), it's used as the brotli or gzip variant.
+// Otherwise, if the file's content type is compressible and it's no larger
+// than max_precompress_size, the missing variants are generated on a
+// background thread (so cache misses never wait for compression); until they
+// are ready, the uncompressed file is served. Setting max_precompress_size to
+// zero disables this.
+//
+// The cache holds at most max_entries files, evicting the least recently used
+// file when full. On Linux, cached files are watched with inotify, and entries
+// are dropped as soon as their files (or sidecar files) are modified, replaced,
+// or deleted. The inotify events are read on a background thread, so this
+// doesn't depend on any event loop running (a Server's worker threads each run
+// their own Base, so base may never run at all). On other systems, each lookup
+// checks the file's metadata with stat() instead.
+//
+// This object may be shared between a Server's worker threads.
+class StaticFileCache {
+public:
+  struct File {
+    ContentEncoding encoding;
+    // Exactly one of these contains the file's data: segment for files on disk
+    // (including sidecar files), or data for variants compressed in memory.
+    // Both are empty if the file is empty. fd is owned by segment.
+    struct evbuffer_file_segment* segment;
+    int fd;
+    std::string data;
+    uint64_t size;
+    std::string etag;
+    std::string last_modified;
+    const char* content_type;
+    dev_t device;
+    ino_t inode;
+    time_t mtime;
+
+    File();
+    File(const File&) = delete;
+    File(File&&) = delete;
+    File& operator=(const File&) = delete;
+    File& operator=(File&&) = delete;
+    ~File();
+  };
+
+  StaticFileCache(
+      Base& base,
+      const std::string& root_directory,
+      size_t max_entries = 1024,
+      size_t max_precompress_size = 1024 * 1024);
+  StaticFileCache(const StaticFileCache&) = delete;
+  StaticFileCache(StaticFileCache&&) = delete;
+  StaticFileCache& operator=(const StaticFileCache&) = delete;
+  StaticFileCache& operator=(StaticFileCache&&) = delete;
+  ~StaticFileCache();
+
+  // Returns the file at the given path, relative to the root directory. The
+  // path must already be URL-decoded. Returns nullptr if the path refers to
+  // something outside the root directory, or if the file doesn't exist or
+  // isn't a regular file. accepted_encodings is a bitmask as returned by
+  // parse_accept_encoding; if a variant in an accepted encoding is available,
+  // the preferred one is returned instead of the uncompressed file.
+  std::shared_ptr<const File> get(
+      const std::string& relative_path, uint32_t accepted_encodings = 1);
+
+  void clear();
+  size_t size();
+
+  static const char* content_type_for_filename(const std::string& filename);
+
+private:
+  struct Entry {
+    // Indexed by ContentEncoding; IDENTITY is always present
+    std::shared_ptr<const File> files[NUM_CONTENT_ENCODINGS];
+    std::list<std::string>::iterator lru_it;
+    std::vector<int> watch_descriptors;
+  };
+
+  struct PrecompressJob {
+    std::string relative_path;
+    std::shared_ptr<const File> file;
+  };
+
+  Base& base;
+  std::string root_directory;
+  size_t max_entries;
+  size_t max_precompress_size;
+
+  std::mutex lock;
+  std::unordered_map<std::string, Entry> entries;
+  // Most recently used at the front
+  std::list<std::string> lru;
+
+  int inotify_fd;
+  std::unordered_multimap<int, std::string> watch_descriptor_to_path;
+  // The destructor writes to the second fd to wake the inotify thread
+  int inotify_thread_exit_fds[2];
+  std::thread inotify_thread;
+
+  // Precompression jobs are protected by lock as well
+  std::deque<PrecompressJob> precompress_queue;
+  std::condition_variable precompress_cv;
+  bool precompress_thread_should_exit;
+  std::thread precompress_thread;
+
+  static bool is_valid_relative_path(const std::string& relative_path);
+  static std::shared_ptr<File> create_file(int fd, const struct stat& st);
+  static std::shared_ptr<const File> preferred_file(
+      const Entry& entry, uint32_t accepted_encodings);
+  std::shared_ptr<const File> open_sidecar_locked(
+      const std::string& full_path,
+      const File& original,
+      ContentEncoding encoding,
+      int* watch_descriptor);
+  int add_watch_locked(const std::string& full_path);
+  void erase_locked(std::unordered_map<std::string, Entry>::iterator it);
+  void release_unused_watch_locked(int watch_descriptor);
+  void precompress_thread_fn();
+
+  void inotify_thread_fn();
+  void on_inotify_readable();
+};
+
+} // namespace EventAsync::HTTP
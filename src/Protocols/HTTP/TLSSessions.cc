@@ -0,0 +1,376 @@
+#include "TLSSessions.hh"
+
+#include <openssl/rand.h>
+#include <string.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+TLSClientSessionCache::TLSClientSessionCache(size_t max_entries)
+    : max_entries(max_entries) {
+  if (this->max_entries == 0) {
+    throw invalid_argument("max_entries must be at least 1");
+  }
+}
+
+TLSClientSessionCache::~TLSClientSessionCache() {
+  this->clear();
+}
+
+int TLSClientSessionCache::ssl_ctx_ex_index() {
+  static int index = SSL_CTX_get_ex_new_index(
+      0, nullptr, nullptr, nullptr,
+      +[](void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) -> void {
+        delete reinterpret_cast<TLSClientSessionCache*>(ptr);
+      });
+  return index;
+}
+
+int TLSClientSessionCache::ssl_ex_index() {
+  // Each connection's SSL object holds the cache key for the server it's
+  // connected to, so on_new_session knows where to put new sessions
+  static int index = SSL_get_ex_new_index(
+      0, nullptr, nullptr, nullptr,
+      +[](void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) -> void {
+        delete reinterpret_cast<string*>(ptr);
+      });
+  return index;
+}
+
+TLSClientSessionCache* TLSClientSessionCache::attach(
+    SSL_CTX* ssl_ctx, size_t max_entries) {
+  // The previous cache (if any) is only deleted once the new one has replaced
+  // it, so the context never points to a deleted cache, even if this fails
+  auto* cache = new TLSClientSessionCache(max_entries);
+  auto* prev_cache = TLSClientSessionCache::get(ssl_ctx);
+  if (!SSL_CTX_set_ex_data(ssl_ctx, TLSClientSessionCache::ssl_ctx_ex_index(), cache)) {
+    delete cache;
+    throw runtime_error("failed to attach session cache to SSL context");
+  }
+  delete prev_cache;
+
+  // OpenSSL's internal cache is keyed by session ID, which isn't useful on the
+  // client side; we only need the callback for new sessions. In TLS 1.3, new
+  // sessions arrive after the handshake is complete, so this callback is the
+  // only way to get them.
+  SSL_CTX_set_session_cache_mode(
+      ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_ctx, &TLSClientSessionCache::on_new_session);
+  return cache;
+}
+
+TLSClientSessionCache* TLSClientSessionCache::get(SSL_CTX* ssl_ctx) {
+  return reinterpret_cast<TLSClientSessionCache*>(
+      SSL_CTX_get_ex_data(ssl_ctx, TLSClientSessionCache::ssl_ctx_ex_index()));
+}
+
+void TLSClientSessionCache::prepare(
+    SSL* ssl, const string& host, uint16_t port) {
+  auto* key = new string(host + ":" + to_string(port));
+  auto* prev_key = reinterpret_cast<string*>(
+      SSL_get_ex_data(ssl, TLSClientSessionCache::ssl_ex_index()));
+  if (!SSL_set_ex_data(ssl, TLSClientSessionCache::ssl_ex_index(), key)) {
+    delete key;
+    throw runtime_error("failed to set session cache key");
+  }
+  delete prev_key;
+
+  lock_guard<mutex> g(this->lock);
+  auto it = this->entries.find(*key);
+  if (it == this->entries.end()) {
+    return;
+  }
+  if (!SSL_SESSION_is_resumable(it->second.session) ||
+      (SSL_SESSION_get_time(it->second.session) + SSL_SESSION_get_timeout(it->second.session) <
+          static_cast<long>(time(nullptr)))) {
+    this->erase_locked(it);
+    return;
+  }
+  // OpenSSL marks a connection's session as not resumable if the connection
+  // isn't shut down cleanly, which evhttp never does, so each connection gets
+  // its own copy of the session
+  SSL_SESSION* session = SSL_SESSION_dup(it->second.session);
+  if (session) {
+    SSL_set_session(ssl, session);
+    SSL_SESSION_free(session);
+  }
+  this->lru.splice(this->lru.begin(), this->lru, it->second.lru_it);
+}
+
+void TLSClientSessionCache::add(const string& key, SSL_SESSION* session) {
+  lock_guard<mutex> g(this->lock);
+  auto emplace_ret = this->entries.try_emplace(key);
+  Entry& entry = emplace_ret.first->second;
+  if (emplace_ret.second) {
+    this->lru.emplace_front(key);
+    entry.lru_it = this->lru.begin();
+  } else {
+    SSL_SESSION_free(entry.session);
+    this->lru.splice(this->lru.begin(), this->lru, entry.lru_it);
+  }
+  entry.session = session;
+
+  while (this->entries.size() > this->max_entries) {
+    this->erase_locked(this->entries.find(this->lru.back()));
+  }
+}
+
+size_t TLSClientSessionCache::size() {
+  lock_guard<mutex> g(this->lock);
+  return this->entries.size();
+}
+
+void TLSClientSessionCache::clear() {
+  lock_guard<mutex> g(this->lock);
+  for (auto& it : this->entries) {
+    SSL_SESSION_free(it.second.session);
+  }
+  this->entries.clear();
+  this->lru.clear();
+}
+
+void TLSClientSessionCache::erase_locked(
+    unordered_map<string, Entry>::iterator it) {
+  SSL_SESSION_free(it->second.session);
+  this->lru.erase(it->second.lru_it);
+  this->entries.erase(it);
+}
+
+int TLSClientSessionCache::on_new_session(SSL* ssl, SSL_SESSION* session) {
+  auto* cache = TLSClientSessionCache::get(SSL_get_SSL_CTX(ssl));
+  auto* key = reinterpret_cast<const string*>(
+      SSL_get_ex_data(ssl, TLSClientSessionCache::ssl_ex_index()));
+  if (!cache || !key || !SSL_SESSION_is_resumable(session)) {
+    return 0;
+  }
+  // The session still belongs to the connection (see the comment in prepare),
+  // so the cache keeps a copy of it instead
+  SSL_SESSION* copy = SSL_SESSION_dup(session);
+  if (copy) {
+    cache->add(*key, copy);
+  }
+  return 0;
+}
+
+TLSServerSessionTickets::TLSServerSessionTickets(
+    uint64_t key_rotation_usecs, size_t num_previous_keys)
+    : key_rotation_usecs(key_rotation_usecs),
+      num_previous_keys(num_previous_keys),
+      num_full_handshakes(0),
+      num_resumed_handshakes(0) {
+  if (this->key_rotation_usecs == 0) {
+    throw invalid_argument("key_rotation_usecs must be nonzero");
+  }
+  this->rotate_keys_locked(now());
+}
+
+TLSServerSessionTickets::~TLSServerSessionTickets() {
+  // Don't leave key material lying around in freed memory
+  OPENSSL_cleanse(this->keys.data(), this->keys.size() * sizeof(TicketKey));
+}
+
+int TLSServerSessionTickets::ssl_ctx_ex_index() {
+  static int index = SSL_CTX_get_ex_new_index(
+      0, nullptr, nullptr, nullptr,
+      +[](void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) -> void {
+        delete reinterpret_cast<TLSServerSessionTickets*>(ptr);
+      });
+  return index;
+}
+
+int TLSServerSessionTickets::ssl_ex_index() {
+  // This is set on each connection once its first handshake has been counted;
+  // in TLS 1.3, the info callback reports another completed handshake after
+  // each post-handshake message (e.g. NewSessionTicket)
+  static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+TLSServerSessionTickets* TLSServerSessionTickets::attach(
+    SSL_CTX* ssl_ctx, uint64_t key_rotation_usecs, size_t num_previous_keys) {
+  if (TLSServerSessionTickets::get(ssl_ctx)) {
+    throw logic_error("SSL context already has session tickets enabled");
+  }
+  auto* tickets = new TLSServerSessionTickets(key_rotation_usecs, num_previous_keys);
+  if (!SSL_CTX_set_ex_data(ssl_ctx, TLSServerSessionTickets::ssl_ctx_ex_index(), tickets)) {
+    delete tickets;
+    throw runtime_error("failed to attach session tickets to SSL context");
+  }
+
+  SSL_CTX_clear_options(ssl_ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, &TLSServerSessionTickets::on_ticket_key);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, &TLSServerSessionTickets::on_ticket_key);
+#endif
+  SSL_CTX_set_info_callback(ssl_ctx, &TLSServerSessionTickets::on_info);
+
+  // Tickets outlive their key by up to one rotation interval for each
+  // previous key, so there's no point in the client keeping them any longer
+  // than that
+  SSL_CTX_set_timeout(ssl_ctx,
+      (key_rotation_usecs * (num_previous_keys + 1)) / 1000000);
+  return tickets;
+}
+
+TLSServerSessionTickets* TLSServerSessionTickets::get(SSL_CTX* ssl_ctx) {
+  return reinterpret_cast<TLSServerSessionTickets*>(
+      SSL_CTX_get_ex_data(ssl_ctx, TLSServerSessionTickets::ssl_ctx_ex_index()));
+}
+
+void TLSServerSessionTickets::rotate_keys() {
+  lock_guard<mutex> g(this->lock);
+  this->rotate_keys_locked(now());
+}
+
+void TLSServerSessionTickets::rotate_keys_locked(uint64_t now_usecs) {
+  TicketKey key;
+  if ((RAND_bytes(key.name, sizeof(key.name)) != 1) ||
+      (RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1) ||
+      (RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)) {
+    throw runtime_error("failed to generate session ticket key");
+  }
+  key.created_time = now_usecs;
+
+  if (this->keys.size() > this->num_previous_keys) {
+    OPENSSL_cleanse(&this->keys.back(), sizeof(TicketKey));
+    this->keys.pop_back();
+  }
+  this->keys.insert(this->keys.begin(), key);
+}
+
+TLSServerSessionTickets::TicketKey TLSServerSessionTickets::current_key() {
+  lock_guard<mutex> g(this->lock);
+  uint64_t t = now();
+  if (t - this->keys.front().created_time >= this->key_rotation_usecs) {
+    this->rotate_keys_locked(t);
+  }
+  return this->keys.front();
+}
+
+bool TLSServerSessionTickets::find_key(
+    const uint8_t* name, TicketKey* key, bool* is_current) {
+  lock_guard<mutex> g(this->lock);
+  for (size_t z = 0; z < this->keys.size(); z++) {
+    if (!memcmp(this->keys[z].name, name, sizeof(this->keys[z].name))) {
+      *key = this->keys[z];
+      // If the current key is due to be rotated, tickets encrypted with it
+      // should be renewed too
+      *is_current = (z == 0) &&
+          (now() - this->keys[z].created_time < this->key_rotation_usecs);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t TLSServerSessionTickets::get_num_full_handshakes() const {
+  return this->num_full_handshakes.load(memory_order_relaxed);
+}
+
+uint64_t TLSServerSessionTickets::get_num_resumed_handshakes() const {
+  return this->num_resumed_handshakes.load(memory_order_relaxed);
+}
+
+void TLSServerSessionTickets::on_info(const SSL* ssl, int where, int) {
+  if (!(where & SSL_CB_HANDSHAKE_DONE)) {
+    return;
+  }
+  SSL* mutable_ssl = const_cast<SSL*>(ssl);
+  if (SSL_get_ex_data(mutable_ssl, TLSServerSessionTickets::ssl_ex_index())) {
+    return;
+  }
+  SSL_set_ex_data(mutable_ssl, TLSServerSessionTickets::ssl_ex_index(), mutable_ssl);
+
+  auto* tickets = TLSServerSessionTickets::get(SSL_get_SSL_CTX(ssl));
+  if (!tickets) {
+    return;
+  }
+  if (SSL_session_reused(mutable_ssl)) {
+    tickets->num_resumed_handshakes.fetch_add(1, memory_order_relaxed);
+  } else {
+    tickets->num_full_handshakes.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static bool set_ticket_hmac_key(EVP_MAC_CTX* mac_ctx, uint8_t* hmac_key, size_t size) {
+  char digest_name[] = "SHA256";
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmac_key, size),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest_name, 0),
+      OSSL_PARAM_construct_end(),
+  };
+  return EVP_MAC_CTX_set_params(mac_ctx, params) == 1;
+}
+
+int TLSServerSessionTickets::on_ticket_key(
+    SSL* ssl,
+    uint8_t* key_name,
+    uint8_t* iv,
+    EVP_CIPHER_CTX* cipher_ctx,
+    EVP_MAC_CTX* mac_ctx,
+    int enc) {
+#else
+static bool set_ticket_hmac_key(HMAC_CTX* hmac_ctx, uint8_t* hmac_key, size_t size) {
+  return HMAC_Init_ex(hmac_ctx, hmac_key, size, EVP_sha256(), nullptr) == 1;
+}
+
+int TLSServerSessionTickets::on_ticket_key(
+    SSL* ssl,
+    uint8_t* key_name,
+    uint8_t* iv,
+    EVP_CIPHER_CTX* cipher_ctx,
+    HMAC_CTX* mac_ctx,
+    int enc) {
+#endif
+  // This is called on worker threads, so it must not throw
+  auto* tickets = TLSServerSessionTickets::get(SSL_get_SSL_CTX(ssl));
+  if (!tickets) {
+    return -1;
+  }
+
+  TicketKey key;
+  int ret;
+  try {
+    if (enc) {
+      key = tickets->current_key();
+      memcpy(key_name, key.name, sizeof(key.name));
+      if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+        return -1;
+      }
+      if (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) {
+        return -1;
+      }
+      ret = 1;
+
+    } else {
+      bool is_current;
+      if (!tickets->find_key(key_name, &key, &is_current)) {
+        // The ticket's key has been rotated out; do a full handshake
+        return 0;
+      }
+      if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) {
+        return -1;
+      }
+      // 2 means the ticket is valid but the client should get a new one
+      ret = is_current ? 1 : 2;
+    }
+  } catch (const exception&) {
+    return -1;
+  }
+
+  bool hmac_key_set = set_ticket_hmac_key(mac_ctx, key.hmac_key, sizeof(key.hmac_key));
+  OPENSSL_cleanse(&key, sizeof(key));
+  return hmac_key_set ? ret : -1;
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/ssl.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace EventAsync::HTTP {
+
+// Caches TLS sessions for outbound connections, so that a new connection to a
+// server that was connected to recently can resume the previous session (with
+// an abbreviated handshake) instead of doing a full handshake. Sessions are
+// keyed by host and port. The cache holds at most max_entries sessions,
+// evicting the least recently used one when full.
+//
+// The cache is attached to an SSL_CTX (and is destroyed along with it), and
+// Connection uses it automatically for all connections created with that
+// context. Connection::create_default_ssl_ctx attaches a cache to the contexts
+// it creates. The cache may be used from multiple threads.
+class TLSClientSessionCache {
+public:
+  TLSClientSessionCache(const TLSClientSessionCache&) = delete;
+  TLSClientSessionCache(TLSClientSessionCache&&) = delete;
+  TLSClientSessionCache& operator=(const TLSClientSessionCache&) = delete;
+  TLSClientSessionCache& operator=(TLSClientSessionCache&&) = delete;
+  ~TLSClientSessionCache();
+
+  // Creates a cache and attaches it to ssl_ctx, replacing the context's
+  // existing cache, if any. This also enables client-side session caching on
+  // the context.
+  static TLSClientSessionCache* attach(
+      SSL_CTX* ssl_ctx, size_t max_entries = 1024);
+  // Returns the cache attached to ssl_ctx, or nullptr if there isn't one.
+  static TLSClientSessionCache* get(SSL_CTX* ssl_ctx);
+
+  // Sets up ssl for a new connection to the given host and port: if there's a
+  // cached session for them, ssl will try to resume it, and whatever session
+  // the server sends on this connection will replace it in the cache. This
+  // must be called before the handshake begins.
+  void prepare(SSL* ssl, const std::string& host, uint16_t port);
+
+  size_t size();
+  void clear();
+
+private:
+  struct Entry {
+    SSL_SESSION* session;
+    std::list<std::string>::iterator lru_it;
+  };
+
+  size_t max_entries;
+  std::mutex lock;
+  std::unordered_map<std::string, Entry> entries;
+  // Most recently used at the front
+  std::list<std::string> lru;
+
+  explicit TLSClientSessionCache(size_t max_entries);
+
+  void add(const std::string& key, SSL_SESSION* session);
+  void erase_locked(std::unordered_map<std::string, Entry>::iterator it);
+
+  static int ssl_ctx_ex_index();
+  static int ssl_ex_index();
+  static int on_new_session(SSL* ssl, SSL_SESSION* session);
+};
+
+// Issues TLS session tickets for inbound connections, so that returning
+// clients can resume their sessions on any worker thread without the server
+// keeping per-session state. Tickets are encrypted with a key that's replaced
+// every key_rotation_usecs; tickets encrypted with the previous
+// num_previous_keys keys are still accepted (and the client is sent a new
+// ticket), and older tickets cause a full handshake. Ticket keys are generated
+// randomly and only exist in memory, so tickets aren't valid across restarts
+// or across processes.
+//
+// This object also counts completed handshakes on the context, so the
+// proportion of resumed handshakes can be monitored.
+//
+// The object is attached to an SSL_CTX (and is destroyed along with it).
+// Server::create_server_ssl_ctx attaches one to the contexts it creates. The
+// object may be used from multiple threads.
+class TLSServerSessionTickets {
+public:
+  TLSServerSessionTickets(const TLSServerSessionTickets&) = delete;
+  TLSServerSessionTickets(TLSServerSessionTickets&&) = delete;
+  TLSServerSessionTickets& operator=(const TLSServerSessionTickets&) = delete;
+  TLSServerSessionTickets& operator=(TLSServerSessionTickets&&) = delete;
+  ~TLSServerSessionTickets();
+
+  // Creates a ticket key manager and attaches it to ssl_ctx. This replaces
+  // the context's info callback and sets its session timeout to the maximum
+  // lifetime of a ticket. Throws logic_error if the context already has a
+  // ticket key manager.
+  static TLSServerSessionTickets* attach(
+      SSL_CTX* ssl_ctx,
+      uint64_t key_rotation_usecs = 3600000000,
+      size_t num_previous_keys = 2);
+  // Returns the ticket key manager attached to ssl_ctx, or nullptr if there
+  // isn't one.
+  static TLSServerSessionTickets* get(SSL_CTX* ssl_ctx);
+
+  // Replaces the current ticket key immediately. Tickets issued before this
+  // call are still accepted until num_previous_keys more rotations happen.
+  void rotate_keys();
+
+  uint64_t get_num_full_handshakes() const;
+  uint64_t get_num_resumed_handshakes() const;
+
+private:
+  struct TicketKey {
+    uint8_t name[16];
+    uint8_t aes_key[32];
+    uint8_t hmac_key[32];
+    uint64_t created_time;
+  };
+
+  uint64_t key_rotation_usecs;
+  size_t num_previous_keys;
+  std::mutex lock;
+  // The current key is at the front
+  std::vector<TicketKey> keys;
+
+  std::atomic<uint64_t> num_full_handshakes;
+  std::atomic<uint64_t> num_resumed_handshakes;
+
+  TLSServerSessionTickets(uint64_t key_rotation_usecs, size_t num_previous_keys);
+
+  void rotate_keys_locked(uint64_t now_usecs);
+  // Returns the key to encrypt a new ticket with, rotating keys first if the
+  // current key is too old.
+  TicketKey current_key();
+  // Returns true if a key with the given name exists, and sets *is_current to
+  // indicate whether it's the current key.
+  bool find_key(const uint8_t* name, TicketKey* key, bool* is_current);
+
+  static int ssl_ctx_ex_index();
+  static int ssl_ex_index();
+  static void on_info(const SSL* ssl, int where, int ret);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int on_ticket_key(
+      SSL* ssl,
+      uint8_t* key_name,
+      uint8_t* iv,
+      EVP_CIPHER_CTX* cipher_ctx,
+      EVP_MAC_CTX* mac_ctx,
+      int enc);
+#else
+  static int on_ticket_key(
+      SSL* ssl,
+      uint8_t* key_name,
+      uint8_t* iv,
+      EVP_CIPHER_CTX* cipher_ctx,
+      HMAC_CTX* hmac_ctx,
+      int enc);
+#endif
+};
+
+} // namespace EventAsync::HTTP
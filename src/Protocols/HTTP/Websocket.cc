@@ -0,0 +1,801 @@
+#include "Websocket.hh"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <phosg/Strings.hh>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+void add_websocket_frame_header(
+    Buffer& buf,
+    uint8_t opcode,
+    size_t payload_size,
+    bool compressed,
+    const uint8_t* mask_key,
+    bool fin) {
+  buf.add_u8((fin ? 0x80 : 0x00) | (compressed ? 0x40 : 0x00) | (opcode & 0x0F));
+  uint8_t mask_flag = mask_key ? 0x80 : 0x00;
+  if (payload_size > 0xFFFF) {
+    buf.add_u8(mask_flag | 0x7F);
+    buf.add_u64b(payload_size);
+  } else if (payload_size > 0x7D) {
+    buf.add_u8(mask_flag | 0x7E);
+    buf.add_u16b(payload_size);
+  } else {
+    buf.add_u8(mask_flag | payload_size);
+  }
+  if (mask_key) {
+    buf.add(mask_key, 4);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// This is compiled for AVX2 regardless of the target architecture, so it must
+// only be called if the CPU supports it
+__attribute__((target("avx2"))) static size_t copy_with_websocket_mask_avx2(
+    uint8_t* dest, const uint8_t* src, size_t size, uint32_t mask) {
+  __m256i mask_v = _mm256_set1_epi32(mask);
+  size_t x = 0;
+  for (; x + 32 <= size; x += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), _mm256_xor_si256(v, mask_v));
+  }
+  return x;
+}
+
+static bool cpu_supports_avx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+#endif
+
+// dest and src may be the same (but must not otherwise overlap)
+static void mask_bytes(uint8_t* dest, const uint8_t* src, size_t size,
+    const uint8_t mask_key[4], size_t offset) {
+  // Rotate the key so its first byte applies to src[0]. All the vector sizes
+  // below are multiples of 4, so the key stays aligned with the data after
+  // each block.
+  uint8_t rotated_key[4];
+  for (size_t z = 0; z < 4; z++) {
+    rotated_key[z] = mask_key[(offset + z) & 3];
+  }
+  uint32_t mask;
+  memcpy(&mask, rotated_key, sizeof(mask));
+
+  size_t x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  if (size >= 64 && cpu_supports_avx2()) {
+    x = copy_with_websocket_mask_avx2(dest, src, size, mask);
+  }
+#if defined(__SSE2__)
+  __m128i mask_v = _mm_set1_epi32(mask);
+  for (; x + 16 <= size; x += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), _mm_xor_si128(v, mask_v));
+  }
+#endif
+#elif defined(__ARM_NEON)
+  uint8x16_t mask_v = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+  for (; x + 16 <= size; x += 16) {
+    vst1q_u8(dest + x, veorq_u8(vld1q_u8(src + x), mask_v));
+  }
+#endif
+
+  uint64_t mask64 = (static_cast<uint64_t>(mask) << 32) | mask;
+  for (; x + 8 <= size; x += 8) {
+    uint64_t v;
+    memcpy(&v, src + x, sizeof(v));
+    v ^= mask64;
+    memcpy(dest + x, &v, sizeof(v));
+  }
+  for (; x < size; x++) {
+    dest[x] = src[x] ^ rotated_key[x & 3];
+  }
+}
+
+void generate_websocket_mask_key(uint8_t mask_key[4]) {
+  // xorshift64*, seeded once per thread. Each 64-bit output provides two keys.
+  static thread_local uint64_t state = 0;
+  static thread_local uint32_t next_key = 0;
+  static thread_local bool has_next_key = false;
+  if (has_next_key) {
+    memcpy(mask_key, &next_key, 4);
+    has_next_key = false;
+    return;
+  }
+  if (state == 0) {
+    random_device rd;
+    state = (static_cast<uint64_t>(rd()) << 32) | rd();
+    state |= 1;
+  }
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  uint64_t value = state * 0x2545F4914F6CDD1DULL;
+  uint32_t key = value;
+  memcpy(mask_key, &key, 4);
+  next_key = value >> 32;
+  has_next_key = true;
+}
+
+void apply_websocket_mask(
+    void* data, size_t size, const uint8_t mask_key[4], size_t offset) {
+  uint8_t* bytes = reinterpret_cast<uint8_t*>(data);
+  mask_bytes(bytes, bytes, size, mask_key, offset);
+}
+
+void copy_with_websocket_mask(void* dest, const void* src, size_t size,
+    const uint8_t mask_key[4], size_t offset) {
+  mask_bytes(reinterpret_cast<uint8_t*>(dest),
+      reinterpret_cast<const uint8_t*>(src), size, mask_key, offset);
+}
+
+// Calls fn(data, size) for each contiguous segment of the first size bytes of
+// buf, without copying them out of the buffer
+template <typename FnT>
+static void for_each_segment(Buffer& buf, size_t size, FnT&& fn) {
+  if (size == 0) {
+    return;
+  }
+
+  // Messages usually span only a few chains, so try a small fixed-size array
+  // first
+  struct evbuffer_iovec small_vecs[8];
+  struct evbuffer_iovec* vecs = small_vecs;
+  vector<struct evbuffer_iovec> large_vecs;
+  int num_vecs = buf.peek(size, nullptr, vecs, 8);
+  if (num_vecs > 8) {
+    large_vecs.resize(num_vecs);
+    vecs = large_vecs.data();
+    num_vecs = buf.peek(size, nullptr, vecs, num_vecs);
+  }
+  if (num_vecs < 0) {
+    throw runtime_error("evbuffer_peek");
+  }
+
+  size_t offset = 0;
+  for (int z = 0; (z < num_vecs) && (offset < size); z++) {
+    size_t segment_size = min<size_t>(vecs[z].iov_len, size - offset);
+    fn(vecs[z].iov_base, segment_size);
+    offset += segment_size;
+  }
+  if (offset < size) {
+    throw logic_error("buffer is smaller than requested size");
+  }
+}
+
+void apply_websocket_mask(Buffer& buf, size_t size, const uint8_t mask_key[4]) {
+  size_t offset = 0;
+  for_each_segment(buf, size, [&](void* data, size_t segment_size) {
+    apply_websocket_mask(data, segment_size, mask_key, offset);
+    offset += segment_size;
+  });
+}
+
+static string trim_whitespace(const string& s) {
+  size_t start = s.find_first_not_of(" \t");
+  if (start == string::npos) {
+    return "";
+  }
+  size_t end = s.find_last_not_of(" \t");
+  return s.substr(start, end - start + 1);
+}
+
+// Parses a window bits parameter value, which may be quoted. Returns 0 if the
+// value is invalid.
+static uint8_t parse_window_bits(string value) {
+  if ((value.size() >= 2) && (value.front() == '"') && (value.back() == '"')) {
+    value = value.substr(1, value.size() - 2);
+  }
+  if ((value.size() < 1) || (value.size() > 2) ||
+      (value.find_first_not_of("0123456789") != string::npos)) {
+    return 0;
+  }
+  int bits = stoi(value);
+  return ((bits >= 8) && (bits <= 15)) ? bits : 0;
+}
+
+bool negotiate_websocket_deflate(
+    const char* header,
+    const WebsocketDeflateOptions& options,
+    WebsocketDeflateParams* params,
+    string* response_header) {
+  if (!options.enabled || !header) {
+    return false;
+  }
+
+  // zlib can't produce raw deflate streams with an 8-bit window, so our side
+  // always uses at least 9 bits
+  uint8_t local_max_window_bits = max<uint8_t>(
+      9, min<uint8_t>(15, options.local_max_window_bits));
+  uint8_t peer_max_window_bits = max<uint8_t>(
+      8, min<uint8_t>(15, options.peer_max_window_bits));
+
+  for (const auto& offer : split(header, ',')) {
+    auto tokens = split(offer, ';');
+    if (trim_whitespace(tokens[0]) != "permessage-deflate") {
+      continue;
+    }
+
+    bool valid = true;
+    bool server_no_context_takeover = false;
+    bool client_no_context_takeover = false;
+    uint8_t server_max_window_bits = 0;
+    uint8_t client_max_window_bits = 0;
+    bool client_max_window_bits_present = false;
+    for (size_t z = 1; valid && (z < tokens.size()); z++) {
+      string token = trim_whitespace(tokens[z]);
+      string name, value;
+      size_t equals_pos = token.find('=');
+      if (equals_pos == string::npos) {
+        name = token;
+      } else {
+        name = trim_whitespace(token.substr(0, equals_pos));
+        value = trim_whitespace(token.substr(equals_pos + 1));
+      }
+
+      // Each parameter may appear only once
+      if (name == "server_no_context_takeover") {
+        valid = !server_no_context_takeover && value.empty();
+        server_no_context_takeover = true;
+      } else if (name == "client_no_context_takeover") {
+        valid = !client_no_context_takeover && value.empty();
+        client_no_context_takeover = true;
+      } else if (name == "server_max_window_bits") {
+        valid = (server_max_window_bits == 0);
+        server_max_window_bits = parse_window_bits(value);
+        valid &= (server_max_window_bits != 0);
+      } else if (name == "client_max_window_bits") {
+        valid = !client_max_window_bits_present;
+        client_max_window_bits_present = true;
+        client_max_window_bits = value.empty() ? 15 : parse_window_bits(value);
+        valid &= (client_max_window_bits != 0);
+      } else {
+        valid = false;
+      }
+    }
+    if (!valid) {
+      continue;
+    }
+
+    // The server's window can't be larger than the client asked for; if the
+    // client asked for a window smaller than we can produce, decline this offer
+    params->server_max_window_bits = min<uint8_t>(
+        local_max_window_bits, server_max_window_bits ? server_max_window_bits : 15);
+    if (params->server_max_window_bits < 9) {
+      continue;
+    }
+    // We can only limit the client's window if it said it supports that
+    params->client_max_window_bits = client_max_window_bits_present
+        ? min<uint8_t>(peer_max_window_bits, client_max_window_bits)
+        : 15;
+    params->server_no_context_takeover = server_no_context_takeover || options.share_contexts;
+    params->client_no_context_takeover = options.share_contexts;
+
+    *response_header = "permessage-deflate";
+    if (params->server_no_context_takeover) {
+      *response_header += "; server_no_context_takeover";
+    }
+    if (params->client_no_context_takeover) {
+      *response_header += "; client_no_context_takeover";
+    }
+    if (server_max_window_bits || (params->server_max_window_bits < 15)) {
+      *response_header += string_printf(
+          "; server_max_window_bits=%hhu", params->server_max_window_bits);
+    }
+    if (client_max_window_bits_present && (params->client_max_window_bits < 15)) {
+      *response_header += string_printf(
+          "; client_max_window_bits=%hhu", params->client_max_window_bits);
+    }
+    return true;
+  }
+
+  return false;
+}
+
+string websocket_deflate_offer(const WebsocketDeflateOptions& options) {
+  // The client's compressor always uses at least 9 bits (see above); a client
+  // that says it supports client_max_window_bits must accept any value the
+  // server sends back, so we announce our own limit with it
+  uint8_t local_max_window_bits = max<uint8_t>(
+      9, min<uint8_t>(15, options.local_max_window_bits));
+  uint8_t peer_max_window_bits = max<uint8_t>(
+      8, min<uint8_t>(15, options.peer_max_window_bits));
+
+  string ret = string_printf(
+      "permessage-deflate; client_max_window_bits=%hhu", local_max_window_bits);
+  if (peer_max_window_bits < 15) {
+    ret += string_printf("; server_max_window_bits=%hhu", peer_max_window_bits);
+  }
+  if (options.share_contexts) {
+    ret += "; client_no_context_takeover; server_no_context_takeover";
+  }
+  return ret;
+}
+
+bool parse_websocket_deflate_response(
+    const char* header,
+    const WebsocketDeflateOptions& options,
+    WebsocketDeflateParams* params) {
+  if (!header) {
+    return false;
+  }
+
+  auto extensions = split(header, ',');
+  if (extensions.size() != 1) {
+    throw runtime_error("server accepted multiple websocket extensions");
+  }
+  auto tokens = split(extensions[0], ';');
+  if (trim_whitespace(tokens[0]) != "permessage-deflate") {
+    throw runtime_error("server accepted an unknown websocket extension");
+  }
+
+  uint8_t local_max_window_bits = max<uint8_t>(
+      9, min<uint8_t>(15, options.local_max_window_bits));
+  uint8_t peer_max_window_bits = max<uint8_t>(
+      8, min<uint8_t>(15, options.peer_max_window_bits));
+
+  // The client's compression context is reset after every message if the
+  // server asks for that or if we offered it
+  params->server_no_context_takeover = false;
+  params->client_no_context_takeover = options.share_contexts;
+  params->server_max_window_bits = 15;
+  params->client_max_window_bits = local_max_window_bits;
+  for (size_t z = 1; z < tokens.size(); z++) {
+    string token = trim_whitespace(tokens[z]);
+    string name, value;
+    size_t equals_pos = token.find('=');
+    if (equals_pos == string::npos) {
+      name = token;
+    } else {
+      name = trim_whitespace(token.substr(0, equals_pos));
+      value = trim_whitespace(token.substr(equals_pos + 1));
+    }
+
+    if ((name == "server_no_context_takeover") && value.empty()) {
+      params->server_no_context_takeover = true;
+    } else if ((name == "client_no_context_takeover") && value.empty()) {
+      params->client_no_context_takeover = true;
+    } else if (name == "server_max_window_bits") {
+      params->server_max_window_bits = parse_window_bits(value);
+      if ((params->server_max_window_bits == 0) ||
+          (params->server_max_window_bits > peer_max_window_bits)) {
+        throw runtime_error("server sent an invalid server_max_window_bits");
+      }
+    } else if (name == "client_max_window_bits") {
+      params->client_max_window_bits = parse_window_bits(value);
+      if ((params->client_max_window_bits < 9) ||
+          (params->client_max_window_bits > local_max_window_bits)) {
+        throw runtime_error("server sent an unsupported client_max_window_bits");
+      }
+    } else {
+      throw runtime_error("server sent an invalid permessage-deflate parameter");
+    }
+  }
+  return true;
+}
+
+static constexpr size_t DEFLATE_OUTPUT_CHUNK_SIZE = 16 * 1024;
+
+WebsocketDeflateCodec::Stream::Stream(bool is_deflate)
+    : initialized(false),
+      is_deflate(is_deflate) {
+  memset(&this->z, 0, sizeof(this->z));
+}
+
+WebsocketDeflateCodec::Stream::~Stream() {
+  if (this->initialized) {
+    if (this->is_deflate) {
+      deflateEnd(&this->z);
+    } else {
+      inflateEnd(&this->z);
+    }
+  }
+}
+
+WebsocketDeflateCodec::WebsocketDeflateCodec(
+    bool is_server,
+    const WebsocketDeflateParams& params,
+    const WebsocketDeflateOptions& options)
+    : min_size(options.min_size),
+      max_message_size(options.max_message_size),
+      level(options.level),
+      mem_level(options.mem_level),
+      deflate_window_bits(is_server
+              ? params.server_max_window_bits
+              : params.client_max_window_bits),
+      inflate_window_bits(is_server
+              ? params.client_max_window_bits
+              : params.server_max_window_bits),
+      deflate_no_context_takeover(is_server
+              ? params.server_no_context_takeover
+              : params.client_no_context_takeover),
+      inflate_no_context_takeover(is_server
+              ? params.client_no_context_takeover
+              : params.server_no_context_takeover),
+      share_contexts(options.share_contexts) {
+  // zlib can't compress with an 8-bit window, but a 9-bit window can
+  // decompress streams that were compressed with an 8-bit window
+  if ((this->deflate_window_bits < 9) || (this->deflate_window_bits > 15)) {
+    throw invalid_argument("invalid window size for compression");
+  }
+  this->inflate_window_bits = max<int>(9, this->inflate_window_bits);
+}
+
+WebsocketDeflateCodec::~WebsocketDeflateCodec() = default;
+
+bool WebsocketDeflateCodec::should_compress(size_t size) const {
+  return size >= this->min_size;
+}
+
+z_stream* WebsocketDeflateCodec::get_deflater() {
+  // A stream can only be shared if it's reset after every message
+  unique_ptr<Stream>* stream;
+  if (this->share_contexts && this->deflate_no_context_takeover) {
+    static thread_local unordered_map<uint64_t, unique_ptr<Stream>> shared_streams;
+    uint64_t key = (static_cast<uint64_t>(this->deflate_window_bits) << 32) |
+        (static_cast<uint64_t>(this->mem_level) << 16) |
+        static_cast<uint16_t>(this->level);
+    stream = &shared_streams[key];
+  } else {
+    stream = &this->own_deflater;
+  }
+
+  if (!*stream) {
+    auto new_stream = make_unique<Stream>(true);
+    int ret = deflateInit2(&new_stream->z, this->level, Z_DEFLATED,
+        -this->deflate_window_bits, this->mem_level, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+      throw runtime_error(string_printf("deflateInit2 failed (%d)", ret));
+    }
+    new_stream->initialized = true;
+    *stream = std::move(new_stream);
+  }
+  return &(*stream)->z;
+}
+
+z_stream* WebsocketDeflateCodec::get_inflater() {
+  unique_ptr<Stream>* stream;
+  if (this->share_contexts && this->inflate_no_context_takeover) {
+    static thread_local unordered_map<int, unique_ptr<Stream>> shared_streams;
+    stream = &shared_streams[this->inflate_window_bits];
+  } else {
+    stream = &this->own_inflater;
+  }
+
+  if (!*stream) {
+    auto new_stream = make_unique<Stream>(false);
+    int ret = inflateInit2(&new_stream->z, -this->inflate_window_bits);
+    if (ret != Z_OK) {
+      throw runtime_error(string_printf("inflateInit2 failed (%d)", ret));
+    }
+    new_stream->initialized = true;
+    *stream = std::move(new_stream);
+  }
+  return &(*stream)->z;
+}
+
+void WebsocketDeflateCodec::compress(Buffer& dest, Buffer& src) {
+  z_stream* z = this->get_deflater();
+
+  // The output is built in a temporary buffer so the trailer can be removed
+  // from the end; the rest is then moved to dest without copying
+  Buffer compressed(src.base);
+  auto run = [&](int flush) {
+    do {
+      struct evbuffer_iovec out;
+      if (compressed.reserve_space(DEFLATE_OUTPUT_CHUNK_SIZE, &out, 1) != 1) {
+        throw runtime_error("cannot reserve space for compressed data");
+      }
+      z->next_out = reinterpret_cast<Bytef*>(out.iov_base);
+      z->avail_out = out.iov_len;
+      int ret = deflate(z, flush);
+      if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+        throw runtime_error(string_printf("deflate failed (%d)", ret));
+      }
+      out.iov_len -= z->avail_out;
+      compressed.commit_space(&out, 1);
+    } while ((z->avail_in > 0) || (z->avail_out == 0));
+  };
+
+  try {
+    for_each_segment(src, src.get_length(), [&](void* data, size_t size) {
+      z->next_in = reinterpret_cast<Bytef*>(data);
+      z->avail_in = size;
+      run(Z_NO_FLUSH);
+    });
+    z->next_in = nullptr;
+    z->avail_in = 0;
+    run(Z_SYNC_FLUSH);
+  } catch (const exception&) {
+    deflateReset(z);
+    throw;
+  }
+  if (this->deflate_no_context_takeover) {
+    deflateReset(z);
+  }
+
+  // Every message compressed with Z_SYNC_FLUSH ends with 00 00 FF FF; these
+  // bytes aren't sent, and the receiver adds them back before decompressing
+  src.drain_all();
+  size_t compressed_size = compressed.get_length();
+  if (compressed_size < 4) {
+    throw logic_error("compressed message is missing trailer");
+  }
+  compressed.remove_buffer(dest, compressed_size - 4);
+}
+
+void WebsocketDeflateCodec::decompress(Buffer& dest, Buffer& src) {
+  z_stream* z = this->get_inflater();
+
+  size_t bytes_produced = 0;
+  bool stream_ended = false;
+  auto run = [&](void* data, size_t size) {
+    z->next_in = reinterpret_cast<Bytef*>(data);
+    z->avail_in = size;
+    while (!stream_ended && ((z->avail_in > 0) || (z->avail_out == 0))) {
+      struct evbuffer_iovec out;
+      if (dest.reserve_space(DEFLATE_OUTPUT_CHUNK_SIZE, &out, 1) != 1) {
+        throw runtime_error("cannot reserve space for decompressed data");
+      }
+      z->next_out = reinterpret_cast<Bytef*>(out.iov_base);
+      z->avail_out = out.iov_len;
+      int ret = inflate(z, Z_SYNC_FLUSH);
+      if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR)) {
+        throw WebsocketProtocolError(
+            string_printf("inflate failed (%d)", ret), 1007);
+      }
+      out.iov_len -= z->avail_out;
+      dest.commit_space(&out, 1);
+      bytes_produced += out.iov_len;
+      if (bytes_produced > this->max_message_size) {
+        throw WebsocketProtocolError("decompressed message is too large", 1009);
+      }
+      // The peer may end the deflate stream at the end of a message; if it
+      // does, any remaining input is ignored and the stream is reset below
+      stream_ended = (ret == Z_STREAM_END);
+      if ((ret == Z_BUF_ERROR) && (z->avail_out > 0)) {
+        break;
+      }
+    }
+  };
+
+  try {
+    for_each_segment(src, src.get_length(), run);
+    uint8_t trailer[4] = {0x00, 0x00, 0xFF, 0xFF};
+    run(trailer, sizeof(trailer));
+  } catch (const exception&) {
+    inflateReset(z);
+    throw;
+  }
+  if (stream_ended || this->inflate_no_context_takeover) {
+    inflateReset(z);
+  }
+  src.drain_all();
+}
+
+WebsocketMessage::WebsocketMessage() : opcode(0) {}
+
+static void append_websocket_frame(
+    Buffer& frame,
+    Buffer& data,
+    size_t size,
+    uint8_t opcode,
+    bool compressed,
+    bool mask,
+    bool fin) {
+  if (!mask) {
+    add_websocket_frame_header(frame, opcode, size, compressed, nullptr, fin);
+    data.remove_buffer(frame, size);
+    return;
+  }
+
+  uint8_t mask_key[4];
+  generate_websocket_mask_key(mask_key);
+  add_websocket_frame_header(frame, opcode, size, compressed, mask_key, fin);
+  if (size > 0) {
+    struct evbuffer_iovec out;
+    if (frame.reserve_space(size, &out, 1) != 1) {
+      throw runtime_error("cannot reserve space for masked data");
+    }
+    uint8_t* dest = reinterpret_cast<uint8_t*>(out.iov_base);
+    size_t offset = 0;
+    for_each_segment(data, size, [&](void* segment, size_t segment_size) {
+      copy_with_websocket_mask(dest + offset, segment, segment_size, mask_key, offset);
+      offset += segment_size;
+    });
+    out.iov_len = size;
+    frame.commit_space(&out, 1);
+    data.drain(size);
+  }
+}
+
+void encode_websocket_message(
+    Buffer& frame,
+    Buffer& payload,
+    uint8_t opcode,
+    WebsocketDeflateCodec* deflate,
+    bool mask,
+    size_t max_frame_size,
+    deque<size_t>* frame_sizes) {
+  Buffer compressed_payload(payload.base);
+  Buffer* data = &payload;
+  bool compressed = false;
+  if (deflate && !(opcode & 0x08) && deflate->should_compress(payload.get_length())) {
+    deflate->compress(compressed_payload, payload);
+    data = &compressed_payload;
+    compressed = true;
+  }
+
+  // Control frames can't be fragmented. For data messages, only the first
+  // frame has the message's opcode and RSV1 bit; the rest are continuation
+  // frames (opcode 0), and only the last one has the FIN bit.
+  size_t remaining = data->get_length();
+  if ((max_frame_size == 0) || (opcode & 0x08)) {
+    max_frame_size = remaining;
+  }
+  bool is_first = true;
+  do {
+    size_t size = min<size_t>(remaining, max_frame_size);
+    remaining -= size;
+    size_t start_length = frame.get_length();
+    append_websocket_frame(frame, *data, size, is_first ? opcode : 0x00,
+        compressed && is_first, mask, remaining == 0);
+    if (frame_sizes) {
+      frame_sizes->emplace_back(frame.get_length() - start_length);
+    }
+    is_first = false;
+  } while (remaining > 0);
+}
+
+WebsocketProtocolError::WebsocketProtocolError(
+    const string& what, uint16_t close_code)
+    : runtime_error(what),
+      close_code(close_code) {}
+
+WebsocketDecoder::WebsocketDecoder(
+    Base& base,
+    bool is_server,
+    WebsocketDeflateCodec* deflate,
+    size_t max_message_size)
+    : is_server(is_server),
+      deflate(deflate),
+      max_message_size(max_message_size),
+      msg_buf(base),
+      msg_opcode(0),
+      msg_compressed(false),
+      bytes_needed(2) {}
+
+size_t WebsocketDecoder::get_bytes_needed() const {
+  return this->bytes_needed;
+}
+
+WebsocketDecoder::Result WebsocketDecoder::decode(
+    Buffer& buf, WebsocketMessage* msg) {
+  for (;;) {
+    // The header is 2-14 bytes, depending on the payload size and whether
+    // there's a masking key
+    size_t available = buf.get_length();
+    if (available < 2) {
+      this->bytes_needed = 2;
+      return Result::NEED_MORE_DATA;
+    }
+    uint8_t header[14];
+    buf.copyout_atmost(header, min<size_t>(available, sizeof(header)));
+    uint8_t frame_opcode = header[0];
+    bool has_mask = header[1] & 0x80;
+    size_t payload_size = header[1] & 0x7F;
+    size_t header_size = 2 + (has_mask ? 4 : 0);
+    if (payload_size == 0x7E) {
+      header_size += 2;
+    } else if (payload_size == 0x7F) {
+      header_size += 8;
+    }
+    if (available < header_size) {
+      this->bytes_needed = header_size;
+      return Result::NEED_MORE_DATA;
+    }
+    if (payload_size == 0x7E) {
+      payload_size = (header[2] << 8) | header[3];
+    } else if (payload_size == 0x7F) {
+      payload_size = 0;
+      for (size_t z = 2; z < 10; z++) {
+        payload_size = (payload_size << 8) | header[z];
+      }
+      if (payload_size > (1ULL << 62)) {
+        throw WebsocketProtocolError("frame is too large", 1009);
+      }
+    }
+
+    // RSV1 marks a compressed message, and is only valid on the first frame of
+    // a data message if permessage-deflate was negotiated. RSV2 and RSV3 aren't
+    // used by any extension we support.
+    uint8_t opcode = frame_opcode & 0x0F;
+    if ((frame_opcode & 0x30) ||
+        ((frame_opcode & 0x40) && (!this->deflate || (opcode == 0) || (opcode & 0x08)))) {
+      throw WebsocketProtocolError("invalid reserved bits in frame header");
+    }
+
+    // Clients must mask all frames they send, and servers must not mask any
+    // (RFC 6455 section 5.1)
+    if (has_mask != this->is_server) {
+      throw WebsocketProtocolError(this->is_server
+          ? "frame from client is not masked"
+          : "frame from server is masked");
+    }
+
+    // Control frames can't be fragmented, and their payloads are limited to
+    // 125 bytes (RFC 6455 section 5.5). Data frames are checked against the
+    // message size limit here, so an oversized message is rejected before we
+    // wait for (and buffer) its payload.
+    if (opcode & 0x08) {
+      if ((payload_size > 125) || !(frame_opcode & 0x80)) {
+        throw WebsocketProtocolError("invalid control frame");
+      }
+    } else if (payload_size > this->max_message_size - this->msg_buf.get_length()) {
+      throw WebsocketProtocolError("message is too large", 1009);
+    }
+
+    // Wait for the entire frame before consuming any of it
+    if (available < header_size + payload_size) {
+      this->bytes_needed = header_size + payload_size;
+      return Result::NEED_MORE_DATA;
+    }
+    buf.drain(header_size);
+    if (has_mask) {
+      apply_websocket_mask(buf, payload_size, header + header_size - 4);
+    }
+
+    // Control frames can be sent in the middle of fragmented messages; we
+    // should not fail if that happens
+    if (opcode & 0x08) {
+      msg->opcode = opcode;
+      msg->data = buf.remove(payload_size);
+      this->bytes_needed = 2;
+      return Result::CONTROL_FRAME;
+    }
+
+    // If this is the first frame in a message, the frame's opcode must not be
+    // zero; if it's a continuation frame, the frame's opcode must be zero.
+    if ((this->msg_opcode == 0) == (opcode == 0)) {
+      throw WebsocketProtocolError("invalid opcode");
+    }
+    if (opcode) {
+      this->msg_opcode = opcode;
+      this->msg_compressed = frame_opcode & 0x40;
+    }
+    buf.remove_buffer(this->msg_buf, payload_size);
+
+    // If the FIN bit is set, then the message is complete; otherwise, we need
+    // to receive at least one more frame to complete the message.
+    if (frame_opcode & 0x80) {
+      msg->opcode = this->msg_opcode;
+      if (this->msg_compressed) {
+        Buffer decompressed_buf(this->msg_buf.base);
+        this->deflate->decompress(decompressed_buf, this->msg_buf);
+        msg->data = decompressed_buf.remove(decompressed_buf.get_length());
+      } else {
+        msg->data = this->msg_buf.remove(this->msg_buf.get_length());
+      }
+      this->msg_opcode = 0;
+      this->msg_compressed = false;
+      this->bytes_needed = 2;
+      return Result::MESSAGE;
+    }
+  }
+}
+
+} // namespace EventAsync::HTTP
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "../../Buffer.hh"
+
+namespace EventAsync::HTTP {
+
+// Appends a websocket frame header to buf. The payload should be appended
+// after this. If compressed is true, the RSV1 bit is set, which marks the first
+// frame of a message compressed with the permessage-deflate extension. If
+// mask_key is not null, the frame is marked as masked with that key, and the
+// payload must be masked with it. If fin is false, the FIN bit is cleared,
+// which means more frames of the same message follow this one.
+void add_websocket_frame_header(
+    Buffer& buf,
+    uint8_t opcode,
+    size_t payload_size,
+    bool compressed = false,
+    const uint8_t* mask_key = nullptr,
+    bool fin = true);
+
+// Settings for the permessage-deflate extension (RFC 7692).
+struct WebsocketDeflateOptions {
+  bool enabled = false;
+  // zlib compression level (0-9, or -1 for zlib's default) and memLevel (1-9)
+  // for outgoing messages. Lower values use less memory per connection.
+  int level = -1;
+  int mem_level = 8;
+  // Maximum LZ77 window sizes (9-15) for our side's compressor and for the
+  // peer's compressor. A window of N bits uses about 2^(N+1) bytes per
+  // direction per connection. The peer may request smaller windows.
+  uint8_t local_max_window_bits = 15;
+  uint8_t peer_max_window_bits = 15;
+  // Messages smaller than this are sent uncompressed.
+  size_t min_size = 64;
+  // Compressed messages that decompress to more than this are rejected.
+  size_t max_message_size = 64 * 1024 * 1024;
+  // If true, both sides are required to reset their compression state after
+  // each message (no_context_takeover), and all connections on a thread share
+  // the same zlib streams instead of each having their own. This keeps the
+  // per-connection memory cost near zero, at the expense of compression ratio
+  // for messages that repeat content from earlier messages.
+  bool share_contexts = false;
+};
+
+// Returns the value of the Sec-WebSocket-Extensions header that a client should
+// send to offer the permessage-deflate extension with the given options.
+std::string websocket_deflate_offer(const WebsocketDeflateOptions& options);
+
+// Parameters of a negotiated permessage-deflate extension.
+struct WebsocketDeflateParams {
+  bool server_no_context_takeover = false;
+  bool client_no_context_takeover = false;
+  uint8_t server_max_window_bits = 15;
+  uint8_t client_max_window_bits = 15;
+};
+
+// Chooses the first acceptable permessage-deflate offer from a client's
+// Sec-WebSocket-Extensions header. Returns false if there isn't one (or if
+// header is null); otherwise, fills in params and sets response_header to the
+// value to send in the response's Sec-WebSocket-Extensions header.
+bool negotiate_websocket_deflate(
+    const char* header,
+    const WebsocketDeflateOptions& options,
+    WebsocketDeflateParams* params,
+    std::string* response_header);
+
+// Parses the server's Sec-WebSocket-Extensions response header, after a client
+// sent the offer returned by websocket_deflate_offer. Returns false if the
+// server didn't accept the extension (or if header is null), and throws
+// runtime_error if the server's response isn't valid for the offer.
+bool parse_websocket_deflate_response(
+    const char* header,
+    const WebsocketDeflateOptions& options,
+    WebsocketDeflateParams* params);
+
+// Thrown by WebsocketDecoder when the peer violates the protocol. close_code is
+// the status code that the connection should be closed with (RFC 6455 section
+// 7.4.1).
+class WebsocketProtocolError : public std::runtime_error {
+public:
+  WebsocketProtocolError(const std::string& what, uint16_t close_code = 1002);
+  ~WebsocketProtocolError() = default;
+
+  uint16_t close_code;
+};
+
+// Compresses and decompresses messages for one websocket connection that uses
+// the permessage-deflate extension. The zlib streams are created when they're
+// first needed, so a connection that never sends (or never receives)
+// compressed messages doesn't allocate them.
+class WebsocketDeflateCodec {
+public:
+  WebsocketDeflateCodec(
+      bool is_server,
+      const WebsocketDeflateParams& params,
+      const WebsocketDeflateOptions& options);
+  WebsocketDeflateCodec(const WebsocketDeflateCodec&) = delete;
+  WebsocketDeflateCodec(WebsocketDeflateCodec&&) = delete;
+  WebsocketDeflateCodec& operator=(const WebsocketDeflateCodec&) = delete;
+  WebsocketDeflateCodec& operator=(WebsocketDeflateCodec&&) = delete;
+  ~WebsocketDeflateCodec();
+
+  // Returns true if a message of this size should be compressed.
+  bool should_compress(size_t size) const;
+
+  // Compresses a message's payload from src into dest, draining src.
+  void compress(Buffer& dest, Buffer& src);
+  // Decompresses a message's payload from src into dest, draining src. Throws
+  // WebsocketProtocolError if the data is invalid (close code 1007) or
+  // decompresses to more than max_message_size bytes (close code 1009).
+  void decompress(Buffer& dest, Buffer& src);
+
+private:
+  struct Stream {
+    z_stream z;
+    bool initialized;
+    bool is_deflate;
+    Stream(bool is_deflate);
+    ~Stream();
+  };
+
+  size_t min_size;
+  size_t max_message_size;
+  int level;
+  int mem_level;
+  int deflate_window_bits;
+  int inflate_window_bits;
+  bool deflate_no_context_takeover;
+  bool inflate_no_context_takeover;
+  bool share_contexts;
+  std::unique_ptr<Stream> own_deflater;
+  std::unique_ptr<Stream> own_inflater;
+
+  z_stream* get_deflater();
+  z_stream* get_inflater();
+};
+
+// Generates a random masking key for a frame sent by a client. This uses a
+// fast per-thread PRNG that's seeded from the system's random source.
+void generate_websocket_mask_key(uint8_t mask_key[4]);
+
+// Applies a websocket masking key to data in place. Since masking is an XOR,
+// this both masks and unmasks data. offset is the position of data[0] within
+// the frame's payload, so a payload that's split across several memory
+// segments can be processed one segment at a time. This uses SSE2 or NEON when
+// available, and AVX2 if the CPU supports it.
+void apply_websocket_mask(
+    void* data, size_t size, const uint8_t mask_key[4], size_t offset = 0);
+
+// Like apply_websocket_mask, but reads from src and writes the masked data to
+// dest instead of modifying it in place. dest and src must not overlap.
+void copy_with_websocket_mask(void* dest, const void* src, size_t size,
+    const uint8_t mask_key[4], size_t offset = 0);
+
+// Applies a websocket masking key to the first size bytes of buf in place,
+// without copying them out of the buffer. buf must contain at least size
+// bytes, and they must not be in reference or file segments (data that was
+// read from a socket into the buffer is always fine).
+void apply_websocket_mask(Buffer& buf, size_t size, const uint8_t mask_key[4]);
+
+struct WebsocketMessage {
+  uint8_t opcode;
+  std::string data;
+  WebsocketMessage();
+};
+
+// Appends a message's frames to frame, draining payload. If deflate is given
+// and the message is large enough, the payload is compressed (control frames
+// are never compressed). If mask is true, the payload is masked with a random
+// key, as is required for frames sent by clients; since the payload may refer
+// to memory owned by the caller, it's copied in this case rather than masked in
+// place. If max_frame_size is nonzero, data messages whose (compressed)
+// payload is larger than that are split into multiple frames. If frame_sizes
+// is not null, the size of each frame (including its header) is appended to it.
+void encode_websocket_message(
+    Buffer& frame,
+    Buffer& payload,
+    uint8_t opcode,
+    WebsocketDeflateCodec* deflate,
+    bool mask,
+    size_t max_frame_size = 0,
+    std::deque<size_t>* frame_sizes = nullptr);
+
+// Decodes websocket frames and reassembles fragmented messages. This doesn't do
+// any I/O; the caller reads data into a buffer and calls decode until it returns
+// a message. This is used for both sides of the connection.
+class WebsocketDecoder {
+public:
+  enum class Result {
+    // buf doesn't contain a complete frame; get_bytes_needed returns how many
+    // bytes it must contain before decode can make progress
+    NEED_MORE_DATA = 0,
+    // A control frame was decoded. Control frames can arrive in the middle of
+    // a fragmented message; decode should be called again after handling it.
+    CONTROL_FRAME,
+    // A complete data message was decoded
+    MESSAGE,
+  };
+
+  // is_server is true if this decodes frames sent by a client, which must all
+  // be masked; otherwise, frames must not be masked. If deflate is not null,
+  // messages with the RSV1 bit set are decompressed with it; otherwise, the
+  // RSV1 bit is a protocol error. Messages whose payloads add up to more than
+  // max_message_size bytes (before decompression; the codec limits their size
+  // after decompression) are rejected with close code 1009 as soon as the
+  // frame header that exceeds the limit arrives.
+  WebsocketDecoder(
+      Base& base,
+      bool is_server,
+      WebsocketDeflateCodec* deflate = nullptr,
+      size_t max_message_size = 64 * 1024 * 1024);
+  WebsocketDecoder(const WebsocketDecoder&) = delete;
+  WebsocketDecoder(WebsocketDecoder&&) = delete;
+  WebsocketDecoder& operator=(const WebsocketDecoder&) = delete;
+  WebsocketDecoder& operator=(WebsocketDecoder&&) = delete;
+  ~WebsocketDecoder() = default;
+
+  // Consumes complete frames from the beginning of buf until a control frame
+  // or the last frame of a message has been consumed, and returns it in msg.
+  // Data frames are unmasked in place and moved into an internal buffer until
+  // their message is complete, so fragmented messages are only copied once.
+  // Throws WebsocketProtocolError if the data violates the protocol.
+  Result decode(Buffer& buf, WebsocketMessage* msg);
+  size_t get_bytes_needed() const;
+
+private:
+  bool is_server;
+  WebsocketDeflateCodec* deflate;
+  size_t max_message_size;
+  Buffer msg_buf;
+  uint8_t msg_opcode;
+  bool msg_compressed;
+  size_t bytes_needed;
+};
+
+} // namespace EventAsync::HTTP
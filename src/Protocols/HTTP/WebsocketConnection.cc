@@ -0,0 +1,474 @@
+#include "WebsocketConnection.hh"
+
+#include <event2/bufferevent_ssl.h>
+#include <event2/http.h>
+#include <openssl/err.h>
+#include <string.h>
+#include <strings.h>
+
+#include <phosg/Hash.hh>
+#include <phosg/Strings.hh>
+#include <random>
+
+#include "Connection.hh"
+
+using namespace std;
+
+namespace EventAsync::HTTP {
+
+// Writers wait when the output buffer holds more than HIGH_WATERMARK bytes,
+// until it drains to LOW_WATERMARK bytes
+static constexpr size_t OUTPUT_HIGH_WATERMARK = 0x40000;
+static constexpr size_t OUTPUT_LOW_WATERMARK = 0x10000;
+// The connection stops reading from the socket when this much data is waiting
+// to be decoded (unless more is needed to complete the current frame)
+static constexpr size_t INPUT_HIGH_WATERMARK = 0x100000;
+static constexpr size_t MAX_HANDSHAKE_RESPONSE_SIZE = 0x10000;
+
+static struct bufferevent* create_bufferevent(Base& base, SSL* ssl) {
+  struct bufferevent* bev;
+  if (ssl) {
+    // bev takes ownership of ssl
+    bev = bufferevent_openssl_socket_new(
+        base.base,
+        -1, // fd
+        ssl,
+        BUFFEREVENT_SSL_CONNECTING,
+        BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    if (!bev) {
+      SSL_free(ssl);
+      throw runtime_error("failed to create ssl bufferevent");
+    }
+    bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+  } else {
+    bev = bufferevent_socket_new(
+        base.base, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    if (!bev) {
+      throw runtime_error("failed to create bufferevent");
+    }
+  }
+  return bev;
+}
+
+WebsocketConnection::WebsocketConnection(Base& base, SSL* ssl)
+    : base(base),
+      bev(create_bufferevent(base, ssl)),
+      input_buf(base, bufferevent_get_input(this->bev)),
+      max_message_size(64 * 1024 * 1024),
+      connected(false),
+      failed(false),
+      read_bytes_needed(0),
+      read_coro(nullptr),
+      write_threshold(OUTPUT_LOW_WATERMARK),
+      connect_coro(nullptr) {
+  bufferevent_setcb(this->bev,
+      &WebsocketConnection::on_read,
+      &WebsocketConnection::on_write,
+      &WebsocketConnection::on_event,
+      this);
+  bufferevent_setwatermark(this->bev, EV_READ, 0, INPUT_HIGH_WATERMARK);
+  bufferevent_setwatermark(this->bev, EV_WRITE, OUTPUT_LOW_WATERMARK, 0);
+  bufferevent_enable(this->bev, EV_READ | EV_WRITE);
+}
+
+WebsocketConnection::~WebsocketConnection() {
+  if (this->bev) {
+    bufferevent_free(this->bev);
+  }
+}
+
+Task<unique_ptr<WebsocketConnection>> WebsocketConnection::connect(
+    Base& base,
+    DNSBase& dns_base,
+    const string& url,
+    SSL_CTX* ssl_ctx,
+    const WebsocketDeflateOptions& deflate_options,
+    const unordered_map<string, string>& headers) {
+  unique_ptr<struct evhttp_uri, void (*)(struct evhttp_uri*)> uri(
+      evhttp_uri_parse(url.c_str()), evhttp_uri_free);
+  if (!uri) {
+    throw invalid_argument("invalid URL: " + url);
+  }
+
+  const char* scheme = evhttp_uri_get_scheme(uri.get());
+  bool use_ssl;
+  if (scheme && !strcasecmp(scheme, "ws")) {
+    use_ssl = false;
+  } else if (scheme && !strcasecmp(scheme, "wss")) {
+    use_ssl = true;
+    if (!ssl_ctx) {
+      throw invalid_argument("an SSL context is required for wss URLs");
+    }
+  } else {
+    throw invalid_argument("URL scheme must be ws or wss: " + url);
+  }
+
+  const char* host = evhttp_uri_get_host(uri.get());
+  if (!host || !*host) {
+    throw invalid_argument("URL has no host: " + url);
+  }
+  int port = evhttp_uri_get_port(uri.get());
+  if (port < 0) {
+    port = use_ssl ? 443 : 80;
+  }
+
+  const char* path = evhttp_uri_get_path(uri.get());
+  const char* query = evhttp_uri_get_query(uri.get());
+  string path_and_query = (path && *path) ? path : "/";
+  if (query) {
+    path_and_query += '?';
+    path_and_query += query;
+  }
+
+  SSL* ssl = use_ssl ? Connection::create_ssl(ssl_ctx, host, port) : nullptr;
+  unique_ptr<WebsocketConnection> conn(new WebsocketConnection(base, ssl));
+
+  // For TLS connections, this completes after the TLS handshake
+  if (bufferevent_socket_connect_hostname(
+          conn->bev, dns_base.dns_base, AF_UNSPEC, host, port)) {
+    throw runtime_error(string_printf("cannot connect to %s:%d", host, port));
+  }
+  co_await ConnectAwaiter(*conn);
+
+  co_await conn->handshake(
+      host, port, use_ssl, path_and_query, deflate_options, headers);
+  co_return std::move(conn);
+}
+
+Task<void> WebsocketConnection::handshake(
+    const string& host,
+    uint16_t port,
+    bool use_ssl,
+    const string& path_and_query,
+    const WebsocketDeflateOptions& deflate_options,
+    const unordered_map<string, string>& headers) {
+  string key_data(16, '\0');
+  random_device rd;
+  for (size_t z = 0; z < key_data.size(); z += 4) {
+    uint32_t v = rd();
+    memcpy(key_data.data() + z, &v, 4);
+  }
+  string key = base64_encode(key_data);
+
+  Buffer request_buf(this->base);
+  request_buf.add_printf("GET %s HTTP/1.1\r\n", path_and_query.c_str());
+  if (port == (use_ssl ? 443 : 80)) {
+    request_buf.add_printf("Host: %s\r\n", host.c_str());
+  } else {
+    request_buf.add_printf("Host: %s:%hu\r\n", host.c_str(), port);
+  }
+  request_buf.add_printf("Upgrade: websocket\r\n\
+Connection: Upgrade\r\n\
+Sec-WebSocket-Key: %s\r\n\
+Sec-WebSocket-Version: 13\r\n",
+      key.c_str());
+  if (deflate_options.enabled) {
+    request_buf.add_printf("Sec-WebSocket-Extensions: %s\r\n",
+        websocket_deflate_offer(deflate_options).c_str());
+  }
+  for (const auto& it : headers) {
+    request_buf.add_printf("%s: %s\r\n", it.first.c_str(), it.second.c_str());
+  }
+  request_buf.add("\r\n", 2);
+  if (bufferevent_write_buffer(this->bev, request_buf.buf)) {
+    throw runtime_error("cannot send websocket handshake");
+  }
+
+  // Wait for the end of the response headers. Anything after them is the
+  // beginning of the websocket stream, so it's left in input_buf.
+  struct evbuffer_ptr end_pos;
+  for (;;) {
+    end_pos = this->input_buf.search("\r\n\r\n", 4, nullptr);
+    if (end_pos.pos >= 0) {
+      break;
+    }
+    if (this->input_buf.get_length() > MAX_HANDSHAKE_RESPONSE_SIZE) {
+      throw runtime_error("websocket handshake response is too large");
+    }
+    co_await InputAwaiter(*this, this->input_buf.get_length() + 1);
+  }
+  string response = this->input_buf.remove(end_pos.pos + 2);
+  this->input_buf.drain(2);
+
+  // Header names are case-insensitive, so they're lowercased here; repeated
+  // headers are combined, as if they were sent as a comma-separated list
+  auto lines = split(response, '\n');
+  int status_code = 0;
+  if ((sscanf(lines[0].c_str(), "HTTP/1.%*d %d", &status_code) != 1) ||
+      (status_code != 101)) {
+    throw runtime_error("server did not accept websocket handshake: " +
+        lines[0].substr(0, lines[0].find('\r')));
+  }
+  unordered_map<string, string> response_headers;
+  for (size_t z = 1; z < lines.size(); z++) {
+    string& line = lines[z];
+    if (!line.empty() && (line.back() == '\r')) {
+      line.pop_back();
+    }
+    size_t colon_pos = line.find(':');
+    if (colon_pos == string::npos) {
+      continue;
+    }
+    string name = line.substr(0, colon_pos);
+    for (char& ch : name) {
+      ch = ::tolower(ch);
+    }
+    size_t value_pos = line.find_first_not_of(" \t", colon_pos + 1);
+    string value = (value_pos == string::npos) ? "" : line.substr(value_pos);
+    auto emplace_ret = response_headers.emplace(name, value);
+    if (!emplace_ret.second) {
+      emplace_ret.first->second += ", " + value;
+    }
+  }
+
+  auto upgrade_it = response_headers.find("upgrade");
+  if ((upgrade_it == response_headers.end()) ||
+      strcasecmp(upgrade_it->second.c_str(), "websocket")) {
+    throw runtime_error("server did not upgrade to websocket protocol");
+  }
+  string expected_accept = base64_encode(
+      sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+  auto accept_it = response_headers.find("sec-websocket-accept");
+  if ((accept_it == response_headers.end()) ||
+      (accept_it->second != expected_accept)) {
+    throw runtime_error("server sent an incorrect Sec-WebSocket-Accept header");
+  }
+
+  auto extensions_it = response_headers.find("sec-websocket-extensions");
+  if (extensions_it != response_headers.end()) {
+    WebsocketDeflateParams params;
+    if (!deflate_options.enabled ||
+        !parse_websocket_deflate_response(
+            extensions_it->second.c_str(), deflate_options, &params)) {
+      throw runtime_error("server accepted an extension that was not offered");
+    }
+    this->deflate = make_unique<WebsocketDeflateCodec>(
+        false, params, deflate_options);
+  }
+}
+
+Task<WebsocketConnection::WebsocketMessage> WebsocketConnection::read() {
+  // We automatically respond to control messages appropriately without
+  // returning to the calling coroutine.
+  WebsocketDecoder decoder(
+      this->base, false, this->deflate.get(), this->max_message_size);
+  for (;;) {
+    WebsocketMessage msg;
+    WebsocketDecoder::Result result = WebsocketDecoder::Result::NEED_MORE_DATA;
+    uint16_t close_code = 0;
+    string error;
+    try {
+      result = decoder.decode(this->input_buf, &msg);
+    } catch (const WebsocketProtocolError& e) {
+      close_code = e.close_code;
+      error = e.what();
+    }
+    if (close_code) {
+      // The connection is unusable after this, even if the close frame can't
+      // be sent
+      try {
+        co_await this->close(close_code);
+      } catch (const runtime_error&) { }
+      throw WebsocketProtocolError(error, close_code);
+    }
+
+    switch (result) {
+      case WebsocketDecoder::Result::NEED_MORE_DATA:
+        co_await InputAwaiter(*this, decoder.get_bytes_needed());
+        break;
+      case WebsocketDecoder::Result::CONTROL_FRAME:
+        if (msg.opcode == 0x0A) { // Ping response
+          // (Ignore these)
+        } else if (msg.opcode == 0x08) { // Close
+          co_await this->write(msg.data.data(), msg.data.size(), 0x08);
+          throw runtime_error("server has closed the connection");
+        } else if (msg.opcode == 0x09) { // Ping
+          co_await this->write(msg.data.data(), msg.data.size(), 0x0A);
+        } else {
+          throw runtime_error("unrecognized control message");
+        }
+        break;
+      case WebsocketDecoder::Result::MESSAGE:
+        co_return std::move(msg);
+    }
+  }
+}
+
+Task<void> WebsocketConnection::write(Buffer& buf, uint8_t opcode) {
+  this->check_failed();
+  Buffer frame(this->base);
+  encode_websocket_message(frame, buf, opcode, this->deflate.get(), true);
+  if (bufferevent_write_buffer(this->bev, frame.buf)) {
+    throw runtime_error("cannot write to websocket connection");
+  }
+  if (this->get_output_length() > OUTPUT_HIGH_WATERMARK) {
+    co_await OutputAwaiter(*this, OUTPUT_LOW_WATERMARK);
+  }
+}
+
+Task<void> WebsocketConnection::write(
+    const void* data, size_t size, uint8_t opcode) {
+  Buffer buf(this->base);
+  buf.add_reference(data, size);
+  co_await this->write(buf, opcode);
+}
+
+Task<void> WebsocketConnection::close(uint16_t status_code) {
+  if (!this->failed) {
+    uint8_t payload[2] = {
+        static_cast<uint8_t>(status_code >> 8),
+        static_cast<uint8_t>(status_code)};
+    co_await this->write(payload, sizeof(payload), 0x08);
+    co_await OutputAwaiter(*this, 0);
+  }
+  if (this->bev) {
+    bufferevent_free(this->bev);
+    this->bev = nullptr;
+  }
+  this->failed = true;
+  this->error_message = "connection has been closed";
+}
+
+bool WebsocketConnection::is_compressed() const {
+  return this->deflate.get() != nullptr;
+}
+
+void WebsocketConnection::set_max_message_size(size_t max_message_size) {
+  this->max_message_size = max_message_size;
+}
+
+size_t WebsocketConnection::get_output_length() const {
+  return evbuffer_get_length(bufferevent_get_output(this->bev));
+}
+
+void WebsocketConnection::check_failed() const {
+  if (this->failed) {
+    throw runtime_error(this->error_message);
+  }
+}
+
+void WebsocketConnection::resume_coro(coroutine_handle<>& coro) {
+  // bufferevent callbacks are deferred, but the resumed coroutine may destroy
+  // this object, so it's resumed on the next event loop iteration instead of
+  // from within the callback
+  if (coro) {
+    auto c = coro;
+    coro = nullptr;
+    this->base.once(-1, EV_TIMEOUT, [c](evutil_socket_t, short) {
+      c.resume();
+    }, 0);
+  }
+}
+
+void WebsocketConnection::on_read(struct bufferevent*, void* ctx) {
+  auto* c = reinterpret_cast<WebsocketConnection*>(ctx);
+  if (c->read_coro && (c->input_buf.get_length() >= c->read_bytes_needed)) {
+    c->resume_coro(c->read_coro);
+  }
+}
+
+void WebsocketConnection::on_write(struct bufferevent*, void* ctx) {
+  auto* c = reinterpret_cast<WebsocketConnection*>(ctx);
+  if (c->get_output_length() <= c->write_threshold) {
+    while (!c->write_coros.empty()) {
+      c->resume_coro(c->write_coros.front());
+      c->write_coros.pop_front();
+    }
+  }
+}
+
+void WebsocketConnection::on_event(struct bufferevent*, short what, void* ctx) {
+  auto* c = reinterpret_cast<WebsocketConnection*>(ctx);
+  if (what & BEV_EVENT_CONNECTED) {
+    c->connected = true;
+  } else if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
+    c->failed = true;
+    if (what & BEV_EVENT_EOF) {
+      c->error_message = "server has disconnected";
+    } else if (bufferevent_socket_get_dns_error(c->bev)) {
+      c->error_message = string("cannot resolve hostname: ") +
+          evutil_gai_strerror(bufferevent_socket_get_dns_error(c->bev));
+    } else if (unsigned long ssl_error = bufferevent_get_openssl_error(c->bev)) {
+      char ssl_error_str[256];
+      ERR_error_string_n(ssl_error, ssl_error_str, sizeof(ssl_error_str));
+      c->error_message = string("websocket connection failed: ") + ssl_error_str;
+    } else if (EVUTIL_SOCKET_ERROR()) {
+      c->error_message = string("websocket connection failed: ") +
+          evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR());
+    } else {
+      c->error_message = "websocket connection failed";
+    }
+    bufferevent_disable(c->bev, EV_READ | EV_WRITE);
+  } else {
+    return;
+  }
+  c->resume_coro(c->connect_coro);
+  c->resume_coro(c->read_coro);
+  while (!c->write_coros.empty()) {
+    c->resume_coro(c->write_coros.front());
+    c->write_coros.pop_front();
+  }
+}
+
+WebsocketConnection::InputAwaiter::InputAwaiter(
+    WebsocketConnection& conn, size_t size)
+    : conn(conn),
+      size(size) {}
+
+bool WebsocketConnection::InputAwaiter::await_ready() const {
+  return this->conn.failed || (this->conn.input_buf.get_length() >= this->size);
+}
+
+void WebsocketConnection::InputAwaiter::await_suspend(coroutine_handle<> coro) {
+  if (this->conn.read_coro) {
+    throw logic_error("multiple coroutines are reading from the same websocket");
+  }
+  this->conn.read_coro = coro;
+  this->conn.read_bytes_needed = this->size;
+  // Make sure the bufferevent doesn't stop reading before the frame is complete
+  bufferevent_setwatermark(this->conn.bev, EV_READ, 0,
+      max<size_t>(this->size, INPUT_HIGH_WATERMARK));
+}
+
+void WebsocketConnection::InputAwaiter::await_resume() {
+  // Data that was received before the connection failed can still be read
+  if (this->conn.input_buf.get_length() < this->size) {
+    this->conn.check_failed();
+  }
+}
+
+WebsocketConnection::OutputAwaiter::OutputAwaiter(
+    WebsocketConnection& conn, size_t threshold)
+    : conn(conn),
+      threshold(threshold) {}
+
+bool WebsocketConnection::OutputAwaiter::await_ready() const {
+  return this->conn.failed || (this->conn.get_output_length() <= this->threshold);
+}
+
+void WebsocketConnection::OutputAwaiter::await_suspend(coroutine_handle<> coro) {
+  this->conn.write_threshold = this->threshold;
+  bufferevent_setwatermark(this->conn.bev, EV_WRITE, this->threshold, 0);
+  this->conn.write_coros.emplace_back(coro);
+}
+
+void WebsocketConnection::OutputAwaiter::await_resume() {
+  this->conn.check_failed();
+}
+
+WebsocketConnection::ConnectAwaiter::ConnectAwaiter(WebsocketConnection& conn)
+    : conn(conn) {}
+
+bool WebsocketConnection::ConnectAwaiter::await_ready() const {
+  return this->conn.connected || this->conn.failed;
+}
+
+void WebsocketConnection::ConnectAwaiter::await_suspend(coroutine_handle<> coro) {
+  this->conn.connect_coro = coro;
+}
+
+void WebsocketConnection::ConnectAwaiter::await_resume() {
+  this->conn.check_failed();
+}
+
+} // namespace EventAsync::HTTP
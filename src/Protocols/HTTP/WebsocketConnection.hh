@@ -0,0 +1,150 @@
+#pragma once
+
+#include <event2/bufferevent.h>
+#include <openssl/ssl.h>
+#include <stdint.h>
+
+#include <coroutine>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "../../Base.hh"
+#include "../../Buffer.hh"
+#include "../../DNSBase.hh"
+#include "../../Task.hh"
+#include "Websocket.hh"
+
+namespace EventAsync::HTTP {
+
+// An outbound websocket connection. The connection runs on a Base like any
+// other socket, and uses the same frame encoding and decoding code as
+// Server::WebsocketClient. TLS connections (wss:// URLs) are set up the same
+// way as for Connection, including hostname verification and session
+// resumption.
+class WebsocketConnection {
+public:
+  using WebsocketMessage = HTTP::WebsocketMessage;
+
+  WebsocketConnection(const WebsocketConnection&) = delete;
+  WebsocketConnection(WebsocketConnection&&) = delete;
+  WebsocketConnection& operator=(const WebsocketConnection&) = delete;
+  WebsocketConnection& operator=(WebsocketConnection&&) = delete;
+  ~WebsocketConnection();
+
+  // Connects to a websocket server and performs the opening handshake. url's
+  // scheme must be ws or wss; for wss, ssl_ctx must not be null (see
+  // Connection::create_default_ssl_ctx). headers are added to the handshake
+  // request (for example, Origin or Authorization). If deflate_options.enabled
+  // is true, the permessage-deflate extension is offered to the server. Throws
+  // runtime_error if the connection or the handshake fails.
+  static Task<std::unique_ptr<WebsocketConnection>> connect(
+      Base& base,
+      DNSBase& dns_base,
+      const std::string& url,
+      SSL_CTX* ssl_ctx = nullptr,
+      const WebsocketDeflateOptions& deflate_options = WebsocketDeflateOptions(),
+      const std::unordered_map<std::string, std::string>& headers = {});
+
+  // Waits for and returns a complete message from the server. Pings are
+  // answered automatically and pongs are ignored. Throws runtime_error if the
+  // server closes the connection or the connection fails. If the server
+  // violates the protocol, this closes the connection with the appropriate
+  // status code and throws WebsocketProtocolError. Only one coroutine may call
+  // read at a time.
+  Task<WebsocketMessage> read();
+
+  // Sends a message to the server. The frame is added to the connection's
+  // output buffer, and this returns immediately unless that buffer is above
+  // its high watermark, in which case it first waits for it to drain. Throws
+  // runtime_error if the connection has failed.
+  Task<void> write(Buffer& buf, uint8_t opcode = 0x01);
+  Task<void> write(const void* data, size_t size, uint8_t opcode = 0x01);
+
+  // Sends a close frame with the given status code, waits for all queued data
+  // to be sent, and closes the connection. The object can't be used for
+  // anything else after this.
+  Task<void> close(uint16_t status_code = 1000);
+
+  // Returns true if the permessage-deflate extension was negotiated.
+  bool is_compressed() const;
+
+  // Sets the largest message that read will accept (64MB by default). If the
+  // server sends a larger one, read closes the connection with status 1009
+  // and throws WebsocketProtocolError.
+  void set_max_message_size(size_t max_message_size);
+
+  Base& base;
+
+protected:
+  struct bufferevent* bev;
+  Buffer input_buf;
+  std::unique_ptr<WebsocketDeflateCodec> deflate;
+  size_t max_message_size;
+  bool connected;
+  bool failed;
+  std::string error_message;
+
+  // The reader waits for input_buf to contain at least read_bytes_needed
+  // bytes; writers wait for the output buffer to drain to write_threshold
+  // bytes or less
+  size_t read_bytes_needed;
+  std::coroutine_handle<> read_coro;
+  size_t write_threshold;
+  std::deque<std::coroutine_handle<>> write_coros;
+  std::coroutine_handle<> connect_coro;
+
+  WebsocketConnection(Base& base, SSL* ssl);
+
+  class InputAwaiter {
+  public:
+    InputAwaiter(WebsocketConnection& conn, size_t size);
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> coro);
+    void await_resume();
+
+  private:
+    WebsocketConnection& conn;
+    size_t size;
+  };
+  class OutputAwaiter {
+  public:
+    OutputAwaiter(WebsocketConnection& conn, size_t threshold);
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> coro);
+    void await_resume();
+
+  private:
+    WebsocketConnection& conn;
+    size_t threshold;
+  };
+  class ConnectAwaiter {
+  public:
+    explicit ConnectAwaiter(WebsocketConnection& conn);
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> coro);
+    void await_resume();
+
+  private:
+    WebsocketConnection& conn;
+  };
+
+  size_t get_output_length() const;
+  void check_failed() const;
+  void resume_coro(std::coroutine_handle<>& coro);
+
+  Task<void> handshake(
+      const std::string& host,
+      uint16_t port,
+      bool use_ssl,
+      const std::string& path_and_query,
+      const WebsocketDeflateOptions& deflate_options,
+      const std::unordered_map<std::string, std::string>& headers);
+
+  static void on_read(struct bufferevent* bev, void* ctx);
+  static void on_write(struct bufferevent* bev, void* ctx);
+  static void on_event(struct bufferevent* bev, short what, void* ctx);
+};
+
+} // namespace EventAsync::HTTP
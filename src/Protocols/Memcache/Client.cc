@@ -10,8 +10,10 @@ using namespace std;
 
 namespace EventAsync::Memcache {
 
-Client::Client(Base& base, const char* hostname, uint16_t port)
+Client::Client(
+    Base& base, const char* hostname, uint16_t port, DNSBase* dns_base)
     : base(base),
+      dns_base(dns_base),
       hostname(hostname),
       port(port),
       fd(-1) {}
@@ -20,7 +22,12 @@ Task<void> Client::connect() {
   if (this->fd.is_open()) {
     co_return;
   }
-  this->fd = co_await this->base.connect(this->hostname, this->port);
+  if (this->dns_base) {
+    this->fd = co_await this->base.connect(
+        *this->dns_base, this->hostname, this->port);
+  } else {
+    this->fd = co_await this->base.connect(this->hostname, this->port);
+  }
 }
 
 Task<void> Client::quit() {
@@ -4,6 +4,7 @@
 
 #include "../../Base.hh"
 #include "../../Buffer.hh"
+#include "../../DNSBase.hh"
 #include "../../Task.hh"
 #include <phosg/Filesystem.hh>
 #include <string>
@@ -16,7 +17,14 @@ namespace EventAsync::Memcache {
 
 class Client {
 public:
-  Client(Base& base, const char* hostname, uint16_t port);
+  // If dns_base is given, hostname is resolved with it when connecting;
+  // otherwise, the lookup blocks the event loop. dns_base must outlive the
+  // Client.
+  Client(
+      Base& base,
+      const char* hostname,
+      uint16_t port,
+      DNSBase* dns_base = nullptr);
   ~Client() = default;
 
   // Opens the connection. After constructing a Client object, you must
@@ -113,6 +121,7 @@ public:
 
 private:
   Base& base;
+  DNSBase* dns_base;
   std::string hostname;
   uint16_t port;
 
@@ -0,0 +1,244 @@
+#include "BinlogCheckpointer.hh"
+
+#include <errno.h>
+#include <event2/util.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+namespace EventAsync::MySQL {
+
+BinlogCheckpointer::BinlogCheckpointer(
+    Base& base,
+    BinlogProcessor& proc,
+    const string& filename,
+    size_t max_batch_transactions,
+    uint64_t max_batch_usecs)
+    : base(base),
+      proc(proc),
+      filename(filename),
+      temp_filename(filename + ".tmp"),
+      max_batch_transactions(max_batch_transactions),
+      max_batch_usecs(max_batch_usecs),
+      pending_transactions(0),
+      unqueued_transactions(0),
+      timer_pending(false),
+      flush_soon_pending(false),
+      batch_timer(base, max_batch_usecs, &BinlogCheckpointer::dispatch_start_write, this),
+      flush_soon_event(base, 0, &BinlogCheckpointer::dispatch_start_write, this),
+      flush_count(0),
+      write_in_progress(false),
+      writer_thread_should_exit(false) {
+  if (this->proc.checkpointer) {
+    throw logic_error("BinlogProcessor already has a checkpointer");
+  }
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, this->notify_fds)) {
+    throw runtime_error("cannot create notify socket: " + string_for_error(errno));
+  }
+  for (evutil_socket_t fd : this->notify_fds) {
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+  }
+  this->notify_event = Event(this->base, this->notify_fds[0], EV_READ | EV_PERSIST,
+      &BinlogCheckpointer::dispatch_on_write_completed, this);
+  this->notify_event.add();
+  this->writer_thread = thread(&BinlogCheckpointer::writer_thread_fn, this);
+  this->proc.checkpointer = this;
+}
+
+BinlogCheckpointer::~BinlogCheckpointer() {
+  this->proc.checkpointer = nullptr;
+  {
+    lock_guard<mutex> g(this->lock);
+    this->writer_thread_should_exit = true;
+  }
+  this->write_queued_cv.notify_all();
+  this->writer_thread.join();
+  this->notify_event.del();
+  evutil_closesocket(this->notify_fds[0]);
+  evutil_closesocket(this->notify_fds[1]);
+}
+
+optional<BinlogCheckpoint> BinlogCheckpointer::load(const string& filename) {
+  if (!isfile(filename)) {
+    return nullopt;
+  }
+
+  auto lines = split(load_file(filename), '\n');
+  if (lines.size() < 3) {
+    throw runtime_error("checkpoint file is incomplete: " + filename);
+  }
+  BinlogCheckpoint ret;
+  ret.filename = lines[0];
+  ret.position = stoull(lines[1], nullptr, 10);
+  ret.executed_gtids = GTIDSet(lines[2]);
+  return ret;
+}
+
+void BinlogCheckpointer::on_transaction_committed() {
+  this->pending_transactions++;
+  this->unqueued_transactions++;
+  if (this->unqueued_transactions >= this->max_batch_transactions) {
+    // Don't start the write in the middle of the caller's event processing;
+    // do it on the next event loop iteration instead
+    if (!this->flush_soon_pending) {
+      this->flush_soon_event.add();
+      this->flush_soon_pending = true;
+    }
+  } else if (!this->timer_pending) {
+    this->batch_timer.add();
+    this->timer_pending = true;
+  }
+}
+
+void BinlogCheckpointer::dispatch_start_write(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<BinlogCheckpointer*>(ctx)->start_write();
+}
+
+void BinlogCheckpointer::start_write() {
+  if (this->timer_pending) {
+    this->batch_timer.del();
+    this->timer_pending = false;
+  }
+  if (this->flush_soon_pending) {
+    this->flush_soon_event.del();
+    this->flush_soon_pending = false;
+  }
+  if (this->unqueued_transactions == 0) {
+    return;
+  }
+
+  const auto& checkpoint = this->proc.get_committed_checkpoint();
+  string gtids_str = checkpoint.executed_gtids.str();
+  Write w{
+      string_printf("%s\n%" PRIu64 "\n%s\n",
+          checkpoint.filename.c_str(), checkpoint.position, gtids_str.c_str()),
+      this->unqueued_transactions};
+  this->unqueued_transactions = 0;
+  {
+    lock_guard<mutex> g(this->lock);
+    if (this->queued_write) {
+      w.num_transactions += this->queued_write->num_transactions;
+    }
+    this->queued_write = std::move(w);
+  }
+  this->write_queued_cv.notify_one();
+}
+
+void BinlogCheckpointer::dispatch_on_write_completed(evutil_socket_t fd, short, void* ctx) {
+  char buf[64];
+  while (::read(fd, buf, sizeof(buf)) > 0) {
+  }
+  reinterpret_cast<BinlogCheckpointer*>(ctx)->collect_completed_writes();
+}
+
+void BinlogCheckpointer::collect_completed_writes() {
+  vector<CompletedWrite> writes;
+  {
+    lock_guard<mutex> g(this->lock);
+    writes.swap(this->completed_writes);
+  }
+  for (auto& w : writes) {
+    this->flush_error = std::move(w.error);
+    if (this->flush_error.empty()) {
+      this->pending_transactions -= w.num_transactions;
+      this->flush_count++;
+    } else {
+      // The transactions go back into the next write, which is retried later
+      this->unqueued_transactions += w.num_transactions;
+      if (!this->timer_pending && !this->flush_soon_pending) {
+        this->batch_timer.add();
+        this->timer_pending = true;
+      }
+    }
+  }
+}
+
+void BinlogCheckpointer::flush() {
+  this->collect_completed_writes();
+  this->start_write();
+  {
+    unique_lock<mutex> g(this->lock);
+    this->write_completed_cv.wait(g, [this]() {
+      return !this->queued_write && !this->write_in_progress;
+    });
+  }
+  this->collect_completed_writes();
+  if (!this->flush_error.empty()) {
+    throw runtime_error(this->flush_error);
+  }
+}
+
+void BinlogCheckpointer::writer_thread_fn() {
+  unique_lock<mutex> g(this->lock);
+  for (;;) {
+    this->write_queued_cv.wait(g, [this]() {
+      return this->writer_thread_should_exit || this->queued_write;
+    });
+    // Writes that were already started are completed before exiting
+    if (!this->queued_write) {
+      return;
+    }
+    Write w = std::move(*this->queued_write);
+    this->queued_write.reset();
+    this->write_in_progress = true;
+
+    g.unlock();
+    string error;
+    try {
+      this->write_file(w.data);
+    } catch (const exception& e) {
+      error = e.what();
+    }
+    g.lock();
+
+    this->write_in_progress = false;
+    this->completed_writes.emplace_back(CompletedWrite{w.num_transactions, std::move(error)});
+    this->write_completed_cv.notify_all();
+    // If the socket is full, the event loop hasn't read the earlier
+    // notifications yet, and will collect this write along with them
+    char ch = 0;
+    (void)!::write(this->notify_fds[1], &ch, 1);
+  }
+}
+
+void BinlogCheckpointer::write_file(const string& data) const {
+  {
+    scoped_fd fd(::open(this->temp_filename.c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd.is_open()) {
+      throw runtime_error("cannot open checkpoint file: " + string_for_error(errno));
+    }
+    for (size_t offset = 0; offset < data.size();) {
+      ssize_t bytes_written = ::write(fd, data.data() + offset, data.size() - offset);
+      if (bytes_written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw runtime_error("cannot write checkpoint file: " + string_for_error(errno));
+      }
+      offset += bytes_written;
+    }
+    if (fsync(fd)) {
+      throw runtime_error("cannot sync checkpoint file: " + string_for_error(errno));
+    }
+  }
+  if (::rename(this->temp_filename.c_str(), this->filename.c_str())) {
+    throw runtime_error("cannot rename checkpoint file: " + string_for_error(errno));
+  }
+}
+
+uint64_t BinlogCheckpointer::get_flush_count() const {
+  return this->flush_count;
+}
+
+const string& BinlogCheckpointer::last_flush_error() const {
+  return this->flush_error;
+}
+
+} // namespace EventAsync::MySQL
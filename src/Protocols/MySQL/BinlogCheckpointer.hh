@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../Base.hh"
+#include "../../Event.hh"
+#include "BinlogProcessor.hh"
+
+namespace EventAsync::MySQL {
+
+// Durably records the committed position of a BinlogProcessor in a file, so a
+// binlog reader can resume exactly where it left off after a crash or restart.
+//
+// The checkpoint is not written on every commit. Instead, a write is started
+// after max_batch_transactions transactions have committed, or max_batch_usecs
+// after the first unwritten commit, whichever happens first. Each write goes to
+// a temporary file which is fsynced and then renamed over the checkpoint file,
+// so the file always contains a complete checkpoint even if the process dies
+// mid-write. These writes happen on a thread owned by the checkpointer, so the
+// event loop isn't blocked while the file is synced; if a write fails, it's
+// retried after max_batch_usecs, and the error is available from
+// last_flush_error().
+//
+// Only the state as of the last fully committed transaction is ever written, so
+// resuming from the checkpoint never replays part of a transaction. Events
+// after the last completed write may be seen again after a crash; call flush()
+// before a clean shutdown to avoid this.
+class BinlogCheckpointer {
+public:
+  BinlogCheckpointer(
+      Base& base,
+      BinlogProcessor& proc,
+      const std::string& filename,
+      size_t max_batch_transactions = 1000,
+      uint64_t max_batch_usecs = 1000000);
+  BinlogCheckpointer(const BinlogCheckpointer&) = delete;
+  BinlogCheckpointer(BinlogCheckpointer&&) = delete;
+  BinlogCheckpointer& operator=(const BinlogCheckpointer&) = delete;
+  BinlogCheckpointer& operator=(BinlogCheckpointer&&) = delete;
+  // Waits for any write that's already been started to complete.
+  ~BinlogCheckpointer();
+
+  // Reads a checkpoint file. Returns nullopt if the file does not exist.
+  static std::optional<BinlogCheckpoint> load(const std::string& filename);
+
+  // Writes the processor's committed state to the file, if any transactions
+  // have committed since the last write, and waits for the write (and any
+  // write already in progress) to complete. Unlike the batched writes, this
+  // blocks the calling thread. Throws runtime_error if the write fails.
+  void flush();
+
+  // Returns the number of times the checkpoint file has been written.
+  uint64_t get_flush_count() const;
+  // Returns the error from the most recent write, or an empty string if it
+  // succeeded (or there haven't been any writes).
+  const std::string& last_flush_error() const;
+
+protected:
+  friend class BinlogProcessor;
+
+  Base& base;
+  BinlogProcessor& proc;
+  std::string filename;
+  std::string temp_filename;
+  size_t max_batch_transactions;
+  uint64_t max_batch_usecs;
+
+  // pending_transactions counts transactions that aren't in a completed write;
+  // unqueued_transactions counts those that aren't in any write yet (a write
+  // may be in progress for the others)
+  size_t pending_transactions;
+  size_t unqueued_transactions;
+  bool timer_pending;
+  bool flush_soon_pending;
+  TimeoutEvent batch_timer;
+  TimeoutEvent flush_soon_event;
+  uint64_t flush_count;
+  std::string flush_error;
+
+  struct Write {
+    std::string data;
+    size_t num_transactions;
+  };
+  struct CompletedWrite {
+    size_t num_transactions;
+    std::string error; // empty if the write succeeded
+  };
+
+  // The writer thread writes one checkpoint at a time. If a write is started
+  // while another one is queued, the newer checkpoint replaces the queued one,
+  // since it includes all of the same transactions. Completed writes are
+  // reported to the event loop through a socket pair (notify_fds), since
+  // libevent's own cross-thread notifications require evthread locking.
+  std::mutex lock;
+  std::condition_variable write_queued_cv;
+  std::condition_variable write_completed_cv;
+  std::optional<Write> queued_write;
+  bool write_in_progress;
+  std::vector<CompletedWrite> completed_writes;
+  bool writer_thread_should_exit;
+  evutil_socket_t notify_fds[2];
+  Event notify_event;
+  std::thread writer_thread;
+
+  void on_transaction_committed();
+  void start_write();
+  void collect_completed_writes();
+  void writer_thread_fn();
+  void write_file(const std::string& data) const;
+  static void dispatch_start_write(evutil_socket_t fd, short what, void* ctx);
+  static void dispatch_on_write_completed(evutil_socket_t fd, short what, void* ctx);
+};
+
+} // namespace EventAsync::MySQL
@@ -1,13 +1,16 @@
 #include "BinlogProcessor.hh"
 
+#include <ctype.h>
 #include <event2/buffer.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #include <phosg/Hash.hh>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
 
+#include "BinlogCheckpointer.hh"
 #include "ProtocolBuffer.hh"
 
 using namespace std;
@@ -87,8 +90,19 @@ uint32_t BinlogProcessor::read_datetime_fractional_part(
   }
 }
 
-Value BinlogProcessor::read_cell_data(
-    StringReader& r, const BinlogTableInfo::ColumnInfo& ci) {
+// Returns a view of the next size bytes of data (which r must be reading) and
+// advances r past them.
+static string_view get_view(StringReader& r, const string& data, size_t size) {
+  if (r.remaining() < size) {
+    throw out_of_range("end of string");
+  }
+  string_view ret(data.data() + r.where(), size);
+  r.skip(size);
+  return ret;
+}
+
+ValueRef BinlogProcessor::read_cell_data(
+    StringReader& r, const string& data, const BinlogTableInfo::ColumnInfo& ci) {
   switch (ci.type) {
     case ColumnType::T_NULL:
       return nullptr;
@@ -134,7 +148,7 @@ Value BinlogProcessor::read_cell_data(
         default:
           throw runtime_error("invalid blob-type meta-length");
       }
-      return r.read(size);
+      return get_view(r, data, size);
     }
 
     case ColumnType::T_YEAR:
@@ -148,16 +162,16 @@ Value BinlogProcessor::read_cell_data(
       }
       uint8_t subtype = ci.type_meta[0];
       if (subtype == ColumnType::T_SET || subtype == ColumnType::T_ENUM) {
-        return r.read(ci.type_meta[1]);
+        return get_view(r, data, ci.type_meta[1]);
       } else {
         // Someone working the MySQL server was too clever for their own good here
         uint16_t max_display_width =
             (((static_cast<uint16_t>(ci.type_meta[0]) << 4) & 0x300) ^ 0x300) +
             static_cast<uint8_t>(ci.type_meta[1]);
         if (max_display_width > 255) {
-          return r.read(r.get_u16l());
+          return get_view(r, data, r.get_u16l());
         } else {
-          return r.read(r.get_u8());
+          return get_view(r, data, r.get_u8());
         }
       }
     }
@@ -167,9 +181,9 @@ Value BinlogProcessor::read_cell_data(
         throw runtime_error("invalid type options");
       }
       if (*reinterpret_cast<const uint16_t*>(ci.type_meta.data()) > 255) {
-        return r.read(r.get_u16l());
+        return get_view(r, data, r.get_u16l());
       } else {
-        return r.read(r.get_u8());
+        return get_view(r, data, r.get_u8());
       }
     }
 
@@ -304,31 +318,75 @@ size_t BinlogProcessor::metadata_bytes_for_column_type(uint8_t type) {
   }
 }
 
-vector<Value> BinlogProcessor::read_row_data(
-    ProtocolStringReader& r, shared_ptr<const BinlogTableInfo> ti) {
-  vector<bool> columns_null = r.get_bitmask(ti->columns.size());
-  vector<Value> row;
-  for (size_t column_index = 0;
-       column_index < ti->columns.size();
-       column_index++) {
-    const auto& ci = ti->columns[column_index];
-    if (columns_null[column_index]) {
+void BinlogProcessor::read_row_data(
+    vector<ValueRef>& cells,
+    ProtocolStringReader& r,
+    const string& data,
+    const BinlogTableInfo& ti) {
+  size_t num_columns = ti.columns.size();
+  string_view null_bitmap = get_view(r, data, (num_columns + 7) / 8);
+  for (size_t column_index = 0; column_index < num_columns; column_index++) {
+    const auto& ci = ti.columns[column_index];
+    if ((null_bitmap[column_index >> 3] >> (column_index & 7)) & 1) {
       if (!ci.nullable) {
         throw runtime_error("found null value in non-nullable column");
       }
-      row.emplace_back(nullptr);
+      cells.emplace_back(nullptr);
     } else {
-      row.emplace_back(read_cell_data(r, ci));
+      cells.emplace_back(read_cell_data(r, data, ci));
     }
   }
-  if (row.size() != ti->columns.size()) {
-    throw runtime_error("row1 length does not match column count");
-  }
-  return row;
 }
 
+BinlogCheckpoint::BinlogCheckpoint() : filename("<missing-filename>"),
+                                       position(4) {}
+
 BinlogProcessor::BinlogProcessor() : filename("<missing-filename>"),
-                                     position(4) {}
+                                     position(4),
+                                     in_transaction(false),
+                                     has_pending_gtid(false),
+                                     pending_gtid_gno(0),
+                                     committed_transaction_count(0),
+                                     checkpointer(nullptr) {}
+
+const string& BinlogProcessor::get_filename() const {
+  return this->filename;
+}
+
+uint64_t BinlogProcessor::get_position() const {
+  return this->position;
+}
+
+const BinlogCheckpoint& BinlogProcessor::get_committed_checkpoint() const {
+  return this->committed;
+}
+
+uint64_t BinlogProcessor::get_committed_transaction_count() const {
+  return this->committed_transaction_count;
+}
+
+void BinlogProcessor::set_checkpoint(const BinlogCheckpoint& checkpoint) {
+  this->committed = checkpoint;
+  this->filename = checkpoint.filename;
+  this->position = checkpoint.position;
+  this->in_transaction = false;
+  this->has_pending_gtid = false;
+}
+
+void BinlogProcessor::commit_transaction() {
+  if (this->has_pending_gtid) {
+    this->committed.executed_gtids.add(
+        this->pending_gtid_sid, this->pending_gtid_gno);
+    this->has_pending_gtid = false;
+  }
+  this->in_transaction = false;
+  this->committed.filename = this->filename;
+  this->committed.position = this->position;
+  this->committed_transaction_count++;
+  if (this->checkpointer) {
+    this->checkpointer->on_transaction_committed();
+  }
+}
 
 const BinlogEventHeader* BinlogProcessor::get_event_header(const string& data) {
   if (data.size() < sizeof(BinlogEventHeader)) {
@@ -390,9 +448,11 @@ BinlogTableMapEvent BinlogProcessor::parse_table_map_event(const string& data) {
   return ev;
 }
 
-BinlogRowsEvent BinlogProcessor::parse_rows_event(const string& data) {
-  BinlogRowsEvent ev;
-  ProtocolStringReader r(data);
+bool BinlogProcessor::parse_rows_event_header(
+    BinlogRowsEventBase& ev,
+    ProtocolStringReader& r,
+    const string& data,
+    string_view* extra_data) {
   ev.header = r.get<BinlogEventHeader>();
 
   bool is_v2 =
@@ -426,7 +486,9 @@ BinlogRowsEvent BinlogProcessor::parse_rows_event(const string& data) {
   ev.ti = this->table_map.at(ev.table_id);
   ev.flags = r.get_u16l(); // flags
   if (is_v2) {
-    ev.extra_data = r.read(r.get_u16l() - 2);
+    *extra_data = get_view(r, data, r.get_u16l() - 2);
+  } else {
+    *extra_data = string_view();
   }
   uint64_t num_columns = r.get_varint();
   if (num_columns != ev.ti->columns.size()) {
@@ -434,33 +496,58 @@ BinlogRowsEvent BinlogProcessor::parse_rows_event(const string& data) {
   }
 
   // TODO: do we need to support the case where some columns aren't present?
+  size_t bitmask_bytes = (num_columns + 7) / 8;
   for (size_t x = 0; x < static_cast<size_t>(1 + has_preimage); x++) {
-    for (bool p : r.get_bitmask(num_columns)) {
-      if (!p) {
+    string_view present_bitmap = get_view(r, data, bitmask_bytes);
+    for (size_t z = 0; z < num_columns; z++) {
+      if (!((present_bitmap[z >> 3] >> (z & 7)) & 1)) {
         throw runtime_error("one or more columns not present in row event");
       }
     }
   }
 
+  return has_preimage;
+}
+
+BinlogRowsEvent BinlogProcessor::parse_rows_event(const string& data) {
+  BinlogRowsEvent ev;
+  ProtocolStringReader r(data);
+  string_view extra_data;
+  bool has_preimage = this->parse_rows_event_header(ev, r, data, &extra_data);
+  ev.extra_data = extra_data;
+
+  // Rows are decoded into views first, then copied into owned values
+  vector<ValueRef> cells;
+  auto read_row = [&]() -> vector<Value> {
+    cells.clear();
+    this->read_row_data(cells, r, data, *ev.ti);
+    vector<Value> row;
+    row.reserve(cells.size());
+    for (const auto& cell : cells) {
+      row.emplace_back(to_value(cell));
+    }
+    return row;
+  };
+
   while (!r.eof()) {
     auto& rc = ev.rows.emplace_back();
     size_t start_offset = r.where();
     switch (ev.write_type) {
       case BinlogRowsEvent::WriteType::INSERT:
-        rc.post = this->read_row_data(r, ev.ti);
+        rc.post = read_row();
         rc.post_bytes = r.where() - start_offset;
         break;
       case BinlogRowsEvent::WriteType::UPDATE:
         if (has_preimage) {
-          rc.pre = this->read_row_data(r, ev.ti);
+          rc.pre = read_row();
           rc.pre_bytes = r.where() - start_offset;
           start_offset = r.where();
         }
-        rc.post = this->read_row_data(r, ev.ti);
+        rc.post = read_row();
         rc.post_bytes = r.where() - start_offset;
         break;
       case BinlogRowsEvent::WriteType::DELETE:
-        rc.pre = this->read_row_data(r, ev.ti);
+        rc.pre = read_row();
         rc.pre_bytes = r.where() - start_offset;
         break;
     }
@@ -470,6 +557,66 @@ BinlogRowsEvent BinlogProcessor::parse_rows_event(const string& data) {
   return ev;
 }
 
+void BinlogProcessor::parse_rows_event_view(
+    string&& data, BinlogRowsEventView& ev) {
+  // Clear the previous event's contents, but keep the arrays' capacity
+  ev.rows.clear();
+  ev.cells.clear();
+  ev.data = std::move(data);
+
+  ProtocolStringReader r(ev.data);
+  bool has_preimage = this->parse_rows_event_header(ev, r, ev.data, &ev.extra_data);
+
+  // The cells array may be reallocated as rows are added, so we record each
+  // row's position in the array first and create the spans at the end
+  size_t num_columns = ev.ti->columns.size();
+  auto& offsets = this->row_cell_offsets;
+  offsets.clear();
+
+  while (!r.eof()) {
+    auto& rc = ev.rows.emplace_back();
+    rc.pre_bytes = 0;
+    rc.post_bytes = 0;
+    auto& ro = offsets.emplace_back(string::npos, string::npos);
+    size_t start_offset = r.where();
+    if ((ev.write_type == BinlogRowsEvent::WriteType::DELETE) || has_preimage) {
+      ro.first = ev.cells.size();
+      this->read_row_data(ev.cells, r, ev.data, *ev.ti);
+      rc.pre_bytes = r.where() - start_offset;
+      start_offset = r.where();
+    }
+    if (ev.write_type != BinlogRowsEvent::WriteType::DELETE) {
+      ro.second = ev.cells.size();
+      this->read_row_data(ev.cells, r, ev.data, *ev.ti);
+      rc.post_bytes = r.where() - start_offset;
+    }
+  }
+
+  span<const ValueRef> all_cells(ev.cells);
+  for (size_t x = 0; x < ev.rows.size(); x++) {
+    auto& rc = ev.rows[x];
+    const auto& ro = offsets[x];
+    rc.pre = (ro.first == string::npos)
+        ? span<const ValueRef>()
+        : all_cells.subspan(ro.first, num_columns);
+    rc.post = (ro.second == string::npos)
+        ? span<const ValueRef>()
+        : all_cells.subspan(ro.second, num_columns);
+  }
+
+  this->position = ev.header.end_position;
+}
+
+// Returns true if query begins with the given keywords (which must be in
+// uppercase), followed by the end of the query or by whitespace. Keywords are
+// case-insensitive in SQL, so "xa start" matches "XA START" too.
+static bool query_starts_with(const string& query, const char* keywords) {
+  size_t keywords_size = strlen(keywords);
+  return (query.size() >= keywords_size) &&
+      !strncasecmp(query.data(), keywords, keywords_size) &&
+      ((query.size() == keywords_size) || isspace(query[keywords_size]));
+}
+
 BinlogQueryEvent BinlogProcessor::parse_query_event(const string& data) {
   BinlogQueryEvent ev;
   ProtocolStringReader r(data);
@@ -487,6 +634,19 @@ BinlogQueryEvent BinlogProcessor::parse_query_event(const string& data) {
   ev.query = r.get_string_eof();
 
   this->position = ev.header.end_position;
+  // XA START is followed by the transaction's ID, so only the beginning of the
+  // query is checked. ROLLBACK TO (a savepoint) doesn't end the transaction,
+  // but ROLLBACK does: the transaction's events are all in the binlog (for
+  // changes to nontransactional tables), and it has a GTID like any other.
+  if (query_starts_with(ev.query, "BEGIN") || query_starts_with(ev.query, "XA START")) {
+    this->in_transaction = true;
+  } else if (!strcasecmp(ev.query.c_str(), "COMMIT") ||
+      !strcasecmp(ev.query.c_str(), "ROLLBACK") ||
+      !this->in_transaction) {
+    // Statements outside of BEGIN/COMMIT (e.g. DDL) are transactions by
+    // themselves
+    this->commit_transaction();
+  }
   return ev;
 }
 
@@ -515,6 +675,7 @@ BinlogXidEvent BinlogProcessor::parse_xid_event(const string& data) {
   ev.xid = r.get_u64l();
 
   this->position = ev.header.end_position;
+  this->commit_transaction();
   return ev;
 }
 
@@ -594,6 +755,49 @@ BinlogFormatDescriptionEvent BinlogProcessor::parse_format_description_event(
   return ev;
 }
 
+BinlogGTIDEvent BinlogProcessor::parse_gtid_event(const string& data) {
+  BinlogGTIDEvent ev;
+  ProtocolStringReader r(data);
+  ev.header = r.get<BinlogEventHeader>();
+  if (ev.header.type != BinlogEventType::GTID_EVENT) {
+    throw logic_error("event is not a gtid event");
+  }
+  ev.flags = r.get_u8();
+  ev.sid = r.read(16);
+  ev.gno = r.get_u64l();
+  ev.last_committed = 0;
+  ev.sequence_number = 0;
+  // The logical timestamps are only present if the type code is 2. After them
+  // there may be more fields (commit timestamps, etc.), which we ignore.
+  if (!r.eof() && r.get_u8() == 2) {
+    ev.last_committed = r.get_u64l();
+    ev.sequence_number = r.get_u64l();
+  }
+
+  this->pending_gtid_sid = ev.sid;
+  this->pending_gtid_gno = ev.gno;
+  this->has_pending_gtid = true;
+  this->position = ev.header.end_position;
+  return ev;
+}
+
+BinlogPreviousGTIDsEvent BinlogProcessor::parse_previous_gtids_event(
+    const string& data) {
+  BinlogPreviousGTIDsEvent ev;
+  ProtocolStringReader r(data);
+  ev.header = r.get<BinlogEventHeader>();
+  if (ev.header.type != BinlogEventType::PREVIOUS_GTIDS_EVENT) {
+    throw logic_error("event is not a previous gtids event");
+  }
+  ev.gtids = GTIDSet::decode(r.get_string_eof());
+
+  // All of these transactions were committed before the current binlog file
+  // began, so they're part of the committed state (if they weren't already)
+  this->committed.executed_gtids.add(ev.gtids);
+  this->position = ev.header.end_position;
+  return ev;
+}
+
 BinlogEventHeader BinlogProcessor::parse_unknown_event(const string& data) {
   if (data.size() < sizeof(BinlogEventHeader)) {
     throw runtime_error("binlog event too small for header");
@@ -601,6 +805,11 @@ BinlogEventHeader BinlogProcessor::parse_unknown_event(const string& data) {
 
   const auto* header = reinterpret_cast<const BinlogEventHeader*>(data.data());
   this->position = header->end_position;
+  // The first part of an XA transaction (from XA START to XA END) ends with
+  // this event; XA COMMIT or XA ROLLBACK comes later, as a separate statement
+  if (header->type == BinlogEventType::XA_PREPARE_LOG_EVENT) {
+    this->commit_transaction();
+  }
   return *header;
 }
 
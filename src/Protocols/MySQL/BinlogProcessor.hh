@@ -3,7 +3,9 @@
 #include <stdint.h>
 
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "ProtocolBuffer.hh"
@@ -84,7 +86,8 @@ struct BinlogTableMapEvent {
   std::shared_ptr<const BinlogTableInfo> ti;
 };
 
-struct BinlogRowsEvent {
+// Fields common to BinlogRowsEvent and BinlogRowsEventView
+struct BinlogRowsEventBase {
   BinlogEventHeader header;
 
   enum class WriteType {
@@ -97,6 +100,9 @@ struct BinlogRowsEvent {
   uint64_t table_id;
   std::shared_ptr<const BinlogTableInfo> ti;
   uint16_t flags;
+};
+
+struct BinlogRowsEvent : BinlogRowsEventBase {
   std::string extra_data; // unparsed
 
   struct RowChange {
@@ -108,6 +114,40 @@ struct BinlogRowsEvent {
   std::vector<RowChange> rows;
 };
 
+// A rows event whose cells don't own their data. The event's raw data is moved
+// into the event, string cells are string_views into it, and all rows' cells
+// are stored in a single contiguous array. To decode a stream of rows events
+// with (almost) no allocations, reuse the same BinlogRowsEventView object for
+// each call to BinlogProcessor::parse_rows_event_view; its arrays keep their
+// capacity across events.
+//
+// The views and spans in this structure are invalidated when it's reused for
+// the next event, so anything that needs to outlive that should be converted
+// with to_value() first. The structure can be moved but not copied, since a
+// copy's spans would still refer to the original.
+struct BinlogRowsEventView : BinlogRowsEventBase {
+  BinlogRowsEventView() = default;
+  BinlogRowsEventView(const BinlogRowsEventView&) = delete;
+  BinlogRowsEventView(BinlogRowsEventView&&) = default;
+  BinlogRowsEventView& operator=(const BinlogRowsEventView&) = delete;
+  BinlogRowsEventView& operator=(BinlogRowsEventView&&) = default;
+  ~BinlogRowsEventView() = default;
+
+  std::string_view extra_data; // unparsed
+
+  struct RowChange {
+    size_t pre_bytes;
+    size_t post_bytes;
+    std::span<const ValueRef> pre;
+    std::span<const ValueRef> post;
+  };
+  std::vector<RowChange> rows;
+
+  // Backing storage for the above; these are not meant to be used directly
+  std::string data;
+  std::vector<ValueRef> cells;
+};
+
 struct BinlogQueryEvent {
   BinlogEventHeader header;
   uint32_t conn_id;
@@ -129,6 +169,21 @@ struct BinlogXidEvent {
   uint64_t xid;
 };
 
+struct BinlogGTIDEvent {
+  BinlogEventHeader header;
+  uint8_t flags;
+  std::string sid; // 16 raw bytes; use GTIDSet::format_sid to print it
+  uint64_t gno;
+  // These are only present on MySQL 5.7+ (otherwise they are zero)
+  uint64_t last_committed;
+  uint64_t sequence_number;
+};
+
+struct BinlogPreviousGTIDsEvent {
+  BinlogEventHeader header;
+  GTIDSet gtids;
+};
+
 struct BinlogFormatDescriptionEvent {
   BinlogEventHeader header;
   uint16_t version;
@@ -138,31 +193,88 @@ struct BinlogFormatDescriptionEvent {
   std::string event_header_lengths;
 };
 
+// The binlog position and GTID state immediately after the last fully
+// committed transaction. Resuming a binlog stream from this point (by filename
+// and position, or by GTID set) neither skips nor replays any transaction.
+struct BinlogCheckpoint {
+  std::string filename;
+  uint64_t position;
+  GTIDSet executed_gtids;
+
+  BinlogCheckpoint();
+};
+
+class BinlogCheckpointer;
+
 class BinlogProcessor {
 public:
   BinlogProcessor();
   ~BinlogProcessor() = default;
 
+  // Returns the position of the end of the last event processed. This may be
+  // in the middle of a transaction.
+  const std::string& get_filename() const;
+  uint64_t get_position() const;
+
+  // Returns the state as of the end of the last committed transaction. A
+  // transaction is committed by an XID_EVENT, a COMMIT or ROLLBACK query, an
+  // XA_PREPARE_LOG_EVENT (passed to parse_unknown_event), or a query event
+  // outside of BEGIN/COMMIT (e.g. DDL).
+  const BinlogCheckpoint& get_committed_checkpoint() const;
+  uint64_t get_committed_transaction_count() const;
+
+  // Sets the starting state, e.g. from BinlogCheckpointer::load(). This should
+  // be called before processing any events.
+  void set_checkpoint(const BinlogCheckpoint& checkpoint);
+
   static const BinlogEventHeader* get_event_header(const std::string& data);
 
   BinlogTableMapEvent parse_table_map_event(const std::string& data);
   BinlogRowsEvent parse_rows_event(const std::string& data);
+  // Like parse_rows_event, but takes ownership of data and doesn't copy string
+  // values out of it. See the comments on BinlogRowsEventView.
+  void parse_rows_event_view(std::string&& data, BinlogRowsEventView& ev);
   BinlogQueryEvent parse_query_event(const std::string& data);
   BinlogRotateEvent parse_rotate_event(const std::string& data);
   BinlogXidEvent parse_xid_event(const std::string& data);
   BinlogFormatDescriptionEvent parse_format_description_event(const std::string& data);
+  BinlogGTIDEvent parse_gtid_event(const std::string& data);
+  BinlogPreviousGTIDsEvent parse_previous_gtids_event(const std::string& data);
   BinlogEventHeader parse_unknown_event(const std::string& data);
 
 private:
+  friend class BinlogCheckpointer;
+
   std::string filename;
   uint64_t position;
   std::unordered_map<uint64_t, std::shared_ptr<BinlogTableInfo>> table_map;
 
-  std::vector<Value> read_row_data(
-      ProtocolStringReader& r, std::shared_ptr<const BinlogTableInfo> ti);
+  bool in_transaction;
+  bool has_pending_gtid;
+  std::string pending_gtid_sid;
+  uint64_t pending_gtid_gno;
+  BinlogCheckpoint committed;
+  uint64_t committed_transaction_count;
+  BinlogCheckpointer* checkpointer;
+
+  // (pre, post) offsets of each row's cells; used by parse_rows_event_view
+  std::vector<std::pair<size_t, size_t>> row_cell_offsets;
+
+  void commit_transaction();
+
+  bool parse_rows_event_header(
+      BinlogRowsEventBase& ev,
+      ProtocolStringReader& r,
+      const std::string& data,
+      std::string_view* extra_data);
+  static void read_row_data(
+      std::vector<ValueRef>& cells,
+      ProtocolStringReader& r,
+      const std::string& data,
+      const BinlogTableInfo& ti);
   static size_t metadata_bytes_for_column_type(uint8_t type);
-  static Value read_cell_data(
-      StringReader& r, const BinlogTableInfo::ColumnInfo& ci);
+  static ValueRef read_cell_data(
+      StringReader& r, const std::string& data, const BinlogTableInfo::ColumnInfo& ci);
   static uint32_t read_datetime_fractional_part(
       StringReader& r, uint8_t precision);
 };
@@ -2,6 +2,7 @@
 
 #include <event2/buffer.h>
 #include <stdio.h>
+#include <sys/socket.h>
 
 #include <phosg/Hash.hh>
 #include <phosg/Random.hh>
@@ -18,8 +19,10 @@ Client::Client(
     const char* hostname,
     uint16_t port,
     const char* username,
-    const char* password)
+    const char* password,
+    DNSBase* dns_base)
     : base(base),
+      dns_base(dns_base),
       hostname(hostname),
       port(port),
       username(username),
@@ -27,18 +30,64 @@ Client::Client(
       fd(-1),
       next_seq(0),
       binlog_read_state(BinlogReadState::NOT_READING),
-      expected_binlog_seq(0) {}
+      expected_binlog_seq(0),
+      requested_compression(CompressionAlgorithm::NONE),
+      compression_threshold(50),
+      compression_level(-1),
+      pipeline_send_buf(base),
+      pipeline_writer_running(false),
+      pipeline_reader_running(false),
+      pipeline_reader_resolving(false),
+      destroyed(make_shared<bool>(false)) {}
+
+Client::~Client() {
+  *this->destroyed = true;
+  if (this->pipeline_writer_task) {
+    this->pipeline_writer_task->cancel();
+  }
+  if (this->pipeline_reader_task && !this->pipeline_reader_resolving) {
+    this->pipeline_reader_task->cancel();
+  }
+  // Canceling a query resumes its caller immediately, so don't leave anything
+  // in the queue that it could see
+  auto queries = std::move(this->pipelined_queries);
+  this->pipelined_queries.clear();
+  for (auto& q : queries) {
+    q->result.cancel();
+  }
+}
+
+void Client::set_compression(
+    CompressionAlgorithm alg, size_t threshold, int level) {
+  if (this->fd.is_open()) {
+    throw logic_error("compression must be configured before connecting");
+  }
+  this->requested_compression = alg;
+  this->compression_threshold = threshold;
+  this->compression_level = level;
+}
+
+CompressionAlgorithm Client::get_compression() const {
+  return this->compression
+      ? this->compression->get_algorithm()
+      : CompressionAlgorithm::NONE;
+}
 
 Task<void> Client::connect() {
   if (this->fd.is_open()) {
     co_return;
   }
-  this->fd = co_await this->base.connect(this->hostname, this->port);
+  if (this->dns_base) {
+    this->fd = co_await this->base.connect(
+        *this->dns_base, this->hostname, this->port);
+  } else {
+    this->fd = co_await this->base.connect(this->hostname, this->port);
+  }
   co_await this->initial_handshake();
 }
 
 Task<void> Client::read_command(ProtocolBuffer& buf) {
-  uint8_t seq = co_await buf.read_command(this->fd);
+  uint8_t seq = co_await buf.read_command(this->fd, this->compression.get());
   if (seq != this->next_seq) {
     throw runtime_error("server sent out-of-sequence commands");
   }
@@ -46,11 +95,19 @@ Task<void> Client::read_command(ProtocolBuffer& buf) {
 }
 
 Task<void> Client::write_command(ProtocolBuffer& buf) {
-  co_await buf.write_command(this->fd, this->next_seq++);
+  co_await buf.write_command(this->fd, this->next_seq++, this->compression.get());
 }
 
 void Client::reset_seq() {
+  // Every command except pipelined queries starts by resetting the sequence
+  // number, so this is a convenient place to catch misuse
+  if (!this->pipelined_queries.empty()) {
+    throw logic_error("cannot send a command while pipelined queries are outstanding");
+  }
   this->next_seq = 0;
+  if (this->compression) {
+    this->compression->reset_seq();
+  }
 }
 
 string Client::compute_auth_response(
@@ -117,7 +174,22 @@ Task<void> Client::initial_handshake() {
   // Capability flags we use: LongPassword, Protocol41, Transactions,
   // SecureConnection, MultiStatements, MultiResults, PluginAuth,
   // PluginAuthLenencClientData, DeprecateEOF
-  static const uint32_t client_cap_flags = 0x012BA201;
+  uint32_t client_cap_flags = 0x012BA201;
+
+  // Choose a compression algorithm, if requested. We prefer zstd if the caller
+  // asked for it, but fall back to zlib if it's not available.
+  CompressionAlgorithm compression_alg = CompressionAlgorithm::NONE;
+  if ((this->requested_compression == CompressionAlgorithm::ZSTD) &&
+      (this->server_cap_flags & CapFlag::ZSTD_COMPRESSION_ALGORITHM) &&
+      compression_algorithm_available(CompressionAlgorithm::ZSTD)) {
+    compression_alg = CompressionAlgorithm::ZSTD;
+    client_cap_flags |= CapFlag::ZSTD_COMPRESSION_ALGORITHM;
+  } else if ((this->requested_compression != CompressionAlgorithm::NONE) &&
+      (this->server_cap_flags & CapFlag::COMPRESS)) {
+    compression_alg = CompressionAlgorithm::ZLIB;
+    client_cap_flags |= CapFlag::COMPRESS;
+  }
+
   buf.add_u32l(client_cap_flags);
   buf.add_u32l(0xFFFFFFFF); // max_allowed_packet
   buf.add_u8(0xFF); // charset
@@ -125,6 +197,9 @@ Task<void> Client::initial_handshake() {
   buf.add_string0(this->username);
   buf.add_var_string(auth_response_data);
   buf.add_string0(auth_plugin_name);
+  if (compression_alg == CompressionAlgorithm::ZSTD) {
+    buf.add_u8((this->compression_level < 0) ? 3 : this->compression_level);
+  }
   co_await this->write_command(buf);
 
   // We expect to get an OK_Packet or ERR_Packet after this.
@@ -133,6 +208,13 @@ Task<void> Client::initial_handshake() {
     uint8_t response_command = buf.remove_u8();
 
     if (response_command == 0x00) { // OK
+      // All communication after this point uses the compressed protocol, if it
+      // was negotiated
+      if (compression_alg != CompressionAlgorithm::NONE) {
+        this->compression.reset(new CompressionLayer(
+            this->base, compression_alg, this->compression_threshold,
+            this->compression_level));
+      }
       break;
 
     } else if (response_command == 0x01) { // auth more data
@@ -185,50 +267,7 @@ Task<void> Client::quit() {
   buf.add_u8(Command::QUIT);
   co_await this->write_command(buf);
   this->fd.close();
-}
-
-static Value parse_value(ColumnType type, string&& value) {
-  switch (type) {
-    case ColumnType::T_TINYINT:
-    case ColumnType::T_SMALLINT:
-    case ColumnType::T_MEDIUMINT:
-    case ColumnType::T_INT:
-    case ColumnType::T_BIGINT:
-    case ColumnType::T_YEAR:
-      if (value.at(0) == '-') {
-        return stoll(value, nullptr, 10);
-      } else {
-        return stoull(value, nullptr, 10);
-      }
-    case ColumnType::T_FLOAT:
-      return stof(value);
-    case ColumnType::T_DOUBLE:
-      return stod(value);
-    case ColumnType::T_NULL:
-      return nullptr;
-    case ColumnType::T_DATE:
-    case ColumnType::T_DATETIME:
-    case ColumnType::T_TIMESTAMP:
-      return DateTimeValue(value);
-    case ColumnType::T_TIME:
-      return TimeValue(value);
-    case ColumnType::T_BIT:
-    case ColumnType::T_STRING:
-    case ColumnType::T_VAR_STRING:
-    case ColumnType::T_VARCHAR:
-    case ColumnType::T_TINYBLOB:
-    case ColumnType::T_BLOB:
-    case ColumnType::T_MEDIUMBLOB:
-    case ColumnType::T_LONGBLOB:
-    case ColumnType::T_DECIMAL:
-    case ColumnType::T_NEWDECIMAL:
-    case ColumnType::T_ENUM:
-    case ColumnType::T_SET:
-    case ColumnType::T_GEOMETRY:
-      return std::move(value);
-    default:
-      throw runtime_error("invalid value type");
-  }
+  this->compression.reset();
 }
 
 Task<void> Client::change_db(const string& db_name) {
@@ -259,6 +298,124 @@ Task<vector<ResultSet>> Client::query_multi(const string& sql, bool rows_as_dict
   buf.add(sql);
   co_await this->write_command(buf);
 
+  co_return co_await this->read_query_results(buf, rows_as_dicts);
+}
+
+Task<ResultSet> Client::query_pipelined(const string& sql, bool rows_as_dicts) {
+  this->assert_conn_open();
+  if (this->binlog_read_state != BinlogReadState::NOT_READING) {
+    throw logic_error("cannot send queries while reading binlogs");
+  }
+  if (this->compression) {
+    // The compressed protocol has a single sequence number shared by both
+    // directions, so requests and responses can't be in flight at once
+    throw logic_error("query pipelining cannot be used with the compressed protocol");
+  }
+
+  auto q = make_shared<PipelinedQuery>();
+  q->rows_as_dicts = rows_as_dicts;
+  this->pipelined_queries.emplace_back(q);
+
+  // Each query is a new command, so its sequence number is always 0. We don't
+  // go through write_command here since that would use (and advance) next_seq,
+  // which belongs to the reader.
+  ProtocolBuffer buf(this->base);
+  buf.add_u24l(sql.size() + 1);
+  buf.add_u8(0);
+  buf.add_u8(Command::QUERY);
+  buf.add(sql);
+  this->pipeline_send_buf.add_buffer(buf);
+
+  if (!this->pipeline_writer_running) {
+    this->pipeline_writer_task.emplace(this->pipeline_writer());
+  }
+  if (!this->pipeline_reader_running) {
+    this->pipeline_reader_task.emplace(this->pipeline_reader());
+  }
+
+  co_return std::move(co_await q->result);
+}
+
+DetachedTask Client::pipeline_writer() {
+  this->pipeline_writer_running = true;
+  try {
+    // More queries may be appended to the buffer while we're waiting for the
+    // socket to be writable; they're sent along with the rest
+    while (this->pipeline_send_buf.get_length()) {
+      co_await this->pipeline_send_buf.write(this->fd);
+    }
+  } catch (const exception&) {
+    // The reader will see EOF and fail all outstanding queries
+    this->pipeline_send_buf.drain_all();
+    shutdown(this->fd, SHUT_RDWR);
+  }
+  this->pipeline_writer_running = false;
+}
+
+DetachedTask Client::pipeline_reader() {
+  this->pipeline_reader_running = true;
+  auto destroyed = this->destroyed;
+
+  ProtocolBuffer buf(this->base);
+  while (!this->pipelined_queries.empty()) {
+    auto q = this->pipelined_queries.front();
+
+    // Each query's response starts at sequence number 1, regardless of what
+    // was written after it
+    this->next_seq = 1;
+    exception_ptr exc;
+    bool stream_broken = false;
+    vector<ResultSet> results;
+    try {
+      results = co_await this->read_query_results(buf, q->rows_as_dicts);
+    } catch (const ServerError&) {
+      exc = current_exception();
+    } catch (const exception&) {
+      exc = current_exception();
+      stream_broken = true;
+    }
+    buf.drain_all();
+
+    if (stream_broken) {
+      // We don't know where the next response begins, so fail everything
+      // that's outstanding and make the connection unusable
+      shutdown(this->fd, SHUT_RDWR);
+      auto queries = std::move(this->pipelined_queries);
+      this->pipelined_queries.clear();
+      this->pipeline_reader_resolving = true;
+      for (auto& failed_q : queries) {
+        failed_q->result.set_exception(exc);
+      }
+      if (*destroyed) {
+        co_return;
+      }
+      this->pipeline_reader_resolving = false;
+      break;
+    }
+
+    // Remove the query before resolving its future, since the caller may
+    // submit more queries as soon as it's resumed
+    this->pipelined_queries.pop_front();
+    this->pipeline_reader_resolving = true;
+    if (exc) {
+      q->result.set_exception(exc);
+    } else if (results.size() != 1) {
+      q->result.set_exception(make_exception_ptr(logic_error(
+          "pipelined query returned multiple result sets")));
+    } else {
+      q->result.set_result(std::move(results[0]));
+    }
+    if (*destroyed) {
+      co_return;
+    }
+    this->pipeline_reader_resolving = false;
+  }
+
+  this->pipeline_reader_running = false;
+}
+
+Task<vector<ResultSet>> Client::read_query_results(
+    ProtocolBuffer& buf, bool rows_as_dicts) {
   vector<ResultSet> ret;
   for (;;) {
     // The first response command specifies either that the query completed (if
@@ -337,25 +494,14 @@ Task<vector<ResultSet>> Client::query_multi(const string& sql, bool rows_as_dict
       if (rows_as_dicts) {
         auto& row = get<vector<unordered_map<string, Value>>>(res.rows).emplace_back();
         for (const auto& column_def : res.columns) {
-          if (buf.copyout_u8() == 0xFB) {
-            buf.remove_u8();
-            row.emplace(column_def.column_name, nullptr);
-          } else {
-            row.emplace(
-                column_def.column_name,
-                parse_value(column_def.type, buf.remove_var_string()));
-          }
+          row.emplace(column_def.column_name, buf.remove_text_value(column_def.type));
         }
 
       } else {
         auto& row = get<vector<vector<Value>>>(res.rows).emplace_back();
+        row.reserve(res.columns.size());
         for (const auto& column_def : res.columns) {
-          if (buf.copyout_u8() == 0xFB) {
-            buf.remove_u8();
-            row.emplace_back(nullptr);
-          } else {
-            row.emplace_back(parse_value(column_def.type, buf.remove_var_string()));
-          }
+          row.emplace_back(buf.remove_text_value(column_def.type));
         }
       }
     }
@@ -364,16 +510,7 @@ Task<vector<ResultSet>> Client::query_multi(const string& sql, bool rows_as_dict
 
 Task<void> Client::read_binlogs(
     const string& filename, size_t position, uint32_t server_id, bool block) {
-  this->assert_conn_open();
-
-  co_await this->query(
-      "SET @master_binlog_checksum = 'ALL', @source_binlog_checksum = 'ALL'");
-
-  if (server_id == 0) {
-    server_id = random_object<uint32_t>();
-  }
-
-  this->reset_seq();
+  server_id = co_await this->prepare_binlog_stream(server_id);
 
   ProtocolBuffer buf(this->base);
   buf.add_u8(Command::BINLOG_DUMP);
@@ -387,6 +524,40 @@ Task<void> Client::read_binlogs(
   this->expected_binlog_seq = 1;
 }
 
+Task<void> Client::read_binlogs_gtid(
+    const GTIDSet& executed_gtids, uint32_t server_id, bool block) {
+  server_id = co_await this->prepare_binlog_stream(server_id);
+
+  // Flags: 0x0001 = non-blocking, 0x0004 = through GTID (send GTID set)
+  string gtid_data = executed_gtids.encode();
+  ProtocolBuffer buf(this->base);
+  buf.add_u8(Command::BINLOG_DUMP_GTID);
+  buf.add_u16l(block ? 0x0004 : 0x0005);
+  buf.add_u32l(server_id);
+  buf.add_u32l(0); // binlog filename length (the server chooses the file)
+  buf.add_u64l(4); // binlog position
+  buf.add_u32l(gtid_data.size());
+  buf.add(gtid_data);
+  co_await this->write_command(buf);
+
+  this->binlog_read_state = BinlogReadState::READING_FIRST_EVENT;
+  this->expected_binlog_seq = 1;
+}
+
+Task<uint32_t> Client::prepare_binlog_stream(uint32_t server_id) {
+  this->assert_conn_open();
+
+  co_await this->query(
+      "SET @master_binlog_checksum = 'ALL', @source_binlog_checksum = 'ALL'");
+
+  if (server_id == 0) {
+    server_id = random_object<uint32_t>();
+  }
+
+  this->reset_seq();
+  co_return std::move(server_id);
+}
+
 Task<string> Client::get_binlog_event() {
   this->assert_conn_open();
   if (this->binlog_read_state == BinlogReadState::NOT_READING) {
@@ -427,8 +598,7 @@ void Client::parse_error_body(ProtocolBuffer& buf) {
   uint16_t error_code = buf.remove_u16l();
   string sqlstate = buf.remove(6); // '#' + 5-char sqlstate
   string message = buf.remove_string_eof();
-  throw runtime_error(string_printf("(%hu; %s) %s",
-      error_code, sqlstate.c_str(), message.c_str()));
+  throw ServerError(error_code, sqlstate, message);
 }
 
 Task<void> Client::expect_ok() {
@@ -5,10 +5,15 @@
 #include "../../Base.hh"
 #include "../../Buffer.hh"
 #include "../../DNSBase.hh"
+#include "../../Future.hh"
 #include "../../Task.hh"
+#include <deque>
+#include <memory>
+#include <optional>
 #include <phosg/Filesystem.hh>
 #include <string>
 
+#include "Compression.hh"
 #include "ProtocolBuffer.hh"
 #include "Types.hh"
 
@@ -16,13 +21,33 @@ namespace EventAsync::MySQL {
 
 class Client {
 public:
+  // If dns_base is given, hostname is resolved with it when connecting;
+  // otherwise, the lookup blocks the event loop. dns_base must outlive the
+  // Client.
   Client(
       Base& base,
       const char* hostname,
       uint16_t port,
       const char* username,
-      const char* password);
-  ~Client() = default;
+      const char* password,
+      DNSBase* dns_base = nullptr);
+  // Cancels any pipelined queries that are still outstanding; their
+  // query_pipelined calls throw Future<ResultSet>::canceled_error, and must
+  // not use the Client after that.
+  ~Client();
+
+  // Enables the compressed protocol, if the server supports it. This must be
+  // called before connect(). If alg is ZSTD but the server (or this build)
+  // doesn't support zstd, zlib is used instead. Packets smaller than threshold
+  // bytes are sent uncompressed, since compressing them would waste CPU time
+  // for little or no gain. level is the zlib or zstd compression level; -1
+  // means to use the algorithm's default level.
+  void set_compression(
+      CompressionAlgorithm alg, size_t threshold = 50, int level = -1);
+
+  // Returns the compression algorithm in use on the connection. This is NONE
+  // if compression wasn't requested or the server doesn't support it.
+  CompressionAlgorithm get_compression() const;
 
   // Opens the connection. After constructing a Client object, you must
   // co_await client.connect() before calling any other methods on it.
@@ -42,6 +67,22 @@ public:
   Task<std::vector<ResultSet>> query_multi(
       const std::string& sql, bool rows_as_dicts = true);
 
+  // Runs a SQL query without waiting for previously-submitted queries to
+  // finish. Queries submitted this way are written to the server immediately,
+  // back-to-back, and a single reader coroutine resolves each caller's result
+  // in submission order as the responses arrive, so a batch of N independent
+  // queries takes about one round trip instead of N. To use this, start
+  // multiple calls without awaiting them one at a time (e.g. with all()).
+  //
+  // If one of the queries fails with a ServerError, only that call throws; the
+  // others are unaffected. If the connection fails, all outstanding calls
+  // throw. Other commands (query, change_db, read_binlogs, etc.) cannot be sent
+  // while pipelined queries are outstanding, and pipelining cannot be used on
+  // connections using the compressed protocol. The queries must not return
+  // multiple result sets.
+  Task<ResultSet> query_pipelined(
+      const std::string& sql, bool rows_as_dicts = true);
+
   // Starts a binlog stream. To read binlogs, call this method to start reading,
   // then call get_binlog_event infinitely many times or until it throws
   // out_of_range.
@@ -54,6 +95,17 @@ public:
       // Blocking mode. See description of get_binlog_event() below.
       bool block = true);
 
+  // Starts a binlog stream using GTIDs instead of a filename and position. The
+  // server sends all transactions that are not in executed_gtids, so passing
+  // the executed_gtids from a BinlogCheckpoint resumes exactly after the last
+  // committed transaction, even if the server has failed over to a replica
+  // whose binlog files and positions are different. After calling this, call
+  // get_binlog_event as for read_binlogs.
+  Task<void> read_binlogs_gtid(
+      const GTIDSet& executed_gtids,
+      uint32_t server_id = 0,
+      bool block = true);
+
   // Returns the next binlog event from the server's stream. If read_binlogs was
   // called with block=true and there are no more events available, this method
   // waits for the server to send another one. If read_binlogs was called with
@@ -63,6 +115,7 @@ public:
 
 private:
   Base& base;
+  DNSBase* dns_base;
   std::string hostname;
   uint16_t port;
   std::string username;
@@ -84,6 +137,29 @@ private:
   BinlogReadState binlog_read_state;
   uint8_t expected_binlog_seq;
 
+  CompressionAlgorithm requested_compression;
+  size_t compression_threshold;
+  int compression_level;
+  std::unique_ptr<CompressionLayer> compression;
+
+  struct PipelinedQuery {
+    bool rows_as_dicts;
+    Future<ResultSet> result;
+  };
+  std::deque<std::shared_ptr<PipelinedQuery>> pipelined_queries;
+  Buffer pipeline_send_buf;
+  bool pipeline_writer_running;
+  bool pipeline_reader_running;
+  // The writer and reader coroutines refer to this object, so they're
+  // canceled when it's destroyed. The exception is when the reader is the one
+  // destroying it (by resolving a query, whose caller then destroys the
+  // Client); in that case, the reader sees that destroyed is set and returns
+  // without using the Client again.
+  std::optional<DetachedTask> pipeline_writer_task;
+  std::optional<DetachedTask> pipeline_reader_task;
+  bool pipeline_reader_resolving;
+  std::shared_ptr<bool> destroyed;
+
   Task<void> read_command(ProtocolBuffer& buf);
   Task<void> write_command(ProtocolBuffer& buf);
   void reset_seq();
@@ -98,6 +174,11 @@ private:
   void parse_error_body(ProtocolBuffer& buf);
 
   Task<void> expect_ok();
+  Task<std::vector<ResultSet>> read_query_results(
+      ProtocolBuffer& buf, bool rows_as_dicts);
+  DetachedTask pipeline_writer();
+  DetachedTask pipeline_reader();
+  Task<uint32_t> prepare_binlog_stream(uint32_t server_id);
 };
 
 } // namespace EventAsync::MySQL
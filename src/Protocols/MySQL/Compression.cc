@@ -0,0 +1,360 @@
+#include "Compression.hh"
+
+#include <string.h>
+
+#include <phosg/Strings.hh>
+
+#ifdef EVENT_ASYNC_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ProtocolBuffer.hh"
+
+using namespace std;
+
+namespace EventAsync::MySQL {
+
+// Compressed packets can't be larger than this, since the length fields are 24
+// bits. Larger writes are split into multiple compressed packets.
+static const size_t MAX_COMPRESSED_PACKET_PAYLOAD = 0xFFFFFF;
+
+const char* name_for_compression_algorithm(CompressionAlgorithm alg) {
+  switch (alg) {
+    case CompressionAlgorithm::NONE:
+      return "none";
+    case CompressionAlgorithm::ZLIB:
+      return "zlib";
+    case CompressionAlgorithm::ZSTD:
+      return "zstd";
+    default:
+      return "<INVALID_COMPRESSION_ALGORITHM>";
+  }
+}
+
+bool compression_algorithm_available(CompressionAlgorithm alg) {
+  switch (alg) {
+    case CompressionAlgorithm::NONE:
+    case CompressionAlgorithm::ZLIB:
+      return true;
+    case CompressionAlgorithm::ZSTD:
+#ifdef EVENT_ASYNC_HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+CompressionLayer::CompressionLayer(
+    Base& base,
+    CompressionAlgorithm alg,
+    size_t threshold,
+    int level)
+    : base(base),
+      alg(alg),
+      threshold(threshold),
+      level(level),
+      next_seq(0),
+      raw_input_buf(base),
+      plain_input_buf(base),
+      zstd_cctx(nullptr),
+      zstd_dctx(nullptr),
+      bytes_read_raw(0),
+      bytes_read_uncompressed(0),
+      bytes_written_raw(0),
+      bytes_written_uncompressed(0) {
+  memset(&this->inflater, 0, sizeof(this->inflater));
+  memset(&this->deflater, 0, sizeof(this->deflater));
+
+  if (this->alg == CompressionAlgorithm::ZLIB) {
+    if (inflateInit(&this->inflater) != Z_OK) {
+      throw runtime_error("inflateInit failed");
+    }
+    if (deflateInit(&this->deflater, (this->level < 0) ? Z_DEFAULT_COMPRESSION : this->level) != Z_OK) {
+      inflateEnd(&this->inflater);
+      throw runtime_error("deflateInit failed");
+    }
+
+  } else if (this->alg == CompressionAlgorithm::ZSTD) {
+#ifdef EVENT_ASYNC_HAVE_ZSTD
+    this->zstd_cctx = ZSTD_createCCtx();
+    this->zstd_dctx = ZSTD_createDCtx();
+    if (!this->zstd_cctx || !this->zstd_dctx) {
+      ZSTD_freeCCtx(this->zstd_cctx);
+      ZSTD_freeDCtx(this->zstd_dctx);
+      throw bad_alloc();
+    }
+    ZSTD_CCtx_setParameter(this->zstd_cctx, ZSTD_c_compressionLevel,
+        (this->level < 0) ? ZSTD_CLEVEL_DEFAULT : this->level);
+#else
+    throw logic_error("zstd compression is not available in this build");
+#endif
+
+  } else {
+    throw logic_error("invalid compression algorithm");
+  }
+}
+
+CompressionLayer::~CompressionLayer() {
+  if (this->alg == CompressionAlgorithm::ZLIB) {
+    inflateEnd(&this->inflater);
+    deflateEnd(&this->deflater);
+  }
+#ifdef EVENT_ASYNC_HAVE_ZSTD
+  ZSTD_freeCCtx(this->zstd_cctx);
+  ZSTD_freeDCtx(this->zstd_dctx);
+#endif
+}
+
+CompressionAlgorithm CompressionLayer::get_algorithm() const {
+  return this->alg;
+}
+
+void CompressionLayer::reset_seq() {
+  this->next_seq = 0;
+}
+
+uint64_t CompressionLayer::get_bytes_read_raw() const {
+  return this->bytes_read_raw;
+}
+
+uint64_t CompressionLayer::get_bytes_read_uncompressed() const {
+  return this->bytes_read_uncompressed;
+}
+
+uint64_t CompressionLayer::get_bytes_written_raw() const {
+  return this->bytes_written_raw;
+}
+
+uint64_t CompressionLayer::get_bytes_written_uncompressed() const {
+  return this->bytes_written_uncompressed;
+}
+
+size_t CompressionLayer::peek_iovecs(Buffer& buf, size_t size) {
+  int num_vecs = buf.peek(size, nullptr, nullptr, 0);
+  if (num_vecs < 0) {
+    throw runtime_error("evbuffer_peek");
+  }
+  this->iovecs.resize(num_vecs);
+  buf.peek(size, nullptr, this->iovecs.data(), num_vecs);
+  return num_vecs;
+}
+
+Task<void> CompressionLayer::read(int fd, Buffer& dest, size_t size) {
+  while (this->plain_input_buf.get_length() < size) {
+    co_await this->read_packet(fd);
+  }
+  this->plain_input_buf.remove_buffer(dest, size);
+}
+
+Task<void> CompressionLayer::read_packet(int fd) {
+  co_await this->raw_input_buf.read_to(fd, 7);
+  uint8_t header[7];
+  this->raw_input_buf.remove(header, 7);
+  size_t compressed_size = header[0] | (header[1] << 8) | (header[2] << 16);
+  uint8_t seq = header[3];
+  size_t uncompressed_size = header[4] | (header[5] << 8) | (header[6] << 16);
+  if (seq != this->next_seq) {
+    throw runtime_error("server sent out-of-sequence compressed packets");
+  }
+  this->next_seq++;
+
+  co_await this->raw_input_buf.read_to(fd, compressed_size);
+  this->bytes_read_raw += compressed_size + 7;
+  if (uncompressed_size == 0) {
+    // The payload was sent uncompressed; no copy is necessary
+    this->raw_input_buf.remove_buffer(this->plain_input_buf, compressed_size);
+    this->bytes_read_uncompressed += compressed_size;
+  } else {
+    this->decompress(compressed_size, uncompressed_size);
+    this->bytes_read_uncompressed += uncompressed_size;
+  }
+}
+
+void CompressionLayer::decompress(
+    size_t compressed_size, size_t uncompressed_size) {
+  struct evbuffer_iovec out;
+  if (this->plain_input_buf.reserve_space(uncompressed_size, &out, 1) != 1) {
+    throw runtime_error("cannot reserve space for decompressed data");
+  }
+
+  size_t num_vecs = this->peek_iovecs(this->raw_input_buf, compressed_size);
+  size_t remaining = compressed_size;
+
+  if (this->alg == CompressionAlgorithm::ZLIB) {
+    if (inflateReset(&this->inflater) != Z_OK) {
+      throw runtime_error("inflateReset failed");
+    }
+    this->inflater.next_out = reinterpret_cast<Bytef*>(out.iov_base);
+    this->inflater.avail_out = uncompressed_size;
+
+    int ret = Z_OK;
+    for (size_t x = 0; (x < num_vecs) && (remaining > 0); x++) {
+      size_t chunk_size = min<size_t>(this->iovecs[x].iov_len, remaining);
+      this->inflater.next_in = reinterpret_cast<Bytef*>(this->iovecs[x].iov_base);
+      this->inflater.avail_in = chunk_size;
+      ret = inflate(&this->inflater, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+        throw runtime_error(string_printf("inflate failed (%d)", ret));
+      }
+      if (this->inflater.avail_in != 0) {
+        throw runtime_error("compressed packet contains extra data");
+      }
+      remaining -= chunk_size;
+    }
+    if ((ret != Z_STREAM_END) || (this->inflater.total_out != uncompressed_size)) {
+      throw runtime_error("compressed packet has incorrect uncompressed size");
+    }
+
+  } else if (this->alg == CompressionAlgorithm::ZSTD) {
+#ifdef EVENT_ASYNC_HAVE_ZSTD
+    ZSTD_DCtx_reset(this->zstd_dctx, ZSTD_reset_session_only);
+    ZSTD_outBuffer zout = {out.iov_base, uncompressed_size, 0};
+    size_t ret = 1;
+    for (size_t x = 0; (x < num_vecs) && (remaining > 0); x++) {
+      size_t chunk_size = min<size_t>(this->iovecs[x].iov_len, remaining);
+      ZSTD_inBuffer zin = {this->iovecs[x].iov_base, chunk_size, 0};
+      while (zin.pos < zin.size) {
+        size_t prev_in_pos = zin.pos;
+        size_t prev_out_pos = zout.pos;
+        ret = ZSTD_decompressStream(this->zstd_dctx, &zout, &zin);
+        if (ZSTD_isError(ret)) {
+          throw runtime_error(string_printf("ZSTD_decompressStream failed (%s)",
+              ZSTD_getErrorName(ret)));
+        }
+        if ((zin.pos == prev_in_pos) && (zout.pos == prev_out_pos)) {
+          throw runtime_error("compressed packet contains extra data");
+        }
+      }
+      remaining -= chunk_size;
+    }
+    if ((ret != 0) || (zout.pos != uncompressed_size)) {
+      throw runtime_error("compressed packet has incorrect uncompressed size");
+    }
+#endif
+
+  } else {
+    throw logic_error("invalid compression algorithm");
+  }
+
+  out.iov_len = uncompressed_size;
+  this->plain_input_buf.commit_space(&out, 1);
+  this->raw_input_buf.drain(compressed_size);
+}
+
+size_t CompressionLayer::compress(Buffer& dest, Buffer& src, size_t size) {
+  size_t num_vecs = this->peek_iovecs(src, size);
+  size_t remaining = size;
+  struct evbuffer_iovec out;
+  size_t compressed_size = 0;
+
+  if (this->alg == CompressionAlgorithm::ZLIB) {
+    if (deflateReset(&this->deflater) != Z_OK) {
+      throw runtime_error("deflateReset failed");
+    }
+    // With at least deflateBound bytes of output space, deflate always
+    // consumes all of its input in one call, so we don't need to loop here
+    size_t bound = deflateBound(&this->deflater, size);
+    if (dest.reserve_space(bound, &out, 1) != 1) {
+      throw runtime_error("cannot reserve space for compressed data");
+    }
+    this->deflater.next_out = reinterpret_cast<Bytef*>(out.iov_base);
+    this->deflater.avail_out = bound;
+
+    for (size_t x = 0; (x < num_vecs) && (remaining > 0); x++) {
+      size_t chunk_size = min<size_t>(this->iovecs[x].iov_len, remaining);
+      this->deflater.next_in = reinterpret_cast<Bytef*>(this->iovecs[x].iov_base);
+      this->deflater.avail_in = chunk_size;
+      int ret = deflate(&this->deflater, Z_NO_FLUSH);
+      if ((ret != Z_OK) || (this->deflater.avail_in != 0)) {
+        throw runtime_error(string_printf("deflate failed (%d)", ret));
+      }
+      remaining -= chunk_size;
+    }
+    int ret = deflate(&this->deflater, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+      throw runtime_error(string_printf("deflate failed to finish (%d)", ret));
+    }
+    compressed_size = this->deflater.total_out;
+
+  } else if (this->alg == CompressionAlgorithm::ZSTD) {
+#ifdef EVENT_ASYNC_HAVE_ZSTD
+    ZSTD_CCtx_reset(this->zstd_cctx, ZSTD_reset_session_only);
+    size_t bound = ZSTD_compressBound(size);
+    if (dest.reserve_space(bound, &out, 1) != 1) {
+      throw runtime_error("cannot reserve space for compressed data");
+    }
+    ZSTD_outBuffer zout = {out.iov_base, bound, 0};
+    for (size_t x = 0; (x < num_vecs) && (remaining > 0); x++) {
+      size_t chunk_size = min<size_t>(this->iovecs[x].iov_len, remaining);
+      ZSTD_inBuffer zin = {this->iovecs[x].iov_base, chunk_size, 0};
+      while (zin.pos < zin.size) {
+        size_t ret = ZSTD_compressStream2(this->zstd_cctx, &zout, &zin, ZSTD_e_continue);
+        if (ZSTD_isError(ret)) {
+          throw runtime_error(string_printf("ZSTD_compressStream2 failed (%s)",
+              ZSTD_getErrorName(ret)));
+        }
+      }
+      remaining -= chunk_size;
+    }
+    ZSTD_inBuffer zin = {nullptr, 0, 0};
+    for (;;) {
+      size_t ret = ZSTD_compressStream2(this->zstd_cctx, &zout, &zin, ZSTD_e_end);
+      if (ZSTD_isError(ret)) {
+        throw runtime_error(string_printf("ZSTD_compressStream2 failed to finish (%s)",
+            ZSTD_getErrorName(ret)));
+      }
+      if (ret == 0) {
+        break;
+      }
+    }
+    compressed_size = zout.pos;
+#endif
+
+  } else {
+    throw logic_error("invalid compression algorithm");
+  }
+
+  // If compression didn't help, don't commit the reserved space; the caller
+  // will send the data uncompressed instead
+  if (compressed_size >= size) {
+    return 0;
+  }
+  out.iov_len = compressed_size;
+  dest.commit_space(&out, 1);
+  return compressed_size;
+}
+
+Task<void> CompressionLayer::write(int fd, Buffer& src) {
+  ProtocolBuffer send_buf(this->base);
+  Buffer compressed_buf(this->base);
+
+  while (src.get_length() > 0) {
+    size_t chunk_size = min<size_t>(src.get_length(), MAX_COMPRESSED_PACKET_PAYLOAD);
+    size_t compressed_size = (chunk_size >= this->threshold)
+        ? this->compress(compressed_buf, src, chunk_size)
+        : 0;
+
+    if (compressed_size) {
+      send_buf.add_u24l(compressed_size);
+      send_buf.add_u8(this->next_seq++);
+      send_buf.add_u24l(chunk_size);
+      send_buf.add_buffer(compressed_buf);
+      src.drain(chunk_size);
+      this->bytes_written_raw += compressed_size + 7;
+    } else {
+      send_buf.add_u24l(chunk_size);
+      send_buf.add_u8(this->next_seq++);
+      send_buf.add_u24l(0);
+      src.remove_buffer(send_buf, chunk_size);
+      this->bytes_written_raw += chunk_size + 7;
+    }
+    this->bytes_written_uncompressed += chunk_size;
+  }
+
+  co_await send_buf.write(fd);
+}
+
+} // namespace EventAsync::MySQL
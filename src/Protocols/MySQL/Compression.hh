@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "../../Buffer.hh"
+#include "../../Task.hh"
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+namespace EventAsync::MySQL {
+
+enum class CompressionAlgorithm {
+  NONE = 0,
+  ZLIB,
+  ZSTD,
+};
+
+const char* name_for_compression_algorithm(CompressionAlgorithm alg);
+
+// Returns true if this library was built with support for the given algorithm.
+// ZLIB is always supported; ZSTD is supported only if libzstd was found at
+// build time.
+bool compression_algorithm_available(CompressionAlgorithm alg);
+
+// Implements the MySQL compressed protocol, which sits under the normal packet
+// layer once it's negotiated. Each compressed packet has a 7-byte header (3
+// bytes compressed length, 1 byte sequence number, 3 bytes uncompressed length)
+// and a payload that contains one or more normal packets (with their headers).
+// An uncompressed length of zero means the payload was sent uncompressed,
+// which the sender does for payloads smaller than the compression threshold.
+//
+// The inflate/deflate contexts are created once per connection and reset
+// between packets, and data is (de)compressed directly between evbuffer chains
+// without being pulled up into contiguous memory.
+class CompressionLayer {
+public:
+  CompressionLayer(
+      Base& base,
+      CompressionAlgorithm alg,
+      size_t threshold,
+      int level);
+  CompressionLayer(const CompressionLayer&) = delete;
+  CompressionLayer(CompressionLayer&&) = delete;
+  CompressionLayer& operator=(const CompressionLayer&) = delete;
+  CompressionLayer& operator=(CompressionLayer&&) = delete;
+  ~CompressionLayer();
+
+  CompressionAlgorithm get_algorithm() const;
+
+  // Moves exactly size bytes of the decompressed stream into dest, reading and
+  // decompressing more packets from fd as needed.
+  Task<void> read(int fd, Buffer& dest, size_t size);
+
+  // Compresses and frames all data in src (which should consist of one or more
+  // complete packets, with headers) and writes it to fd. src is drained.
+  Task<void> write(int fd, Buffer& src);
+
+  // The compressed protocol has its own sequence numbers, which are reset at
+  // the same time as the packet sequence numbers.
+  void reset_seq();
+
+  // Statistics, in bytes
+  uint64_t get_bytes_read_raw() const;
+  uint64_t get_bytes_read_uncompressed() const;
+  uint64_t get_bytes_written_raw() const;
+  uint64_t get_bytes_written_uncompressed() const;
+
+private:
+  Base& base;
+  CompressionAlgorithm alg;
+  size_t threshold;
+  int level;
+  uint8_t next_seq;
+
+  Buffer raw_input_buf;
+  Buffer plain_input_buf;
+  std::vector<struct evbuffer_iovec> iovecs;
+
+  z_stream inflater;
+  z_stream deflater;
+  ZSTD_CCtx_s* zstd_cctx;
+  ZSTD_DCtx_s* zstd_dctx;
+
+  uint64_t bytes_read_raw;
+  uint64_t bytes_read_uncompressed;
+  uint64_t bytes_written_raw;
+  uint64_t bytes_written_uncompressed;
+
+  Task<void> read_packet(int fd);
+  void decompress(size_t compressed_size, size_t uncompressed_size);
+  // Compresses the first size bytes of src into dest. Returns the compressed
+  // size, or 0 if the data did not get smaller (in which case dest is
+  // unchanged).
+  size_t compress(Buffer& dest, Buffer& src, size_t size);
+
+  size_t peek_iovecs(Buffer& buf, size_t size);
+};
+
+} // namespace EventAsync::MySQL
@@ -2,29 +2,44 @@
 
 #include <stdio.h>
 
+#include <charconv>
 #include <phosg/Strings.hh>
 
+#include "Compression.hh"
+
 using namespace std;
 
 namespace EventAsync::MySQL {
 
-Task<uint8_t> ProtocolBuffer::read_command(int fd) {
+Task<uint8_t> ProtocolBuffer::read_command(int fd, CompressionLayer* compression) {
   if (this->get_length() != 0) {
     throw logic_error("attempted to read command into non-empty buffer");
   }
-  co_await this->read_to(fd, 4);
+  if (compression) {
+    co_await compression->read(fd, *this, 4);
+  } else {
+    co_await this->read_to(fd, 4);
+  }
   size_t command_length = this->remove_u24l();
   uint8_t command_seq = this->remove_u8();
-  co_await this->read_to(fd, command_length);
+  if (compression) {
+    co_await compression->read(fd, *this, command_length);
+  } else {
+    co_await this->read_to(fd, command_length);
+  }
   co_return std::move(command_seq);
 }
 
-Task<void> ProtocolBuffer::write_command(int fd, uint8_t seq) {
+Task<void> ProtocolBuffer::write_command(int fd, uint8_t seq, CompressionLayer* compression) {
   ProtocolBuffer send_buf(this->base);
   send_buf.add_u24l(this->get_length());
   send_buf.add_u8(seq);
   send_buf.add_buffer(*this);
-  co_await send_buf.write(fd);
+  if (compression) {
+    co_await compression->write(fd, send_buf);
+  } else {
+    co_await send_buf.write(fd);
+  }
 }
 
 uint32_t ProtocolBuffer::remove_u24l() {
@@ -101,6 +116,94 @@ void ProtocolBuffer::add_var_string(const string& str) {
   this->add(str);
 }
 
+template <typename T>
+static T parse_number(const char* data, size_t size) {
+  T ret;
+  auto res = from_chars(data, data + size, ret);
+  if ((res.ec != errc()) || (res.ptr != data + size)) {
+    throw runtime_error("invalid numeric value: " + string(data, size));
+  }
+  return ret;
+}
+
+Value ProtocolBuffer::remove_text_value(ColumnType type) {
+  if (this->copyout_u8() == 0xFB) {
+    this->remove_u8();
+    return nullptr;
+  }
+
+  switch (type) {
+    case ColumnType::T_TINYINT:
+    case ColumnType::T_SMALLINT:
+    case ColumnType::T_MEDIUMINT:
+    case ColumnType::T_INT:
+    case ColumnType::T_BIGINT:
+    case ColumnType::T_YEAR:
+    case ColumnType::T_FLOAT:
+    case ColumnType::T_DOUBLE:
+    case ColumnType::T_NULL:
+    case ColumnType::T_DATE:
+    case ColumnType::T_DATETIME:
+    case ColumnType::T_TIMESTAMP:
+    case ColumnType::T_TIME: {
+      // These values are short, so they're almost always contiguous in the
+      // buffer already; if not, pullup only has to move a few bytes
+      size_t size = this->remove_varint();
+      if (size == 0) {
+        throw runtime_error("empty value in non-string column");
+      }
+      const char* data = reinterpret_cast<const char*>(this->pullup(size));
+
+      Value ret;
+      switch (type) {
+        case ColumnType::T_FLOAT:
+          ret = parse_number<float>(data, size);
+          break;
+        case ColumnType::T_DOUBLE:
+          ret = parse_number<double>(data, size);
+          break;
+        case ColumnType::T_NULL:
+          ret = nullptr;
+          break;
+        case ColumnType::T_DATE:
+        case ColumnType::T_DATETIME:
+        case ColumnType::T_TIMESTAMP:
+          ret = DateTimeValue(data, size);
+          break;
+        case ColumnType::T_TIME:
+          ret = TimeValue(data, size);
+          break;
+        default:
+          if (data[0] == '-') {
+            ret = parse_number<int64_t>(data, size);
+          } else {
+            ret = parse_number<uint64_t>(data, size);
+          }
+      }
+      this->drain(size);
+      return ret;
+    }
+
+    case ColumnType::T_BIT:
+    case ColumnType::T_STRING:
+    case ColumnType::T_VAR_STRING:
+    case ColumnType::T_VARCHAR:
+    case ColumnType::T_TINYBLOB:
+    case ColumnType::T_BLOB:
+    case ColumnType::T_MEDIUMBLOB:
+    case ColumnType::T_LONGBLOB:
+    case ColumnType::T_DECIMAL:
+    case ColumnType::T_NEWDECIMAL:
+    case ColumnType::T_ENUM:
+    case ColumnType::T_SET:
+    case ColumnType::T_GEOMETRY:
+      return this->remove_var_string();
+
+    default:
+      throw runtime_error("invalid value type");
+  }
+}
+
 void ProtocolBuffer::add_zeroes(size_t count) {
   for (; count >= 8; count -= 8) {
     this->add_u64l(0);
@@ -6,16 +6,21 @@
 #include <phosg/Strings.hh>
 #include <string>
 
+#include "Types.hh"
+
 namespace EventAsync::MySQL {
 
+class CompressionLayer;
+
 class ProtocolBuffer : public Buffer {
 public:
   using Buffer::Buffer;
   virtual ~ProtocolBuffer() = default;
 
-  // Command sending/receiving
-  Task<uint8_t> read_command(int fd); // returns sequence number
-  Task<void> write_command(int fd, uint8_t seq);
+  // Command sending/receiving. If compression is not null, the data is read
+  // from or written to the fd through the compression layer.
+  Task<uint8_t> read_command(int fd, CompressionLayer* compression = nullptr); // returns sequence number
+  Task<void> write_command(int fd, uint8_t seq, CompressionLayer* compression = nullptr);
 
   // Integer types (Buffer already provides 8/16/32/64)
   // Warning: these functions do not consider the endianness of the system; it
@@ -35,6 +40,11 @@ public:
   void add_string0(const std::string& str);
   void add_var_string(const std::string& str);
   void add_zeroes(size_t count);
+
+  // Removes one column value from a text-protocol result row and converts it
+  // to the appropriate type. Numeric and date/time values are parsed in place
+  // from the buffer's memory without constructing intermediate strings.
+  Value remove_text_value(ColumnType type);
 };
 
 class ProtocolStringReader : public StringReader {
@@ -57,7 +57,42 @@ const char* name_for_column_type(uint8_t type) {
   }
 }
 
+// Parses an unsigned decimal field starting at *data and advances *data past it
+// and the single separator character following it (if any). If num_digits is
+// not null, the number of digits read is written there. These are used instead
+// of sscanf because date/time columns are parsed for every row of a result set.
+template <typename IntT>
+static IntT parse_decimal_field(
+    const char** data, const char* end, size_t* num_digits = nullptr) {
+  IntT ret = 0;
+  const char* start = *data;
+  for (; (*data < end) && (**data >= '0') && (**data <= '9'); (*data)++) {
+    ret = ret * 10 + (**data - '0');
+  }
+  if (num_digits) {
+    *num_digits = *data - start;
+  }
+  if (*data < end) {
+    (*data)++;
+  }
+  return ret;
+}
+
+// Parses a fractional-seconds field, which may have fewer than six digits of
+// precision, into microseconds.
+static uint32_t parse_usecs_field(const char** data, const char* end) {
+  size_t num_digits;
+  uint32_t ret = parse_decimal_field<uint32_t>(data, end, &num_digits);
+  for (; num_digits < 6; num_digits++) {
+    ret *= 10;
+  }
+  return ret;
+}
+
 DateTimeValue::DateTimeValue(const string& str)
+    : DateTimeValue(str.data(), str.size()) {}
+
+DateTimeValue::DateTimeValue(const char* data, size_t size)
     : years(0),
       months(0),
       days(0),
@@ -65,13 +100,16 @@ DateTimeValue::DateTimeValue(const string& str)
       minutes(0),
       seconds(0),
       usecs(0) {
-  sscanf(str.c_str(), "%hu-%hhu-%hhu %hhu:%hhu:%hhu.%u",
-      &this->years, &this->months, &this->days, &this->hours, &this->minutes,
-      &this->seconds, &this->usecs);
-  // Hack: there might be fewer than six digits of precision on the usecs field,
-  // so we have to account for this manually here.
-  for (size_t x = str.size(); x < 26; x++) {
-    this->usecs *= 10;
+  // Format is YYYY-MM-DD[ hh:mm:ss[.uuuuuu]]
+  const char* end = data + size;
+  this->years = parse_decimal_field<uint16_t>(&data, end);
+  this->months = parse_decimal_field<uint8_t>(&data, end);
+  this->days = parse_decimal_field<uint8_t>(&data, end);
+  this->hours = parse_decimal_field<uint8_t>(&data, end);
+  this->minutes = parse_decimal_field<uint8_t>(&data, end);
+  this->seconds = parse_decimal_field<uint8_t>(&data, end);
+  if (data < end) {
+    this->usecs = parse_usecs_field(&data, end);
   }
 }
 
@@ -82,24 +120,25 @@ string DateTimeValue::str() const {
 }
 
 TimeValue::TimeValue(const string& str)
+    : TimeValue(str.data(), str.size()) {}
+
+TimeValue::TimeValue(const char* data, size_t size)
     : is_negative(false),
       hours(0),
       minutes(0),
       seconds(0),
       usecs(0) {
-
-  this->is_negative = str[0] == '-';
-  const char* s = is_negative ? &str[1] : &str[0];
-  sscanf(s, "%u:%hhu:%hhu.%u",
-      &this->hours, &this->minutes, &this->seconds, &this->usecs);
-
-  size_t dot_pos = str.find('.');
-  if (dot_pos != string::npos) {
-    size_t precision = str.size() - dot_pos - 1;
-    sscanf(&str[dot_pos + 1], "%u", &this->usecs);
-    for (; precision < 6; precision++) {
-      this->usecs *= 10;
-    }
+  // Format is [-]hhh:mm:ss[.uuuuuu]
+  const char* end = data + size;
+  if ((data < end) && (*data == '-')) {
+    this->is_negative = true;
+    data++;
+  }
+  this->hours = parse_decimal_field<uint32_t>(&data, end);
+  this->minutes = parse_decimal_field<uint8_t>(&data, end);
+  this->seconds = parse_decimal_field<uint8_t>(&data, end);
+  if (data < end) {
+    this->usecs = parse_usecs_field(&data, end);
   }
 }
 
@@ -150,6 +189,24 @@ string format_cell_value(const Value& cell) {
   }
 };
 
+string format_cell_value(const ValueRef& cell) {
+  if (holds_alternative<string_view>(cell)) {
+    string s = escape_quotes(string(get<string_view>(cell)));
+    return string_printf("(string) \"%s\"", s.c_str());
+  }
+  return format_cell_value(to_value(cell));
+}
+
+Value to_value(const ValueRef& ref) {
+  return visit([](const auto& v) -> Value {
+    if constexpr (is_same_v<decay_t<decltype(v)>, string_view>) {
+      return string(v);
+    } else {
+      return v;
+    }
+  }, ref);
+}
+
 void ResultSet::print(FILE* stream) const {
   fprintf(stream, "ResultSet:\n");
   fprintf(stream, "  Metadata:\n");
@@ -209,4 +266,198 @@ void ResultSet::print(FILE* stream) const {
   }
 }
 
+ServerError::ServerError(
+    uint16_t error_code,
+    const string& sqlstate,
+    const string& message)
+    : runtime_error(string_printf("(%hu; %s) %s",
+          error_code, sqlstate.c_str(), message.c_str())),
+      error_code(error_code),
+      sqlstate(sqlstate) {}
+
+GTIDSet::GTIDSet(const string& text) {
+  for (string sid_str : split(text, ',')) {
+    strip_whitespace(sid_str);
+    if (sid_str.empty()) {
+      continue;
+    }
+    auto tokens = split(sid_str, ':');
+    string sid = GTIDSet::parse_sid(tokens[0]);
+    if (tokens.size() < 2) {
+      throw runtime_error("GTID set entry has no intervals");
+    }
+    for (size_t x = 1; x < tokens.size(); x++) {
+      // Intervals in the text form are inclusive on both ends
+      const string& interval_str = tokens[x];
+      size_t dash_pos = interval_str.find('-');
+      uint64_t start = stoull(interval_str.substr(0, dash_pos), nullptr, 10);
+      uint64_t end = (dash_pos == string::npos)
+          ? start
+          : stoull(interval_str.substr(dash_pos + 1), nullptr, 10);
+      if (start == 0 || end < start) {
+        throw runtime_error("invalid GTID interval: " + interval_str);
+      }
+      this->add_interval(sid, start, end + 1);
+    }
+  }
+}
+
+GTIDSet GTIDSet::decode(const string& data) {
+  GTIDSet ret;
+  StringReader r(data);
+  uint64_t num_sids = r.get_u64l();
+  for (uint64_t z = 0; z < num_sids; z++) {
+    string sid = r.read(16);
+    uint64_t num_intervals = r.get_u64l();
+    for (uint64_t y = 0; y < num_intervals; y++) {
+      uint64_t start = r.get_u64l();
+      uint64_t end = r.get_u64l();
+      if (end <= start) {
+        throw runtime_error("invalid GTID interval in binary GTID set");
+      }
+      ret.add_interval(sid, start, end);
+    }
+  }
+  return ret;
+}
+
+string GTIDSet::encode() const {
+  string ret;
+  auto add_u64l = [&](uint64_t v) -> void {
+    ret.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  };
+  add_u64l(this->intervals.size());
+  for (const auto& [sid, sid_intervals] : this->intervals) {
+    ret += sid;
+    add_u64l(sid_intervals.size());
+    for (const auto& [start, end] : sid_intervals) {
+      add_u64l(start);
+      add_u64l(end);
+    }
+  }
+  return ret;
+}
+
+void GTIDSet::add(const string& sid, uint64_t gno) {
+  if (sid.size() != 16) {
+    throw logic_error("GTID server UUID must be 16 bytes");
+  }
+  // Fast path: transactions from a single server almost always arrive in
+  // order, so the new GTID usually just extends the last interval.
+  auto& sid_intervals = this->intervals[sid];
+  if (!sid_intervals.empty()) {
+    auto last_it = sid_intervals.rbegin();
+    if (last_it->second == gno) {
+      last_it->second++;
+      return;
+    }
+    if (last_it->first <= gno && gno < last_it->second) {
+      return;
+    }
+  }
+  this->add_interval(sid, gno, gno + 1);
+}
+
+void GTIDSet::add(const GTIDSet& other) {
+  for (const auto& [sid, sid_intervals] : other.intervals) {
+    for (const auto& [start, end] : sid_intervals) {
+      this->add_interval(sid, start, end);
+    }
+  }
+}
+
+void GTIDSet::add_interval(const string& sid, uint64_t start, uint64_t end) {
+  auto& sid_intervals = this->intervals[sid];
+
+  // Merge with the preceding interval if they overlap or are adjacent
+  auto it = sid_intervals.upper_bound(start);
+  if (it != sid_intervals.begin()) {
+    auto prev_it = std::prev(it);
+    if (prev_it->second >= start) {
+      start = prev_it->first;
+      end = max<uint64_t>(end, prev_it->second);
+      sid_intervals.erase(prev_it);
+    }
+  }
+  // Merge with any following intervals that overlap or are adjacent
+  while (it != sid_intervals.end() && it->first <= end) {
+    end = max<uint64_t>(end, it->second);
+    it = sid_intervals.erase(it);
+  }
+  sid_intervals.emplace(start, end);
+}
+
+bool GTIDSet::contains(const string& sid, uint64_t gno) const {
+  auto sid_it = this->intervals.find(sid);
+  if (sid_it == this->intervals.end()) {
+    return false;
+  }
+  auto it = sid_it->second.upper_bound(gno);
+  if (it == sid_it->second.begin()) {
+    return false;
+  }
+  return (std::prev(it)->second > gno);
+}
+
+bool GTIDSet::empty() const {
+  return this->intervals.empty();
+}
+
+void GTIDSet::clear() {
+  this->intervals.clear();
+}
+
+string GTIDSet::str() const {
+  string ret;
+  for (const auto& [sid, sid_intervals] : this->intervals) {
+    if (!ret.empty()) {
+      ret += ',';
+    }
+    ret += GTIDSet::format_sid(sid);
+    for (const auto& [start, end] : sid_intervals) {
+      if (end - 1 == start) {
+        ret += string_printf(":%" PRIu64, start);
+      } else {
+        ret += string_printf(":%" PRIu64 "-%" PRIu64, start, end - 1);
+      }
+    }
+  }
+  return ret;
+}
+
+string GTIDSet::format_sid(const string& sid) {
+  if (sid.size() != 16) {
+    throw logic_error("GTID server UUID must be 16 bytes");
+  }
+  const uint8_t* d = reinterpret_cast<const uint8_t*>(sid.data());
+  return string_printf(
+      "%02hhx%02hhx%02hhx%02hhx-%02hhx%02hhx-%02hhx%02hhx-%02hhx%02hhx-%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx",
+      d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7],
+      d[8], d[9], d[10], d[11], d[12], d[13], d[14], d[15]);
+}
+
+string GTIDSet::parse_sid(const string& text) {
+  string ret;
+  uint8_t pending = 0;
+  bool have_high_nybble = false;
+  for (char ch : text) {
+    if (ch == '-' || ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
+      continue;
+    }
+    if (!isxdigit(ch)) {
+      throw runtime_error("invalid character in server UUID: " + text);
+    }
+    if (have_high_nybble) {
+      ret.push_back(static_cast<char>((pending << 4) | value_for_hex_char(ch)));
+    } else {
+      pending = value_for_hex_char(ch);
+    }
+    have_high_nybble = !have_high_nybble;
+  }
+  if (ret.size() != 16 || have_high_nybble) {
+    throw runtime_error("server UUID is not 16 bytes: " + text);
+  }
+  return ret;
+}
+
 } // namespace EventAsync::MySQL
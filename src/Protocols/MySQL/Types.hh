@@ -2,7 +2,10 @@
 
 #include <stdint.h>
 
+#include <map>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -34,6 +37,8 @@ enum CapFlag {
   CAN_HANDLE_EXPIRED_PASSWORDS = 0x00400000,
   SESSION_TRACK = 0x00800000,
   DEPRECATE_EOF = 0x01000000,
+  OPTIONAL_RESULTSET_METADATA = 0x02000000,
+  ZSTD_COMPRESSION_ALGORITHM = 0x04000000,
 };
 
 enum StatusFlag {
@@ -136,6 +141,7 @@ struct DateTimeValue {
 
   DateTimeValue() = default;
   DateTimeValue(const std::string& str);
+  DateTimeValue(const char* data, size_t size);
   std::string str() const;
 };
 
@@ -148,6 +154,7 @@ struct TimeValue {
 
   TimeValue() = default;
   TimeValue(const std::string& str);
+  TimeValue(const char* data, size_t size);
   std::string str() const;
 };
 
@@ -173,6 +180,22 @@ using Value = std::variant<
     // T_LONGBLOB, T_DECIMAL, T_NEWDECIMAL, T_ENUM, T_SET, T_GEOMETRY
     std::string>;
 
+// Same as Value, but string values refer to memory owned by something else
+// (usually a binlog event's raw data) instead of owning a copy. This allows
+// rows to be decoded without allocating memory for each cell.
+using ValueRef = std::variant<
+    uint64_t,
+    int64_t,
+    float,
+    double,
+    const void*,
+    DateTimeValue,
+    TimeValue,
+    std::string_view>;
+
+// Copies a ValueRef's data (if any) into an owned Value.
+Value to_value(const ValueRef& ref);
+
 struct ColumnDefinition {
   std::string catalog_name;
   std::string database_name;
@@ -188,6 +211,7 @@ struct ColumnDefinition {
 };
 
 std::string format_cell_value(const Value& cell);
+std::string format_cell_value(const ValueRef& cell);
 
 struct ResultSet {
   std::vector<ColumnDefinition> columns;
@@ -209,4 +233,57 @@ struct ResultSet {
   void print(FILE* stream) const;
 };
 
+// Thrown when the server responds to a command with an error. Unlike I/O or
+// protocol errors, the connection is still usable after this is thrown.
+class ServerError : public std::runtime_error {
+public:
+  ServerError(
+      uint16_t error_code,
+      const std::string& sqlstate,
+      const std::string& message);
+  ~ServerError() = default;
+
+  uint16_t error_code;
+  std::string sqlstate;
+};
+
+// A set of global transaction IDs, as used by COM_BINLOG_DUMP_GTID and the
+// PREVIOUS_GTIDS_EVENT binlog event. Each GTID is a (server UUID, transaction
+// number) pair; the set is stored as a sorted list of [start, end) transaction
+// number intervals per server UUID, so it stays small even after billions of
+// transactions. Server UUIDs are stored as 16 raw bytes.
+class GTIDSet {
+public:
+  GTIDSet() = default;
+  // Parses the text form used by MySQL (e.g. "uuid:1-5:7-9,uuid2:1-3").
+  explicit GTIDSet(const std::string& text);
+  ~GTIDSet() = default;
+
+  // Parses and produces the binary form used by COM_BINLOG_DUMP_GTID and
+  // PREVIOUS_GTIDS_EVENT.
+  static GTIDSet decode(const std::string& data);
+  std::string encode() const;
+
+  void add(const std::string& sid, uint64_t gno);
+  void add(const GTIDSet& other);
+  bool contains(const std::string& sid, uint64_t gno) const;
+  bool empty() const;
+  void clear();
+
+  // Returns the text form of the set, which can be passed to the constructor
+  // above or used in SQL (e.g. SET GLOBAL gtid_purged = '...').
+  std::string str() const;
+
+  static std::string format_sid(const std::string& sid);
+  static std::string parse_sid(const std::string& text);
+
+  bool operator==(const GTIDSet& other) const = default;
+
+private:
+  // sid -> {start -> end}, where each interval is [start, end)
+  std::map<std::string, std::map<uint64_t, uint64_t>> intervals;
+
+  void add_interval(const std::string& sid, uint64_t start, uint64_t end);
+};
+
 } // namespace EventAsync::MySQL